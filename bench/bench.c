@@ -0,0 +1,1187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mpd/client.h>
+#include <sqlite3.h>
+
+#include "../src/db.h"
+#include "../src/library.h"
+#include "../src/playlist.h"
+#include "../src/playlist_plan.h"
+#include "../src/metrics.h"
+#include "../src/arena.h"
+#include "../src/rank.h"
+#include "../src/similar.h"
+#include "../src/endpoint.h"
+#include "../src/reactor.h"
+#include "../src/journal.h"
+#include "../src/import.h"
+#include "../src/report.h"
+#include "../src/columnar.h"
+#include "../src/msleep.h"
+#include "gen.h"
+#include "stub_mpd.h"
+
+#define MAX_SERIES 96
+// report timings kept by bench_report()
+#define MAX_REPORTS 100000
+#define MIN_REPORTS 20
+// similarity samples are taken after this many plays, up to --similar-plays
+static const long SIMILAR_CHECKPOINTS[] = {100000, 1000000, 10000000, 100000000};
+#define N_SIMILAR_CHECKPOINTS (sizeof(SIMILAR_CHECKPOINTS) / sizeof(SIMILAR_CHECKPOINTS[0]))
+
+struct series {
+  const char *name;
+  long *ns;
+  int n;
+};
+
+static struct series results[MAX_SERIES];
+static int n_results;
+// Source.ID of GEN_SOURCE
+static int source_id;
+
+
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+static struct series *series_new(const char *name, int iterations) {
+  struct series *s = &results[n_results++];
+  s->name = name;
+  s->ns = malloc(iterations * sizeof(long));
+  s->n = 0;
+  return s;
+}
+
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+
+static double percentile_us(const struct series *s, double p) {
+  int i = (int)(p * (s->n - 1) + 0.5);
+  return s->ns[i] / 1000.0;
+}
+
+
+static double mean_us(const struct series *s) {
+  double total = 0;
+  for (int i = 0; i < s->n; i++) total += s->ns[i];
+  return s->n ? total / s->n / 1000.0 : 0;
+}
+
+
+static void report(const struct gen_config *gen, const char *output) {
+  printf("%-28s %8s %10s %10s %10s %10s %10s\n", "benchmark", "n", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+  for (int i = 0; i < n_results; i++) {
+    struct series *s = &results[i];
+    if (s->n == 0) continue;
+    qsort(s->ns, s->n, sizeof(long), cmp_long);
+    printf("%-28s %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", s->name, s->n, mean_us(s),
+        percentile_us(s, 0.5), percentile_us(s, 0.9), percentile_us(s, 0.99), percentile_us(s, 1.0));
+  }
+
+  if (output == NULL) return;
+  FILE *f = fopen(output, "w");
+  if (f == NULL) {
+    perror(output);
+    return;
+  }
+  fprintf(f, "{\"config\": {\"artists\": %d, \"albums\": %d, \"songs\": %d, \"plays\": %ld, \"zipf\": %g, \"seed\": %llu},\n",
+      gen->artists, gen->albums, gen->songs, gen->plays, gen->zipf, (unsigned long long)gen->seed);
+  fprintf(f, " \"results\": [");
+  int first = 1;
+  for (int i = 0; i < n_results; i++) {
+    struct series *s = &results[i];
+    if (s->n == 0) continue;
+    fprintf(f, "%s\n  {\"name\": \"%s\", \"n\": %d, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+        first ? "" : ",", s->name, s->n, mean_us(s),
+        percentile_us(s, 0.5), percentile_us(s, 0.9), percentile_us(s, 0.99), percentile_us(s, 1.0));
+    first = 0;
+  }
+  fprintf(f, "\n ]}\n");
+  fclose(f);
+  printf("Results written to %s\n", output);
+}
+
+
+// Copies each row, as a consumer keeping the results would.
+static int copy_row(void *ctx, const char *name) {
+  return arena_strdup(ctx, name) == NULL;
+}
+
+
+static void bench_fetch(struct db_conn *db, const char *name, int (*f)(struct db_conn *, db_row_fn, void *), int iterations) {
+  struct series *s = series_new(name, iterations);
+  struct arena *arena = arena_new();
+  for (int i = 0; i < iterations; i++) {
+    long t0 = now_ns();
+    f(db, copy_row, arena);
+    s->ns[s->n++] = now_ns() - t0;
+    arena_reset(arena);
+  }
+  arena_free(arena);
+}
+
+// "Similar to Now Playing" for the generated plays' source.
+static int fetch_similar_albums(struct db_conn *db, db_row_fn f, void *ctx) {
+  return db_fetch_similar_albums(db, source_id, f, ctx);
+}
+
+
+// The most played albums over the last `days` days the way it was done
+// before the daily rollups, scanning that window of Plays by time. Checks the
+// top counts agree with the rollups; returns the number of mismatches.
+static int bench_window_scan(const char *db_path, const char *name, int days, int iterations) {
+  static const char *scan_sql =
+    "SELECT SUM(n) FROM (SELECT COUNT(*) AS n FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID "
+      "INNER JOIN Album ON Song.AlbumID=Album.ID "
+      "WHERE Time >= ?1 "
+      "GROUP BY Album.Name ORDER BY n DESC LIMIT 10);";
+  static const char *rollup_sql =
+    "SELECT SUM(n) FROM (SELECT SUM(PlayCount) AS n FROM AlbumDaily WHERE Day >= ?2 "
+      "GROUP BY Name ORDER BY n DESC LIMIT 10);";
+  sqlite3 *db = NULL;
+  sqlite3_stmt *scan = NULL, *rollup = NULL;
+  int mismatches = 1;
+  if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL)
+      || sqlite3_prepare_v2(db, scan_sql, -1, &scan, NULL)
+      || sqlite3_prepare_v2(db, rollup_sql, -1, &rollup, NULL)) {
+    fprintf(stderr, ":: Failed to prep window scan: %s\n", sqlite3_errmsg(db));
+    goto _bench_window_scan_end;
+  }
+
+  long first_day = time(NULL) / 86400 - (days - 1);
+  sqlite3_bind_int64(scan, 1, first_day * 86400);
+  sqlite3_bind_int64(scan, 2, first_day);
+  sqlite3_bind_int64(rollup, 2, first_day);
+
+  struct series *s = series_new(name, iterations);
+  long scanned = 0;
+  for (int i = 0; i < iterations; i++) {
+    long t0 = now_ns();
+    if (sqlite3_step(scan) == SQLITE_ROW) scanned = sqlite3_column_int64(scan, 0);
+    s->ns[s->n++] = now_ns() - t0;
+    sqlite3_reset(scan);
+  }
+
+  long rolled = sqlite3_step(rollup) == SQLITE_ROW ? sqlite3_column_int64(rollup, 0) : -1;
+  mismatches = scanned != rolled;
+  if (mismatches) fprintf(stderr, ":: %d day window: top albums have %ld plays in Plays, %ld in AlbumDaily\n", days, scanned, rolled);
+
+_bench_window_scan_end:
+  sqlite3_finalize(scan);
+  sqlite3_finalize(rollup);
+  sqlite3_close(db);
+  return mismatches;
+}
+
+
+// Cost of timing one stage, as the time for 1000 start/record pairs: the
+// reported microseconds read as nanoseconds per call.
+static void bench_metrics(int iterations) {
+  struct series *s = series_new("metrics_record_x1000", iterations);
+  for (int i = 0; i < iterations; i++) {
+    long t0 = now_ns();
+    for (int j = 0; j < 1000; j++) {
+      // the metrics file is written before this runs
+      metrics_record(METRIC_STATUS, metrics_start(), 1);
+    }
+    s->ns[s->n++] = now_ns() - t0;
+  }
+}
+
+
+static void record_play(const struct gen_config *gen, struct db_conn *db) {
+  struct gen_song song;
+  int i = gen_next_song(gen);
+  gen_song(gen, i, &song);
+  db_add_play(db, source_id, song.title, song.artist, song.album, i);
+}
+
+
+static void bench_plays(const struct gen_config *gen, struct db_conn *db, const char *name, int iterations) {
+  struct series *s = series_new(name, iterations);
+  for (int i = 0; i < iterations; i++) {
+    long t0 = now_ns();
+    record_play(gen, db);
+    s->ns[s->n++] = now_ns() - t0;
+  }
+}
+
+
+// Number of songs in a stored playlist, -1 on error.
+static int playlist_length(struct mpd_connection *mpd, const char *name) {
+  if (!mpd_send_list_playlist(mpd, name)) return -1;
+  int n = 0;
+  struct mpd_song *song;
+  while ((song = mpd_recv_song(mpd)) != NULL) {
+    mpd_song_free(song);
+    n++;
+  }
+  return mpd_response_finish(mpd) ? n : -1;
+}
+
+
+static void bench_playlists(const struct gen_config *gen, struct db_conn *db, int iterations, unsigned batch_size) {
+  struct gen_song *songs = malloc(gen->songs * sizeof(struct gen_song));
+  for (int i = 0; i < gen->songs; i++) gen_song(gen, i, &songs[i]);
+  struct stub_mpd *stub = stub_mpd_start(songs, gen->songs, 0);
+  free(songs);
+  if (stub == NULL) return;
+
+  struct mpd_connection *mpd = mpd_connection_new("127.0.0.1", stub_mpd_port(stub), 0);
+  if (mpd == NULL || mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+    fprintf(stderr, ":: Failed to connect to stub MPD\n");
+    goto _bench_playlists_end;
+  }
+
+  struct series *load = series_new("library_load", 1);
+  long t0 = now_ns();
+  struct library *lib = library_load(mpd);
+  load->ns[load->n++] = now_ns() - t0;
+  if (lib == NULL) goto _bench_playlists_end;
+
+  struct playlist_plan plan;
+  playlist_plan_default(&plan);
+
+  // the first pass fills every playlist from scratch
+  struct series *first = series_new("generate_playlists_initial", 1);
+  t0 = now_ns();
+  generate_playlists(mpd, source_id, db, lib, &plan, NULL, batch_size);
+  first->ns[first->n++] = now_ns() - t0;
+
+  // without a memo every playlist is read back from MPD and diffed
+  struct series *s = series_new("generate_playlists", iterations);
+  unsigned long commands = stub_mpd_commands(stub);
+  for (int i = 0; i < iterations; i++) {
+    record_play(gen, db);
+    t0 = now_ns();
+    generate_playlists(mpd, source_id, db, lib, &plan, NULL, batch_size);
+    s->ns[s->n++] = now_ns() - t0;
+  }
+  printf("MPD commands per regeneration: %.1f\n", (double)(stub_mpd_commands(stub) - commands) / iterations);
+
+  // as the worker does, skipping the playlists whose rows did not change
+  struct playlist_memo memo;
+  playlist_memo_reset(&memo);
+  generate_playlists(mpd, source_id, db, lib, &plan, &memo, batch_size);
+  s = series_new("generate_playlists_memo", iterations);
+  commands = stub_mpd_commands(stub);
+  for (int i = 0; i < iterations; i++) {
+    record_play(gen, db);
+    t0 = now_ns();
+    generate_playlists(mpd, source_id, db, lib, &plan, &memo, batch_size);
+    s->ns[s->n++] = now_ns() - t0;
+  }
+  printf("MPD commands per regeneration with a memo: %.1f\n", (double)(stub_mpd_commands(stub) - commands) / iterations);
+
+  // a playlist cleared from another client, a second after it was built as
+  // MPD's modification times are to the second, is rebuilt by the next pass
+  const char *name = plan.playlists[0].name;
+  int length = playlist_length(mpd, name);
+  struct mpd_connection *other = mpd_connection_new("127.0.0.1", stub_mpd_port(stub), 0);
+  sleep(1);
+  if (other != NULL) mpd_run_playlist_clear(other, name);
+  record_play(gen, db);
+  generate_playlists(mpd, source_id, db, lib, &plan, &memo, batch_size);
+  int rebuilt = playlist_length(mpd, name);
+  printf("Playlist cleared in MPD: %d of %d songs back after one pass with a memo (%s)\n", rebuilt, length,
+      rebuilt == length ? "ok" : "failed");
+  if (other != NULL) mpd_connection_free(other);
+
+  library_free(lib);
+
+_bench_playlists_end:
+  if (mpd != NULL) mpd_connection_free(mpd);
+  stub_mpd_stop(stub);
+}
+
+
+// What the watcher asks MPD when the player changes, replayed over the
+// synthetic history against a stub server whose replies are held back by
+// delay_us: status then currentsong as two round trips, against both in one
+// command list.
+static void bench_detect(const struct gen_config *gen, int iterations, long delay_us, const char *serial_name, const char *pipelined_name) {
+  struct gen_song *songs = malloc(gen->songs * sizeof(struct gen_song));
+  for (int i = 0; i < gen->songs; i++) gen_song(gen, i, &songs[i]);
+  struct stub_mpd *stub = stub_mpd_start(songs, gen->songs, 0);
+  free(songs);
+  if (stub == NULL) return;
+  stub_mpd_set_delay(stub, delay_us);
+
+  struct mpd_connection *mpd = mpd_connection_new("127.0.0.1", stub_mpd_port(stub), 0);
+  if (mpd == NULL || mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+    fprintf(stderr, ":: Failed to connect to stub MPD\n");
+    goto _bench_detect_end;
+  }
+
+  struct series *serial = series_new(serial_name, iterations);
+  struct series *pipelined = series_new(pipelined_name, iterations);
+  unsigned long replies[2] = {0, 0};
+  int wrong = 0;
+
+  for (int i = 0; i < iterations; i++) {
+    stub_mpd_play(stub, gen_next_song(gen));
+    unsigned long before = stub_mpd_replies(stub);
+    long t0 = now_ns();
+    struct mpd_status *status = mpd_run_status(mpd);
+    struct mpd_song *song = status != NULL ? mpd_run_current_song(mpd) : NULL;
+    serial->ns[serial->n++] = now_ns() - t0;
+    replies[0] += stub_mpd_replies(stub) - before;
+    if (song == NULL || (int)mpd_song_get_id(song) != mpd_status_get_song_id(status)) wrong++;
+    if (status != NULL) mpd_status_free(status);
+    if (song != NULL) mpd_song_free(song);
+
+    stub_mpd_play(stub, gen_next_song(gen));
+    before = stub_mpd_replies(stub);
+    t0 = now_ns();
+    status = NULL;
+    song = NULL;
+    if (mpd_command_list_begin(mpd, true) && mpd_send_status(mpd) && mpd_send_current_song(mpd)
+        && mpd_command_list_end(mpd)) {
+      status = mpd_recv_status(mpd);
+      if (status != NULL && mpd_response_next(mpd)) song = mpd_recv_song(mpd);
+      mpd_response_finish(mpd);
+    }
+    pipelined->ns[pipelined->n++] = now_ns() - t0;
+    replies[1] += stub_mpd_replies(stub) - before;
+    if (song == NULL || (int)mpd_song_get_id(song) != mpd_status_get_song_id(status)) wrong++;
+    if (status != NULL) mpd_status_free(status);
+    if (song != NULL) mpd_song_free(song);
+
+    if (mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+      fprintf(stderr, ":: Stub MPD: %s\n", mpd_connection_get_error_message(mpd));
+      break;
+    }
+  }
+  printf("Detection with %ldus replies: %.1f round trips serial, %.1f pipelined, %d wrong\n",
+      delay_us, (double)replies[0] / iterations, (double)replies[1] / iterations, wrong);
+
+_bench_detect_end:
+  if (mpd != NULL) mpd_connection_free(mpd);
+  stub_mpd_stop(stub);
+}
+
+
+static void *reactor_thread(void *arg) {
+  reactor_run(arg);
+  return NULL;
+}
+
+
+// rowid of the newest play
+static long last_play(sqlite3_stmt *stmt) {
+  long rowid = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+  sqlite3_reset(stmt);
+  return rowid;
+}
+
+
+// A port on localhost that nothing listens on.
+static unsigned dead_port(void) {
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = 0};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return 1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || getsockname(fd, (struct sockaddr *)&addr, &len)) addr.sin_port = htons(1);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+
+// Songs started in turn on several stub servers watched by one reactor, with
+// one more address that refuses connections and is retried throughout: the
+// time from a song starting to its play being committed. Returns the number
+// of plays missing or recorded against the wrong source.
+static int bench_reactor(const struct gen_config *gen, struct db_conn *db, const char *db_path, int iterations, int n_servers) {
+  struct gen_song *songs = malloc(gen->songs * sizeof(struct gen_song));
+  for (int i = 0; i < gen->songs; i++) gen_song(gen, i, &songs[i]);
+
+  struct stub_mpd *stubs[n_servers];
+  int sources[n_servers], last_song[n_servers], expected[n_servers];
+  struct journal *journal = journal_open(db, 0);
+  struct reactor *reactor = journal != NULL ? reactor_new(journal, 0) : NULL;
+  struct mpd_endpoint endpoint;
+  char address[64];
+  int errors = -1, n_stubs = 0;
+
+  sqlite3 *reader = NULL;
+  sqlite3_stmt *last = NULL, *count = NULL;
+  pthread_t thread;
+  int running = 0;
+
+  if (reactor == NULL) goto _bench_reactor_end;
+  for (; n_stubs < n_servers; n_stubs++) {
+    stubs[n_stubs] = stub_mpd_start(songs, gen->songs, 0);
+    if (stubs[n_stubs] == NULL) goto _bench_reactor_end;
+
+    snprintf(address, sizeof(address), "127.0.0.1:%u", stub_mpd_port(stubs[n_stubs]));
+    if (endpoint_parse(&endpoint, address)) goto _bench_reactor_end;
+    sources[n_stubs] = db_source(db, endpoint.name);
+    if (sources[n_stubs] < 0 || reactor_add(reactor, &endpoint, sources[n_stubs], NULL)) goto _bench_reactor_end;
+    last_song[n_stubs] = -1;
+    expected[n_stubs] = 0;
+  }
+  snprintf(address, sizeof(address), "127.0.0.1:%u", dead_port());
+  if (endpoint_parse(&endpoint, address) || reactor_add(reactor, &endpoint, db_source(db, endpoint.name), NULL)) goto _bench_reactor_end;
+
+  // the journal thread is now the only user of db
+  if (journal_start(journal, NULL, NULL)) goto _bench_reactor_end;
+  if (sqlite3_open_v2(db_path, &reader, SQLITE_OPEN_READONLY, NULL)
+      || sqlite3_prepare_v2(reader, "SELECT MAX(rowid) FROM Plays;", -1, &last, NULL)
+      || sqlite3_prepare_v2(reader, "SELECT COUNT(*) FROM Plays WHERE rowid > ? AND SourceID=?;", -1, &count, NULL)) {
+    fprintf(stderr, ":: Failed to open reader: %s\n", sqlite3_errmsg(reader));
+    goto _bench_reactor_end;
+  }
+  long first = last_play(last), seen = first;
+
+  if (pthread_create(&thread, NULL, reactor_thread, reactor)) goto _bench_reactor_end;
+  running = 1;
+  // let every server connect and report its stopped player
+  msleep(200);
+
+  struct series *s = series_new("reactor_play", iterations);
+  for (int i = 0; i < iterations; i++) {
+    int server = i % n_servers;
+    int song = gen_next_song(gen);
+    // the same song again without a seek back is not a new play
+    if (song == last_song[server]) song = (song + 1) % gen->songs;
+    last_song[server] = song;
+    expected[server]++;
+
+    long t0 = now_ns();
+    stub_mpd_play(stubs[server], song);
+    while (last_play(last) == seen && now_ns() - t0 < 5000000000L);
+    s->ns[s->n++] = now_ns() - t0;
+    seen = last_play(last);
+  }
+
+  errors = 0;
+  for (int i = 0; i < n_servers; i++) {
+    sqlite3_bind_int64(count, 1, first);
+    sqlite3_bind_int(count, 2, sources[i]);
+    int n = sqlite3_step(count) == SQLITE_ROW ? sqlite3_column_int(count, 0) : -1;
+    sqlite3_reset(count);
+    if (n != expected[i]) errors += abs(expected[i] - n);
+  }
+  printf("Reactor: %d servers and 1 unreachable, %d plays, %d missing or misattributed\n", n_servers, iterations, errors);
+
+_bench_reactor_end:
+  if (running) {
+    reactor_stop(reactor);
+    pthread_join(thread, NULL);
+  }
+  // closing the connections lets the stubs stop
+  reactor_free(reactor);
+  journal_close(journal);
+  for (int i = 0; i < n_stubs; i++) stub_mpd_stop(stubs[i]);
+  sqlite3_finalize(last);
+  sqlite3_finalize(count);
+  sqlite3_close(reader);
+  free(songs);
+  return errors;
+}
+
+
+// Plays recorded while another connection holds the database's write lock,
+// as a long report or a backup would: the time to record each, and whether
+// all of them reach the database once the lock is released. Returns the
+// number lost.
+static int bench_journal(const struct gen_config *gen, struct db_conn *db, const char *db_path, int iterations) {
+  struct journal *journal = journal_open(db, 0);
+  sqlite3 *locker = NULL;
+  sqlite3_stmt *count = NULL;
+  int lost = -1;
+
+  if (journal == NULL) goto _bench_journal_end;
+  if (sqlite3_open(db_path, &locker)
+      || sqlite3_prepare_v2(locker, "SELECT COUNT(*) FROM Plays;", -1, &count, NULL)
+      || sqlite3_step(count) != SQLITE_ROW) {
+    fprintf(stderr, ":: Failed to open locker: %s\n", sqlite3_errmsg(locker));
+    goto _bench_journal_end;
+  }
+  int before = sqlite3_column_int(count, 0);
+  sqlite3_reset(count);
+
+  // the journal thread may be writing already, doing maintenance
+  sqlite3_busy_timeout(locker, 5000);
+  if (journal_start(journal, NULL, NULL)) goto _bench_journal_end;
+  if (sqlite3_exec(locker, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) {
+    fprintf(stderr, ":: Failed to lock the database: %s\n", sqlite3_errmsg(locker));
+    goto _bench_journal_end;
+  }
+  struct series *s = series_new("journal_append_locked", iterations);
+  for (int i = 0; i < iterations; i++) {
+    struct gen_song song;
+    int n = gen_next_song(gen);
+    gen_song(gen, n, &song);
+    long t0 = now_ns();
+    journal_append(journal, source_id, song.title, song.artist, song.album, n, NULL);
+    s->ns[s->n++] = now_ns() - t0;
+  }
+  // the compactor is stuck behind the lock meanwhile
+  msleep(200);
+  sqlite3_exec(locker, "COMMIT;", NULL, NULL, NULL);
+
+  long t0 = now_ns();
+  journal_close(journal);
+  journal = NULL;
+  struct series *drain = series_new("journal_drain", 1);
+  drain->ns[drain->n++] = now_ns() - t0;
+
+  if (sqlite3_step(count) == SQLITE_ROW) lost = iterations - (sqlite3_column_int(count, 0) - before);
+  printf("Journal: %d plays recorded under a write lock, %d lost\n", iterations, lost);
+
+_bench_journal_end:
+  journal_close(journal);
+  sqlite3_finalize(count);
+  sqlite3_close(locker);
+  return lost;
+}
+
+
+struct report_load {
+  struct db_conn *db;
+  struct series *times;
+  volatile int stop;
+  int reports;
+  int failed;
+};
+
+// Cycle through every kind of report until told to stop.
+static void *report_thread(void *arg) {
+  struct report_load *load = arg;
+  const struct report reports[] = {
+    {.kind = REPORT_TOP, .dim = RANK_ALBUM, .format = REPORT_TEXT},
+    {.kind = REPORT_TOP, .dim = RANK_SONG, .days = 30, .format = REPORT_JSON},
+    {.kind = REPORT_RECENT, .dim = RANK_ARTIST, .format = REPORT_CSV},
+    {.kind = REPORT_ARTIST, .artist = "Artist 0", .limit = 10, .format = REPORT_JSON},
+  };
+  int n_reports = sizeof(reports) / sizeof(reports[0]);
+  FILE *out = fopen("/dev/null", "w");
+  if (out == NULL) {
+    load->failed++;
+    return NULL;
+  }
+  while (!load->stop) {
+    long t0 = now_ns();
+    if (report_write(load->db, &reports[load->reports % n_reports], out) < 0) load->failed++;
+    if (load->times->n < MAX_REPORTS) load->times->ns[load->times->n++] = now_ns() - t0;
+    load->reports++;
+  }
+  fclose(out);
+  return NULL;
+}
+
+
+// Plays recorded while `mpd_stats report` runs reports back to back through
+// a read-only connection, against the same plays recorded alone. With reports
+// running, plays go on until each kind of report has run a few times. Returns
+// the number of plays or reports that failed.
+static int bench_report(const struct gen_config *gen, struct db_conn *db, const char *db_path, int iterations) {
+  struct db_config config = {.path = db_path, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+  struct report_load load = {.db = db_init(&config, 1)};
+  if (load.db == NULL) return 1;
+  load.times = series_new("report_during_plays", MAX_REPORTS);
+  struct series *alone = series_new("add_play_alone", iterations);
+  struct series *during = series_new("add_play_during_reports", MAX_REPORTS);
+  int failed = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    pthread_t thread;
+    if (pass == 1 && pthread_create(&thread, NULL, report_thread, &load)) {
+      failed++;
+      break;
+    }
+    struct series *s = pass == 0 ? alone : during;
+    for (int i = 0; i < iterations || (pass == 1 && load.reports < MIN_REPORTS && i < MAX_REPORTS); i++) {
+      struct gen_song song;
+      int n = gen_next_song(gen);
+      gen_song(gen, n, &song);
+      long t0 = now_ns();
+      if (db_add_play(db, source_id, song.title, song.artist, song.album, n)) failed++;
+      s->ns[s->n++] = now_ns() - t0;
+    }
+    if (pass == 1) {
+      load.stop = 1;
+      pthread_join(thread, NULL);
+    }
+  }
+
+  qsort(alone->ns, alone->n, sizeof(long), cmp_long);
+  qsort(during->ns, during->n, sizeof(long), cmp_long);
+  printf("Reports: %d run (%d failed) while recording %d plays (%d failed), play p99 %.0fus vs %.0fus alone\n",
+      load.reports, load.failed, during->n, failed, percentile_us(during, 0.99), percentile_us(alone, 0.99));
+  db_free(load.db);
+  return failed + load.failed;
+}
+
+
+static int count_name(void *ctx, const char *name) {
+  (void)name;
+  (*(int *)ctx)++;
+  return 0;
+}
+
+
+// Feed `plays` synthetic plays, a few minutes apart, into an engine of its
+// own, timing a play and a "Similar to Now Playing" lookup over the last
+// `iterations` plays before each checkpoint: neither should grow with the
+// history. Returns the number of failed plays.
+static long bench_similar(const struct gen_config *gen, long plays, int iterations) {
+  static char names[N_SIMILAR_CHECKPOINTS][2][32];
+  struct similar *similar = similar_new();
+  long failed = 0;
+  if (similar == NULL) return 1;
+
+  struct gen_song song;
+  for (int i = 0; i < gen->songs; i++) {
+    gen_song(gen, i, &song);
+    if (similar_add_song(similar, i + 1, song.artist, song.album)) {
+      failed++;
+      goto _bench_similar_end;
+    }
+  }
+
+  long start = time(NULL) - plays * 200, done = 0;
+  long t0 = now_ns();
+  for (unsigned c = 0; c < N_SIMILAR_CHECKPOINTS && SIMILAR_CHECKPOINTS[c] <= plays; c++) {
+    long checkpoint = SIMILAR_CHECKPOINTS[c];
+    for (; done < checkpoint - iterations; done++) {
+      failed += similar_play(similar, 1, gen_next_song(gen) + 1, start + done * 200, done + 1) != 0;
+    }
+
+    snprintf(names[c][0], sizeof(names[c][0]), "similar_play_%.0e", (double)checkpoint);
+    snprintf(names[c][1], sizeof(names[c][1]), "similar_query_%.0e", (double)checkpoint);
+    struct series *play = series_new(names[c][0], iterations);
+    struct series *query = series_new(names[c][1], iterations);
+    for (; done < checkpoint; done++) {
+      int song_id = gen_next_song(gen) + 1, n = 0;
+      long t1 = now_ns();
+      failed += similar_play(similar, 1, song_id, start + done * 200, done + 1) != 0;
+      long t2 = now_ns();
+      similar_each(similar, RANK_ALBUM, NULL, 1, 10, count_name, &n);
+      long t3 = now_ns();
+      play->ns[play->n++] = t2 - t1;
+      query->ns[query->n++] = t3 - t2;
+    }
+
+    long artist_edges, album_edges;
+    int artists = similar_size(similar, RANK_ARTIST, &artist_edges);
+    int albums = similar_size(similar, RANK_ALBUM, &album_edges);
+    printf("Similarity after %ld plays (%.1fs): %d artists with %ld edges, %d albums with %ld edges, %.1f MiB\n",
+        done, (now_ns() - t0) / 1e9, artists, artist_edges, albums, album_edges, similar_memory(similar) / (1024.0 * 1024.0));
+  }
+
+_bench_similar_end:
+  similar_free(similar);
+  return failed;
+}
+
+
+static long query_long(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt = NULL;
+  long v = -1;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    v = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return v;
+}
+
+
+static long bench_query(sqlite3 *db, const char *name, const char *sql, int iterations) {
+  struct series *s = series_new(name, iterations);
+  long v = -1;
+  for (int i = 0; i < iterations; i++) {
+    long t0 = now_ns();
+    v = query_long(db, sql);
+    s->ns[s->n++] = now_ns() - t0;
+  }
+  return v;
+}
+
+
+// Each dimension code's database ID times its count, to compare with SQL.
+static long weighted_sum(const struct columnar *col, enum columnar_dim dim, const uint32_t *counts) {
+  long sum = 0;
+  for (uint32_t i = 0; i < col->dicts[dim].n; i++) sum += (long)col->dicts[dim].ids[i] * counts[i];
+  return sum;
+}
+
+static long bucket_sum(const uint32_t *counts, int n) {
+  long sum = 0;
+  for (int i = 0; i < n; i++) sum += (long)i * counts[i];
+  return sum;
+}
+
+// The aggregates compared by bench_columnar(): plays per song and per artist
+// over all time, per album over the last 30 days, per day over the last year,
+// and per hour of the week.
+enum kernel {
+  COUNT_SONGS,
+  COUNT_ARTISTS,
+  MONTH_ALBUMS,
+  DAILY_YEAR,
+  HOUR_OF_WEEK,
+  N_KERNELS
+};
+
+// each kernel's series, then its SQL's
+static const char *KERNEL_NAMES[N_KERNELS][2] = {
+  [COUNT_SONGS] = {"columnar_count_songs", "sql_count_songs"},
+  [COUNT_ARTISTS] = {"columnar_count_artists", "sql_count_artists"},
+  [MONTH_ALBUMS] = {"columnar_month_albums", "sql_month_albums"},
+  [DAILY_YEAR] = {"columnar_daily_year", "sql_daily_year"},
+  [HOUR_OF_WEEK] = {"columnar_hour_of_week", "sql_hour_of_week"},
+};
+
+// One aggregate over the columnar export, cleared and run iterations times.
+// Returns its weighted sum.
+static long bench_kernel(const struct columnar *col, const char *name, enum kernel kernel, long now, uint32_t *counts, int iterations) {
+  static const enum columnar_dim DIMS[] = {[COUNT_SONGS] = COLUMNAR_SONG, [COUNT_ARTISTS] = COLUMNAR_ARTIST, [MONTH_ALBUMS] = COLUMNAR_ALBUM};
+  struct series *s = series_new(name, iterations);
+  long sum = 0;
+  for (int i = 0; i < iterations; i++) {
+    long t0 = now_ns(), first, last;
+    switch (kernel) {
+      case COUNT_SONGS:
+      case COUNT_ARTISTS:
+      case MONTH_ALBUMS:
+        memset(counts, 0, col->dicts[DIMS[kernel]].n * sizeof(uint32_t));
+        if (kernel == MONTH_ALBUMS) columnar_range(col, now - 30 * 86400L, LONG_MAX, &first, &last);
+        else first = 0, last = col->n_plays;
+        columnar_count(col, DIMS[kernel], first, last, counts);
+        s->ns[s->n++] = now_ns() - t0;
+        sum = weighted_sum(col, DIMS[kernel], counts);
+        break;
+      case DAILY_YEAR:
+        memset(counts, 0, 365 * sizeof(uint32_t));
+        columnar_windows(col, now - 365 * 86400L, 86400, 365, counts);
+        s->ns[s->n++] = now_ns() - t0;
+        sum = bucket_sum(counts, 365);
+        break;
+      case HOUR_OF_WEEK:
+        memset(counts, 0, 168 * sizeof(uint32_t));
+        columnar_histogram(col, 0, col->n_plays, 0, 604800, 168, counts);
+        s->ns[s->n++] = now_ns() - t0;
+        sum = bucket_sum(counts, 168);
+        break;
+      case N_KERNELS:
+        break;
+    }
+  }
+  return sum;
+}
+
+// Export the history to a columnar file, then time its aggregation kernels
+// against the same aggregates in SQL, each reduced to one weighted sum so the
+// answers can be compared. Returns the number that differ.
+static int bench_columnar(struct db_conn *db, const char *db_path, int iterations) {
+  char path[] = "/tmp/mpd_stats_columnar_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  close(fd);
+
+  struct columnar col = {0};
+  sqlite3 *raw = NULL;
+  uint32_t *counts = NULL;
+  int mismatches = 1;
+  struct series *s = series_new("columnar_export", 1);
+  long t0 = now_ns();
+  long plays = columnar_export(db, path);
+  s->ns[s->n++] = now_ns() - t0;
+  if (plays < 0) goto _bench_columnar_end;
+  s = series_new("columnar_open", 1);
+  t0 = now_ns();
+  if (columnar_open(&col, path)) goto _bench_columnar_end;
+  s->ns[s->n++] = now_ns() - t0;
+  printf("Columnar export: %ld plays, %.1f MiB\n", plays, col.size / (1024.0 * 1024.0));
+
+  uint32_t n = 365;
+  for (int d = 0; d < N_COLUMNAR_DIMS; d++) n = col.dicts[d].n > n ? col.dicts[d].n : n;
+  counts = malloc(n * sizeof(uint32_t));
+  if (counts == NULL || sqlite3_open(db_path, &raw)) goto _bench_columnar_end;
+
+  // the SQL scans every play each run, so fewer of them
+  int sql_runs = iterations < 5 ? iterations : 5;
+  int runs = iterations < 50 ? iterations : 50;
+  long now = time(NULL), month = now - 30 * 86400L, year = now - 365 * 86400L;
+  char month_sql[256], year_sql[256];
+  snprintf(month_sql, sizeof(month_sql), "SELECT SUM(AlbumID * n) FROM (SELECT Song.AlbumID, COUNT(*) AS n FROM Plays "
+      "INNER JOIN Song ON Plays.SongID=Song.ID WHERE Plays.Time >= %ld GROUP BY 1);", month);
+  snprintf(year_sql, sizeof(year_sql), "SELECT IFNULL(SUM(d * n), 0) FROM (SELECT (Time - %1$ld) / 86400 AS d, COUNT(*) AS n FROM Plays "
+      "WHERE Time >= %1$ld AND Time < %2$ld GROUP BY 1);", year, year + 365 * 86400L);
+  const char *sql[N_KERNELS] = {
+    [COUNT_SONGS] = "SELECT SUM(SongID * n) FROM (SELECT SongID, COUNT(*) AS n FROM Plays GROUP BY SongID);",
+    [COUNT_ARTISTS] = "SELECT SUM(ArtistID * n) FROM (SELECT Album.ArtistID, COUNT(*) AS n FROM Plays "
+      "INNER JOIN Song ON Plays.SongID=Song.ID INNER JOIN Album ON Song.AlbumID=Album.ID GROUP BY 1);",
+    [MONTH_ALBUMS] = month_sql,
+    [DAILY_YEAR] = year_sql,
+    // long generated histories start before 1970, where SQL's % is negative
+    [HOUR_OF_WEEK] = "SELECT SUM(b * n) FROM (SELECT (Time % 604800 + 604800) % 604800 / 3600 AS b, COUNT(*) AS n FROM Plays GROUP BY 1);",
+  };
+
+  mismatches = 0;
+  for (int k = 0; k < N_KERNELS; k++) {
+    long kernel = bench_kernel(&col, KERNEL_NAMES[k][0], k, now, counts, runs);
+    long expected = bench_query(raw, KERNEL_NAMES[k][1], sql[k], sql_runs);
+    if (kernel != expected) {
+      fprintf(stderr, ":: %s: %ld, SQL %ld\n", KERNEL_NAMES[k][0], kernel, expected);
+      mismatches++;
+    }
+  }
+  printf("Columnar kernels vs SQL: %d mismatches\n", mismatches);
+
+_bench_columnar_end:
+  free(counts);
+  sqlite3_close(raw);
+  columnar_close(&col);
+  unlink(path);
+  return mismatches;
+}
+
+
+// Fold the plays older than `days` into PlaysArchive the way the daemon does
+// between plays, one db_maintain() step at a time, and compare the size of
+// the database and the cost of an all-time aggregate over the raw plays
+// before and after. Returns the number of mismatches in that aggregate.
+static int bench_retention(const char *db_path, int days, int iterations) {
+  static const char *size_sql = "SELECT page_count * page_size FROM pragma_page_count(), pragma_page_size();";
+  static const char *before_sql = "SELECT SUM(SongID * n) FROM (SELECT SongID, COUNT(*) AS n FROM Plays GROUP BY SongID);";
+  static const char *after_sql =
+    "SELECT SUM(SongID * n) FROM (SELECT SongID, SUM(n) AS n FROM ("
+      "SELECT SongID, COUNT(*) AS n FROM Plays GROUP BY SongID "
+      "UNION ALL SELECT SongID, SUM(PlayCount) FROM PlaysArchive GROUP BY SongID) GROUP BY SongID);";
+  struct db_config config = {.path = db_path, .synchronous = "NORMAL", .busy_timeout_ms = 5000, .retention_days = days};
+  sqlite3 *raw = NULL;
+  struct db_conn *db = NULL;
+  int mismatches = 1;
+
+  if (sqlite3_open(db_path, &raw)) goto _bench_retention_end;
+  int runs = iterations < 20 ? iterations : 20;
+  long plays_before = query_long(raw, "SELECT COUNT(*) FROM Plays;");
+  long size_before = query_long(raw, size_sql);
+  long sum_before = bench_query(raw, "alltime_scan", before_sql, runs);
+
+  db = db_init(&config, 0);
+  if (db == NULL) goto _bench_retention_end;
+  int cap = plays_before / DB_MAINTAIN_PLAYS + 4096;
+  struct series *steps = series_new("maintain_step", cap);
+  long t0 = now_ns();
+  int more = 1;
+  while (more > 0 && steps->n < cap) {
+    long t1 = now_ns();
+    more = db_maintain(db);
+    steps->ns[steps->n++] = now_ns() - t1;
+  }
+  double seconds = (now_ns() - t0) / 1e9;
+  if (more < 0) goto _bench_retention_end;
+
+  long plays_after = query_long(raw, "SELECT COUNT(*) FROM Plays;");
+  long archived = query_long(raw, "SELECT COUNT(*) FROM PlaysArchive;");
+  long size_after = query_long(raw, size_sql);
+  long sum_after = bench_query(raw, "alltime_scan_retained", after_sql, runs);
+  mismatches = sum_before != sum_after;
+  printf("Retention of %d days: %ld plays kept of %ld, %ld archive rows, %.1f MiB -> %.1f MiB in %d steps over %.1fs, %s\n",
+      days, plays_after, plays_before, archived, size_before / (1024.0 * 1024.0), size_after / (1024.0 * 1024.0),
+      steps->n, seconds, mismatches ? "all-time counts differ" : "all-time counts agree");
+
+_bench_retention_end:
+  db_free(db);
+  sqlite3_close(raw);
+  return mismatches;
+}
+
+
+static void remove_db(const char *path) {
+  char side[PATH_MAX];
+  unlink(path);
+  snprintf(side, sizeof(side), "%s-wal", path);
+  unlink(side);
+  snprintf(side, sizeof(side), "%s-shm", path);
+  unlink(side);
+  snprintf(side, sizeof(side), "%s.playlog", path);
+  unlink(side);
+}
+
+
+// Import n generated plays from a CSV file into a fresh database, once
+// committing in batches and once deferring the stats and indexes. Returns the
+// number of plays that did not arrive.
+static long bench_import(const struct gen_config *gen, long n) {
+  char csv_path[] = "/tmp/mpd_stats_import_XXXXXX";
+  int fd = mkstemp(csv_path);
+  FILE *csv = fd >= 0 ? fdopen(fd, "w+") : NULL;
+  if (csv == NULL) {
+    perror(csv_path);
+    return n;
+  }
+  fprintf(csv, "time,artist,album,title\n");
+  long start = time(NULL) - n;
+  for (long i = 0; i < n; i++) {
+    struct gen_song song;
+    gen_song(gen, gen_next_song(gen), &song);
+    fprintf(csv, "%ld,%s,%s,%s\n", start + i, song.artist, song.album, song.title);
+  }
+
+  long missing = 0;
+  for (int defer_index = 0; defer_index <= 1; defer_index++) {
+    char db_path[] = "/tmp/mpd_stats_bench_import_XXXXXX";
+    int db_fd = mkstemp(db_path);
+    if (db_fd < 0) {
+      perror(db_path);
+      missing += n;
+      continue;
+    }
+    close(db_fd);
+    struct db_config config = {.path = db_path, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+    struct db_conn *db = db_init(&config, 0);
+    struct import_stats stats = {0};
+    struct series *s = series_new(defer_index ? "import_deferred" : "import_batched", 1);
+
+    rewind(csv);
+    long t0 = now_ns();
+    struct db_import *import = db ? db_import_begin(db, db_source(db, "import"), 100000, defer_index) : NULL;
+    int failed = import == NULL || import_stream(import, csv, IMPORT_CSV, NULL, &stats);
+    if (import != NULL && db_import_end(import, !failed)) failed = 1;
+    if (failed) stats.plays = 0;
+    s->ns[s->n++] = now_ns() - t0;
+
+    missing += n - stats.plays;
+    printf("Import%s: %ld plays at %.0f plays/min\n", defer_index ? " (deferred indexes)" : "",
+        stats.plays, stats.plays / (s->ns[0] / 60e9));
+    db_free(db);
+    remove_db(db_path);
+  }
+
+  fclose(csv);
+  unlink(csv_path);
+  return missing;
+}
+
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+      "Usage: %s [options]\n"
+      "  --artists N      distinct artists (default 500)\n"
+      "  --albums N       distinct albums (default 2000)\n"
+      "  --songs N        distinct songs (default 20000)\n"
+      "  --plays N        plays of history (default 100000)\n"
+      "  --zipf S         Zipf exponent of song popularity (default 1.0)\n"
+      "  --seed N         random seed (default 1)\n"
+      "  --iterations N   timed runs per benchmark (default 200)\n"
+      "  --db PATH        keep the generated database at PATH (replaced if present)\n"
+      "  --output PATH    write results as JSON (default bench_results.json)\n"
+      "  --metrics PATH   write the daemon's own stage metrics to PATH\n"
+      "  --servers N      stub MPD servers watched at once (default 4)\n"
+      "  --delay US       stub MPD reply delay for the detection comparison (default 1000)\n"
+      "  --import-plays N plays loaded by the import benchmark (default 1000000)\n"
+      "  --retention DAYS retention applied to the history at the end (default 90)\n"
+      "  --similar-plays N plays fed to the similarity benchmark (default 10000000)\n",
+      prog);
+}
+
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"artists", required_argument, NULL, 'a'},
+    {"albums", required_argument, NULL, 'l'},
+    {"songs", required_argument, NULL, 's'},
+    {"plays", required_argument, NULL, 'p'},
+    {"zipf", required_argument, NULL, 'z'},
+    {"seed", required_argument, NULL, 'r'},
+    {"iterations", required_argument, NULL, 'i'},
+    {"db", required_argument, NULL, 'd'},
+    {"output", required_argument, NULL, 'o'},
+    {"metrics", required_argument, NULL, 'm'},
+    {"servers", required_argument, NULL, 'n'},
+    {"delay", required_argument, NULL, 'y'},
+    {"import-plays", required_argument, NULL, 'I'},
+    {"retention", required_argument, NULL, 'R'},
+    {"similar-plays", required_argument, NULL, 'S'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  struct gen_config gen = {.artists = 500, .albums = 2000, .songs = 20000, .plays = 100000, .zipf = 1.0, .seed = 1};
+  int iterations = 200;
+  const char *db_path = NULL;
+  const char *output = "bench_results.json";
+  const char *metrics_file = NULL;
+  int servers = 4;
+  long delay_us = 1000;
+  long import_plays = 1000000;
+  int retention = 90;
+  long similar_plays = 10000000;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'a': gen.artists = atoi(optarg); break;
+      case 'l': gen.albums = atoi(optarg); break;
+      case 's': gen.songs = atoi(optarg); break;
+      case 'p': gen.plays = atol(optarg); break;
+      case 'z': gen.zipf = atof(optarg); break;
+      case 'r': gen.seed = strtoull(optarg, NULL, 10); break;
+      case 'i': iterations = atoi(optarg); break;
+      case 'd': db_path = optarg; break;
+      case 'o': output = optarg; break;
+      case 'm': metrics_file = optarg; break;
+      case 'n': servers = atoi(optarg); break;
+      case 'y': delay_us = atol(optarg); break;
+      case 'I': import_plays = atol(optarg); break;
+      case 'R': retention = atoi(optarg); break;
+      case 'S': similar_plays = atol(optarg); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (gen.artists < 1 || gen.albums < gen.artists || gen.songs < gen.albums || gen.plays < 0 || import_plays < 0 || similar_plays < 0 || iterations < 1 || servers < 1) {
+    fprintf(stderr, ":: Need 1 <= artists <= albums <= songs, and iterations and servers >= 1\n");
+    return 1;
+  }
+
+  char tmp_path[] = "/tmp/mpd_stats_bench_XXXXXX";
+  if (db_path == NULL) {
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+      perror(tmp_path);
+      return 1;
+    }
+    close(fd);
+    db_path = tmp_path;
+  }
+  else {
+    remove_db(db_path);
+  }
+
+  struct db_config config = {.path = db_path, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+  int rv = 1;
+
+  // create the schema, then fill it behind the daemon's back
+  struct db_conn *db = db_init(&config, 0);
+  if (db == NULL) goto _main_end;
+  db_free(db);
+
+  printf("Generating %ld plays of %d songs, %d albums, %d artists (zipf %g)...\n",
+      gen.plays, gen.songs, gen.albums, gen.artists, gen.zipf);
+  long t0 = now_ns();
+  if (gen_database(&gen, db_path)) goto _main_end;
+  printf("Generated in %.1fs\n", (now_ns() - t0) / 1e9);
+
+  db = db_init(&config, 0);
+  if (db == NULL) goto _main_end;
+  source_id = db_source(db, GEN_SOURCE);
+
+  bench_fetch(db, "db_fetch_recent_artists", db_fetch_recent_artists, iterations);
+  bench_fetch(db, "db_fetch_recent_albums", db_fetch_recent_albums, iterations);
+  bench_fetch(db, "db_fetch_recent_songs", db_fetch_recent_songs, iterations);
+  bench_fetch(db, "db_fetch_frequent_artists", db_fetch_frequent_artists, iterations);
+  bench_fetch(db, "db_fetch_frequent_albums", db_fetch_frequent_albums, iterations);
+  bench_fetch(db, "db_fetch_frequent_songs", db_fetch_frequent_songs, iterations);
+
+  bench_fetch(db, "db_fetch_week_albums", db_fetch_week_albums, iterations);
+  bench_fetch(db, "db_fetch_month_albums", db_fetch_month_albums, iterations);
+  bench_fetch(db, "db_fetch_year_albums", db_fetch_year_albums, iterations);
+  int window_mismatches = bench_window_scan(db_path, "scan_week_albums", 7, iterations)
+    + bench_window_scan(db_path, "scan_month_albums", 30, iterations)
+    + bench_window_scan(db_path, "scan_year_albums", 365, iterations);
+
+  bench_plays(&gen, db, "db_add_play", iterations);
+
+  // the same queries and plays again, answered and kept by the rank engine
+  struct rank *rank = rank_new();
+  struct series *load = series_new("rank_load", 1);
+  t0 = now_ns();
+  if (rank == NULL || db_load_rank(db, rank)) {
+    fprintf(stderr, ":: Failed to load rankings\n");
+    db_free(db);
+    rank_free(rank);
+    goto _main_end;
+  }
+  load->ns[load->n++] = now_ns() - t0;
+  printf("Rank engine: %d artists, %d albums, %d songs played, %.1f MiB\n",
+      rank_size(rank, RANK_ARTIST), rank_size(rank, RANK_ALBUM), rank_size(rank, RANK_SONG),
+      rank_memory(rank) / (1024.0 * 1024.0));
+
+  bench_fetch(db, "rank_fetch_recent_artists", db_fetch_recent_artists, iterations);
+  bench_fetch(db, "rank_fetch_recent_albums", db_fetch_recent_albums, iterations);
+  bench_fetch(db, "rank_fetch_recent_songs", db_fetch_recent_songs, iterations);
+  bench_fetch(db, "rank_fetch_frequent_artists", db_fetch_frequent_artists, iterations);
+  bench_fetch(db, "rank_fetch_frequent_albums", db_fetch_frequent_albums, iterations);
+  bench_fetch(db, "rank_fetch_frequent_songs", db_fetch_frequent_songs, iterations);
+  bench_plays(&gen, db, "rank_add_play", iterations);
+
+  // "Similar to Now Playing" from the saved neighbours, then from the engine
+  struct similar *similar = similar_new();
+  load = series_new("similar_load", 1);
+  t0 = now_ns();
+  if (similar == NULL || db_load_similar(db, similar)) {
+    fprintf(stderr, ":: Failed to load the similarity graph\n");
+    db_free(db);
+    rank_free(rank);
+    similar_free(similar);
+    goto _main_end;
+  }
+  load->ns[load->n++] = now_ns() - t0;
+  struct series *save = series_new("similar_save", 1);
+  t0 = now_ns();
+  db_maintain(db);
+  save->ns[save->n++] = now_ns() - t0;
+  struct db_conn *plain = db_init(&config, 0);
+  if (plain != NULL) bench_fetch(plain, "db_fetch_similar_albums", fetch_similar_albums, iterations);
+  db_free(plain);
+  bench_fetch(db, "similar_fetch_albums", fetch_similar_albums, iterations);
+  bench_plays(&gen, db, "similar_add_play", iterations);
+
+  bench_playlists(&gen, db, iterations, 256);
+  bench_detect(&gen, iterations, 0, "detect_serial", "detect_pipelined");
+  bench_detect(&gen, iterations, delay_us, "detect_serial_delayed", "detect_pipelined_delayed");
+  int reactor_errors = bench_reactor(&gen, db, db_path, iterations, servers);
+  int journal_lost = bench_journal(&gen, db, db_path, iterations);
+  int report_failures = bench_report(&gen, db, db_path, iterations);
+  long import_missing = bench_import(&gen, import_plays);
+  long similar_failures = bench_similar(&gen, similar_plays, iterations);
+  int columnar_mismatches = bench_columnar(db, db_path, iterations);
+  int retention_mismatches = retention > 0 ? bench_retention(db_path, retention, iterations) : 0;
+
+  int mismatches = db_check_rank(db);
+  printf("Rank engine vs SQL: %d mismatches\n", mismatches);
+
+  // before bench_metrics() inflates the status stage
+  if (metrics_file != NULL) metrics_write_file(metrics_file);
+  bench_metrics(iterations);
+
+  db_free(db);
+  rank_free(rank);
+  similar_free(similar);
+  report(&gen, output);
+  rv = mismatches != 0 || window_mismatches != 0 || retention_mismatches != 0 || reactor_errors != 0 || journal_lost != 0 || report_failures != 0 || import_missing != 0 || similar_failures != 0
+    || columnar_mismatches != 0;
+
+_main_end:
+  if (db_path == tmp_path) remove_db(tmp_path);
+  return rv;
+}
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "gen.h"
+
+static uint64_t rng_state;
+static double *zipf_cdf;
+static int zipf_n;
+
+
+static double rng_uniform(void) {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static int zipf_init(const struct gen_config *config) {
+  if (zipf_cdf != NULL && zipf_n == config->songs) return 0;
+
+  free(zipf_cdf);
+  zipf_cdf = malloc(config->songs * sizeof(double));
+  if (zipf_cdf == NULL) return -1;
+  zipf_n = config->songs;
+
+  double total = 0;
+  for (int i = 0; i < zipf_n; i++) {
+    total += 1.0 / pow(i + 1, config->zipf);
+    zipf_cdf[i] = total;
+  }
+  for (int i = 0; i < zipf_n; i++) {
+    zipf_cdf[i] /= total;
+  }
+
+  rng_state = config->seed ? config->seed : 1;
+  return 0;
+}
+
+
+int gen_next_song(const struct gen_config *config) {
+  if (zipf_init(config)) return 0;
+
+  double u = rng_uniform();
+  int lo = 0, hi = zipf_n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u) lo = mid + 1;
+    else hi = mid;
+  }
+
+  // scatter popularity so the most played songs aren't all on one album
+  return (int)((lo * 2654435761u) % (unsigned)zipf_n);
+}
+
+
+void gen_song(const struct gen_config *config, int song, struct gen_song *out) {
+  int album = (int)((long)song * config->albums / config->songs);
+  int artist = (int)((long)album * config->artists / config->albums);
+
+  snprintf(out->artist, sizeof(out->artist), "Artist %d", artist);
+  snprintf(out->album, sizeof(out->album), "Album %d", album);
+  snprintf(out->title, sizeof(out->title), "Song %d", song);
+  snprintf(out->uri, sizeof(out->uri), "artist%d/album%d/song%d.flac", artist, album, song);
+}
+
+
+static int exec(sqlite3 *db, const char *sql) {
+  char *errmsg = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg)) {
+    fprintf(stderr, ":: Error running sql \"%s\": %s\n", sql, errmsg);
+    sqlite3_free(errmsg);
+    return -1;
+  }
+  return 0;
+}
+
+
+int gen_database(const struct gen_config *config, const char *path) {
+  sqlite3 *db = NULL;
+  sqlite3_stmt *artist = NULL, *album = NULL, *song = NULL, *song_source = NULL, *play = NULL;
+  int rv = -1;
+
+  if (zipf_init(config)) return -1;
+
+  if (sqlite3_open(path, &db)) goto _gen_database_end;
+  if (exec(db, "PRAGMA synchronous=OFF; BEGIN;")) goto _gen_database_end;
+  if (exec(db, "INSERT INTO Source(ID, Name) VALUES (1, '" GEN_SOURCE "');")) goto _gen_database_end;
+
+  if (sqlite3_prepare_v2(db, "INSERT INTO Artist(ID, Name) VALUES (?, ?);", -1, &artist, NULL)
+      || sqlite3_prepare_v2(db, "INSERT INTO Album(ID, ArtistID, Name) VALUES (?, ?, ?);", -1, &album, NULL)
+      || sqlite3_prepare_v2(db, "INSERT INTO Song(ID, AlbumID, Name) VALUES (?, ?, ?);", -1, &song, NULL)
+      || sqlite3_prepare_v2(db, "INSERT INTO SongSource(SourceID, MPDID, SongID) VALUES (1, ?, ?);", -1, &song_source, NULL)
+      || sqlite3_prepare_v2(db, "INSERT INTO Plays(Time, SongID, SourceID) VALUES (?, ?, 1);", -1, &play, NULL)) {
+    fprintf(stderr, ":: Failed to prep generator stmts: %s\n", sqlite3_errmsg(db));
+    goto _gen_database_end;
+  }
+
+  int last_artist = -1, last_album = -1;
+  for (int i = 0; i < config->songs; i++) {
+    struct gen_song s;
+    gen_song(config, i, &s);
+    int album_id = (int)((long)i * config->albums / config->songs) + 1;
+    int artist_id = (int)((long)(album_id - 1) * config->artists / config->albums) + 1;
+
+    if (artist_id != last_artist) {
+      sqlite3_bind_int(artist, 1, artist_id);
+      sqlite3_bind_text(artist, 2, s.artist, -1, SQLITE_STATIC);
+      if (sqlite3_step(artist) != SQLITE_DONE) goto _gen_database_err;
+      sqlite3_reset(artist);
+      last_artist = artist_id;
+    }
+    if (album_id != last_album) {
+      sqlite3_bind_int(album, 1, album_id);
+      sqlite3_bind_int(album, 2, artist_id);
+      sqlite3_bind_text(album, 3, s.album, -1, SQLITE_STATIC);
+      if (sqlite3_step(album) != SQLITE_DONE) goto _gen_database_err;
+      sqlite3_reset(album);
+      last_album = album_id;
+    }
+    sqlite3_bind_int(song, 1, i + 1);
+    sqlite3_bind_int(song, 2, album_id);
+    sqlite3_bind_text(song, 3, s.title, -1, SQLITE_STATIC);
+    if (sqlite3_step(song) != SQLITE_DONE) goto _gen_database_err;
+    sqlite3_reset(song);
+
+    // the stub server's song ids are the song indexes
+    sqlite3_bind_int(song_source, 1, i);
+    sqlite3_bind_int(song_source, 2, i + 1);
+    if (sqlite3_step(song_source) != SQLITE_DONE) goto _gen_database_err;
+    sqlite3_reset(song_source);
+  }
+
+  // one play every ~4 minutes, ending now
+  long long t = (long long)time(NULL) - config->plays * 240;
+  for (long i = 0; i < config->plays; i++) {
+    t += 120 + (long long)(rng_uniform() * 240);
+    sqlite3_bind_int64(play, 1, t);
+    sqlite3_bind_int(play, 2, gen_next_song(config) + 1);
+    if (sqlite3_step(play) != SQLITE_DONE) goto _gen_database_err;
+    sqlite3_reset(play);
+  }
+
+  if (exec(db, "COMMIT;")) goto _gen_database_end;
+  rv = 0;
+  goto _gen_database_end;
+
+_gen_database_err:
+  fprintf(stderr, ":: Failed to generate history: %s\n", sqlite3_errmsg(db));
+
+_gen_database_end:
+  sqlite3_finalize(artist);
+  sqlite3_finalize(album);
+  sqlite3_finalize(song);
+  sqlite3_finalize(song_source);
+  sqlite3_finalize(play);
+  sqlite3_close(db);
+  return rv;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Synthetic listening history: songs spread evenly over albums and albums
+// over artists, with plays drawn from a Zipf distribution over songs.
+struct gen_config {
+  int artists;
+  int albums;
+  int songs;
+  long plays;
+  double zipf;
+  uint64_t seed;
+};
+
+struct gen_song {
+  char uri[96];
+  char artist[32];
+  char album[32];
+  char title[32];
+};
+
+// Generated plays, and the song ids of the stub server, belong to this source.
+#define GEN_SOURCE "stub"
+
+void gen_song(const struct gen_config *config, int song, struct gen_song *out);
+
+// Fill a database, which must already have the daemon's schema, with the
+// configured history. Returns 0 on success.
+int gen_database(const struct gen_config *config, const char *path);
+
+// Zipf-distributed song index, for plays recorded during a benchmark.
+int gen_next_song(const struct gen_config *config);
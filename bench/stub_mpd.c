@@ -0,0 +1,519 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stub_mpd.h"
+
+#define STUB_MAX_ARGS 8
+#define STUB_MAX_PLAYLISTS 64
+
+#define ACK_ARG 2
+#define ACK_UNKNOWN 5
+#define ACK_NO_EXIST 50
+
+// how often an idling client checks for noidle or a hangup
+#define STUB_IDLE_CHECK_MS 20
+
+struct stub_playlist {
+  char *name;
+  char **uris;
+  int n;
+  int cap;
+  // unix time of the last edit, to the second as MPD reports it
+  time_t modified;
+};
+
+struct stub_mpd {
+  int listen_fd;
+  unsigned port;
+  pthread_t thread;
+
+  struct gen_song *songs;
+  int n_songs;
+
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  int n_clients;
+
+  // the song playing, -1 when stopped, under queue id current_id, at
+  // elapsed_ms when started (CLOCK_MONOTONIC), advancing unless paused
+  int current;
+  int current_id;
+  int paused;
+  unsigned elapsed_ms;
+  struct timespec started;
+  // bumped on every player change, waking idling clients
+  unsigned long player_events;
+  pthread_cond_t player;
+
+  struct stub_playlist playlists[STUB_MAX_PLAYLISTS];
+  int n_playlists;
+  unsigned long commands;
+  unsigned long replies;
+  // added before each reply, standing in for the network
+  long delay_us;
+};
+
+struct stub_client {
+  struct stub_mpd *stub;
+  int fd;
+  FILE *out;
+  // player events already reported by idle
+  unsigned long seen_events;
+};
+
+
+// Split a command line into arguments, handling MPD's double quoting.
+static int split_args(char *line, char **args) {
+  int n = 0;
+  char *p = line;
+  while (*p && n < STUB_MAX_ARGS) {
+    while (*p == ' ') p++;
+    if (!*p) break;
+
+    if (*p == '"') {
+      char *dst = ++p;
+      args[n++] = dst;
+      while (*p && *p != '"') {
+        if (*p == '\\' && p[1]) p++;
+        *dst++ = *p++;
+      }
+      if (*p) p++;
+      *dst = 0;
+    }
+    else {
+      args[n++] = p;
+      while (*p && *p != ' ') p++;
+      if (*p) *p++ = 0;
+    }
+  }
+  return n;
+}
+
+
+static struct stub_playlist *find_playlist(struct stub_mpd *stub, const char *name, int create) {
+  for (int i = 0; i < stub->n_playlists; i++) {
+    if (strcmp(stub->playlists[i].name, name) == 0) return &stub->playlists[i];
+  }
+  if (!create || stub->n_playlists == STUB_MAX_PLAYLISTS) return NULL;
+
+  struct stub_playlist *pl = &stub->playlists[stub->n_playlists++];
+  *pl = (struct stub_playlist){.name = strdup(name), .modified = time(NULL)};
+  return pl;
+}
+
+
+static void playlist_insert(struct stub_playlist *pl, int pos, char *uri) {
+  if (pl->n == pl->cap) {
+    pl->cap = pl->cap ? pl->cap * 2 : 64;
+    pl->uris = realloc(pl->uris, pl->cap * sizeof(char *));
+  }
+  memmove(&pl->uris[pos + 1], &pl->uris[pos], (pl->n - pos) * sizeof(char *));
+  pl->uris[pos] = uri;
+  pl->n++;
+  pl->modified = time(NULL);
+}
+
+
+static char *playlist_remove(struct stub_playlist *pl, int pos) {
+  char *uri = pl->uris[pos];
+  memmove(&pl->uris[pos], &pl->uris[pos + 1], (pl->n - pos - 1) * sizeof(char *));
+  pl->n--;
+  pl->modified = time(NULL);
+  return uri;
+}
+
+
+// Run one command, writing its output. Returns 0 or an ACK error code, with
+// the message in *error.
+static int run_command(struct stub_client *client, char **args, int n, const char **error) {
+  struct stub_mpd *stub = client->stub;
+  const char *cmd = args[0];
+  int rv = 0;
+
+  pthread_mutex_lock(&stub->lock);
+  stub->commands++;
+
+  if (strcmp(cmd, "ping") == 0 || strcmp(cmd, "binarylimit") == 0 || strcmp(cmd, "tagtypes") == 0
+      || strcmp(cmd, "password") == 0 || strcmp(cmd, "noidle") == 0) {
+    // nothing to do
+  }
+  else if (strcmp(cmd, "status") == 0) {
+    if (stub->current < 0) {
+      fprintf(client->out, "state: stop\n");
+    }
+    else {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double elapsed = stub->elapsed_ms / 1e3;
+      if (!stub->paused) elapsed += (now.tv_sec - stub->started.tv_sec) + (now.tv_nsec - stub->started.tv_nsec) / 1e9;
+      fprintf(client->out, "state: %s\nsong: %d\nsongid: %d\nelapsed: %.3f\n",
+          stub->paused ? "pause" : "play", stub->current, stub->current_id, elapsed);
+    }
+  }
+  else if (strcmp(cmd, "currentsong") == 0) {
+    if (stub->current >= 0) {
+      const struct gen_song *s = &stub->songs[stub->current];
+      // like MPD, a missing tag is left out
+      fprintf(client->out, "file: %s\n", s->uri);
+      if (s->artist[0]) fprintf(client->out, "Artist: %s\n", s->artist);
+      if (s->album[0]) fprintf(client->out, "Album: %s\n", s->album);
+      if (s->title[0]) fprintf(client->out, "Title: %s\n", s->title);
+      fprintf(client->out, "Pos: %d\nId: %d\n", stub->current, stub->current_id);
+    }
+  }
+  else if (strcmp(cmd, "stats") == 0) {
+    fprintf(client->out, "songs: %d\ndb_update: 1\n", stub->n_songs);
+  }
+  else if (strcmp(cmd, "listallinfo") == 0) {
+    for (int i = 0; i < stub->n_songs; i++) {
+      const struct gen_song *s = &stub->songs[i];
+      fprintf(client->out, "file: %s\n", s->uri);
+      if (s->artist[0]) fprintf(client->out, "Artist: %s\n", s->artist);
+      if (s->album[0]) fprintf(client->out, "Album: %s\n", s->album);
+      if (s->title[0]) fprintf(client->out, "Title: %s\n", s->title);
+    }
+  }
+  else if (strcmp(cmd, "listplaylist") == 0 && n == 2) {
+    struct stub_playlist *pl = find_playlist(stub, args[1], 0);
+    if (pl == NULL) {
+      rv = ACK_NO_EXIST;
+      *error = "No such playlist";
+    }
+    else {
+      for (int i = 0; i < pl->n; i++) fprintf(client->out, "file: %s\n", pl->uris[i]);
+    }
+  }
+  else if (strcmp(cmd, "listplaylists") == 0) {
+    for (int i = 0; i < stub->n_playlists; i++) {
+      struct tm tm;
+      char when[32];
+      strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&stub->playlists[i].modified, &tm));
+      fprintf(client->out, "playlist: %s\nLast-Modified: %s\n", stub->playlists[i].name, when);
+    }
+  }
+  else if (strcmp(cmd, "playlistclear") == 0 && n == 2) {
+    struct stub_playlist *pl = find_playlist(stub, args[1], 0);
+    if (pl == NULL) {
+      rv = ACK_NO_EXIST;
+      *error = "No such playlist";
+    }
+    else {
+      while (pl->n > 0) free(playlist_remove(pl, pl->n - 1));
+      pl->modified = time(NULL);
+    }
+  }
+  else if (strcmp(cmd, "playlistadd") == 0 && (n == 3 || n == 4)) {
+    struct stub_playlist *pl = find_playlist(stub, args[1], 1);
+    int pos = n == 4 ? atoi(args[3]) : pl->n;
+    if (pos < 0 || pos > pl->n) {
+      rv = ACK_ARG;
+      *error = "Bad position";
+    }
+    else {
+      playlist_insert(pl, pos, strdup(args[2]));
+    }
+  }
+  else if (strcmp(cmd, "playlistdelete") == 0 && n == 3) {
+    struct stub_playlist *pl = find_playlist(stub, args[1], 0);
+    int pos = atoi(args[2]);
+    if (pl == NULL || pos < 0 || pos >= pl->n) {
+      rv = ACK_ARG;
+      *error = "Bad song index";
+    }
+    else {
+      free(playlist_remove(pl, pos));
+    }
+  }
+  else if (strcmp(cmd, "playlistmove") == 0 && n == 4) {
+    struct stub_playlist *pl = find_playlist(stub, args[1], 0);
+    int from = atoi(args[2]), to = atoi(args[3]);
+    if (pl == NULL || from < 0 || from >= pl->n || to < 0 || to >= pl->n) {
+      rv = ACK_ARG;
+      *error = "Bad song index";
+    }
+    else {
+      playlist_insert(pl, to, playlist_remove(pl, from));
+    }
+  }
+  else {
+    rv = ACK_UNKNOWN;
+    *error = "unknown command";
+  }
+
+  pthread_mutex_unlock(&stub->lock);
+  return rv;
+}
+
+
+// Block until the player changes or the client sends noidle. Non-zero if the
+// client went away.
+static int client_idle(struct stub_client *client, FILE *in) {
+  struct stub_mpd *stub = client->stub;
+  struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+  int changed = 0, gone = 0;
+
+  pthread_mutex_lock(&stub->lock);
+  stub->commands++;
+  while (!changed && !gone) {
+    if (stub->player_events != client->seen_events) {
+      client->seen_events = stub->player_events;
+      changed = 1;
+      break;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += STUB_IDLE_CHECK_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&stub->player, &stub->lock, &deadline);
+
+    if (stub->player_events == client->seen_events && poll(&pfd, 1, 0) > 0) {
+      // the only thing a client may send while idle is noidle
+      char *line = NULL;
+      size_t size = 0;
+      pthread_mutex_unlock(&stub->lock);
+      gone = getline(&line, &size, in) <= 0;
+      free(line);
+      pthread_mutex_lock(&stub->lock);
+      if (!gone) break;
+    }
+  }
+  pthread_mutex_unlock(&stub->lock);
+
+  if (gone) return -1;
+  if (changed) fprintf(client->out, "changed: player\n");
+  fprintf(client->out, "OK\n");
+  fflush(client->out);
+  return 0;
+}
+
+
+static void *client_run(void *arg) {
+  struct stub_client *client = arg;
+  FILE *in = fdopen(client->fd, "r");
+  client->out = fdopen(dup(client->fd), "w");
+  if (in == NULL || client->out == NULL) goto _client_run_end;
+
+  fprintf(client->out, "OK MPD 0.23.5\n");
+  fflush(client->out);
+
+  char *line = NULL;
+  size_t size = 0;
+  // commands buffered inside a command list, run at command_list_end
+  char **list = NULL;
+  int n_list = 0, in_list = 0, list_ok = 0;
+
+  while (getline(&line, &size, in) > 0) {
+    line[strcspn(line, "\r\n")] = 0;
+
+    if (strcmp(line, "command_list_begin") == 0 || strcmp(line, "command_list_ok_begin") == 0) {
+      in_list = 1;
+      list_ok = strcmp(line, "command_list_ok_begin") == 0;
+      continue;
+    }
+    if (in_list && strcmp(line, "command_list_end") != 0) {
+      list = realloc(list, (n_list + 1) * sizeof(char *));
+      list[n_list++] = strdup(line);
+      continue;
+    }
+
+    if (!in_list && strncmp(line, "idle", 4) == 0 && (line[4] == 0 || line[4] == ' ')) {
+      if (client_idle(client, in)) break;
+      continue;
+    }
+
+    char *single[1] = {line};
+    char **cmds = in_list ? list : single;
+    int n_cmds = in_list ? n_list : 1;
+    int failed = 0;
+
+    for (int i = 0; i < n_cmds && !failed; i++) {
+      char *args[STUB_MAX_ARGS];
+      int n = split_args(cmds[i], args);
+      if (n == 0) continue;
+
+      const char *error = NULL;
+      int code = run_command(client, args, n, &error);
+      if (code) {
+        fprintf(client->out, "ACK [%d@%d] {%s} %s\n", code, in_list ? i : 0, args[0], error);
+        failed = 1;
+      }
+      else if (in_list && list_ok) {
+        fprintf(client->out, "list_OK\n");
+      }
+    }
+    if (!failed) fprintf(client->out, "OK\n");
+    if (client->stub->delay_us > 0) usleep(client->stub->delay_us);
+    // counted before the client can see it
+    pthread_mutex_lock(&client->stub->lock);
+    client->stub->replies++;
+    pthread_mutex_unlock(&client->stub->lock);
+    fflush(client->out);
+
+    for (int i = 0; i < n_list; i++) free(list[i]);
+    n_list = 0;
+    in_list = 0;
+  }
+
+  free(line);
+  free(list);
+
+_client_run_end:
+  if (client->out != NULL) fclose(client->out);
+  if (in != NULL) fclose(in);
+  else close(client->fd);
+
+  pthread_mutex_lock(&client->stub->lock);
+  client->stub->n_clients--;
+  pthread_cond_signal(&client->stub->idle);
+  pthread_mutex_unlock(&client->stub->lock);
+  free(client);
+  return NULL;
+}
+
+
+static void *stub_run(void *arg) {
+  struct stub_mpd *stub = arg;
+
+  while (1) {
+    int fd = accept(stub->listen_fd, NULL, NULL);
+    if (fd < 0) break;
+
+    struct stub_client *client = calloc(1, sizeof(struct stub_client));
+    client->stub = stub;
+    client->fd = fd;
+
+    pthread_mutex_lock(&stub->lock);
+    client->seen_events = stub->player_events;
+    stub->n_clients++;
+    pthread_mutex_unlock(&stub->lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, client_run, client)) {
+      pthread_mutex_lock(&stub->lock);
+      stub->n_clients--;
+      pthread_mutex_unlock(&stub->lock);
+      close(fd);
+      free(client);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  return NULL;
+}
+
+
+struct stub_mpd *stub_mpd_start(const struct gen_song *songs, int n_songs, unsigned port) {
+  struct stub_mpd *stub = calloc(1, sizeof(struct stub_mpd));
+  if (stub == NULL) return NULL;
+
+  stub->songs = malloc((n_songs + 1) * sizeof(struct gen_song));
+  memcpy(stub->songs, songs, n_songs * sizeof(struct gen_song));
+  stub->n_songs = n_songs;
+  stub->current = -1;
+  pthread_mutex_init(&stub->lock, NULL);
+  pthread_cond_init(&stub->idle, NULL);
+  pthread_cond_init(&stub->player, NULL);
+
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+
+  int one = 1;
+  stub->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (stub->listen_fd < 0
+      || setsockopt(stub->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+      || bind(stub->listen_fd, (struct sockaddr *)&addr, sizeof(addr))
+      || listen(stub->listen_fd, 16)
+      || getsockname(stub->listen_fd, (struct sockaddr *)&addr, &len)) {
+    perror(":: stub mpd");
+    goto _stub_mpd_start_err;
+  }
+  stub->port = ntohs(addr.sin_port);
+
+  if (pthread_create(&stub->thread, NULL, stub_run, stub)) goto _stub_mpd_start_err;
+  return stub;
+
+_stub_mpd_start_err:
+  if (stub->listen_fd >= 0) close(stub->listen_fd);
+  free(stub->songs);
+  free(stub);
+  return NULL;
+}
+
+
+unsigned stub_mpd_port(const struct stub_mpd *stub) {
+  return stub->port;
+}
+
+
+unsigned long stub_mpd_commands(const struct stub_mpd *stub) {
+  return stub->commands;
+}
+
+
+unsigned long stub_mpd_replies(const struct stub_mpd *stub) {
+  return stub->replies;
+}
+
+
+void stub_mpd_set_delay(struct stub_mpd *stub, long delay_us) {
+  stub->delay_us = delay_us;
+}
+
+
+void stub_mpd_play(struct stub_mpd *stub, int song) {
+  stub_mpd_set_player(stub, song, song, 1, 0);
+}
+
+
+void stub_mpd_set_player(struct stub_mpd *stub, int song, int id, int playing, unsigned elapsed_ms) {
+  pthread_mutex_lock(&stub->lock);
+  stub->current = song;
+  stub->current_id = id;
+  stub->paused = !playing;
+  stub->elapsed_ms = elapsed_ms;
+  clock_gettime(CLOCK_MONOTONIC, &stub->started);
+  stub->player_events++;
+  pthread_cond_broadcast(&stub->player);
+  pthread_mutex_unlock(&stub->lock);
+}
+
+
+void stub_mpd_stop(struct stub_mpd *stub) {
+  if (stub == NULL) return;
+
+  // unblocks accept()
+  shutdown(stub->listen_fd, SHUT_RDWR);
+  close(stub->listen_fd);
+  pthread_join(stub->thread, NULL);
+
+  // clients exit once their peer disconnects
+  pthread_mutex_lock(&stub->lock);
+  while (stub->n_clients > 0) pthread_cond_wait(&stub->idle, &stub->lock);
+  pthread_mutex_unlock(&stub->lock);
+  pthread_cond_destroy(&stub->idle);
+  pthread_cond_destroy(&stub->player);
+  pthread_mutex_destroy(&stub->lock);
+
+  for (int i = 0; i < stub->n_playlists; i++) {
+    struct stub_playlist *pl = &stub->playlists[i];
+    for (int j = 0; j < pl->n; j++) free(pl->uris[j]);
+    free(pl->uris);
+    free(pl->name);
+  }
+  free(stub->songs);
+  free(stub);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "gen.h"
+
+// A minimal MPD server on localhost, serving a fixed song database, in-memory
+// stored playlists and a simulated player; enough of the protocol for the
+// playlist code and for watching playback with idle.
+struct stub_mpd;
+
+// Listens on port, or an ephemeral one if 0, see stub_mpd_port(). The songs
+// are copied; a song's id is its index.
+struct stub_mpd *stub_mpd_start(const struct gen_song *songs, int n_songs, unsigned port);
+unsigned stub_mpd_port(const struct stub_mpd *stub);
+// Commands received so far, command list members counted individually.
+unsigned long stub_mpd_commands(const struct stub_mpd *stub);
+// Replies sent so far: a command list gets one, so this counts round trips.
+unsigned long stub_mpd_replies(const struct stub_mpd *stub);
+// Hold each reply back by delay_us, as a slower network would. Set before
+// clients connect.
+void stub_mpd_set_delay(struct stub_mpd *stub, long delay_us);
+// Start playing a song from the beginning, waking idling clients.
+void stub_mpd_play(struct stub_mpd *stub, int song);
+// Set the whole player state, waking idling clients: song -1 stops, else it
+// is reported under queue id `id`, at elapsed_ms, playing or paused.
+void stub_mpd_set_player(struct stub_mpd *stub, int song, int id, int playing, unsigned elapsed_ms);
+// Waits for every client to disconnect first.
+void stub_mpd_stop(struct stub_mpd *stub);
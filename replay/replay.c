@@ -0,0 +1,544 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <mpd/client.h>
+#include <sqlite3.h>
+
+#include "../src/db.h"
+#include "../src/rank.h"
+#include "../src/similar.h"
+#include "../src/metrics.h"
+#include "../src/endpoint.h"
+#include "../src/journal.h"
+#include "../src/reactor.h"
+#include "../src/worker.h"
+#include "../src/playlist_plan.h"
+#include "../src/msleep.h"
+#include "../bench/stub_mpd.h"
+#include "trace.h"
+
+// how long the tracker gets to catch up with the last event
+#define DRAIN_MS 500
+
+// Matches the plays committed to the database against the trace's expected
+// ones, on the journal's thread as each batch commits.
+struct harness {
+  const struct trace *trace;
+  struct playlist_worker *worker;
+
+  pthread_mutex_t lock;
+  // when each event was handed to the stub, 0 until then
+  long *injected_ns;
+  // first event a committed play may match
+  int next;
+  sqlite3 *reader;
+  sqlite3_stmt *new_plays;
+  long seen;
+
+  long *latency_ns;
+  int detected;
+  int spurious;
+};
+
+static volatile sig_atomic_t stopping;
+
+
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+
+static double percentile_ms(const long *ns, int n, double p) {
+  return n ? ns[(int)(p * (n - 1) + 0.5)] / 1e6 : 0;
+}
+
+
+static int same_tag(const char *a, const char *b) {
+  return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+
+// A committed play is the first expected play at or after `next` with its
+// tags; the expected plays passed over were missed.
+static void match_play(struct harness *h, const char *artist, const char *album, const char *title, long commit_ns) {
+  const struct trace *trace = h->trace;
+  for (int i = h->next; i < trace->n && h->injected_ns[i] != 0; i++) {
+    const struct trace_event *event = &trace->events[i];
+    if (!event->expected) continue;
+    const struct gen_song *song = &trace->songs[event->song];
+    if (same_tag(artist, song->artist) && same_tag(album, song->album) && same_tag(title, song->title)) {
+      h->latency_ns[h->detected++] = commit_ns - h->injected_ns[i];
+      h->next = i + 1;
+      return;
+    }
+  }
+  h->spurious++;
+}
+
+
+static void on_applied(void *ctx) {
+  struct harness *h = ctx;
+  long commit_ns = now_ns();
+  playlist_worker_notify(h->worker);
+
+  pthread_mutex_lock(&h->lock);
+  sqlite3_bind_int64(h->new_plays, 1, h->seen);
+  while (sqlite3_step(h->new_plays) == SQLITE_ROW) {
+    h->seen = sqlite3_column_int64(h->new_plays, 0);
+    match_play(h, (const char *)sqlite3_column_text(h->new_plays, 1), (const char *)sqlite3_column_text(h->new_plays, 2),
+        (const char *)sqlite3_column_text(h->new_plays, 3), commit_ns);
+  }
+  sqlite3_reset(h->new_plays);
+  pthread_mutex_unlock(&h->lock);
+}
+
+
+static void *reactor_thread(void *arg) {
+  reactor_run(arg);
+  return NULL;
+}
+
+
+static void sleep_until(long deadline_ns) {
+  struct timespec ts = {.tv_sec = deadline_ns / 1000000000L, .tv_nsec = deadline_ns % 1000000000L};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && !stopping);
+}
+
+
+struct replay_options {
+  double speed;
+  long max_gap_ms;
+  int poll;
+  unsigned batch_size;
+  long debounce_ms;
+  struct playlist_plan plan;
+};
+
+// Play the trace back through a stub server watched by the daemon's own
+// reactor, journal, database and playlist worker. Returns non-zero if the
+// harness itself failed.
+static int replay(const struct trace *trace, const struct db_config *config, const struct replay_options *opts, struct harness *h) {
+  struct stub_mpd *stub = stub_mpd_start(trace->songs, trace->n_songs, 0);
+  struct db_conn *db = db_init(config, 0);
+  struct rank *rank = rank_new();
+  struct similar *similar = similar_new();
+  struct journal *journal = NULL;
+  struct reactor *reactor = NULL;
+  struct mpd_endpoint endpoint;
+  char address[64];
+  pthread_t thread;
+  int running = 0, rv = -1;
+
+  if (stub == NULL || db == NULL || rank == NULL || similar == NULL) goto _replay_end;
+  if (db_load_rank(db, rank) || db_load_similar(db, similar)) goto _replay_end;
+  if (sqlite3_open_v2(db_filename(db), &h->reader, SQLITE_OPEN_READONLY, NULL)
+      || sqlite3_prepare_v2(h->reader,
+        "SELECT Plays.rowid, Artist.Name, Album.Name, Song.Name FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID "
+        "INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID "
+        "WHERE Plays.rowid > ? ORDER BY Plays.rowid;", -1, &h->new_plays, NULL)) {
+    fprintf(stderr, ":: Failed to open reader: %s\n", sqlite3_errmsg(h->reader));
+    goto _replay_end;
+  }
+  sqlite3_stmt *last = NULL;
+  if (sqlite3_prepare_v2(h->reader, "SELECT IFNULL(MAX(rowid), 0) FROM Plays;", -1, &last, NULL) == SQLITE_OK
+      && sqlite3_step(last) == SQLITE_ROW) {
+    h->seen = sqlite3_column_int64(last, 0);
+  }
+  sqlite3_finalize(last);
+
+  snprintf(address, sizeof(address), "127.0.0.1:%u", stub_mpd_port(stub));
+  if (endpoint_parse(&endpoint, address)) goto _replay_end;
+  int source_id = db_source(db, endpoint.name);
+  journal = source_id >= 0 ? journal_open(db, 0) : NULL;
+  reactor = journal != NULL ? reactor_new(journal, opts->poll) : NULL;
+  if (reactor == NULL) goto _replay_end;
+  h->worker = playlist_worker_start(&endpoint, source_id, config, rank, similar, &opts->plan, opts->batch_size, opts->debounce_ms);
+  if (h->worker == NULL || reactor_add(reactor, &endpoint, source_id, h->worker)) goto _replay_end;
+
+  // the journal thread is now the only user of db
+  if (journal_start(journal, on_applied, h)) goto _replay_end;
+  if (pthread_create(&thread, NULL, reactor_thread, reactor)) goto _replay_end;
+  running = 1;
+  // let the reactor connect and see the stopped player
+  msleep(200);
+
+  long start_ns = now_ns(), at_ns = start_ns;
+  for (int i = 0; i < trace->n && !stopping; i++) {
+    const struct trace_event *event = &trace->events[i];
+    if (i > 0) {
+      const struct trace_event *prev = &trace->events[i - 1];
+      long trace_gap_ns = (event->ms - prev->ms) * 1000000L;
+      long gap_ns = (long)(trace_gap_ns / opts->speed);
+      if (opts->max_gap_ms > 0 && gap_ns > opts->max_gap_ms * 1000000L) gap_ns = opts->max_gap_ms * 1000000L;
+      // the tracker tells a jump back from how far the song got since it last
+      // looked, which a shortened wait hides: show it halfway
+      if (gap_ns < trace_gap_ns && prev->state == TRACE_PLAY && event->state != TRACE_STOP && event->id == prev->id) {
+        sleep_until(at_ns + gap_ns / 2);
+        stub_mpd_set_player(stub, prev->song, prev->id, 1, prev->elapsed_ms + (event->ms - prev->ms));
+      }
+      at_ns += gap_ns;
+      sleep_until(at_ns);
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->injected_ns[i] = now_ns();
+    pthread_mutex_unlock(&h->lock);
+    stub_mpd_set_player(stub, event->song, event->id, event->state == TRACE_PLAY, event->elapsed_ms);
+  }
+  msleep(DRAIN_MS);
+  printf("Replayed %d events in %.1fs\n", trace->n, (now_ns() - start_ns) / 1e9);
+  rv = 0;
+
+_replay_end:
+  if (running) {
+    reactor_stop(reactor);
+    pthread_join(thread, NULL);
+  }
+  // closing the connections lets the stub stop
+  reactor_free(reactor);
+  journal_close(journal);
+  playlist_worker_stop(h->worker);
+  h->worker = NULL;
+  stub_mpd_stop(stub);
+  db_free(db);
+  rank_free(rank);
+  similar_free(similar);
+  return rv;
+}
+
+
+// Write the player's state after each player event of a live server until
+// interrupted or `duration_s` is up.
+static int record(const struct mpd_endpoint *endpoint, long duration_s, FILE *out) {
+  struct mpd_connection *mpd = mpd_connection_new(endpoint->host, endpoint->port, 0);
+  struct trace *trace = trace_new();
+  long start_ns = now_ns(), events = 0;
+  int rv = -1;
+
+  if (trace == NULL || mpd == NULL || mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+    fprintf(stderr, ":: %s: %s\n", endpoint->name, mpd ? mpd_connection_get_error_message(mpd) : "out of memory");
+    goto _record_end;
+  }
+  if (endpoint->password[0] && !mpd_run_password(mpd, endpoint->password)) goto _record_err;
+  fprintf(out, "# mpd_stats trace of %s: ms, state, queue id, elapsed ms, file, artist, album, title\n", endpoint->name);
+
+  while (!stopping) {
+    long ms = (now_ns() - start_ns) / 1000000;
+    struct mpd_status *status = mpd_run_status(mpd);
+    if (status == NULL) goto _record_err;
+    struct mpd_song *song = mpd_run_current_song(mpd);
+    if (song == NULL && mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+      mpd_status_free(status);
+      goto _record_err;
+    }
+
+    enum mpd_state player = mpd_status_get_state(status);
+    enum trace_state state = song == NULL || player == MPD_STATE_STOP || player == MPD_STATE_UNKNOWN
+      ? TRACE_STOP : player == MPD_STATE_PLAY ? TRACE_PLAY : TRACE_PAUSE;
+    int err = state == TRACE_STOP
+      ? trace_add(trace, ms, state, -1, 0, NULL, NULL, NULL, NULL)
+      : trace_add(trace, ms, state, mpd_status_get_song_id(status), mpd_status_get_elapsed_ms(status), mpd_song_get_uri(song),
+          mpd_song_get_tag(song, MPD_TAG_ARTIST, 0), mpd_song_get_tag(song, MPD_TAG_ALBUM, 0), mpd_song_get_tag(song, MPD_TAG_TITLE, 0));
+    mpd_status_free(status);
+    if (song != NULL) mpd_song_free(song);
+    // one line at a time, so an interrupted recording is still a trace
+    if (err || trace_write_event(trace, &trace->events[trace->n - 1], out) || fflush(out)) goto _record_end;
+    events++;
+
+    if (!mpd_send_idle_mask(mpd, MPD_IDLE_PLAYER)) goto _record_err;
+    struct pollfd pfd = {.fd = mpd_connection_get_fd(mpd), .events = POLLIN};
+    int ready = 0;
+    while (!stopping && !ready) {
+      long left_ms = duration_s > 0 ? start_ns / 1000000 + duration_s * 1000 - now_ns() / 1000000 : 1000;
+      if (left_ms <= 0) stopping = 1;
+      else ready = poll(&pfd, 1, left_ms < 1000 ? left_ms : 1000) > 0;
+    }
+    if (!ready) mpd_send_noidle(mpd);
+    if (mpd_recv_idle(mpd, 1) == 0 && mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) goto _record_err;
+  }
+  fprintf(stderr, ":: Recorded %ld events over %.1fs\n", events, (now_ns() - start_ns) / 1e9);
+  rv = 0;
+  goto _record_end;
+
+_record_err:
+  fprintf(stderr, ":: %s: %s\n", endpoint->name, mpd_connection_get_error_message(mpd));
+
+_record_end:
+  if (mpd != NULL) mpd_connection_free(mpd);
+  trace_free(trace);
+  return rv;
+}
+
+
+static void on_signal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+
+static void record_usage(void) {
+  fprintf(stderr,
+      "Usage: mpd_stats_replay record [--mpd ADDRESS] [--duration S] PATH\n"
+      "  --mpd ADDRESS    [password@]host[:port] or socket path (default MPD_HOST and MPD_PORT)\n"
+      "  --duration S     stop after S seconds (default: on SIGINT)\n"
+      "  PATH             trace to write, - for stdout\n");
+}
+
+
+static int record_main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"mpd", required_argument, NULL, 'm'},
+    {"duration", required_argument, NULL, 'D'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *address = NULL;
+  long duration_s = 0;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'm': address = optarg; break;
+      case 'D': duration_s = atol(optarg); break;
+      default:
+        record_usage();
+        return 1;
+    }
+  }
+  if (argc - optind != 1) {
+    record_usage();
+    return 1;
+  }
+
+  struct mpd_endpoint endpoint;
+  if (endpoint_parse(&endpoint, address)) return 1;
+  const char *path = argv[optind];
+  FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    return 1;
+  }
+  struct sigaction action = {.sa_handler = on_signal};
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  int rv = record(&endpoint, duration_s, out);
+  if (out != stdout && fclose(out)) rv = -1;
+  return rv ? 4 : 0;
+}
+
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+      "Usage: %s [options]\n"
+      "       %s record --help\n"
+      "  --trace PATH     trace to replay (default: a synthetic one)\n"
+      "  --events N       events in the synthetic trace (default 200)\n"
+      "  --songs N        songs in the synthetic trace's library (default 2000)\n"
+      "  --seed N         random seed of the synthetic trace (default 1)\n"
+      "  --save-trace PATH write the trace replayed to PATH\n"
+      "  --speed X        replay X times faster than recorded (default 1)\n"
+      "  --max-gap MS     cut longer waits between events to MS, 0 for none (default 200)\n"
+      "  --poll           poll the stub server instead of idling\n"
+      "  --db PATH        record into PATH, e.g. a benchmark's history (default: a new database)\n"
+      "  --batch-size N   max commands per command list when writing playlists (default 256)\n"
+      "  --debounce MS    wait for track changes to settle before regenerating playlists (default 0)\n"
+      "  --playlists PATH playlists to keep, as mpd_stats --playlists (default: the built-in ones)\n"
+      "  --output PATH    write results as JSON\n"
+      "  --max-missed N   fail if more than N expected plays are missed\n"
+      "  --max-p99 MS     fail if the p99 from event to committed play exceeds MS\n",
+      prog, prog);
+}
+
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "record") == 0) return record_main(argc - 1, argv + 1);
+
+  static const struct option long_options[] = {
+    {"trace", required_argument, NULL, 't'},
+    {"events", required_argument, NULL, 'e'},
+    {"songs", required_argument, NULL, 's'},
+    {"seed", required_argument, NULL, 'r'},
+    {"save-trace", required_argument, NULL, 'S'},
+    {"speed", required_argument, NULL, 'x'},
+    {"max-gap", required_argument, NULL, 'g'},
+    {"poll", no_argument, NULL, 'p'},
+    {"db", required_argument, NULL, 'd'},
+    {"batch-size", required_argument, NULL, 'b'},
+    {"debounce", required_argument, NULL, 'D'},
+    {"playlists", required_argument, NULL, 'L'},
+    {"output", required_argument, NULL, 'o'},
+    {"max-missed", required_argument, NULL, 'M'},
+    {"max-p99", required_argument, NULL, 'P'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  struct gen_config gen = {.songs = 2000, .zipf = 1.0, .seed = 1};
+  struct replay_options opts = {.speed = 1, .max_gap_ms = 200, .batch_size = 256};
+  const char *trace_path = NULL, *save_path = NULL, *db_path = NULL, *output = NULL, *playlists = NULL;
+  int events = 200, max_missed = -1;
+  double max_p99_ms = -1;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 't': trace_path = optarg; break;
+      case 'e': events = atoi(optarg); break;
+      case 's': gen.songs = atoi(optarg); break;
+      case 'r': gen.seed = strtoull(optarg, NULL, 10); break;
+      case 'S': save_path = optarg; break;
+      case 'x': opts.speed = atof(optarg); break;
+      case 'g': opts.max_gap_ms = atol(optarg); break;
+      case 'p': opts.poll = 1; break;
+      case 'd': db_path = optarg; break;
+      case 'b': opts.batch_size = atoi(optarg); break;
+      case 'D': opts.debounce_ms = atol(optarg); break;
+      case 'L': playlists = optarg; break;
+      case 'o': output = optarg; break;
+      case 'M': max_missed = atoi(optarg); break;
+      case 'P': max_p99_ms = atof(optarg); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (events < 1 || gen.songs < 40 || opts.speed <= 0 || opts.max_gap_ms < 0 || opts.batch_size < 1) {
+    fprintf(stderr, ":: Need events >= 1, songs >= 40, speed > 0, max-gap >= 0 and batch-size >= 1\n");
+    return 1;
+  }
+  gen.albums = gen.songs / 10;
+  gen.artists = gen.songs / 40;
+  if (playlists == NULL) playlist_plan_default(&opts.plan);
+  else if (playlist_plan_load(&opts.plan, playlists)) return 1;
+
+  struct trace *trace = NULL;
+  if (trace_path != NULL) {
+    FILE *in = fopen(trace_path, "r");
+    if (in == NULL) {
+      perror(trace_path);
+      return 1;
+    }
+    trace = trace_read(in);
+    fclose(in);
+  }
+  else {
+    trace = trace_synthesize(&gen, events);
+  }
+  if (trace == NULL || trace->n == 0 || trace->n_songs == 0) {
+    fprintf(stderr, ":: No trace to replay\n");
+    trace_free(trace);
+    return 1;
+  }
+  if (save_path != NULL) {
+    FILE *out = fopen(save_path, "w");
+    if (out == NULL || trace_write(trace, out) || fclose(out)) {
+      perror(save_path);
+      trace_free(trace);
+      return 1;
+    }
+  }
+
+  int expected = trace_expect(trace);
+  printf("Trace: %d events, %d plays expected, %d songs, %.1fs long\n",
+      trace->n, expected, trace->n_songs, trace->events[trace->n - 1].ms / 1e3);
+
+  char tmp_path[] = "/tmp/mpd_stats_replay_XXXXXX";
+  if (db_path == NULL) {
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+      perror(tmp_path);
+      trace_free(trace);
+      return 1;
+    }
+    close(fd);
+    db_path = tmp_path;
+  }
+  struct db_config config = {.path = db_path, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+  struct harness h = {
+    .trace = trace,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .injected_ns = calloc(trace->n, sizeof(long)),
+    .latency_ns = malloc((expected + 1) * sizeof(long)),
+  };
+  struct sigaction action = {.sa_handler = on_signal};
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  int rv = 4;
+  if (h.injected_ns == NULL || h.latency_ns == NULL || replay(trace, &config, &opts, &h)) {
+    fprintf(stderr, ":: Replay failed\n");
+    goto _main_end;
+  }
+
+  int missed = expected - h.detected;
+  qsort(h.latency_ns, h.detected, sizeof(long), cmp_long);
+  double p50 = percentile_ms(h.latency_ns, h.detected, 0.5), p90 = percentile_ms(h.latency_ns, h.detected, 0.9);
+  double p99 = percentile_ms(h.latency_ns, h.detected, 0.99), max = percentile_ms(h.latency_ns, h.detected, 1.0);
+  unsigned long rebuild_sum_ns;
+  unsigned long rebuilds = metrics_count(METRIC_PLAYLISTS, &rebuild_sum_ns);
+  double rebuild_mean = rebuilds ? rebuild_sum_ns / 1e6 / rebuilds : 0;
+  double rebuild_p50 = metrics_quantile_ns(METRIC_PLAYLISTS, 0.5) / 1e6, rebuild_p99 = metrics_quantile_ns(METRIC_PLAYLISTS, 0.99) / 1e6;
+
+  printf("Plays: %d of %d detected, %d missed, %d spurious\n", h.detected, expected, missed, h.spurious);
+  printf("Event to committed play: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", p50, p90, p99, max);
+  printf("Playlist rebuilds: %lu, mean %.2fms, p50 under %.2fms, p99 under %.2fms\n", rebuilds, rebuild_mean, rebuild_p50, rebuild_p99);
+
+  if (output != NULL) {
+    FILE *f = fopen(output, "w");
+    if (f == NULL) perror(output);
+    else {
+      fprintf(f, "{\"events\": %d, \"expected\": %d, \"detected\": %d, \"missed\": %d, \"spurious\": %d,\n",
+          trace->n, expected, h.detected, missed, h.spurious);
+      fprintf(f, " \"commit_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n", p50, p90, p99, max);
+      fprintf(f, " \"rebuilds\": {\"n\": %lu, \"mean_ms\": %.3f, \"p50_ms_max\": %.3f, \"p99_ms_max\": %.3f}}\n",
+          rebuilds, rebuild_mean, rebuild_p50, rebuild_p99);
+      fclose(f);
+      printf("Results written to %s\n", output);
+    }
+  }
+
+  rv = 0;
+  if (max_missed >= 0 && missed > max_missed) {
+    fprintf(stderr, ":: %d plays missed, more than %d\n", missed, max_missed);
+    rv = 1;
+  }
+  if (max_p99_ms >= 0 && p99 > max_p99_ms) {
+    fprintf(stderr, ":: p99 of %.2fms over %.2fms\n", p99, max_p99_ms);
+    rv = 1;
+  }
+
+_main_end:
+  sqlite3_finalize(h.new_plays);
+  sqlite3_close(h.reader);
+  if (db_path == tmp_path) {
+    char side[PATH_MAX];
+    unlink(tmp_path);
+    snprintf(side, sizeof(side), "%s-wal", tmp_path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s-shm", tmp_path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s.playlog", tmp_path);
+    unlink(side);
+  }
+  free(h.injected_ns);
+  free(h.latency_ns);
+  trace_free(trace);
+  return rv;
+}
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+#include "../src/strpool.h"
+
+// the tracker's slack before a jump back in the same song is a new play
+#define TRACE_SEEK_SLACK_MS 1000
+
+static const char *STATE_NAMES[] = {
+  [TRACE_STOP] = "stop",
+  [TRACE_PLAY] = "play",
+  [TRACE_PAUSE] = "pause",
+};
+
+
+struct trace *trace_new(void) {
+  struct trace *trace = calloc(1, sizeof(struct trace));
+  if (trace == NULL) return NULL;
+  trace->uris = strpool_new();
+  if (trace->uris == NULL) {
+    free(trace);
+    return NULL;
+  }
+  return trace;
+}
+
+
+void trace_free(struct trace *trace) {
+  if (trace == NULL) return;
+  strpool_free(trace->uris);
+  free(trace->events);
+  free(trace->songs);
+  free(trace);
+}
+
+
+static int add_song(struct trace *trace, const char *uri, const char *artist, const char *album, const char *title) {
+  int song = strpool_intern(trace->uris, uri);
+  if (song < 0 || song < trace->n_songs) return song;
+
+  if (trace->n_songs == trace->cap_songs) {
+    int cap = trace->cap_songs ? trace->cap_songs * 2 : 256;
+    struct gen_song *songs = realloc(trace->songs, cap * sizeof(struct gen_song));
+    if (songs == NULL) return -1;
+    trace->songs = songs;
+    trace->cap_songs = cap;
+  }
+  struct gen_song *s = &trace->songs[trace->n_songs++];
+  snprintf(s->uri, sizeof(s->uri), "%s", uri);
+  snprintf(s->artist, sizeof(s->artist), "%s", artist ? artist : "");
+  snprintf(s->album, sizeof(s->album), "%s", album ? album : "");
+  snprintf(s->title, sizeof(s->title), "%s", title ? title : "");
+  return song;
+}
+
+
+int trace_add(struct trace *trace, long ms, enum trace_state state, int id, unsigned elapsed_ms,
+    const char *uri, const char *artist, const char *album, const char *title) {
+  int song = -1;
+  if (state != TRACE_STOP) {
+    song = add_song(trace, uri, artist, album, title);
+    if (song < 0) return -1;
+  }
+
+  if (trace->n == trace->cap) {
+    int cap = trace->cap ? trace->cap * 2 : 1024;
+    struct trace_event *events = realloc(trace->events, cap * sizeof(struct trace_event));
+    if (events == NULL) return -1;
+    trace->events = events;
+    trace->cap = cap;
+  }
+  trace->events[trace->n++] = (struct trace_event){
+    .ms = ms, .state = state, .id = state == TRACE_STOP ? -1 : id,
+    .elapsed_ms = state == TRACE_STOP ? 0 : elapsed_ms, .song = song,
+  };
+  return 0;
+}
+
+
+// Split a line at tabs into at most n fields, returning how many there were.
+static int split_fields(char *line, char **fields, int n) {
+  int i = 0;
+  fields[i++] = line;
+  for (char *p = line; *p && i < n; p++) {
+    if (*p == '\t') {
+      *p = 0;
+      fields[i++] = p + 1;
+    }
+  }
+  return i;
+}
+
+
+struct trace *trace_read(FILE *in) {
+  struct trace *trace = trace_new();
+  char *line = NULL;
+  size_t cap = 0;
+  long line_no = 0;
+  if (trace == NULL) return NULL;
+
+  while (getline(&line, &cap, in) != -1) {
+    line_no++;
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0] == '#' || line[0] == 0) continue;
+
+    char *fields[8];
+    int n = split_fields(line, fields, 8);
+    int state;
+    for (state = TRACE_STOP; state <= TRACE_PAUSE && strcmp(fields[n > 1 ? 1 : 0], STATE_NAMES[state]) != 0; state++);
+    if ((n != 8 && !(n >= 2 && state == TRACE_STOP)) || state > TRACE_PAUSE) {
+      fprintf(stderr, ":: Trace line %ld: expected 8 tab-separated fields\n", line_no);
+      goto _trace_read_err;
+    }
+
+    long ms = atol(fields[0]);
+    if (trace->n > 0 && ms < trace->events[trace->n - 1].ms) {
+      fprintf(stderr, ":: Trace line %ld: events out of order\n", line_no);
+      goto _trace_read_err;
+    }
+    int err = state == TRACE_STOP
+      ? trace_add(trace, ms, state, -1, 0, NULL, NULL, NULL, NULL)
+      : trace_add(trace, ms, state, atoi(fields[2]), strtoul(fields[3], NULL, 10), fields[4], fields[5], fields[6], fields[7]);
+    if (err) goto _trace_read_err;
+  }
+  free(line);
+  return trace;
+
+_trace_read_err:
+  free(line);
+  trace_free(trace);
+  return NULL;
+}
+
+
+// Tabs and newlines would split the field.
+static void write_field(const char *s, FILE *out) {
+  fputc('\t', out);
+  for (; *s; s++) fputc(*s == '\t' || *s == '\n' || *s == '\r' ? ' ' : *s, out);
+}
+
+
+int trace_write_event(const struct trace *trace, const struct trace_event *event, FILE *out) {
+  fprintf(out, "%ld\t%s\t%d\t%u", event->ms, STATE_NAMES[event->state], event->id, event->elapsed_ms);
+  if (event->song < 0) fputs("\t\t\t\t", out);
+  else {
+    const struct gen_song *song = &trace->songs[event->song];
+    write_field(song->uri, out);
+    write_field(song->artist, out);
+    write_field(song->album, out);
+    write_field(song->title, out);
+  }
+  fputc('\n', out);
+  return ferror(out) ? -1 : 0;
+}
+
+
+int trace_write(const struct trace *trace, FILE *out) {
+  fprintf(out, "# mpd_stats trace: ms, state, queue id, elapsed ms, file, artist, album, title\n");
+  for (int i = 0; i < trace->n; i++) {
+    if (trace_write_event(trace, &trace->events[i], out)) return -1;
+  }
+  return 0;
+}
+
+
+static uint64_t rng_state;
+
+static double rng_uniform(void) {
+  // xorshift64*, as gen.c
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long rng_range(long lo, long hi) {
+  return lo + (long)(rng_uniform() * (hi - lo + 1));
+}
+
+
+struct synth {
+  const struct gen_config *gen;
+  struct trace *trace;
+  long ms;
+  int song;
+  int id;
+  int playing;
+  // where the song is at ms
+  unsigned elapsed_ms;
+};
+
+static void synth_wait(struct synth *synth, long ms) {
+  if (synth->playing) synth->elapsed_ms += ms;
+  synth->ms += ms;
+}
+
+static int synth_event(struct synth *synth) {
+  if (synth->song < 0) return trace_add(synth->trace, synth->ms, TRACE_STOP, -1, 0, NULL, NULL, NULL, NULL);
+
+  struct gen_song song;
+  gen_song(synth->gen, synth->song, &song);
+  return trace_add(synth->trace, synth->ms, synth->playing ? TRACE_PLAY : TRACE_PAUSE, synth->id, synth->elapsed_ms,
+      song.uri, song.artist, song.album, song.title);
+}
+
+// The next song in the queue, wait_ms from the last event.
+static int synth_next(struct synth *synth, long wait_ms) {
+  synth_wait(synth, wait_ms);
+  synth->song = gen_next_song(synth->gen);
+  synth->id++;
+  synth->playing = 1;
+  synth->elapsed_ms = 0;
+  return synth_event(synth);
+}
+
+
+struct trace *trace_synthesize(const struct gen_config *gen, int n) {
+  struct synth synth = {.gen = gen, .trace = trace_new(), .song = -1};
+  if (synth.trace == NULL) return NULL;
+  rng_state = gen->seed ? gen->seed : 1;
+
+  int err = synth_next(&synth, 0);
+  while (!err && synth.trace->n < n) {
+    double u = rng_uniform();
+    if (u < 0.55) {
+      // listened through
+      err = synth_next(&synth, rng_range(120000, 360000));
+    }
+    else if (u < 0.70) {
+      err = synth_next(&synth, rng_range(2000, 15000));
+    }
+    else if (u < 0.80) {
+      // skipping through the queue, faster than a status round trip at times
+      for (int k = rng_range(3, 6); !err && k > 0; k--) err = synth_next(&synth, rng_range(1, 150));
+    }
+    else if (u < 0.88) {
+      synth_wait(&synth, rng_range(10000, 120000));
+      synth.playing = 0;
+      err = synth_event(&synth);
+      synth_wait(&synth, rng_range(1000, 60000));
+      synth.playing = 1;
+      if (!err) err = synth_event(&synth);
+    }
+    else if (u < 0.94) {
+      // back to the start of the song
+      synth_wait(&synth, rng_range(30000, 200000));
+      synth.elapsed_ms = 0;
+      err = synth_event(&synth);
+    }
+    else {
+      synth_wait(&synth, rng_range(10000, 120000));
+      synth.song = -1;
+      err = synth_event(&synth) || synth_next(&synth, rng_range(5000, 600000));
+    }
+  }
+
+  if (err) {
+    trace_free(synth.trace);
+    return NULL;
+  }
+  return synth.trace;
+}
+
+
+int trace_expect(struct trace *trace) {
+  int plays = 0, id = -1, playing = 0;
+  long pos = 0, ms = 0;
+  for (int i = 0; i < trace->n; i++) {
+    struct trace_event *event = &trace->events[i];
+    long expected_pos = pos + (playing ? event->ms - ms : 0);
+
+    if (event->state == TRACE_STOP) event->expected = 0;
+    else if (event->id != id) event->expected = 1;
+    else event->expected = (long)event->elapsed_ms + TRACE_SEEK_SLACK_MS < expected_pos;
+
+    id = event->state == TRACE_STOP ? -1 : event->id;
+    playing = event->state == TRACE_PLAY;
+    pos = event->elapsed_ms;
+    ms = event->ms;
+    plays += event->expected;
+  }
+  return plays;
+}
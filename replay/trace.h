@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "../bench/gen.h"
+
+// A listening session as MPD reported it: the player's status and current
+// song after each player event, to be played back by a stub server. As text,
+// one event per line, tab-separated, '#' lines being comments:
+//   <ms since the first event> <play|pause|stop> <queue id> <elapsed ms> <file> <artist> <album> <title>
+enum trace_state {
+  TRACE_STOP,
+  TRACE_PLAY,
+  TRACE_PAUSE,
+};
+
+struct trace_event {
+  long ms;
+  enum trace_state state;
+  int id;
+  unsigned elapsed_ms;
+  // index into the trace's songs, -1 when stopped
+  int song;
+  // a play the tracker should record, see trace_expect()
+  int expected;
+};
+
+struct trace {
+  struct trace_event *events;
+  int n;
+  int cap;
+  // each file once, its tags cut to what a gen_song holds
+  struct gen_song *songs;
+  int n_songs;
+  int cap_songs;
+  struct strpool *uris;
+};
+
+struct trace *trace_new(void);
+void trace_free(struct trace *trace);
+
+// Append an event; the tags are ignored when stopped. Events must come in time
+// order.
+int trace_add(struct trace *trace, long ms, enum trace_state state, int id, unsigned elapsed_ms,
+    const char *uri, const char *artist, const char *album, const char *title);
+
+// NULL if the stream cannot be read, after saying which line is wrong.
+struct trace *trace_read(FILE *in);
+int trace_write(const struct trace *trace, FILE *out);
+int trace_write_event(const struct trace *trace, const struct trace_event *event, FILE *out);
+
+// A session of n events over the configured songs: mostly songs listened
+// through, with skips, bursts of skips a few ms apart, pauses, restarts and
+// stops.
+struct trace *trace_synthesize(const struct gen_config *gen, int n);
+
+// Mark the events where a new play starts: a song starting, including after a
+// stop, or the same song jumping back further than playback could explain.
+// Returns the number of plays.
+int trace_expect(struct trace *trace);
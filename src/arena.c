@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  alignas(max_align_t) char data[];
+};
+
+struct arena {
+  // newest first
+  struct arena_block *blocks;
+  void *last;
+  size_t bytes;
+};
+
+
+struct arena *arena_new(void) {
+  return calloc(1, sizeof(struct arena));
+}
+
+
+static void arena_free_blocks(struct arena_block *block) {
+  while (block != NULL) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+
+void arena_free(struct arena *arena) {
+  if (arena == NULL) return;
+  arena_free_blocks(arena->blocks);
+  free(arena);
+}
+
+
+void arena_reset(struct arena *arena) {
+  struct arena_block *first = arena->blocks;
+  if (first != NULL) {
+    // the oldest block is at the end of the list
+    while (first->next != NULL) {
+      struct arena_block *next = first->next;
+      arena->bytes -= first->size;
+      free(first);
+      first = next;
+    }
+    first->used = 0;
+  }
+  arena->blocks = first;
+  arena->last = NULL;
+}
+
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  struct arena_block *block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(struct arena_block) + block_size);
+    if (block == NULL) return NULL;
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->bytes += block_size;
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  arena->last = ptr;
+  return ptr;
+}
+
+
+char *arena_strdup(struct arena *arena, const char *s) {
+  size_t n = strlen(s) + 1;
+  char *copy = arena_alloc(arena, n);
+  if (copy != NULL) memcpy(copy, s, n);
+  return copy;
+}
+
+
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size) {
+  struct arena_block *block = arena->blocks;
+  if (ptr != NULL && ptr == arena->last) {
+    size_t offset = (char *)ptr - block->data;
+    if (offset + new_size <= block->size) {
+      // block sizes are multiples of the alignment, so this still fits
+      block->used = offset + ((new_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+      return ptr;
+    }
+  }
+
+  void *grown = arena_alloc(arena, new_size);
+  if (grown != NULL && ptr != NULL) memcpy(grown, ptr, old_size);
+  return grown;
+}
+
+
+size_t arena_memory(const struct arena *arena) {
+  return arena->bytes;
+}
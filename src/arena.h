@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Bump allocator: allocations are carved out of large blocks and all freed
+// together by arena_reset() or arena_free().
+struct arena;
+
+struct arena *arena_new(void);
+void arena_free(struct arena *arena);
+// Release every allocation, keeping the first block for reuse.
+void arena_reset(struct arena *arena);
+
+// NULL if out of memory. Memory is aligned for any type.
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *s);
+// Resize the most recent allocation in place when possible, else copy it.
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+size_t arena_memory(const struct arena *arena);
@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "columnar.h"
+
+#define ALIGN 64
+
+enum section {
+  SECTION_TIME_BASE,
+  SECTION_TIME_DELTA,
+  SECTION_LISTENED,
+  // one per dimension of each
+  SECTION_CODES,
+  SECTION_IDS = SECTION_CODES + N_COLUMNAR_DIMS,
+  SECTION_OFFSETS = SECTION_IDS + N_COLUMNAR_DIMS,
+  SECTION_NAMES = SECTION_OFFSETS + N_COLUMNAR_DIMS,
+  N_SECTIONS = SECTION_NAMES + N_COLUMNAR_DIMS
+};
+
+struct header {
+  char magic[8];
+  uint32_t block;
+  uint32_t n_sections;
+  int64_t n_plays;
+  uint32_t n_codes[N_COLUMNAR_DIMS];
+  uint64_t offset[N_SECTIONS];
+  uint64_t size[N_SECTIONS];
+};
+
+
+// A dimension's dictionary as it is read from the database.
+struct dict_builder {
+  int32_t *ids;
+  uint32_t *offsets;
+  // code of the album or artist of each code
+  uint32_t *parents;
+  uint32_t n;
+  uint32_t cap;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  // code of each database ID, -1 for none
+  int32_t *codes;
+  int n_codes;
+};
+
+struct writer {
+  struct dict_builder dicts[N_COLUMNAR_DIMS];
+  char tmp_path[PATH_MAX];
+  int fd;
+  char *map;
+  size_t size;
+
+  long n_plays;
+  long row;
+  int64_t *time_base;
+  int32_t *time_delta;
+  uint32_t *codes[N_COLUMNAR_DIMS];
+  uint32_t *listened_ms;
+};
+
+
+static int dict_add(struct dict_builder *dict, int id, uint32_t parent, const char *name) {
+  size_t len = strlen(name) + 1;
+  if (id < 0) return -1;
+  if (dict->n == dict->cap) {
+    uint32_t cap = dict->cap ? dict->cap * 2 : 1024;
+    int32_t *ids = realloc(dict->ids, cap * sizeof(int32_t));
+    if (ids != NULL) dict->ids = ids;
+    uint32_t *offsets = realloc(dict->offsets, cap * sizeof(uint32_t));
+    if (offsets != NULL) dict->offsets = offsets;
+    uint32_t *parents = realloc(dict->parents, cap * sizeof(uint32_t));
+    if (parents != NULL) dict->parents = parents;
+    if (ids == NULL || offsets == NULL || parents == NULL) return -1;
+    dict->cap = cap;
+  }
+  if (dict->names_len + len > dict->names_cap) {
+    size_t cap = dict->names_cap ? dict->names_cap * 2 : 65536;
+    while (cap < dict->names_len + len) cap *= 2;
+    char *names = realloc(dict->names, cap);
+    if (names == NULL) return -1;
+    dict->names = names;
+    dict->names_cap = cap;
+  }
+  if (id >= dict->n_codes) {
+    int n = dict->n_codes ? dict->n_codes : 1024;
+    while (n <= id) n *= 2;
+    int32_t *codes = realloc(dict->codes, n * sizeof(int32_t));
+    if (codes == NULL) return -1;
+    memset(codes + dict->n_codes, 0xff, (n - dict->n_codes) * sizeof(int32_t));
+    dict->codes = codes;
+    dict->n_codes = n;
+  }
+  if (dict->names_len + len > UINT32_MAX || dict->n == INT32_MAX) return -1;
+
+  dict->codes[id] = dict->n;
+  dict->ids[dict->n] = id;
+  dict->offsets[dict->n] = dict->names_len;
+  dict->parents[dict->n] = parent;
+  dict->n++;
+  memcpy(dict->names + dict->names_len, name, len);
+  dict->names_len += len;
+  return 0;
+}
+
+static int32_t dict_code(const struct dict_builder *dict, int id) {
+  return id >= 0 && id < dict->n_codes ? dict->codes[id] : -1;
+}
+
+static void dict_free(struct dict_builder *dict) {
+  free(dict->ids);
+  free(dict->offsets);
+  free(dict->parents);
+  free(dict->names);
+  free(dict->codes);
+}
+
+
+static int export_name(void *ctx, int table, int id, int parent_id, const char *name) {
+  struct writer *w = ctx;
+  int32_t parent = 0;
+  if (table == COLUMNAR_ALBUM) parent = dict_code(&w->dicts[COLUMNAR_ARTIST], parent_id);
+  else if (table == COLUMNAR_SONG) parent = dict_code(&w->dicts[COLUMNAR_ALBUM], parent_id);
+  if (parent < 0 || dict_add(&w->dicts[table], id, parent, name ? name : "")) {
+    fprintf(stderr, ":: Failed to export \"%s\"\n", name ? name : "");
+    return 1;
+  }
+  return 0;
+}
+
+
+static size_t align(size_t n) {
+  return (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+// Lay the file out now that every size is known, map it, and fill in all
+// but the play columns.
+static int export_begin_plays(void *ctx, long n) {
+  struct writer *w = ctx;
+  struct header header = {.magic = COLUMNAR_MAGIC, .block = COLUMNAR_BLOCK, .n_sections = N_SECTIONS, .n_plays = n};
+  long n_blocks = (n + COLUMNAR_BLOCK - 1) / COLUMNAR_BLOCK;
+  header.size[SECTION_TIME_BASE] = n_blocks * sizeof(int64_t);
+  header.size[SECTION_TIME_DELTA] = n * sizeof(int32_t);
+  header.size[SECTION_LISTENED] = n * sizeof(uint32_t);
+  for (int d = 0; d < N_COLUMNAR_DIMS; d++) {
+    header.n_codes[d] = w->dicts[d].n;
+    header.size[SECTION_CODES + d] = n * sizeof(uint32_t);
+    header.size[SECTION_IDS + d] = w->dicts[d].n * sizeof(int32_t);
+    header.size[SECTION_OFFSETS + d] = w->dicts[d].n * sizeof(uint32_t);
+    header.size[SECTION_NAMES + d] = w->dicts[d].names_len;
+  }
+  size_t size = align(sizeof(header));
+  for (int i = 0; i < N_SECTIONS; i++) {
+    header.offset[i] = size;
+    size += align(header.size[i]);
+  }
+
+  if (ftruncate(w->fd, size)) {
+    fprintf(stderr, ":: Failed to size \"%s\": %s\n", w->tmp_path, strerror(errno));
+    return 1;
+  }
+  w->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+  if (w->map == MAP_FAILED) {
+    w->map = NULL;
+    fprintf(stderr, ":: Failed to map \"%s\": %s\n", w->tmp_path, strerror(errno));
+    return 1;
+  }
+  w->size = size;
+
+  memcpy(w->map, &header, sizeof(header));
+  for (int d = 0; d < N_COLUMNAR_DIMS; d++) {
+    const struct dict_builder *dict = &w->dicts[d];
+    w->codes[d] = (uint32_t *)(w->map + header.offset[SECTION_CODES + d]);
+    if (dict->n == 0) continue;
+    memcpy(w->map + header.offset[SECTION_IDS + d], dict->ids, header.size[SECTION_IDS + d]);
+    memcpy(w->map + header.offset[SECTION_OFFSETS + d], dict->offsets, header.size[SECTION_OFFSETS + d]);
+    memcpy(w->map + header.offset[SECTION_NAMES + d], dict->names, header.size[SECTION_NAMES + d]);
+  }
+  w->time_base = (int64_t *)(w->map + header.offset[SECTION_TIME_BASE]);
+  w->time_delta = (int32_t *)(w->map + header.offset[SECTION_TIME_DELTA]);
+  w->listened_ms = (uint32_t *)(w->map + header.offset[SECTION_LISTENED]);
+  w->n_plays = n;
+  return 0;
+}
+
+
+static int export_play(void *ctx, const struct db_play_row *play) {
+  struct writer *w = ctx;
+  long row = w->row;
+  int32_t song = dict_code(&w->dicts[COLUMNAR_SONG], play->song_id);
+  int32_t source = dict_code(&w->dicts[COLUMNAR_SOURCE], play->source_id);
+  if (row >= w->n_plays || song < 0 || source < 0) {
+    fprintf(stderr, ":: Failed to export play %ld: unknown song or source\n", row);
+    return 1;
+  }
+
+  if (row % COLUMNAR_BLOCK == 0) w->time_base[row / COLUMNAR_BLOCK] = play->played_at;
+  long delta = play->played_at - w->time_base[row / COLUMNAR_BLOCK];
+  if (delta < 0 || delta > INT32_MAX) {
+    fprintf(stderr, ":: Failed to export play %ld: out of order\n", row);
+    return 1;
+  }
+  w->time_delta[row] = delta;
+
+  uint32_t album = w->dicts[COLUMNAR_SONG].parents[song];
+  w->codes[COLUMNAR_SONG][row] = song;
+  w->codes[COLUMNAR_ALBUM][row] = album;
+  w->codes[COLUMNAR_ARTIST][row] = w->dicts[COLUMNAR_ALBUM].parents[album];
+  w->codes[COLUMNAR_SOURCE][row] = source;
+  w->listened_ms[row] = play->listened_ms < 0 ? COLUMNAR_UNKNOWN
+    : play->listened_ms >= COLUMNAR_UNKNOWN ? COLUMNAR_UNKNOWN - 1 : (uint32_t)play->listened_ms;
+  w->row++;
+  return 0;
+}
+
+
+long columnar_export(struct db_conn *db, const char *path) {
+  static const struct db_export_fn fn = {.name = export_name, .begin_plays = export_begin_plays, .play = export_play};
+  struct writer w = {.fd = -1};
+  long rv = -1;
+
+  snprintf(w.tmp_path, sizeof(w.tmp_path), "%s.tmp", path);
+  w.fd = open(w.tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (w.fd < 0) {
+    fprintf(stderr, ":: Failed to create \"%s\": %s\n", w.tmp_path, strerror(errno));
+    return -1;
+  }
+  // plays from before sources have source 0
+  if (dict_add(&w.dicts[COLUMNAR_SOURCE], 0, 0, "")) goto _columnar_export_end;
+
+  long n = db_export(db, &fn, &w);
+  if (n < 0) goto _columnar_export_end;
+  if (w.map == NULL || n != w.n_plays) {
+    fprintf(stderr, ":: Failed to export: the history changed while reading it\n");
+    goto _columnar_export_end;
+  }
+
+  if (munmap(w.map, w.size) || fsync(w.fd) || rename(w.tmp_path, path)) {
+    fprintf(stderr, ":: Failed to write \"%s\": %s\n", path, strerror(errno));
+    w.map = NULL;
+    goto _columnar_export_end;
+  }
+  w.map = NULL;
+  rv = n;
+
+_columnar_export_end:
+  if (w.map != NULL) munmap(w.map, w.size);
+  close(w.fd);
+  if (rv < 0) unlink(w.tmp_path);
+  for (int d = 0; d < N_COLUMNAR_DIMS; d++) dict_free(&w.dicts[d]);
+  return rv;
+}
+
+
+// Largest of n codes, 0 for none.
+static uint32_t max_code(const uint32_t *restrict codes, long n) {
+  uint32_t max = 0;
+  for (long i = 0; i < n; i++) max = codes[i] > max ? codes[i] : max;
+  return max;
+}
+
+int columnar_open(struct columnar *col, const char *path) {
+  memset(col, 0, sizeof(struct columnar));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, ":: Failed to open \"%s\": %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct header)) goto _columnar_open_bad;
+  col->size = st.st_size;
+  col->map = mmap(NULL, col->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (col->map == MAP_FAILED) {
+    col->map = NULL;
+    fprintf(stderr, ":: Failed to map \"%s\": %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  const char *base = col->map;
+  const struct header *header = col->map;
+  if (memcmp(header->magic, COLUMNAR_MAGIC, sizeof(header->magic)) != 0 || header->block != COLUMNAR_BLOCK
+      || header->n_sections != N_SECTIONS || header->n_plays < 0) goto _columnar_open_bad;
+  for (int i = 0; i < N_SECTIONS; i++) {
+    if (header->offset[i] % ALIGN != 0 || header->offset[i] > col->size || header->size[i] > col->size - header->offset[i]) {
+      goto _columnar_open_bad;
+    }
+  }
+
+  long n = header->n_plays;
+  col->n_plays = n;
+  col->n_blocks = (n + COLUMNAR_BLOCK - 1) / COLUMNAR_BLOCK;
+  if (header->size[SECTION_TIME_BASE] != col->n_blocks * sizeof(int64_t) || header->size[SECTION_TIME_DELTA] != n * sizeof(int32_t)
+      || header->size[SECTION_LISTENED] != n * sizeof(uint32_t)) goto _columnar_open_bad;
+  col->time_base = (const int64_t *)(base + header->offset[SECTION_TIME_BASE]);
+  col->time_delta = (const int32_t *)(base + header->offset[SECTION_TIME_DELTA]);
+  col->listened_ms = (const uint32_t *)(base + header->offset[SECTION_LISTENED]);
+
+  for (int d = 0; d < N_COLUMNAR_DIMS; d++) {
+    struct columnar_dict *dict = &col->dicts[d];
+    uint64_t names_size = header->size[SECTION_NAMES + d];
+    dict->n = header->n_codes[d];
+    if (header->size[SECTION_CODES + d] != n * sizeof(uint32_t) || header->size[SECTION_IDS + d] != dict->n * sizeof(int32_t)
+        || header->size[SECTION_OFFSETS + d] != dict->n * sizeof(uint32_t)
+        || (dict->n > 0 && (names_size == 0 || base[header->offset[SECTION_NAMES + d] + names_size - 1] != 0))) {
+      goto _columnar_open_bad;
+    }
+    col->codes[d] = (const uint32_t *)(base + header->offset[SECTION_CODES + d]);
+    dict->ids = (const int32_t *)(base + header->offset[SECTION_IDS + d]);
+    dict->offsets = (const uint32_t *)(base + header->offset[SECTION_OFFSETS + d]);
+    dict->names = base + header->offset[SECTION_NAMES + d];
+
+    // the kernels index by code, so every code is checked once here
+    for (uint32_t i = 0; i < dict->n; i++) {
+      if (dict->offsets[i] >= names_size) goto _columnar_open_bad;
+    }
+    if (n > 0 && max_code(col->codes[d], n) >= dict->n) goto _columnar_open_bad;
+  }
+  return 0;
+
+_columnar_open_bad:
+  fprintf(stderr, ":: \"%s\" is not a columnar export\n", path);
+  columnar_close(col);
+  return -1;
+}
+
+
+void columnar_close(struct columnar *col) {
+  if (col->map != NULL) munmap(col->map, col->size);
+  col->map = NULL;
+}
+
+
+// The number of rows played before t.
+static long rows_before(const struct columnar *col, long t) {
+  // the last block starting before t holds the first row at or after it
+  long lo = 0, hi = col->n_blocks;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (col->time_base[mid] < t) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0) return 0;
+
+  long block = lo - 1;
+  long delta = t - col->time_base[block];
+  lo = block * COLUMNAR_BLOCK;
+  hi = lo + COLUMNAR_BLOCK < col->n_plays ? lo + COLUMNAR_BLOCK : col->n_plays;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (col->time_delta[mid] < delta) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+
+void columnar_range(const struct columnar *col, long from, long to, long *first, long *last) {
+  *first = rows_before(col, from);
+  *last = to > from ? rows_before(col, to) : *first;
+}
+
+
+void columnar_count(const struct columnar *col, enum columnar_dim dim, long first, long last, uint32_t *counts) {
+  const uint32_t *restrict codes = col->codes[dim];
+  for (long i = first; i < last; i++) counts[codes[i]]++;
+}
+
+
+void columnar_windows(const struct columnar *col, long from, long width, int n, uint32_t *counts) {
+  long before = rows_before(col, from);
+  for (int i = 0; i < n; i++) {
+    long next = rows_before(col, from + (i + 1) * width);
+    counts[i] += next - before;
+    before = next;
+  }
+}
+
+
+// The bucket of each of a block's times, shift being where its base falls in
+// the period. Done in doubles, as unlike integer division that vectorizes.
+static void bucket_block(const int32_t *restrict delta, long n, double shift, double period, double n_buckets,
+    int32_t *restrict buckets) {
+  for (long i = 0; i < n; i++) {
+    double t = shift + delta[i];
+    // exact: with COLUMNAR_MAX_PERIOD, no value or product needs more than a
+    // double's 53 bits, and the divisions are correctly rounded
+    double r = t - (double)(int32_t)(t / period) * period;
+    buckets[i] = (int32_t)(r * n_buckets / period);
+  }
+}
+
+void columnar_histogram(const struct columnar *col, long first, long last, long offset, long period, int n_buckets,
+    uint32_t *counts) {
+  int32_t buckets[COLUMNAR_BLOCK];
+  if (period < 2 || period > COLUMNAR_MAX_PERIOD || n_buckets < 1 || n_buckets > period) return;
+
+  for (long row = first; row < last;) {
+    long block = row / COLUMNAR_BLOCK;
+    long end = (block + 1) * COLUMNAR_BLOCK < last ? (block + 1) * COLUMNAR_BLOCK : last;
+    long shift = (col->time_base[block] + offset) % period;
+    if (shift < 0) shift += period;
+
+    bucket_block(col->time_delta + row, end - row, shift, period, n_buckets, buckets);
+    for (long i = 0; i < end - row; i++) counts[buckets[i]]++;
+    row = end;
+  }
+}
+
+
+static void export_usage(void) {
+  fprintf(stderr,
+      "Usage: mpd_stats export --columnar [--db PATH] FILE\n"
+      "  --columnar              write the plays as a memory-mappable file of columns\n"
+      "  --db PATH               database to read (default ~/.mpd_stats.db), opened read-only\n");
+}
+
+
+int export_main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"columnar", no_argument, NULL, 'c'},
+    {"db", required_argument, NULL, 'B'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int columnar = 0;
+  struct db_config config = {.path = NULL, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+
+  int c;
+  while ((c = getopt_long(argc, argv, "cB:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'c':
+        columnar = 1;
+        break;
+      case 'B':
+        config.path = optarg;
+        break;
+      case 'h':
+      default:
+        export_usage();
+        return 1;
+    }
+  }
+  // the only format so far, asked for so that others can be added
+  if (!columnar || argc - optind != 1) {
+    export_usage();
+    return 1;
+  }
+
+  // read in one snapshot, which in WAL mode never holds up the daemon
+  struct db_conn *db = db_init(&config, 1);
+  if (db == NULL) {
+    fprintf(stderr, "DB init failed\n");
+    return 3;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long plays = columnar_export(db, argv[optind]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  db_free(db);
+  if (plays < 0) return 4;
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Exported %ld plays in %.1fs\n", plays, seconds);
+  return 0;
+}
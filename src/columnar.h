@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "db.h"
+
+// The play history as a file of columns, for analytics that would otherwise
+// scan the database under the daemon. Written by `mpd_stats export
+// --columnar`, then mapped read-only and read in place: each column is a
+// plain array, 64-byte aligned, in host byte order.
+//
+// Plays are in time order. Times are stored in blocks of COLUMNAR_BLOCK
+// plays, each a 64-bit base (the block's first time) and 32-bit deltas from
+// it. Artists, albums, songs and sources are dictionary encoded: each play
+// holds a dense 32-bit code per dimension, and each dimension a table of
+// database IDs and NUL-terminated names by code.
+#define COLUMNAR_MAGIC "MPDSCOL1"
+#define COLUMNAR_BLOCK 4096
+// stored for a play with no time listened recorded
+#define COLUMNAR_UNKNOWN UINT32_MAX
+
+enum columnar_dim {
+  COLUMNAR_ARTIST = RANK_ARTIST,
+  COLUMNAR_ALBUM = RANK_ALBUM,
+  COLUMNAR_SONG = RANK_SONG,
+  COLUMNAR_SOURCE = N_RANK_DIMS,
+  N_COLUMNAR_DIMS
+};
+
+struct columnar_dict {
+  uint32_t n;
+  const int32_t *ids;
+  // offset of each name in names
+  const uint32_t *offsets;
+  const char *names;
+};
+
+struct columnar {
+  long n_plays;
+  long n_blocks;
+  const int64_t *time_base;
+  const int32_t *time_delta;
+  const uint32_t *codes[N_COLUMNAR_DIMS];
+  const uint32_t *listened_ms;
+  struct columnar_dict dicts[N_COLUMNAR_DIMS];
+
+  void *map;
+  size_t size;
+};
+
+// Write every kept play to path, replacing it once complete. Returns the
+// number of plays written, -1 on error.
+long columnar_export(struct db_conn *db, const char *path);
+
+// Map a file written by columnar_export(). -1 if it cannot be read or is
+// not one.
+int columnar_open(struct columnar *col, const char *path);
+void columnar_close(struct columnar *col);
+
+static inline long columnar_time(const struct columnar *col, long row) {
+  return col->time_base[row / COLUMNAR_BLOCK] + col->time_delta[row];
+}
+
+static inline const char *columnar_name(const struct columnar *col, enum columnar_dim dim, uint32_t code) {
+  return col->dicts[dim].names + col->dicts[dim].offsets[code];
+}
+
+// Aggregation kernels. Rows are given as [first, last); counts are added to,
+// not cleared.
+
+// The rows played in [from, to), found by binary search.
+void columnar_range(const struct columnar *col, long from, long to, long *first, long *last);
+// Plays per code of a dimension; counts holds one entry per code.
+void columnar_count(const struct columnar *col, enum columnar_dim dim, long first, long last, uint32_t *counts);
+// Plays in each of n consecutive windows of width seconds from `from`.
+void columnar_windows(const struct columnar *col, long from, long width, int n, uint32_t *counts);
+// Plays by where they fall in a repeating period of up to
+// COLUMNAR_MAX_PERIOD seconds, in n_buckets equal buckets (at most one per
+// second): shifted by offset seconds, a period of 86400 and 24 buckets gives
+// hours of the day, 604800 and 168 hours of the week (from Thursday, at
+// offset 0). Nothing is counted otherwise.
+#define COLUMNAR_MAX_PERIOD (1L << 26)
+void columnar_histogram(const struct columnar *col, long first, long last, long offset, long period, int n_buckets,
+    uint32_t *counts);
+
+// `mpd_stats export`, argv[0] being "export".
+int export_main(int argc, char **argv);
@@ -1,13 +1,187 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <sqlite3.h>
 
 #include "db.h"
+#include "idcache.h"
+#include "metrics.h"
+#include "rank.h"
+#include "similar.h"
+#include "strpool.h"
+
+enum db_stmt {
+  STMT_BEGIN,
+  STMT_BEGIN_READ,
+  STMT_COMMIT,
+  STMT_ROLLBACK,
+  STMT_GET_ARTIST,
+  STMT_ADD_ARTIST,
+  STMT_GET_ALBUM,
+  STMT_ADD_ALBUM,
+  STMT_GET_SONG,
+  STMT_ADD_SONG,
+  STMT_GET_SONG_SOURCE,
+  STMT_ADD_SONG_SOURCE,
+  STMT_ADD_PLAY,
+  STMT_END_PLAY,
+  STMT_GET_JOURNAL,
+  STMT_SET_JOURNAL,
+  STMT_REFUSE_PLAY,
+  STMT_RECENT_ARTISTS,
+  STMT_RECENT_ALBUMS,
+  STMT_RECENT_SONGS,
+  STMT_FREQUENT_ARTISTS,
+  STMT_FREQUENT_ALBUMS,
+  STMT_FREQUENT_SONGS,
+  STMT_WINDOW_ARTISTS,
+  STMT_WINDOW_ALBUMS,
+  STMT_WINDOW_SONGS,
+  STMT_ARTIST_STATS,
+  STMT_ALBUM_STATS,
+  STMT_SONG_STATS,
+  STMT_ARTIST_WINDOW_STATS,
+  STMT_ALBUM_WINDOW_STATS,
+  STMT_SONG_WINDOW_STATS,
+  STMT_ARTIST_ALBUMS,
+  STMT_ARTIST_SONGS,
+  STMT_SIMILAR_ARTISTS,
+  STMT_SIMILAR_ALBUMS,
+  STMT_LISTENED_ARTISTS,
+  STMT_LISTENED_ALBUMS,
+  STMT_LISTENED_SONGS,
+  STMT_WINDOW_LISTENED_ARTISTS,
+  STMT_WINDOW_LISTENED_ALBUMS,
+  STMT_WINDOW_LISTENED_SONGS,
+  N_STMTS
+};
+
+// Rankings are read from the *Stats aggregates, which are keyed by name to
+// match grouping plays by Artist/Album/Song name.
+// rows returned by the fixed top lists, in SQL and by the rank engine
+#define TOP_LIMIT 10
+#define TOP_SONGS_LIMIT 100
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+#define SQL_RECENT_ARTISTS "SELECT Name FROM ArtistStats ORDER BY LastPlayed DESC LIMIT ?;"
+#define SQL_RECENT_ALBUMS "SELECT Name FROM AlbumStats ORDER BY LastPlayed DESC LIMIT ?;"
+#define SQL_RECENT_SONGS "SELECT Name FROM SongStats ORDER BY LastPlayed DESC LIMIT ?;"
+
+// Skipped plays are left out of every play count ranked or reported.
+#define SQL_FREQUENT_ARTISTS "SELECT Name FROM ArtistStats ORDER BY PlayCount - Skips DESC LIMIT ?;"
+#define SQL_FREQUENT_ALBUMS "SELECT Name FROM AlbumStats ORDER BY PlayCount - Skips DESC LIMIT ?;"
+#define SQL_FREQUENT_SONGS "SELECT Name FROM SongStats ORDER BY PlayCount - Skips DESC LIMIT ?;"
+
+// Most played from a given day on, ties going to the latest played.
+#define SQL_WINDOW(table) \
+  "SELECT Name FROM " table " WHERE Day >= ? GROUP BY Name ORDER BY SUM(PlayCount - Skips) DESC, MAX(Day) DESC LIMIT ?;"
+
+// Longest listened to, all time or from a given day on.
+#define SQL_LISTENED(table) "SELECT Name FROM " table " ORDER BY ListenedMs DESC LIMIT ?;"
+#define SQL_WINDOW_LISTENED(table) \
+  "SELECT Name FROM " table " WHERE Day >= ? GROUP BY Name ORDER BY SUM(ListenedMs) DESC, MAX(Day) DESC LIMIT ?;"
+
+// Neighbours of the artist or album last played on a source, as last saved
+// from the similarity engine. By time, as an import adds old plays last.
+#define SQL_SIMILAR(table, name) \
+  "SELECT Neighbour FROM " table " WHERE Name=(SELECT " name " FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID " \
+    "INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID " \
+    "WHERE Plays.SourceID=? ORDER BY Plays.Time DESC LIMIT 1) " \
+  "ORDER BY Weight DESC LIMIT ?;"
+
+#define SQL_STATS(table) "SELECT PlayCount - Skips, LastPlayed FROM " table " WHERE Name=?;"
+#define SQL_WINDOW_STATS(table) "SELECT SUM(PlayCount - Skips), MAX(Day) FROM " table " WHERE Day >= ? AND Name=?;"
+
+// An artist's albums or songs by name, counting both kept and archived plays.
+// No index leads from songs to their plays: this scans them.
+#define SQL_ARTIST_BREAKDOWN(name) \
+  "WITH Songs AS (SELECT Song.ID, " name " AS Name FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID " \
+    "INNER JOIN Artist ON Album.ArtistID=Artist.ID WHERE Artist.Name=?1) " \
+  "SELECT Songs.Name, SUM(n), MAX(Last) FROM (" \
+    "SELECT SongID, SUM(Skipped IS NOT 1) AS n, MAX(Time) AS Last FROM Plays WHERE SongID IN (SELECT ID FROM Songs) GROUP BY SongID " \
+    "UNION ALL SELECT SongID, SUM(PlayCount - Skips), MAX(LastPlayed) FROM PlaysArchive WHERE SongID IN (SELECT ID FROM Songs) GROUP BY SongID) " \
+  "INNER JOIN Songs ON Songs.ID=SongID GROUP BY Songs.Name ORDER BY 2 DESC, 3 DESC;"
+
+static const char *STMT_SQL[N_STMTS] = {
+  [STMT_BEGIN] = "BEGIN IMMEDIATE;",
+  [STMT_BEGIN_READ] = "BEGIN DEFERRED;",
+  [STMT_COMMIT] = "COMMIT;",
+  [STMT_ROLLBACK] = "ROLLBACK;",
+  [STMT_GET_ARTIST] = "SELECT ID FROM Artist WHERE Name=?;",
+  [STMT_ADD_ARTIST] = "INSERT INTO Artist(Name) VALUES (?) RETURNING ID;",
+  [STMT_GET_ALBUM] = "SELECT ID FROM Album WHERE Name=? AND ArtistID=?;",
+  [STMT_ADD_ALBUM] = "INSERT INTO Album (Name, ArtistID) VALUES (?, ?) RETURNING ID;",
+  [STMT_GET_SONG] = "SELECT ID FROM Song WHERE Name=? AND AlbumID=?;",
+  [STMT_ADD_SONG] = "INSERT INTO Song (Name, AlbumID) VALUES (?, ?) RETURNING ID;",
+  [STMT_GET_SONG_SOURCE] = "SELECT SongSource.SongID, Song.Name, Artist.Name, Album.Name FROM SongSource "
+    "INNER JOIN Song ON Song.ID=SongSource.SongID INNER JOIN Album ON Song.AlbumID=Album.ID "
+    "INNER JOIN Artist ON Album.ArtistID=Artist.ID WHERE SourceID=? AND MPDID=?;",
+  [STMT_ADD_SONG_SOURCE] = "INSERT OR REPLACE INTO SongSource (SourceID, MPDID, SongID) VALUES (?, ?, ?);",
+  [STMT_ADD_PLAY] = "INSERT INTO Plays (Time, SongID, SourceID) VALUES (?, ?, ?);",
+  // the first play of the song on the source at that time not yet ended,
+  // as plays end in the order they start
+  [STMT_END_PLAY] = "UPDATE Plays SET ListenedMs=?1, Skipped=?2 WHERE rowid=(SELECT MIN(rowid) FROM Plays "
+    "WHERE Time=?3 AND SourceID=?4 AND SongID=(SELECT SongID FROM SongSource WHERE SourceID=?4 AND MPDID=?5) "
+    "AND ListenedMs IS NULL) RETURNING SongID;",
+  [STMT_GET_JOURNAL] = "SELECT Generation, Offset FROM JournalState;",
+  [STMT_SET_JOURNAL] = "INSERT OR REPLACE INTO JournalState (ID, Generation, Offset) VALUES (0, ?, ?);",
+  [STMT_REFUSE_PLAY] = "INSERT INTO RefusedPlays (RefusedAt, Error, SourceID, MPDID, Time, Title, Artist, Album, Ended, ListenedMs, Skipped) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);",
+  [STMT_RECENT_ARTISTS] = SQL_RECENT_ARTISTS,
+  [STMT_RECENT_ALBUMS] = SQL_RECENT_ALBUMS,
+  [STMT_RECENT_SONGS] = SQL_RECENT_SONGS,
+  [STMT_FREQUENT_ARTISTS] = SQL_FREQUENT_ARTISTS,
+  [STMT_FREQUENT_ALBUMS] = SQL_FREQUENT_ALBUMS,
+  [STMT_FREQUENT_SONGS] = SQL_FREQUENT_SONGS,
+  [STMT_WINDOW_ARTISTS] = SQL_WINDOW("ArtistDaily"),
+  [STMT_WINDOW_ALBUMS] = SQL_WINDOW("AlbumDaily"),
+  [STMT_WINDOW_SONGS] = SQL_WINDOW("SongDaily"),
+  [STMT_ARTIST_STATS] = SQL_STATS("ArtistStats"),
+  [STMT_ALBUM_STATS] = SQL_STATS("AlbumStats"),
+  [STMT_SONG_STATS] = SQL_STATS("SongStats"),
+  [STMT_ARTIST_WINDOW_STATS] = SQL_WINDOW_STATS("ArtistDaily"),
+  [STMT_ALBUM_WINDOW_STATS] = SQL_WINDOW_STATS("AlbumDaily"),
+  [STMT_SONG_WINDOW_STATS] = SQL_WINDOW_STATS("SongDaily"),
+  [STMT_ARTIST_ALBUMS] = SQL_ARTIST_BREAKDOWN("Album.Name"),
+  [STMT_ARTIST_SONGS] = SQL_ARTIST_BREAKDOWN("Song.Name"),
+  [STMT_SIMILAR_ARTISTS] = SQL_SIMILAR("ArtistNeighbours", "Artist.Name"),
+  [STMT_SIMILAR_ALBUMS] = SQL_SIMILAR("AlbumNeighbours", "Album.Name"),
+  [STMT_LISTENED_ARTISTS] = SQL_LISTENED("ArtistStats"),
+  [STMT_LISTENED_ALBUMS] = SQL_LISTENED("AlbumStats"),
+  [STMT_LISTENED_SONGS] = SQL_LISTENED("SongStats"),
+  [STMT_WINDOW_LISTENED_ARTISTS] = SQL_WINDOW_LISTENED("ArtistDaily"),
+  [STMT_WINDOW_LISTENED_ALBUMS] = SQL_WINDOW_LISTENED("AlbumDaily"),
+  [STMT_WINDOW_LISTENED_SONGS] = SQL_WINDOW_LISTENED("SongDaily"),
+};
+
+// How the rank engine answers each top-list query; a limit of 0 for those
+// it doesn't.
+static const struct {
+  enum rank_dim dim;
+  enum rank_order order;
+  int limit;
+} RANK_QUERIES[N_STMTS] = {
+  [STMT_RECENT_ARTISTS] = {RANK_ARTIST, RANK_RECENT, TOP_LIMIT},
+  [STMT_RECENT_ALBUMS] = {RANK_ALBUM, RANK_RECENT, TOP_LIMIT},
+  [STMT_RECENT_SONGS] = {RANK_SONG, RANK_RECENT, TOP_LIMIT},
+  [STMT_FREQUENT_ARTISTS] = {RANK_ARTIST, RANK_FREQUENT, TOP_LIMIT},
+  [STMT_FREQUENT_ALBUMS] = {RANK_ALBUM, RANK_FREQUENT, TOP_LIMIT},
+  [STMT_FREQUENT_SONGS] = {RANK_SONG, RANK_FREQUENT, TOP_SONGS_LIMIT},
+};
 
 struct db_conn {
   sqlite3 *inner;
+  sqlite3_stmt *stmts[N_STMTS];
+  struct id_cache *cache;
+  // shared with other connections, not owned
+  struct rank *rank;
+  struct similar *similar;
+  int retention_days;
+  // why db_add_plays() last returned DB_REFUSED
+  char refusal[256];
 };
 
 
@@ -35,29 +209,401 @@ int init_schema(sqlite3 *db) {
 }
 
 
-struct db_conn *db_init() {
-  struct db_conn *conn = malloc(sizeof(struct db_conn));
-  conn->inner = NULL;
-  fprintf(stderr, "Initialising database...\n");
+// The *Stats indexes and the trigger keeping the tables up to date, also
+// dropped and rebuilt around a deferred-index import. The indexes by count
+// were made by PlayCount, then by plays not skipped once there were skips.
+#define SQL_STATS_TIME_INDEXES \
+  "CREATE INDEX ArtistStatsByTime ON ArtistStats(LastPlayed DESC);" \
+  "CREATE INDEX AlbumStatsByTime ON AlbumStats(LastPlayed DESC);" \
+  "CREATE INDEX SongStatsByTime ON SongStats(LastPlayed DESC);"
+#define SQL_STATS_COUNT_INDEXES \
+  "CREATE INDEX ArtistStatsByCount ON ArtistStats(PlayCount DESC);" \
+  "CREATE INDEX AlbumStatsByCount ON AlbumStats(PlayCount DESC);" \
+  "CREATE INDEX SongStatsByCount ON SongStats(PlayCount DESC);"
+#define SQL_STATS_COUNTED_INDEXES \
+  "CREATE INDEX ArtistStatsByCounted ON ArtistStats(PlayCount - Skips DESC);" \
+  "CREATE INDEX AlbumStatsByCounted ON AlbumStats(PlayCount - Skips DESC);" \
+  "CREATE INDEX SongStatsByCounted ON SongStats(PlayCount - Skips DESC);"
+#define SQL_STATS_INDEXES SQL_STATS_COUNTED_INDEXES SQL_STATS_TIME_INDEXES
+#define SQL_DROP_STATS_INDEXES \
+  "DROP INDEX ArtistStatsByCounted; DROP INDEX ArtistStatsByTime;" \
+  "DROP INDEX AlbumStatsByCounted; DROP INDEX AlbumStatsByTime;" \
+  "DROP INDEX SongStatsByCounted; DROP INDEX SongStatsByTime;"
+#define SQL_STATS_TRIGGER \
+  "CREATE TRIGGER PlaysStats AFTER INSERT ON Plays BEGIN " \
+    "INSERT INTO SongStats(Name, PlayCount, LastPlayed) " \
+      "SELECT Song.Name, 1, NEW.Time FROM Song WHERE Song.ID=NEW.SongID " \
+      "ON CONFLICT(Name) DO UPDATE SET PlayCount=PlayCount+1, LastPlayed=max(LastPlayed, excluded.LastPlayed); " \
+    "INSERT INTO AlbumStats(Name, PlayCount, LastPlayed) " \
+      "SELECT Album.Name, 1, NEW.Time FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID WHERE Song.ID=NEW.SongID " \
+      "ON CONFLICT(Name) DO UPDATE SET PlayCount=PlayCount+1, LastPlayed=max(LastPlayed, excluded.LastPlayed); " \
+    "INSERT INTO ArtistStats(Name, PlayCount, LastPlayed) " \
+      "SELECT Artist.Name, 1, NEW.Time FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID WHERE Song.ID=NEW.SongID " \
+      "ON CONFLICT(Name) DO UPDATE SET PlayCount=PlayCount+1, LastPlayed=max(LastPlayed, excluded.LastPlayed); " \
+  "END;"
+// adds the plays after rowid `after` to the *Stats tables, as the trigger
+// would have one at a time
+#define SQL_STATS_ADD(after) \
+  "INSERT INTO SongStats(Name, PlayCount, LastPlayed) " \
+    "SELECT Song.Name, COUNT(*), MAX(Time) FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID " \
+    "WHERE Plays.rowid > " after " GROUP BY Song.Name " \
+    "ON CONFLICT(Name) DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount, LastPlayed=max(LastPlayed, excluded.LastPlayed);" \
+  "INSERT INTO AlbumStats(Name, PlayCount, LastPlayed) " \
+    "SELECT Album.Name, COUNT(*), MAX(Time) FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID INNER JOIN Album ON Song.AlbumID=Album.ID " \
+    "WHERE Plays.rowid > " after " GROUP BY Album.Name " \
+    "ON CONFLICT(Name) DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount, LastPlayed=max(LastPlayed, excluded.LastPlayed);" \
+  "INSERT INTO ArtistStats(Name, PlayCount, LastPlayed) " \
+    "SELECT Artist.Name, COUNT(*), MAX(Time) FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID " \
+    "WHERE Plays.rowid > " after " GROUP BY Artist.Name " \
+    "ON CONFLICT(Name) DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount, LastPlayed=max(LastPlayed, excluded.LastPlayed);"
+// fills the empty *Stats tables from every play
+#define SQL_STATS_BACKFILL SQL_STATS_ADD("0")
+
+// Plays per day (UTC, counted from the epoch) of each artist, album and
+// song, kept up to date by trigger like the *Stats tables. Local days would
+// cost a time zone conversion per play and row, several times the insert.
+#define SQL_DAY(t) "(" t " / 86400)"
+#define SQL_DAILY_TRIGGER \
+  "CREATE TRIGGER PlaysDaily AFTER INSERT ON Plays BEGIN " \
+    "INSERT INTO SongDaily(Day, Name, PlayCount) " \
+      "SELECT " SQL_DAY("NEW.Time") ", Song.Name, 1 FROM Song WHERE Song.ID=NEW.SongID " \
+      "ON CONFLICT(Day, Name) DO UPDATE SET PlayCount=PlayCount+1; " \
+    "INSERT INTO AlbumDaily(Day, Name, PlayCount) " \
+      "SELECT " SQL_DAY("NEW.Time") ", Album.Name, 1 FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID WHERE Song.ID=NEW.SongID " \
+      "ON CONFLICT(Day, Name) DO UPDATE SET PlayCount=PlayCount+1; " \
+    "INSERT INTO ArtistDaily(Day, Name, PlayCount) " \
+      "SELECT " SQL_DAY("NEW.Time") ", Artist.Name, 1 FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID WHERE Song.ID=NEW.SongID " \
+      "ON CONFLICT(Day, Name) DO UPDATE SET PlayCount=PlayCount+1; " \
+  "END;"
+#define SQL_DAILY_ADD(after) \
+  "INSERT INTO SongDaily(Day, Name, PlayCount) " \
+    "SELECT " SQL_DAY("Time") " AS Day, Song.Name, COUNT(*) FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID " \
+    "WHERE Plays.rowid > " after " GROUP BY Day, Song.Name " \
+    "ON CONFLICT(Day, Name) DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount;" \
+  "INSERT INTO AlbumDaily(Day, Name, PlayCount) " \
+    "SELECT " SQL_DAY("Time") " AS Day, Album.Name, COUNT(*) FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID INNER JOIN Album ON Song.AlbumID=Album.ID " \
+    "WHERE Plays.rowid > " after " GROUP BY Day, Album.Name " \
+    "ON CONFLICT(Day, Name) DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount;" \
+  "INSERT INTO ArtistDaily(Day, Name, PlayCount) " \
+    "SELECT " SQL_DAY("Time") " AS Day, Artist.Name, COUNT(*) FROM Plays INNER JOIN Song ON Song.ID=Plays.SongID INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID " \
+    "WHERE Plays.rowid > " after " GROUP BY Day, Artist.Name " \
+    "ON CONFLICT(Day, Name) DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount;"
+#define SQL_DAILY_BACKFILL SQL_DAILY_ADD("0")
+#define SQL_PLAYS_INDEXES "CREATE INDEX PlaysByTime ON Plays(Time);"
+#define SQL_DROP_PLAYS_INDEXES "DROP INDEX PlaysByTime;"
+
+// How long each play was listened to, and whether it was skipped, arrive
+// once the play ends and are added to the *Stats and *Daily rows its insert
+// counted in.
+#define SQL_SONG_NAME "SELECT Name FROM Song WHERE ID=NEW.SongID"
+#define SQL_ALBUM_NAME "SELECT Album.Name FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID WHERE Song.ID=NEW.SongID"
+#define SQL_ARTIST_NAME \
+  "SELECT Artist.Name FROM Song INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID WHERE Song.ID=NEW.SongID"
+#define SQL_LISTENED_UPDATE(table, where) \
+  "UPDATE " table " SET ListenedMs=ListenedMs+NEW.ListenedMs, Skips=Skips+NEW.Skipped WHERE " where ";"
+#define SQL_LISTENED_TRIGGER \
+  "CREATE TRIGGER PlaysListened AFTER UPDATE OF ListenedMs ON Plays WHEN OLD.ListenedMs IS NULL BEGIN " \
+    SQL_LISTENED_UPDATE("SongStats", "Name=(" SQL_SONG_NAME ")") \
+    SQL_LISTENED_UPDATE("AlbumStats", "Name=(" SQL_ALBUM_NAME ")") \
+    SQL_LISTENED_UPDATE("ArtistStats", "Name=(" SQL_ARTIST_NAME ")") \
+    SQL_LISTENED_UPDATE("SongDaily", "Day=" SQL_DAY("NEW.Time") " AND Name=(" SQL_SONG_NAME ")") \
+    SQL_LISTENED_UPDATE("AlbumDaily", "Day=" SQL_DAY("NEW.Time") " AND Name=(" SQL_ALBUM_NAME ")") \
+    SQL_LISTENED_UPDATE("ArtistDaily", "Day=" SQL_DAY("NEW.Time") " AND Name=(" SQL_ARTIST_NAME ")") \
+  "END;"
+#define SQL_LISTENED_INDEXES \
+  "CREATE INDEX ArtistStatsByListened ON ArtistStats(ListenedMs DESC);" \
+  "CREATE INDEX AlbumStatsByListened ON AlbumStats(ListenedMs DESC);" \
+  "CREATE INDEX SongStatsByListened ON SongStats(ListenedMs DESC);"
+#define SQL_DROP_LISTENED_INDEXES \
+  "DROP INDEX ArtistStatsByListened; DROP INDEX AlbumStatsByListened; DROP INDEX SongStatsByListened;"
+#define SQL_ADD_LISTENED(table) \
+  "ALTER TABLE " table " ADD COLUMN ListenedMs INTEGER NOT NULL DEFAULT 0;" \
+  "ALTER TABLE " table " ADD COLUMN Skips INTEGER NOT NULL DEFAULT 0;"
+
+
+// Each entry upgrades the schema by one version (PRAGMA user_version) and is
+// applied in its own transaction.
+static const char *MIGRATIONS[] = {
+  // 1: per-artist/album/song play count and last played time, kept up to date
+  // by trigger and backfilled from the existing plays
+  "CREATE TABLE ArtistStats(Name TEXT PRIMARY KEY, PlayCount INTEGER NOT NULL, LastPlayed INTEGER NOT NULL);"
+  "CREATE TABLE AlbumStats(Name TEXT PRIMARY KEY, PlayCount INTEGER NOT NULL, LastPlayed INTEGER NOT NULL);"
+  "CREATE TABLE SongStats(Name TEXT PRIMARY KEY, PlayCount INTEGER NOT NULL, LastPlayed INTEGER NOT NULL);"
+  SQL_STATS_COUNT_INDEXES
+  SQL_STATS_TIME_INDEXES
+  SQL_STATS_TRIGGER
+  SQL_STATS_BACKFILL,
+  // 2: plays from several MPD servers. Song IDs in MPD are per server (and
+  // per queue entry), so they move to SongSource and songs are identified by
+  // album and title. Plays recorded before this have no source. The rebuild
+  // of Song needs legacy renaming, as the stats trigger refers to it.
+  "CREATE TABLE Source(ID INTEGER PRIMARY KEY, Name TEXT NOT NULL UNIQUE);"
+  "CREATE TABLE SongSource(SourceID INTEGER NOT NULL REFERENCES Source(ID), MPDID INTEGER NOT NULL, "
+    "SongID INTEGER NOT NULL REFERENCES Song(ID), PRIMARY KEY (SourceID, MPDID)) WITHOUT ROWID;"
+  "ALTER TABLE Plays ADD COLUMN SourceID INTEGER REFERENCES Source(ID);"
+  "PRAGMA legacy_alter_table=ON;"
+  "CREATE TABLE NewSong(ID INTEGER PRIMARY KEY, AlbumID INTEGER NOT NULL REFERENCES Album(ID), Name TEXT NOT NULL, UNIQUE (AlbumID, Name), CHECK (AlbumID > 0));"
+  "INSERT INTO NewSong(ID, AlbumID, Name) SELECT ID, AlbumID, Name FROM Song;"
+  "DROP TABLE Song;"
+  "ALTER TABLE NewSong RENAME TO Song;"
+  "PRAGMA legacy_alter_table=OFF;",
+  // 3: how far through the play journal the database is, committed with the
+  // plays so that replaying the journal never adds one twice
+  "CREATE TABLE JournalState(ID INTEGER PRIMARY KEY CHECK (ID = 0), Generation INTEGER NOT NULL, Offset INTEGER NOT NULL);",
+  // 4: daily rollups, so a top list over the last N days reads N days of
+  // rows however long the history, and plays by time
+  "CREATE TABLE ArtistDaily(Day INTEGER NOT NULL, Name TEXT NOT NULL, PlayCount INTEGER NOT NULL, PRIMARY KEY (Day, Name)) WITHOUT ROWID;"
+  "CREATE TABLE AlbumDaily(Day INTEGER NOT NULL, Name TEXT NOT NULL, PlayCount INTEGER NOT NULL, PRIMARY KEY (Day, Name)) WITHOUT ROWID;"
+  "CREATE TABLE SongDaily(Day INTEGER NOT NULL, Name TEXT NOT NULL, PlayCount INTEGER NOT NULL, PRIMARY KEY (Day, Name)) WITHOUT ROWID;"
+  SQL_DAILY_TRIGGER
+  SQL_DAILY_BACKFILL
+  SQL_PLAYS_INDEXES,
+  // 5: plays past the retention period, folded into one row per day, song
+  // and source (0 for plays from before sources)
+  "CREATE TABLE PlaysArchive(Day INTEGER NOT NULL, SongID INTEGER NOT NULL REFERENCES Song(ID), SourceID INTEGER NOT NULL, "
+    "PlayCount INTEGER NOT NULL, LastPlayed INTEGER NOT NULL, PRIMARY KEY (Day, SongID, SourceID)) WITHOUT ROWID;",
+  // 6: the similarity engine's neighbours of each artist and album, saved
+  // from memory along with the last play they count
+  "CREATE TABLE ArtistNeighbours(Name TEXT NOT NULL, Neighbour TEXT NOT NULL, Weight INTEGER NOT NULL, PRIMARY KEY (Name, Neighbour)) WITHOUT ROWID;"
+  "CREATE TABLE AlbumNeighbours(Name TEXT NOT NULL, Neighbour TEXT NOT NULL, Weight INTEGER NOT NULL, PRIMARY KEY (Name, Neighbour)) WITHOUT ROWID;"
+  "CREATE TABLE SimilarState(ID INTEGER PRIMARY KEY CHECK (ID = 0), PlayID INTEGER NOT NULL);",
+  // 7: time listened and skips. Plays from before this, imported ones and
+  // those still playing have neither.
+  "ALTER TABLE Plays ADD COLUMN ListenedMs INTEGER;"
+  "ALTER TABLE Plays ADD COLUMN Skipped INTEGER;"
+  SQL_ADD_LISTENED("ArtistStats") SQL_ADD_LISTENED("AlbumStats") SQL_ADD_LISTENED("SongStats")
+  SQL_ADD_LISTENED("ArtistDaily") SQL_ADD_LISTENED("AlbumDaily") SQL_ADD_LISTENED("SongDaily")
+  "ALTER TABLE PlaysArchive ADD COLUMN ListenedMs INTEGER NOT NULL DEFAULT 0;"
+  "ALTER TABLE PlaysArchive ADD COLUMN Skips INTEGER NOT NULL DEFAULT 0;"
+  SQL_LISTENED_INDEXES
+  SQL_LISTENED_TRIGGER,
+  // 8: plays keyed by an ID never handed out twice. SimilarState holds the
+  // last play counted, but a plain rowid is reused once the highest plays
+  // (imported old ones, say) are expired, and plays under it would never be
+  // counted. The sequence starts past that watermark in case it already was.
+  // Dropping Plays drops its triggers and index, so they are made again.
+  "CREATE TABLE NewPlays(ID INTEGER PRIMARY KEY AUTOINCREMENT, Time INTEGER NOT NULL, SongID INTEGER REFERENCES Song(ID), "
+    "SourceID INTEGER REFERENCES Source(ID), ListenedMs INTEGER, Skipped INTEGER);"
+  "INSERT INTO NewPlays(ID, Time, SongID, SourceID, ListenedMs, Skipped) SELECT rowid, Time, SongID, SourceID, ListenedMs, Skipped FROM Plays;"
+  "DROP TABLE Plays;"
+  "ALTER TABLE NewPlays RENAME TO Plays;"
+  "DELETE FROM sqlite_sequence WHERE name='Plays';"
+  "INSERT INTO sqlite_sequence(name, seq) "
+    "SELECT 'Plays', max(IFNULL((SELECT MAX(ID) FROM Plays), 0), IFNULL((SELECT PlayID FROM SimilarState), 0));"
+  SQL_STATS_TRIGGER
+  SQL_DAILY_TRIGGER
+  SQL_LISTENED_TRIGGER
+  SQL_PLAYS_INDEXES,
+  // 9: "frequent" ranks by plays not skipped, so a song skipped every time
+  // it comes up no longer climbs the list
+  "DROP INDEX ArtistStatsByCount; DROP INDEX AlbumStatsByCount; DROP INDEX SongStatsByCount;"
+  SQL_STATS_COUNTED_INDEXES,
+  // 10: plays the schema refused, kept as the journal had them. The columns
+  // have no types or constraints, so any play fits.
+  "CREATE TABLE RefusedPlays(ID INTEGER PRIMARY KEY, RefusedAt INTEGER NOT NULL, Error TEXT, "
+    "SourceID, MPDID, Time, Title, Artist, Album, Ended, ListenedMs, Skipped);",
+  NULL
+};
 
-  const char *HOME = getenv("HOME");
-  if (HOME == NULL) {
-    fprintf(stderr, ":: No HOME var?");
-    goto db_init_err;
+
+int migrate_schema(sqlite3 *db) {
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL)) {
+    fprintf(stderr, ":: Failed to read schema version: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  int version = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    version = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  int n_migrations = 0;
+  while (MIGRATIONS[n_migrations] != NULL) n_migrations++;
+
+  char *errmsg = NULL;
+  for (int i = version; i < n_migrations; i++) {
+    fprintf(stderr, ":: Migrating schema to version %d\n", i + 1);
+
+    char set_version[64];
+    snprintf(set_version, sizeof(set_version), "PRAGMA user_version = %d;", i + 1);
+
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, &errmsg)
+        || sqlite3_exec(db, MIGRATIONS[i], NULL, NULL, &errmsg)
+        || sqlite3_exec(db, set_version, NULL, NULL, &errmsg)
+        || sqlite3_exec(db, "COMMIT;", NULL, NULL, &errmsg)) {
+      fprintf(stderr, ":: Error migrating schema to version %d: %s\n", i + 1, errmsg);
+      sqlite3_free(errmsg);
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+// A database made before incremental vacuuming, or before it was asked for,
+// has to be rebuilt once to give pages back to the file system.
+static int convert_auto_vacuum(sqlite3 *db) {
+  sqlite3_stmt *stmt = NULL;
+  int mode = -1;
+  if (sqlite3_prepare_v2(db, "PRAGMA auto_vacuum;", -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    mode = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  // 2 is INCREMENTAL
+  if (mode == 2) return 0;
+
+  fprintf(stderr, ":: Rebuilding the database for incremental vacuuming...\n");
+  char *errmsg = NULL;
+  if (sqlite3_exec(db, "PRAGMA auto_vacuum=INCREMENTAL; VACUUM;", NULL, NULL, &errmsg)) {
+    fprintf(stderr, ":: Failed to rebuild the database: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    return -1;
+  }
+  return 0;
+}
+
+
+int prepare_statements(struct db_conn *conn) {
+  for (int i = 0; i < N_STMTS; i++) {
+    const char *sql = STMT_SQL[i];
+    if (sqlite3_prepare_v3(conn->inner, sql, strlen(sql), SQLITE_PREPARE_PERSISTENT, &conn->stmts[i], NULL)) {
+      const char *errmsg = sqlite3_errmsg(conn->inner);
+      fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql, errmsg);
+      return -1;
+    }
   }
 
+  return 0;
+}
+
+
+// Make a cached statement ready for its next use.
+static void db_stmt_done(sqlite3_stmt *stmt) {
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+
+// Load every known artist, album and song ID into a new cache.
+struct id_cache *warm_id_cache(sqlite3 *db) {
+  struct id_cache *cache = id_cache_new();
+  if (cache == NULL) return NULL;
+
+  const char *sql[] = {
+    "SELECT ID, Name FROM Artist;",
+    "SELECT ID, ArtistID, Name FROM Album;",
+    "SELECT SourceID, MPDID, SongID, Song.Name, Artist.Name, Album.Name FROM SongSource "
+      "INNER JOIN Song ON Song.ID=SongSource.SongID INNER JOIN Album ON Song.AlbumID=Album.ID "
+      "INNER JOIN Artist ON Album.ArtistID=Artist.ID;",
+  };
+  int n = 0;
+
+  for (int i = 0; i < 3; i++) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql[i], -1, &stmt, NULL)) {
+      fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql[i], sqlite3_errmsg(db));
+      id_cache_free(cache);
+      return NULL;
+    }
+
+    int err = 0;
+    while (!err && sqlite3_step(stmt) == SQLITE_ROW) {
+      int id = sqlite3_column_int(stmt, 0);
+      switch (i) {
+        case 0:
+          err = id_cache_put_artist(cache, (const char *)sqlite3_column_text(stmt, 1), id);
+          break;
+        case 1:
+          err = id_cache_put_album(cache, sqlite3_column_int(stmt, 1), (const char *)sqlite3_column_text(stmt, 2), id);
+          break;
+        case 2:
+          err = id_cache_put_song(cache, id, sqlite3_column_int(stmt, 1),
+              id_cache_tags((const char *)sqlite3_column_text(stmt, 3), (const char *)sqlite3_column_text(stmt, 4),
+                (const char *)sqlite3_column_text(stmt, 5)),
+              sqlite3_column_int(stmt, 2));
+          break;
+      }
+      n++;
+    }
+    sqlite3_finalize(stmt);
+
+    if (err) {
+      id_cache_free(cache);
+      return NULL;
+    }
+  }
+
+  fprintf(stderr, ":: Cached %d IDs\n", n);
+  return cache;
+}
+
+
+struct db_conn *db_init(const struct db_config *config, int readonly) {
+  struct db_conn *conn = calloc(1, sizeof(struct db_conn));
+  fprintf(stderr, "Initialising database...\n");
+
   char s[1000] = {0};
-  snprintf(s, 1000, "%s/.mpd_stats.db", HOME);
+  if (config->path != NULL) {
+    snprintf(s, 1000, "%s", config->path);
+  }
+  else {
+    const char *HOME = getenv("HOME");
+    if (HOME == NULL) {
+      fprintf(stderr, ":: No HOME var?");
+      goto db_init_err;
+    }
+    snprintf(s, 1000, "%s/.mpd_stats.db", HOME);
+  }
 
-  if (sqlite3_open((const char *)s, &conn->inner)) {
+  int flags = readonly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if (sqlite3_open_v2((const char *)s, &conn->inner, flags, NULL)) {
     fprintf(stderr, ":: Failed to open sqlite db.\n");
     goto db_init_err;
   }
 
-  if (init_schema(conn->inner)) {
+  // readers and the writer share the file, so wait out each other's locks
+  sqlite3_busy_timeout(conn->inner, config->busy_timeout_ms);
+
+  conn->retention_days = config->retention_days;
+  if (!readonly) {
+    // WAL lets readers and the writer proceed concurrently, and only needs
+    // one sync per transaction. Incremental vacuuming only takes on a new
+    // database, see convert_auto_vacuum() for the others.
+    char pragmas[128];
+    snprintf(pragmas, sizeof(pragmas), "PRAGMA auto_vacuum=INCREMENTAL; PRAGMA journal_mode=WAL; PRAGMA synchronous=%s;", config->synchronous);
+    char *errmsg = NULL;
+    if (sqlite3_exec(conn->inner, pragmas, NULL, NULL, &errmsg)) {
+      fprintf(stderr, ":: Error running sql \"%s\": %s\n", pragmas, errmsg);
+      sqlite3_free(errmsg);
+      goto db_init_err;
+    }
+  }
+
+  if (!readonly && init_schema(conn->inner)) {
     fprintf(stderr, ":: Failed to init sqlite schema.\n");
     goto db_init_err;
   }
+
+  if (!readonly && migrate_schema(conn->inner)) {
+    fprintf(stderr, ":: Failed to migrate sqlite schema.\n");
+    goto db_init_err;
+  }
+
+  // not fatal: expired plays still free pages for reuse
+  if (!readonly && conn->retention_days > 0) convert_auto_vacuum(conn->inner);
+
+  if (prepare_statements(conn)) {
+    fprintf(stderr, ":: Failed to prepare sqlite statements.\n");
+    goto db_init_err;
+  }
+
+  if (!readonly) {
+    // not fatal: without it every play looks its IDs up in the database
+    conn->cache = warm_id_cache(conn->inner);
+  }
   fprintf(stderr, "Done!\n");
 
   return conn;
@@ -71,6 +617,11 @@ db_init_err:
 void db_free(struct db_conn *db) {
   if (db == NULL) return;
 
+  for (int i = 0; i < N_STMTS; i++) {
+    sqlite3_finalize(db->stmts[i]);
+  }
+  id_cache_free(db->cache);
+
   if (db->inner != NULL) {
     sqlite3_close(db-> inner);
   }
@@ -80,19 +631,13 @@ void db_free(struct db_conn *db) {
 }
 
 
-int db_add_artist(sqlite3 *db, const char *artist) {
-  const char *sql = "INSERT INTO Artist(Name) VALUES (?) RETURNING ID;";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep select stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
-  }
+int db_add_artist(struct db_conn *db, const char *artist) {
+  sqlite3_stmt *stmt = db->stmts[STMT_ADD_ARTIST];
 
   int rv = -1;
   if (sqlite3_bind_text(stmt, 1, artist, strlen(artist), SQLITE_STATIC)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_add_artist_end;
   }
 
@@ -106,24 +651,18 @@ int db_add_artist(sqlite3 *db, const char *artist) {
   }
 
 _db_add_artist_end:
-  sqlite3_finalize(stmt);
+  db_stmt_done(stmt);
   return rv;
 }
 
 
-int db_get_artist(sqlite3 *db, const char *artist) {
-  const char *sql = "SELECT ID FROM Artist WHERE Name=?;";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep select stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
-  }
+int db_get_artist(struct db_conn *db, const char *artist) {
+  sqlite3_stmt *stmt = db->stmts[STMT_GET_ARTIST];
 
   int rv = -1;
   if (sqlite3_bind_text(stmt, 1, artist, strlen(artist), SQLITE_STATIC)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_get_artist_end;
   }
 
@@ -134,38 +673,32 @@ int db_get_artist(sqlite3 *db, const char *artist) {
       break;
     case SQLITE_DONE:
       // no data :(
-      rv = db_add_artist(db, artist);
-      break;
+      db_stmt_done(stmt);
+      return db_add_artist(db, artist);
     default:
       rv = -1;
       break;
   }
 
 _db_get_artist_end:
-  sqlite3_finalize(stmt);
+  db_stmt_done(stmt);
   return rv;
 }
 
 
-int db_add_album(sqlite3 *db, const char *album, int artist_id) {
-  const char *sql = "INSERT INTO Album (Name, ArtistID) VALUES (?, ?) RETURNING ID;";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep select stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
-  }
+int db_add_album(struct db_conn *db, const char *album, int artist_id) {
+  sqlite3_stmt *stmt = db->stmts[STMT_ADD_ALBUM];
 
   int rv = -1;
   if (sqlite3_bind_text(stmt, 1, album, strlen(album), SQLITE_STATIC)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:Album to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Album to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_add_album_end;
   }
 
   if (sqlite3_bind_int(stmt, 2, artist_id)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 2:ArtistID to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 2:ArtistID to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_add_album_end;
   }
 
@@ -179,30 +712,24 @@ int db_add_album(sqlite3 *db, const char *album, int artist_id) {
   }
 
 _db_add_album_end:
-  sqlite3_finalize(stmt);
+  db_stmt_done(stmt);
   return rv;
 }
 
 
-int db_get_album(sqlite3 *db, const char *album, int artist_id) {
-  const char *sql = "SELECT ID FROM Album WHERE Name=? AND ArtistID=?;";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep select stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
-  }
+int db_get_album(struct db_conn *db, const char *album, int artist_id) {
+  sqlite3_stmt *stmt = db->stmts[STMT_GET_ALBUM];
 
   int rv = -1;
   if (sqlite3_bind_text(stmt, 1, album, strlen(album), SQLITE_STATIC)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_get_album_end;
   }
 
   if (sqlite3_bind_int(stmt, 2, artist_id)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 2:ArtistID to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 2:ArtistID to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_get_album_end;
   }
 
@@ -213,51 +740,38 @@ int db_get_album(sqlite3 *db, const char *album, int artist_id) {
       break;
     case SQLITE_DONE:
       // no data :(
-      rv = db_add_album(db, album, artist_id);
-      break;
+      db_stmt_done(stmt);
+      return db_add_album(db, album, artist_id);
     default:
       rv = -1;
       break;
   }
 
 _db_get_album_end:
-  sqlite3_finalize(stmt);
+  db_stmt_done(stmt);
   return rv;
 }
 
 
 
-int db_add_song(sqlite3 *db, const char *title, int album_id, int mpd_song_id) {
-  const char *sql = "INSERT INTO Song (Name, AlbumID, MPDID) VALUES (?, ?, ?) RETURNING ID;";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
-  }
+int db_add_song(struct db_conn *db, const char *title, int album_id) {
+  sqlite3_stmt *stmt = db->stmts[STMT_ADD_SONG];
 
   int rv = -1;
   if (sqlite3_bind_text(stmt, 1, title, strlen(title), SQLITE_STATIC)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_add_song_end;
   }
 
   if (sqlite3_bind_int(stmt, 2, album_id)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 2:AlbumID to stmt \"%s\": %s\n", sql, errmsg);
-    goto _db_add_song_end;
-  }
-
-  if (sqlite3_bind_int(stmt, 3, mpd_song_id)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 3:MPDID to stmt \"%s\": %s\n", sql, errmsg);
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 2:AlbumID to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_add_song_end;
   }
 
   switch (sqlite3_step(stmt)) {
     case SQLITE_ROW:
-      // found album
       rv = sqlite3_column_int(stmt, 0);
       break;
     default:
@@ -266,23 +780,23 @@ int db_add_song(sqlite3 *db, const char *title, int album_id, int mpd_song_id) {
   }
 
 _db_add_song_end:
-  sqlite3_finalize(stmt);
+  db_stmt_done(stmt);
   return rv;
 }
 
-int db_get_song(sqlite3 *db, const char *title, int album_id, int mpd_song_id) {
-  const char *sql = "SELECT ID FROM Song WHERE MPDID=?;";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
-  }
+int db_get_song(struct db_conn *db, const char *title, int album_id) {
+  sqlite3_stmt *stmt = db->stmts[STMT_GET_SONG];
 
   int rv = -1;
-  if (sqlite3_bind_int(stmt, 1, mpd_song_id)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:MPDID to stmt \"%s\": %s\n", sql, errmsg);
+  if (sqlite3_bind_text(stmt, 1, title, strlen(title), SQLITE_STATIC)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
+    goto _db_get_song_end;
+  }
+
+  if (sqlite3_bind_int(stmt, 2, album_id)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 2:AlbumID to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
     goto _db_get_song_end;
   }
 
@@ -293,112 +807,1154 @@ int db_get_song(sqlite3 *db, const char *title, int album_id, int mpd_song_id) {
       break;
     case SQLITE_DONE:
       // no data :(
-      rv = db_add_song(db, title, album_id, mpd_song_id);
-      break;
+      db_stmt_done(stmt);
+      return db_add_song(db, title, album_id);
     default:
       rv = -1;
       break;
   }
 
 _db_get_song_end:
-  sqlite3_finalize(stmt);
+  db_stmt_done(stmt);
   return rv;
 }
 
 
-int _db_add_play(sqlite3 *db, int song_id) {
-  const char *sql = "INSERT INTO Plays (Time, SongID) VALUES (unixepoch(), ?);";
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql, errmsg);
-    return -1;
+static int same_tag(const unsigned char *name, const char *tag) {
+  return name != NULL && strcmp((const char *)name, tag != NULL ? tag : "") == 0;
+}
+
+// Song.ID last seen behind an MPD song id on a source, -1 if none or if it
+// was another song: the id has since been handed to a new queue entry.
+int db_get_song_source(struct db_conn *db, int source_id, int mpd_song_id, const char *title, const char *artist, const char *album) {
+  sqlite3_stmt *stmt = db->stmts[STMT_GET_SONG_SOURCE];
+
+  int rv = -1;
+  if (sqlite3_bind_int(stmt, 1, source_id) || sqlite3_bind_int(stmt, 2, mpd_song_id)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind vars to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
+    goto _db_get_song_source_end;
+  }
+
+  if (sqlite3_step(stmt) == SQLITE_ROW && same_tag(sqlite3_column_text(stmt, 1), title)
+      && same_tag(sqlite3_column_text(stmt, 2), artist) && same_tag(sqlite3_column_text(stmt, 3), album)) {
+    rv = sqlite3_column_int(stmt, 0);
   }
 
+_db_get_song_source_end:
+  db_stmt_done(stmt);
+  return rv;
+}
+
+
+int db_add_song_source(struct db_conn *db, int source_id, int mpd_song_id, int song_id) {
+  sqlite3_stmt *stmt = db->stmts[STMT_ADD_SONG_SOURCE];
+
   int rv = -1;
-  if (sqlite3_bind_int(stmt, 1, song_id)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to bind var 1:SongID to stmt \"%s\": %s\n", sql, errmsg);
-    goto _db_add_song_end;
+  if (sqlite3_bind_int(stmt, 1, source_id) || sqlite3_bind_int(stmt, 2, mpd_song_id) || sqlite3_bind_int(stmt, 3, song_id)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind vars to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
+    goto _db_add_song_source_end;
+  }
+
+  rv = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+
+_db_add_song_source_end:
+  db_stmt_done(stmt);
+  return rv;
+}
+
+
+int _db_add_play(struct db_conn *db, int source_id, int song_id, long played_at) {
+  sqlite3_stmt *stmt = db->stmts[STMT_ADD_PLAY];
+
+  int rv = -1;
+  if (sqlite3_bind_int64(stmt, 1, played_at)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 1:Time to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
+    goto _db_add_play_end;
+  }
+
+  if (sqlite3_bind_int(stmt, 2, song_id)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 2:SongID to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
+    goto _db_add_play_end;
+  }
+
+  if (sqlite3_bind_int(stmt, 3, source_id)) {
+    const char *errmsg = sqlite3_errmsg(db->inner);
+    fprintf(stderr, ":: Failed to bind var 3:SourceID to stmt \"%s\": %s\n", sqlite3_sql(stmt), errmsg);
+    goto _db_add_play_end;
+  }
+
+  rv = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+
+_db_add_play_end:
+  db_stmt_done(stmt);
+  return rv;
+}
+
+
+int db_exec(struct db_conn *db, enum db_stmt which) {
+  sqlite3_stmt *stmt = db->stmts[which];
+  int rv = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+  if (rv) {
+    fprintf(stderr, ":: Failed to run stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+  }
+  db_stmt_done(stmt);
+  return rv;
+}
+
+
+// IDs a play resolved to, cached once its transaction commits.
+struct play_ids {
+  int artist_id;
+  int album_id;
+  int song_id;
+  int new_mapping;
+  long play_id;
+};
+
+
+// Fill in how a play ended, and the song it was of. One whose start was
+// never recorded, or has since been archived, is left alone.
+static int end_play(struct db_conn *db, const struct db_play *play, struct play_ids *ids) {
+  sqlite3_stmt *stmt = db->stmts[STMT_END_PLAY];
+  int rv = sqlite3_bind_int64(stmt, 1, play->listened_ms) || sqlite3_bind_int(stmt, 2, play->skipped != 0)
+    || sqlite3_bind_int64(stmt, 3, play->played_at) || sqlite3_bind_int(stmt, 4, play->source_id)
+    || sqlite3_bind_int(stmt, 5, play->mpd_song_id) ? -1 : 0;
+  int state = rv ? SQLITE_ERROR : sqlite3_step(stmt);
+  if (state == SQLITE_ROW) {
+    ids->song_id = sqlite3_column_int(stmt, 0);
+    state = sqlite3_step(stmt);
+  }
+  if (state != SQLITE_DONE) rv = -1;
+  if (rv) {
+    fprintf(stderr, ":: Failed to run stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+  }
+  db_stmt_done(stmt);
+  return rv;
+}
+
+
+// Insert a play inside the open transaction.
+static int insert_play(struct db_conn *db, const struct db_play *play, struct play_ids *ids) {
+  *ids = (struct play_ids){.artist_id = -1, .album_id = -1, .song_id = -1};
+  if (play->ended) return end_play(db, play, ids);
+  uint64_t tags = id_cache_tags(play->title, play->artist, play->album);
+  if (db->cache) ids->song_id = id_cache_song(db->cache, play->source_id, play->mpd_song_id, tags);
+  if (ids->song_id < 0) {
+    ids->song_id = db_get_song_source(db, play->source_id, play->mpd_song_id, play->title, play->artist, play->album);
+  }
+
+  if (ids->song_id < 0) {
+    if (db->cache) ids->artist_id = id_cache_artist(db->cache, play->artist);
+    if (ids->artist_id < 0) ids->artist_id = db_get_artist(db, play->artist);
+    if (ids->artist_id < 0) return -1;
+
+    if (db->cache) ids->album_id = id_cache_album(db->cache, ids->artist_id, play->album);
+    if (ids->album_id < 0) ids->album_id = db_get_album(db, play->album, ids->artist_id);
+    if (ids->album_id < 0) return -1;
+
+    // the same song on another server, or requeued, keeps its row; a song id
+    // MPD reused for another song is pointed at that one
+    ids->song_id = db_get_song(db, play->title, ids->album_id);
+    if (ids->song_id < 0 || db_add_song_source(db, play->source_id, play->mpd_song_id, ids->song_id)) return -1;
+    ids->new_mapping = 1;
+  }
+
+  if (_db_add_play(db, play->source_id, ids->song_id, play->played_at)) return -1;
+  ids->play_id = sqlite3_last_insert_rowid(db->inner);
+  return 0;
+}
+
+
+// Update the ID cache and the rank and similarity engines with a committed
+// play.
+static void cache_play(struct db_conn *db, const struct db_play *play, const struct play_ids *ids) {
+  if (play->ended) {
+    if (db->rank && play->skipped && ids->song_id >= 0) rank_skip(db->rank, ids->song_id);
+    return;
+  }
+  if (db->cache) {
+    if (ids->artist_id >= 0) id_cache_put_artist(db->cache, play->artist, ids->artist_id);
+    if (ids->album_id >= 0) id_cache_put_album(db->cache, ids->artist_id, play->album, ids->album_id);
+    id_cache_put_song(db->cache, play->source_id, play->mpd_song_id, id_cache_tags(play->title, play->artist, play->album), ids->song_id);
+  }
+  if (db->rank) {
+    // adding a song the engine already knows is harmless
+    if (ids->new_mapping) rank_add_song(db->rank, ids->song_id, play->artist, play->album, play->title);
+    if (rank_play(db->rank, ids->song_id, play->played_at)) {
+      fprintf(stderr, ":: Rank: unknown song %d\n", ids->song_id);
+    }
   }
+  if (db->similar) {
+    if (ids->new_mapping) similar_add_song(db->similar, ids->song_id, play->artist, play->album);
+    if (similar_play(db->similar, play->source_id, ids->song_id, play->played_at, ids->play_id)) {
+      fprintf(stderr, ":: Similar: failed to count a play of song %d\n", ids->song_id);
+    }
+  }
+}
+
 
+static int set_journal(struct db_conn *db, long generation, long offset) {
+  sqlite3_stmt *stmt = db->stmts[STMT_SET_JOURNAL];
+  int rv = sqlite3_bind_int64(stmt, 1, generation) || sqlite3_bind_int64(stmt, 2, offset)
+    || sqlite3_step(stmt) != SQLITE_DONE ? -1 : 0;
+  if (rv) {
+    fprintf(stderr, ":: Failed to run stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+  }
+  db_stmt_done(stmt);
+  return rv;
+}
+
+
+int db_add_plays(struct db_conn *db, const struct db_play *plays, int n, long journal_generation, long journal_offset) {
+  long start = metrics_start();
+  struct play_ids *ids = n > 0 ? malloc(n * sizeof(struct play_ids)) : NULL;
+  int rv = -1;
+  if ((n > 0 && ids == NULL) || db_exec(db, STMT_BEGIN)) goto _db_add_plays_end;
+
+  for (int i = 0; i < n; i++) {
+    if (insert_play(db, &plays[i], &ids[i])) goto _db_add_plays_err;
+  }
+  if (journal_generation > 0 && set_journal(db, journal_generation, journal_offset)) goto _db_add_plays_err;
+  if (db_exec(db, STMT_COMMIT)) goto _db_add_plays_err;
+
+  // only cache IDs once they are committed
+  for (int i = 0; i < n; i++) cache_play(db, &plays[i], &ids[i]);
+  rv = 0;
+  goto _db_add_plays_end;
+
+_db_add_plays_err:
+  // read before the rollback resets it
+  switch (sqlite3_errcode(db->inner) & 0xff) {
+    case SQLITE_CONSTRAINT:
+    case SQLITE_MISMATCH:
+      snprintf(db->refusal, sizeof(db->refusal), "%s", sqlite3_errmsg(db->inner));
+      rv = DB_REFUSED;
+      break;
+  }
+  db_exec(db, STMT_ROLLBACK);
+_db_add_plays_end:
+  free(ids);
+  metrics_record(METRIC_ADD_PLAY, start, rv == 0);
+  return rv;
+}
+
+
+int db_refuse_play(struct db_conn *db, const struct db_play *play, long journal_generation, long journal_offset) {
+  if (db_exec(db, STMT_BEGIN)) return -1;
+
+  sqlite3_stmt *stmt = db->stmts[STMT_REFUSE_PLAY];
+  int rv = sqlite3_bind_int64(stmt, 1, time(NULL)) || sqlite3_bind_text(stmt, 2, db->refusal, -1, SQLITE_STATIC)
+    || sqlite3_bind_int(stmt, 3, play->source_id) || sqlite3_bind_int(stmt, 4, play->mpd_song_id)
+    || sqlite3_bind_int64(stmt, 5, play->played_at) || sqlite3_bind_text(stmt, 6, play->title, -1, SQLITE_STATIC)
+    || sqlite3_bind_text(stmt, 7, play->artist, -1, SQLITE_STATIC) || sqlite3_bind_text(stmt, 8, play->album, -1, SQLITE_STATIC)
+    || sqlite3_bind_int(stmt, 9, play->ended != 0) || sqlite3_bind_int64(stmt, 10, play->listened_ms)
+    || sqlite3_bind_int(stmt, 11, play->skipped != 0) || sqlite3_step(stmt) != SQLITE_DONE ? -1 : 0;
+  if (rv) {
+    fprintf(stderr, ":: Failed to run stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+  }
+  db_stmt_done(stmt);
+
+  if (rv || (journal_generation > 0 && set_journal(db, journal_generation, journal_offset)) || db_exec(db, STMT_COMMIT)) {
+    db_exec(db, STMT_ROLLBACK);
+    return -1;
+  }
+  return 0;
+}
+
+
+int db_add_play(struct db_conn *db, int source_id, const char *title, const char *artist, const char *album, int mpd_song_id) {
+  struct db_play play = {
+    .source_id = source_id, .title = title, .artist = artist, .album = album,
+    .mpd_song_id = mpd_song_id, .played_at = time(NULL),
+  };
+  return db_add_plays(db, &play, 1, 0, 0);
+}
+
+
+int db_journal_position(struct db_conn *db, long *generation, long *offset) {
+  sqlite3_stmt *stmt = db->stmts[STMT_GET_JOURNAL];
+  *generation = 0;
+  *offset = 0;
+
+  int rv = 0;
   switch (sqlite3_step(stmt)) {
+    case SQLITE_ROW:
+      *generation = sqlite3_column_int64(stmt, 0);
+      *offset = sqlite3_column_int64(stmt, 1);
+      break;
     case SQLITE_DONE:
-      rv = 0;
+      // nothing journalled yet
       break;
     default:
+      fprintf(stderr, ":: Failed to run stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
       rv = -1;
       break;
   }
+  db_stmt_done(stmt);
+  return rv;
+}
 
-_db_add_song_end:
+
+int db_checkpoint(struct db_conn *db) {
+  int log = 0, done = 0;
+  int err = sqlite3_wal_checkpoint_v2(db->inner, NULL, SQLITE_CHECKPOINT_PASSIVE, &log, &done);
+  if (err != SQLITE_OK && err != SQLITE_BUSY) {
+    fprintf(stderr, ":: Failed to checkpoint: %s\n", sqlite3_errmsg(db->inner));
+  }
+  return err == SQLITE_OK && done == log ? 0 : -1;
+}
+
+
+const char *db_filename(struct db_conn *db) {
+  return sqlite3_db_filename(db->inner, "main");
+}
+
+
+// Fold up to max_plays of the oldest plays past the retention period into
+// PlaysArchive, and drop the oldest day of each *Daily table past what the
+// windows read, in one transaction. The *Stats are unchanged. Returns the number of rows changed.
+static int expire_plays(struct db_conn *db, int max_plays) {
+  long today = time(NULL) / 86400;
+  long cutoff = (today - db->retention_days) * 86400;
+  long rollup_cutoff = today - DB_ROLLUP_DAYS;
+  char sql[2048];
+  snprintf(sql, sizeof(sql),
+      "DELETE FROM SongDaily WHERE Day = (SELECT MIN(Day) FROM SongDaily) AND Day < %2$ld;"
+      "DELETE FROM AlbumDaily WHERE Day = (SELECT MIN(Day) FROM AlbumDaily) AND Day < %2$ld;"
+      "DELETE FROM ArtistDaily WHERE Day = (SELECT MIN(Day) FROM ArtistDaily) AND Day < %2$ld;"
+      "CREATE TEMP TABLE IF NOT EXISTS Expiring(ID INTEGER PRIMARY KEY);"
+      "DELETE FROM temp.Expiring;"
+      "INSERT INTO temp.Expiring SELECT rowid FROM Plays WHERE Time < %1$ld ORDER BY Time LIMIT %3$d;"
+      "INSERT INTO PlaysArchive(Day, SongID, SourceID, PlayCount, LastPlayed, ListenedMs, Skips) "
+        "SELECT " SQL_DAY("Time") ", SongID, IFNULL(SourceID, 0), COUNT(*), MAX(Time), TOTAL(ListenedMs), TOTAL(Skipped) FROM Plays "
+        "WHERE rowid IN temp.Expiring GROUP BY 1, 2, 3 "
+        "ON CONFLICT DO UPDATE SET PlayCount=PlayCount+excluded.PlayCount, LastPlayed=max(LastPlayed, excluded.LastPlayed), "
+          "ListenedMs=ListenedMs+excluded.ListenedMs, Skips=Skips+excluded.Skips;"
+      "DELETE FROM Plays WHERE rowid IN temp.Expiring;",
+      cutoff, rollup_cutoff, max_plays);
+
+  if (db_exec(db, STMT_BEGIN)) return -1;
+  int before = sqlite3_total_changes(db->inner);
+  char *errmsg = NULL;
+  if (sqlite3_exec(db->inner, sql, NULL, NULL, &errmsg)) {
+    fprintf(stderr, ":: Failed to expire plays: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    db_exec(db, STMT_ROLLBACK);
+    return -1;
+  }
+  int n = sqlite3_total_changes(db->inner) - before;
+  if (db_exec(db, STMT_COMMIT)) {
+    db_exec(db, STMT_ROLLBACK);
+    return -1;
+  }
+  return n;
+}
+
+
+// Give up to max_pages free pages back to the file system. Returns the
+// number still free.
+static int vacuum_pages(struct db_conn *db, int max_pages) {
+  char sql[64];
+  snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", max_pages);
+  char *errmsg = NULL;
+  if (sqlite3_exec(db->inner, sql, NULL, NULL, &errmsg)) {
+    fprintf(stderr, ":: Failed to vacuum: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    return -1;
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  int free_pages = -1;
+  if (sqlite3_prepare_v2(db->inner, "PRAGMA freelist_count;", -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    free_pages = sqlite3_column_int(stmt, 0);
+  }
   sqlite3_finalize(stmt);
+  return free_pages;
+}
+
+
+static const char *NEIGHBOUR_TABLES[N_SIMILAR_DIMS] = {
+  [RANK_ARTIST] = "ArtistNeighbours",
+  [RANK_ALBUM] = "AlbumNeighbours",
+};
+
+// Write the similarity engine's lists changed since the last save, with the
+// last play they count. Returns the number written, -1 on error.
+int db_save_similar(struct db_conn *db) {
+  struct similar_list *lists = NULL;
+  long through = 0;
+  int n = similar_changes(db->similar, &lists, &through);
+  if (n <= 0) return n;
+
+  sqlite3_stmt *clear[N_SIMILAR_DIMS] = {0}, *insert[N_SIMILAR_DIMS] = {0}, *state = NULL;
+  int rv = -1;
+  for (int d = 0; d < N_SIMILAR_DIMS; d++) {
+    char clear_sql[128], insert_sql[128];
+    snprintf(clear_sql, sizeof(clear_sql), "DELETE FROM %s WHERE Name=?;", NEIGHBOUR_TABLES[d]);
+    snprintf(insert_sql, sizeof(insert_sql), "INSERT INTO %s(Name, Neighbour, Weight) VALUES (?, ?, ?);", NEIGHBOUR_TABLES[d]);
+    if (sqlite3_prepare_v2(db->inner, clear_sql, -1, &clear[d], NULL) || sqlite3_prepare_v2(db->inner, insert_sql, -1, &insert[d], NULL)) {
+      fprintf(stderr, ":: Failed to prep similarity stmts: %s\n", sqlite3_errmsg(db->inner));
+      goto _db_save_similar_end;
+    }
+  }
+  if (sqlite3_prepare_v2(db->inner, "INSERT OR REPLACE INTO SimilarState(ID, PlayID) VALUES (0, ?);", -1, &state, NULL)) {
+    fprintf(stderr, ":: Failed to prep similarity stmts: %s\n", sqlite3_errmsg(db->inner));
+    goto _db_save_similar_end;
+  }
+  if (db_exec(db, STMT_BEGIN)) goto _db_save_similar_end;
+
+  for (int i = 0; i < n; i++) {
+    const struct similar_list *list = &lists[i];
+    sqlite3_bind_text(clear[list->dim], 1, list->name, -1, SQLITE_STATIC);
+    int err = sqlite3_step(clear[list->dim]) != SQLITE_DONE;
+    db_stmt_done(clear[list->dim]);
+
+    sqlite3_stmt *stmt = insert[list->dim];
+    for (int k = 0; !err && k < list->n; k++) {
+      sqlite3_bind_text(stmt, 1, list->name, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, list->neighbours[k], -1, SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 3, list->weights[k]);
+      err = sqlite3_step(stmt) != SQLITE_DONE;
+      db_stmt_done(stmt);
+    }
+    if (err) goto _db_save_similar_err;
+  }
+  sqlite3_bind_int64(state, 1, through);
+  if (sqlite3_step(state) != SQLITE_DONE) goto _db_save_similar_err;
+  if (db_exec(db, STMT_COMMIT)) {
+    db_exec(db, STMT_ROLLBACK);
+    goto _db_save_similar_end;
+  }
+  similar_saved(db->similar, lists, n);
+  rv = n;
+  goto _db_save_similar_end;
+
+_db_save_similar_err:
+  fprintf(stderr, ":: Failed to save the similarity graph: %s\n", sqlite3_errmsg(db->inner));
+  db_exec(db, STMT_ROLLBACK);
+
+_db_save_similar_end:
+  for (int d = 0; d < N_SIMILAR_DIMS; d++) {
+    sqlite3_finalize(clear[d]);
+    sqlite3_finalize(insert[d]);
+  }
+  sqlite3_finalize(state);
+  free(lists);
   return rv;
 }
 
 
-int db_add_play(struct db_conn *db, const char *title, const char *artist, const char *album, int mpd_song_id) {
-  int song_id = db_get_song(db->inner, title, -1, mpd_song_id);
+int db_maintain(struct db_conn *db) {
+  if (db->retention_days <= 0 && db->similar == NULL) return 0;
+  long start = metrics_start();
+  int saved = db->similar ? db_save_similar(db) : 0;
+  int expired = 0, free_pages = 0;
+  if (saved >= 0 && db->retention_days > 0) {
+    expired = expire_plays(db, DB_MAINTAIN_PLAYS);
+    free_pages = expired >= 0 ? vacuum_pages(db, DB_MAINTAIN_PAGES) : -1;
+  }
+  int ok = saved >= 0 && free_pages >= 0;
+  metrics_record(METRIC_MAINTAIN, start, ok);
+  if (!ok) return -1;
+  return expired > 0 || free_pages > 0;
+}
+
+
+
+// Importing
+
+struct db_import {
+  struct db_conn *db;
+  int source_id;
+  long batch;
+  int defer_index;
+  // plays in the open transaction, all after rowid first_play
+  long pending;
+  long first_play;
+
+  // "<album id>\x1f<title>" -> Song.ID, indexed by pool id
+  struct strpool *songs;
+  int *song_ids;
+  int cap_song_ids;
+};
 
-  if (song_id < 0) {
-    int artist_id = db_get_artist(db->inner, artist);
-    if (artist_id < 0) { return -1; }
 
-    int album_id = db_get_album(db->inner, album, artist_id);
-    if (album_id < 0) { return -1; }
+// Open a transaction without the stats triggers, and without the indexes
+// the first time if deferring them. Other connections never see the schema
+// change, as it is undone before the commit.
+static int import_batch_begin(struct db_import *import, int first) {
+  struct db_conn *db = import->db;
+  if (db_exec(db, STMT_BEGIN)) return -1;
 
-    song_id = db_add_song(db->inner, title, album_id, mpd_song_id);
+  sqlite3_stmt *stmt = NULL;
+  const char *sql = "SELECT IFNULL(MAX(rowid), 0) FROM Plays;";
+  if (sqlite3_prepare_v2(db->inner, sql, -1, &stmt, NULL) || sqlite3_step(stmt) != SQLITE_ROW) {
+    fprintf(stderr, ":: Failed to run stmt \"%s\": %s\n", sql, sqlite3_errmsg(db->inner));
+    sqlite3_finalize(stmt);
+    goto _import_batch_begin_err;
   }
+  import->first_play = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
 
-  return _db_add_play(db->inner, song_id);
+  char *errmsg = NULL;
+  if (sqlite3_exec(db->inner, "DROP TRIGGER PlaysStats; DROP TRIGGER PlaysDaily;", NULL, NULL, &errmsg)
+      || (first && import->defer_index
+        && sqlite3_exec(db->inner, SQL_DROP_STATS_INDEXES SQL_DROP_LISTENED_INDEXES SQL_DROP_PLAYS_INDEXES, NULL, NULL, &errmsg))) {
+    fprintf(stderr, ":: Failed to drop the stats triggers and indexes: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    goto _import_batch_begin_err;
+  }
+  import->pending = 0;
+  return 0;
+
+_import_batch_begin_err:
+  db_exec(db, STMT_ROLLBACK);
+  return -1;
 }
 
 
+// Add the batch's plays to the stats in one pass, as the triggers would
+// have, then put back what import_batch_begin() dropped and commit.
+static int import_batch_end(struct db_import *import, int last) {
+  struct db_conn *db = import->db;
+  static const char add_sql[] = SQL_STATS_ADD("%1$ld") SQL_DAILY_ADD("%1$ld") SQL_STATS_TRIGGER SQL_DAILY_TRIGGER;
+  char sql[sizeof(add_sql) + 6 * 20];
+  snprintf(sql, sizeof(sql), add_sql, import->first_play);
 
-// Querying
+  char *errmsg = NULL;
+  if (sqlite3_exec(db->inner, sql, NULL, NULL, &errmsg)
+      || (last && import->defer_index
+        && sqlite3_exec(db->inner, SQL_STATS_INDEXES SQL_LISTENED_INDEXES SQL_PLAYS_INDEXES, NULL, NULL, &errmsg))) {
+    fprintf(stderr, ":: Failed to update the stats: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    db_exec(db, STMT_ROLLBACK);
+    return -1;
+  }
+  if (db_exec(db, STMT_COMMIT)) {
+    db_exec(db, STMT_ROLLBACK);
+    return -1;
+  }
+  return 0;
+}
 
-const char *SQL_RECENT_ARTISTS = "SELECT ArtistName FROM (SELECT Artist.Name AS ArtistName, Max(Time) AS Time FROM Plays INNER JOIN Song s ON s.id=plays.SongID INNER JOIN Album ON s.AlbumID = Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID GROUP BY Artist.Name) ORDER BY Time DESC LIMIT 10;";
-const char *SQL_RECENT_ALBUMS = "SELECT AlbumName FROM (SELECT Album.Name AS AlbumName, Max(Time) AS Time FROM Plays INNER JOIN Song s ON s.id=plays.SongID INNER JOIN Album ON s.AlbumID = Album.ID GROUP BY Album.Name) ORDER BY Time DESC LIMIT 10;";
-const char *SQL_RECENT_SONGS = "SELECT SongName FROM (SELECT S.Name AS SongName, MAX(Time) AS Time FROM Plays INNER JOIN Song s ON s.id=plays.SongID GROUP BY S.Name) ORDER BY Time DESC LIMIT 10;";
 
-const char *SQL_FREQUENT_ARTISTS = "SELECT ArtistName FROM (SELECT Artist.Name as ArtistName, COUNT(*) as PlayCount FROM Plays INNER JOIN Song s ON s.id=plays.SongID INNER JOIN Album ON s.AlbumID = Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID GROUP BY Artist.Name) ORDER BY PlayCount Desc LIMIT 10;";
-const char *SQL_FREQUENT_ALBUMS = "SELECT AlbumName FROM (SELECT Album.Name as AlbumName, COUNT(*) as PlayCount FROM Plays INNER JOIN Song s ON s.id=plays.SongID INNER JOIN Album ON s.AlbumID = Album.ID GROUP BY Album.Name) ORDER BY PlayCount Desc LIMIT 10;";
-const char *SQL_FREQUENT_SONGS = "SELECT SongName FROM (SELECT S.Name as SongName, COUNT(*) as PlayCount FROM Plays INNER JOIN Song s ON s.id=plays.SongID GROUP BY S.Name) ORDER BY PlayCount Desc LIMIT 100;";
+struct db_import *db_import_begin(struct db_conn *db, int source_id, long batch, int defer_index) {
+  struct db_import *import = calloc(1, sizeof(struct db_import));
+  if (import == NULL) return NULL;
+  import->db = db;
+  import->source_id = source_id;
+  import->batch = batch;
+  import->defer_index = defer_index;
+  import->songs = strpool_new();
+  if (import->songs == NULL) goto _db_import_begin_err;
+
+  char *errmsg = NULL;
+  // enough pages for the indexes being filled to stay in memory
+  if (sqlite3_exec(db->inner, "PRAGMA cache_size=-65536;", NULL, NULL, &errmsg)) {
+    fprintf(stderr, ":: Failed to set the cache size: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    goto _db_import_begin_err;
+  }
+  if (import_batch_begin(import, 1)) goto _db_import_begin_err;
+  return import;
+
+_db_import_begin_err:
+  strpool_free(import->songs);
+  free(import);
+  return NULL;
+}
 
 
-int fetch_results(sqlite3 *db, const char *query, char ***results) {
+static int import_song(struct db_import *import, const char *artist, const char *album, const char *title) {
+  struct db_conn *db = import->db;
+  // an import that fails is abandoned along with the cache, so IDs are cached
+  // before they are committed
+  int artist_id = db->cache ? id_cache_artist(db->cache, artist) : -1;
+  if (artist_id < 0) {
+    artist_id = db_get_artist(db, artist);
+    if (artist_id < 0) return -1;
+    if (db->cache) id_cache_put_artist(db->cache, artist, artist_id);
+  }
+
+  int album_id = db->cache ? id_cache_album(db->cache, artist_id, album) : -1;
+  if (album_id < 0) {
+    album_id = db_get_album(db, album, artist_id);
+    if (album_id < 0) return -1;
+    if (db->cache) id_cache_put_album(db->cache, artist_id, album, album_id);
+  }
+
+  char buf[512];
+  char *key = buf;
+  int n = snprintf(buf, sizeof(buf), "%d\x1f%s", album_id, title);
+  if (n >= (int)sizeof(buf)) {
+    key = malloc(n + 1);
+    if (key == NULL) return -1;
+    snprintf(key, n + 1, "%d\x1f%s", album_id, title);
+  }
+  int idx = strpool_intern(import->songs, key);
+  if (key != buf) free(key);
+  if (idx < 0) return -1;
+
+  if (idx >= import->cap_song_ids) {
+    int cap = import->cap_song_ids ? import->cap_song_ids * 2 : 1024;
+    while (cap <= idx) cap *= 2;
+    int *ids = realloc(import->song_ids, cap * sizeof(int));
+    if (ids == NULL) return -1;
+    memset(&ids[import->cap_song_ids], 0xff, (cap - import->cap_song_ids) * sizeof(int));
+    import->song_ids = ids;
+    import->cap_song_ids = cap;
+  }
+  if (import->song_ids[idx] < 0) import->song_ids[idx] = db_get_song(db, title, album_id);
+  return import->song_ids[idx];
+}
+
+
+int db_import_play(struct db_import *import, const char *artist, const char *album, const char *title, long played_at) {
+  struct db_conn *db = import->db;
+  int song_id = import_song(import, artist, album, title);
+  if (song_id < 0 || _db_add_play(db, import->source_id, song_id, played_at)) return -1;
+
+  if (++import->pending == import->batch && !import->defer_index) {
+    // a failed batch leaves no transaction open, for db_import_end() to find
+    if (import_batch_end(import, 0)) {
+      import->pending = -1;
+      return -1;
+    }
+    if (import_batch_begin(import, 0)) {
+      import->pending = -1;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int db_import_end(struct db_import *import, int commit) {
+  int rv = -1;
+  if (import->pending >= 0) {
+    if (commit) rv = import_batch_end(import, 1);
+    else db_exec(import->db, STMT_ROLLBACK);
+  }
+
+  strpool_free(import->songs);
+  free(import->song_ids);
+  free(import);
+  return rv;
+}
+
+
+int db_source(struct db_conn *db, const char *name) {
+  const char *sql = "INSERT INTO Source (Name) VALUES (?) ON CONFLICT(Name) DO UPDATE SET Name=excluded.Name RETURNING ID;";
   sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, query, strlen(query), &stmt, NULL)) {
-    const char *errmsg = sqlite3_errmsg(db);
-    fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", query, errmsg);
-    return 0;
+  if (sqlite3_prepare_v2(db->inner, sql, -1, &stmt, NULL)) {
+    fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql, sqlite3_errmsg(db->inner));
+    return -1;
   }
 
+  int rv = -1;
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    rv = sqlite3_column_int(stmt, 0);
+  }
+  else {
+    fprintf(stderr, ":: Failed to add source \"%s\": %s\n", name, sqlite3_errmsg(db->inner));
+  }
+  sqlite3_finalize(stmt);
+  return rv;
+}
+
+
+
+// Querying
+
+int db_begin_read(struct db_conn *db) {
+  if (db->rank) rank_lock(db->rank);
+  int rv = db_exec(db, STMT_BEGIN_READ);
+  // a read that didn't begin is never ended
+  if (rv && db->rank) rank_unlock(db->rank);
+  return rv;
+}
+
+int db_end_read(struct db_conn *db) {
+  int rv = db_exec(db, STMT_COMMIT);
+  if (db->rank) rank_unlock(db->rank);
+  return rv;
+}
+
+// Every top list's statement takes its limit as its last parameter.
+static int fetch_results(struct db_conn *db, enum db_stmt query, enum metric_stage stage, int limit, db_row_fn f, void *ctx) {
+  long start = metrics_start();
+
+  if (db->rank && RANK_QUERIES[query].limit > 0) {
+    int count = rank_each(db->rank, RANK_QUERIES[query].dim, RANK_QUERIES[query].order, limit, f, ctx);
+    metrics_record(stage, start, 1);
+    return count;
+  }
+
+  sqlite3_stmt *stmt = db->stmts[query];
+  if (sqlite3_bind_int(stmt, sqlite3_bind_parameter_count(stmt), limit)) {
+    fprintf(stderr, ":: Failed to bind limit to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    db_stmt_done(stmt);
+    return -1;
+  }
   int count = 0;
-  (*results) = malloc(10*sizeof(const char *));
-  for (int state = sqlite3_step(stmt); state == SQLITE_ROW; state=sqlite3_step(stmt)) {
-    const char *s = (const char *)sqlite3_column_text(stmt, 0);
-    int n = strlen(s);
-    (*results)[count] = malloc(sizeof(char)*(n + 1));
-    strncpy((*results)[count], s, n);
-    (*results)[count][n] = 0;
-    count ++;
+  int state;
+  for (state = sqlite3_step(stmt); state == SQLITE_ROW; state = sqlite3_step(stmt)) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 0);
+    count++;
+    if (f(ctx, name != NULL ? name : "")) {
+      state = SQLITE_DONE;
+      break;
+    }
   }
 
-  sqlite3_finalize(stmt);
+  if (state != SQLITE_DONE) {
+    fprintf(stderr, ":: Failed to run query \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    count = -1;
+  }
+  db_stmt_done(stmt);
+  metrics_record(stage, start, count >= 0);
   return count;
 }
 
-int db_fetch_recent_artists(struct db_conn *db, char ***results) { return fetch_results(db->inner, SQL_RECENT_ARTISTS, results); }
-int db_fetch_recent_albums(struct db_conn *db, char ***results) { return fetch_results(db->inner, SQL_RECENT_ALBUMS, results); }
-int db_fetch_recent_songs(struct db_conn *db, char ***results) { return fetch_results(db->inner, SQL_RECENT_SONGS, results); }
-int db_fetch_frequent_artists(struct db_conn *db, char ***results) { return fetch_results(db->inner, SQL_FREQUENT_ARTISTS, results); }
-int db_fetch_frequent_albums(struct db_conn *db, char ***results) { return fetch_results(db->inner, SQL_FREQUENT_ALBUMS, results); }
-int db_fetch_frequent_songs(struct db_conn *db, char ***results) { return fetch_results(db->inner, SQL_FREQUENT_SONGS, results); }
+int db_fetch_recent_artists(struct db_conn *db, db_row_fn f, void *ctx) { return fetch_results(db, STMT_RECENT_ARTISTS, METRIC_FETCH_RECENT_ARTISTS, TOP_LIMIT, f, ctx); }
+int db_fetch_recent_albums(struct db_conn *db, db_row_fn f, void *ctx) { return fetch_results(db, STMT_RECENT_ALBUMS, METRIC_FETCH_RECENT_ALBUMS, TOP_LIMIT, f, ctx); }
+int db_fetch_recent_songs(struct db_conn *db, db_row_fn f, void *ctx) { return fetch_results(db, STMT_RECENT_SONGS, METRIC_FETCH_RECENT_SONGS, TOP_LIMIT, f, ctx); }
+int db_fetch_frequent_artists(struct db_conn *db, db_row_fn f, void *ctx) { return fetch_results(db, STMT_FREQUENT_ARTISTS, METRIC_FETCH_FREQUENT_ARTISTS, TOP_LIMIT, f, ctx); }
+int db_fetch_frequent_albums(struct db_conn *db, db_row_fn f, void *ctx) { return fetch_results(db, STMT_FREQUENT_ALBUMS, METRIC_FETCH_FREQUENT_ALBUMS, TOP_LIMIT, f, ctx); }
+int db_fetch_frequent_songs(struct db_conn *db, db_row_fn f, void *ctx) { return fetch_results(db, STMT_FREQUENT_SONGS, METRIC_FETCH_FREQUENT_SONGS, TOP_SONGS_LIMIT, f, ctx); }
+
+static int fetch_window(struct db_conn *db, enum db_stmt query, enum metric_stage stage, int days, int limit, db_row_fn f, void *ctx) {
+  sqlite3_stmt *stmt = db->stmts[query];
+  if (sqlite3_bind_int64(stmt, 1, time(NULL) / 86400 - (days - 1))) {
+    fprintf(stderr, ":: Failed to bind var 1:Day to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    return -1;
+  }
+  return fetch_results(db, query, stage, limit, f, ctx);
+}
 
-void db_free_results(char **results, int n_results) {
-  for (int i = 0; i < n_results; i++) {
-    free(results[i]);
+int db_fetch_window_artists(struct db_conn *db, int days, db_row_fn f, void *ctx) { return fetch_window(db, STMT_WINDOW_ARTISTS, METRIC_FETCH_WINDOW_ARTISTS, days, TOP_LIMIT, f, ctx); }
+int db_fetch_window_albums(struct db_conn *db, int days, db_row_fn f, void *ctx) { return fetch_window(db, STMT_WINDOW_ALBUMS, METRIC_FETCH_WINDOW_ALBUMS, days, TOP_LIMIT, f, ctx); }
+int db_fetch_window_songs(struct db_conn *db, int days, db_row_fn f, void *ctx) { return fetch_window(db, STMT_WINDOW_SONGS, METRIC_FETCH_WINDOW_SONGS, days, TOP_SONGS_LIMIT, f, ctx); }
+int db_fetch_week_albums(struct db_conn *db, db_row_fn f, void *ctx) { return db_fetch_window_albums(db, 7, f, ctx); }
+int db_fetch_month_albums(struct db_conn *db, db_row_fn f, void *ctx) { return db_fetch_window_albums(db, 30, f, ctx); }
+int db_fetch_year_albums(struct db_conn *db, db_row_fn f, void *ctx) { return db_fetch_window_albums(db, 365, f, ctx); }
+
+static int fetch_similar(struct db_conn *db, enum db_stmt query, enum metric_stage stage, enum rank_dim dim, int source_id, int limit,
+    db_row_fn f, void *ctx) {
+  if (db->similar == NULL) {
+    sqlite3_stmt *stmt = db->stmts[query];
+    if (sqlite3_bind_int(stmt, 1, source_id)) {
+      fprintf(stderr, ":: Failed to bind var 1:SourceID to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+      return -1;
+    }
+    return fetch_results(db, query, stage, limit, f, ctx);
   }
-  free(results);
+  long start = metrics_start();
+  int count = similar_each(db->similar, dim, NULL, source_id, limit, f, ctx);
+  metrics_record(stage, start, 1);
+  return count;
+}
+
+int db_fetch_similar_artists(struct db_conn *db, int source_id, db_row_fn f, void *ctx) {
+  return fetch_similar(db, STMT_SIMILAR_ARTISTS, METRIC_FETCH_SIMILAR_ARTISTS, RANK_ARTIST, source_id, TOP_LIMIT, f, ctx);
+}
+int db_fetch_similar_albums(struct db_conn *db, int source_id, db_row_fn f, void *ctx) {
+  return fetch_similar(db, STMT_SIMILAR_ALBUMS, METRIC_FETCH_SIMILAR_ALBUMS, RANK_ALBUM, source_id, TOP_LIMIT, f, ctx);
+}
+
+int db_list_default_limit(enum rank_dim dim) {
+  return dim == RANK_SONG ? TOP_SONGS_LIMIT : TOP_LIMIT;
+}
+
+int db_fetch_list(struct db_conn *db, const struct db_list *list, int source_id, db_row_fn f, void *ctx) {
+  static const enum db_stmt RECENT[N_RANK_DIMS] = {STMT_RECENT_ARTISTS, STMT_RECENT_ALBUMS, STMT_RECENT_SONGS};
+  static const enum db_stmt FREQUENT[N_RANK_DIMS] = {STMT_FREQUENT_ARTISTS, STMT_FREQUENT_ALBUMS, STMT_FREQUENT_SONGS};
+  static const enum db_stmt WINDOW[N_RANK_DIMS] = {STMT_WINDOW_ARTISTS, STMT_WINDOW_ALBUMS, STMT_WINDOW_SONGS};
+  static const enum db_stmt SIMILAR[N_SIMILAR_DIMS] = {STMT_SIMILAR_ARTISTS, STMT_SIMILAR_ALBUMS};
+  static const enum metric_stage RECENT_STAGES[N_RANK_DIMS] = {METRIC_FETCH_RECENT_ARTISTS, METRIC_FETCH_RECENT_ALBUMS, METRIC_FETCH_RECENT_SONGS};
+  static const enum metric_stage FREQUENT_STAGES[N_RANK_DIMS] = {METRIC_FETCH_FREQUENT_ARTISTS, METRIC_FETCH_FREQUENT_ALBUMS, METRIC_FETCH_FREQUENT_SONGS};
+  static const enum metric_stage WINDOW_STAGES[N_RANK_DIMS] = {METRIC_FETCH_WINDOW_ARTISTS, METRIC_FETCH_WINDOW_ALBUMS, METRIC_FETCH_WINDOW_SONGS};
+  static const enum metric_stage SIMILAR_STAGES[N_SIMILAR_DIMS] = {METRIC_FETCH_SIMILAR_ARTISTS, METRIC_FETCH_SIMILAR_ALBUMS};
+  static const enum db_stmt LISTENED[N_RANK_DIMS] = {STMT_LISTENED_ARTISTS, STMT_LISTENED_ALBUMS, STMT_LISTENED_SONGS};
+  static const enum db_stmt WINDOW_LISTENED[N_RANK_DIMS] = {STMT_WINDOW_LISTENED_ARTISTS, STMT_WINDOW_LISTENED_ALBUMS, STMT_WINDOW_LISTENED_SONGS};
+  static const enum metric_stage LISTENED_STAGES[N_RANK_DIMS] = {METRIC_FETCH_LISTENED_ARTISTS, METRIC_FETCH_LISTENED_ALBUMS, METRIC_FETCH_LISTENED_SONGS};
+  enum rank_dim dim = list->dim;
+
+  switch (list->ranking) {
+    case DB_RECENT:
+      return fetch_results(db, RECENT[dim], RECENT_STAGES[dim], list->limit, f, ctx);
+    case DB_FREQUENT:
+      if (list->days > 0) return fetch_window(db, WINDOW[dim], WINDOW_STAGES[dim], list->days, list->limit, f, ctx);
+      return fetch_results(db, FREQUENT[dim], FREQUENT_STAGES[dim], list->limit, f, ctx);
+    case DB_SIMILAR:
+      if (dim >= N_SIMILAR_DIMS) return -1;
+      return fetch_similar(db, SIMILAR[dim], SIMILAR_STAGES[dim], dim, source_id, list->limit, f, ctx);
+    case DB_LISTENED:
+      if (list->days > 0) return fetch_window(db, WINDOW_LISTENED[dim], LISTENED_STAGES[dim], list->days, list->limit, f, ctx);
+      return fetch_results(db, LISTENED[dim], LISTENED_STAGES[dim], list->limit, f, ctx);
+  }
+  return -1;
+}
+
+
+// Reporting
+
+static const enum db_stmt STATS_STMTS[N_RANK_DIMS] = {STMT_ARTIST_STATS, STMT_ALBUM_STATS, STMT_SONG_STATS};
+static const enum db_stmt WINDOW_STATS_STMTS[N_RANK_DIMS] = {STMT_ARTIST_WINDOW_STATS, STMT_ALBUM_WINDOW_STATS, STMT_SONG_WINDOW_STATS};
+
+// Read the two numbers of a one-row query, 0 and 0 if it has none.
+static int get_stats(struct db_conn *db, sqlite3_stmt *stmt, long *plays, long *last) {
+  int rv = 0;
+  *plays = 0;
+  *last = 0;
+  int state = sqlite3_step(stmt);
+  if (state == SQLITE_ROW) {
+    *plays = sqlite3_column_int64(stmt, 0);
+    *last = sqlite3_column_int64(stmt, 1);
+  }
+  else if (state != SQLITE_DONE) {
+    fprintf(stderr, ":: Failed to run query \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    rv = -1;
+  }
+  db_stmt_done(stmt);
+  return rv;
+}
+
+int db_get_stats(struct db_conn *db, enum rank_dim dim, const char *name, long *plays, long *last) {
+  sqlite3_stmt *stmt = db->stmts[STATS_STMTS[dim]];
+  if (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC)) {
+    fprintf(stderr, ":: Failed to bind var 1:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    return -1;
+  }
+  return get_stats(db, stmt, plays, last);
+}
+
+int db_get_window_stats(struct db_conn *db, enum rank_dim dim, const char *name, int days, long *plays, long *last_day) {
+  sqlite3_stmt *stmt = db->stmts[WINDOW_STATS_STMTS[dim]];
+  if (sqlite3_bind_int64(stmt, 1, time(NULL) / 86400 - (days - 1))) {
+    fprintf(stderr, ":: Failed to bind var 1:Day to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    return -1;
+  }
+  if (sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC)) {
+    fprintf(stderr, ":: Failed to bind var 2:Name to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    db_stmt_done(stmt);
+    return -1;
+  }
+  return get_stats(db, stmt, plays, last_day);
+}
+
+static int fetch_breakdown(struct db_conn *db, enum db_stmt query, const char *artist, db_stats_fn f, void *ctx) {
+  sqlite3_stmt *stmt = db->stmts[query];
+  if (sqlite3_bind_text(stmt, 1, artist, -1, SQLITE_STATIC)) {
+    fprintf(stderr, ":: Failed to bind var 1:Artist to stmt \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    return -1;
+  }
+
+  int count = 0;
+  int state;
+  for (state = sqlite3_step(stmt); state == SQLITE_ROW; state = sqlite3_step(stmt)) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 0);
+    count++;
+    if (f(ctx, name != NULL ? name : "", sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2))) {
+      state = SQLITE_DONE;
+      break;
+    }
+  }
+
+  if (state != SQLITE_DONE) {
+    fprintf(stderr, ":: Failed to run query \"%s\": %s\n", sqlite3_sql(stmt), sqlite3_errmsg(db->inner));
+    count = -1;
+  }
+  db_stmt_done(stmt);
+  return count;
+}
+
+int db_fetch_artist_albums(struct db_conn *db, const char *artist, db_stats_fn f, void *ctx) { return fetch_breakdown(db, STMT_ARTIST_ALBUMS, artist, f, ctx); }
+int db_fetch_artist_songs(struct db_conn *db, const char *artist, db_stats_fn f, void *ctx) { return fetch_breakdown(db, STMT_ARTIST_SONGS, artist, f, ctx); }
+
+
+// Rank engine
+
+static const char *STATS_TABLES[N_RANK_DIMS] = {
+  [RANK_ARTIST] = "ArtistStats",
+  [RANK_ALBUM] = "AlbumStats",
+  [RANK_SONG] = "SongStats",
+};
+
+
+int db_load_rank(struct db_conn *db, struct rank *rank) {
+  const char *sql[1 + N_RANK_DIMS] = {
+    "SELECT Song.ID, Artist.Name, Album.Name, Song.Name FROM Song "
+      "INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID;",
+    "SELECT Name, PlayCount - Skips, LastPlayed FROM ArtistStats;",
+    "SELECT Name, PlayCount - Skips, LastPlayed FROM AlbumStats;",
+    "SELECT Name, PlayCount - Skips, LastPlayed FROM SongStats;",
+  };
+  int rv = -1;
+  if (db_exec(db, STMT_BEGIN_READ)) return -1;
+
+  for (int i = 0; i < 1 + N_RANK_DIMS; i++) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db->inner, sql[i], -1, &stmt, NULL)) {
+      fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql[i], sqlite3_errmsg(db->inner));
+      goto _db_load_rank_end;
+    }
+
+    int err = 0, state;
+    for (state = sqlite3_step(stmt); !err && state == SQLITE_ROW; state = sqlite3_step(stmt)) {
+      if (i == 0) {
+        err = rank_add_song(rank, sqlite3_column_int(stmt, 0), (const char *)sqlite3_column_text(stmt, 1),
+            (const char *)sqlite3_column_text(stmt, 2), (const char *)sqlite3_column_text(stmt, 3));
+      }
+      else {
+        err = rank_seed(rank, i - 1, (const char *)sqlite3_column_text(stmt, 0),
+            sqlite3_column_int(stmt, 1), sqlite3_column_int64(stmt, 2));
+      }
+    }
+    if (!err && state != SQLITE_DONE) {
+      fprintf(stderr, ":: Failed to run query \"%s\": %s\n", sql[i], sqlite3_errmsg(db->inner));
+      err = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (err) goto _db_load_rank_end;
+  }
+
+  if (rank_seed_done(rank)) goto _db_load_rank_end;
+  db->rank = rank;
+  rv = 0;
+
+_db_load_rank_end:
+  db_exec(db, STMT_COMMIT);
+  return rv;
+}
+
+
+void db_set_rank(struct db_conn *db, struct rank *rank) {
+  db->rank = rank;
+}
+
+
+// Plays before the engine's last save replayed only to refill the windows.
+#define SIMILAR_REPLAY_MARGIN 256
+
+int db_load_similar(struct db_conn *db, struct similar *similar) {
+  const char *sql[] = {
+    "SELECT Song.ID, Artist.Name, Album.Name FROM Song "
+      "INNER JOIN Album ON Song.AlbumID=Album.ID INNER JOIN Artist ON Album.ArtistID=Artist.ID;",
+    "SELECT Name, Neighbour, Weight FROM ArtistNeighbours ORDER BY Name, Weight DESC;",
+    "SELECT Name, Neighbour, Weight FROM AlbumNeighbours ORDER BY Name, Weight DESC;",
+    "SELECT PlayID FROM SimilarState;",
+    "SELECT rowid, SourceID, Time, SongID FROM Plays WHERE rowid > ? ORDER BY rowid;",
+  };
+  int rv = -1;
+  long through = 0, replayed = 0;
+  if (db_exec(db, STMT_BEGIN_READ)) return -1;
+
+  for (size_t i = 0; i < sizeof(sql) / sizeof(sql[0]); i++) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db->inner, sql[i], -1, &stmt, NULL)) {
+      fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql[i], sqlite3_errmsg(db->inner));
+      goto _db_load_similar_end;
+    }
+    if (i == 4) sqlite3_bind_int64(stmt, 1, through > SIMILAR_REPLAY_MARGIN ? through - SIMILAR_REPLAY_MARGIN : 0);
+
+    int err = 0, state;
+    for (state = sqlite3_step(stmt); !err && state == SQLITE_ROW; state = sqlite3_step(stmt)) {
+      if (i == 0) {
+        err = similar_add_song(similar, sqlite3_column_int(stmt, 0),
+            (const char *)sqlite3_column_text(stmt, 1), (const char *)sqlite3_column_text(stmt, 2));
+      }
+      else if (i <= N_SIMILAR_DIMS) {
+        err = similar_seed(similar, i - 1, (const char *)sqlite3_column_text(stmt, 0),
+            (const char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+      }
+      else if (i == 3) {
+        through = sqlite3_column_int64(stmt, 0);
+      }
+      else {
+        // a play whose song is gone is skipped
+        long play_id = sqlite3_column_int64(stmt, 0);
+        int source_id = sqlite3_column_int(stmt, 1), song_id = sqlite3_column_int(stmt, 3);
+        long time = sqlite3_column_int64(stmt, 2);
+        if (play_id <= through) similar_recall(similar, source_id, song_id, time);
+        else if (similar_play(similar, source_id, song_id, time, play_id) == 0) replayed++;
+      }
+    }
+    if (!err && state != SQLITE_DONE) {
+      fprintf(stderr, ":: Failed to run query \"%s\": %s\n", sql[i], sqlite3_errmsg(db->inner));
+      err = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (err) goto _db_load_similar_end;
+  }
+
+  if (replayed > 0) fprintf(stderr, ":: Similar: counted %ld plays since the last save\n", replayed);
+  db->similar = similar;
+  rv = 0;
+
+_db_load_similar_end:
+  db_exec(db, STMT_COMMIT);
+  return rv;
+}
+
+
+void db_set_similar(struct db_conn *db, struct similar *similar) {
+  db->similar = similar;
+}
+
+
+struct check_ctx {
+  struct db_conn *db;
+  enum rank_dim dim;
+  enum rank_order order;
+  sqlite3_stmt *get;
+  long keys[TOP_SONGS_LIMIT];
+  int n;
+  int mismatches;
+};
+
+// Compare one name from the engine with its row in the stats table.
+static int check_row(void *arg, const char *name) {
+  struct check_ctx *ctx = arg;
+  unsigned count = 0;
+  long last = 0;
+  rank_get(ctx->db->rank, ctx->dim, name, &count, &last);
+
+  sqlite3_bind_text(ctx->get, 1, name, -1, SQLITE_STATIC);
+  if (sqlite3_step(ctx->get) != SQLITE_ROW) {
+    fprintf(stderr, ":: Rank: \"%s\" is not in %s\n", name, STATS_TABLES[ctx->dim]);
+    ctx->mismatches++;
+  }
+  else if ((unsigned)sqlite3_column_int(ctx->get, 0) != count || sqlite3_column_int64(ctx->get, 1) != last) {
+    fprintf(stderr, ":: Rank: \"%s\" has %u plays, last %ld, but %s has %d, last %lld\n", name, count, last,
+        STATS_TABLES[ctx->dim], sqlite3_column_int(ctx->get, 0), (long long)sqlite3_column_int64(ctx->get, 1));
+    ctx->mismatches++;
+  }
+  db_stmt_done(ctx->get);
+
+  ctx->keys[ctx->n++] = ctx->order == RANK_FREQUENT ? (long)count : last;
+  return 0;
+}
+
+
+long db_export(struct db_conn *db, const struct db_export_fn *fn, void *ctx) {
+  const char *names_sql[N_RANK_DIMS + 1] = {
+    [RANK_ARTIST] = "SELECT ID, 0, Name FROM Artist ORDER BY ID;",
+    [RANK_ALBUM] = "SELECT ID, ArtistID, Name FROM Album ORDER BY ID;",
+    [RANK_SONG] = "SELECT ID, AlbumID, Name FROM Song ORDER BY ID;",
+    [N_RANK_DIMS] = "SELECT ID, 0, Name FROM Source ORDER BY ID;",
+  };
+  const char *count_sql = "SELECT COUNT(*) FROM Plays;";
+  const char *plays_sql = "SELECT Time, SongID, IFNULL(SourceID, 0), IFNULL(ListenedMs, -1) FROM Plays ORDER BY Time;";
+  long rv = -1, n = 0;
+  if (db_exec(db, STMT_BEGIN_READ)) return -1;
+
+  for (int i = 0; i < N_RANK_DIMS + 3; i++) {
+    const char *sql = i <= N_RANK_DIMS ? names_sql[i] : i == N_RANK_DIMS + 1 ? count_sql : plays_sql;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db->inner, sql, -1, &stmt, NULL)) {
+      fprintf(stderr, ":: Failed to prep stmt \"%s\": %s\n", sql, sqlite3_errmsg(db->inner));
+      goto _db_export_end;
+    }
+
+    int err = 0, state;
+    for (state = sqlite3_step(stmt); !err && state == SQLITE_ROW; state = sqlite3_step(stmt)) {
+      if (i <= N_RANK_DIMS) {
+        err = fn->name(ctx, i, sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
+            (const char *)sqlite3_column_text(stmt, 2));
+      }
+      else if (i == N_RANK_DIMS + 1) {
+        err = fn->begin_plays(ctx, sqlite3_column_int64(stmt, 0));
+      }
+      else {
+        struct db_play_row play = {
+          .played_at = sqlite3_column_int64(stmt, 0),
+          .song_id = sqlite3_column_int(stmt, 1),
+          .source_id = sqlite3_column_int(stmt, 2),
+          .listened_ms = sqlite3_column_int64(stmt, 3),
+        };
+        err = fn->play(ctx, &play);
+        n++;
+      }
+    }
+    if (!err && state != SQLITE_DONE) {
+      fprintf(stderr, ":: Failed to run query \"%s\": %s\n", sql, sqlite3_errmsg(db->inner));
+      err = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (err) goto _db_export_end;
+  }
+  rv = n;
+
+_db_export_end:
+  db_exec(db, STMT_COMMIT);
+  return rv;
+}
+
+
+int db_check_rank(struct db_conn *db) {
+  static const enum db_stmt queries[] = {
+    STMT_RECENT_ARTISTS, STMT_RECENT_ALBUMS, STMT_RECENT_SONGS,
+    STMT_FREQUENT_ARTISTS, STMT_FREQUENT_ALBUMS, STMT_FREQUENT_SONGS,
+  };
+  if (db->rank == NULL) return -1;
+
+  int mismatches = 0;
+  if (db_begin_read(db)) return -1;
+
+  for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+    struct check_ctx ctx = {.db = db, .dim = RANK_QUERIES[queries[q]].dim, .order = RANK_QUERIES[queries[q]].order};
+    const char *key = ctx.order == RANK_FREQUENT ? "PlayCount - Skips" : "LastPlayed";
+    char get_sql[128], keys_sql[128], size_sql[128];
+    snprintf(get_sql, sizeof(get_sql), "SELECT PlayCount - Skips, LastPlayed FROM %s WHERE Name=?;", STATS_TABLES[ctx.dim]);
+    snprintf(keys_sql, sizeof(keys_sql), "SELECT %s FROM %s ORDER BY %s DESC LIMIT %d;",
+        key, STATS_TABLES[ctx.dim], key, RANK_QUERIES[queries[q]].limit);
+    snprintf(size_sql, sizeof(size_sql), "SELECT COUNT(*) FROM %s;", STATS_TABLES[ctx.dim]);
+
+    sqlite3_stmt *keys = NULL, *size = NULL;
+    if (sqlite3_prepare_v2(db->inner, get_sql, -1, &ctx.get, NULL)
+        || sqlite3_prepare_v2(db->inner, keys_sql, -1, &keys, NULL)
+        || sqlite3_prepare_v2(db->inner, size_sql, -1, &size, NULL)) {
+      fprintf(stderr, ":: Rank: failed to prep check: %s\n", sqlite3_errmsg(db->inner));
+      mismatches = -1;
+    }
+    else {
+      // each name listed must match its row, and the list must be in the
+      // same order of keys as SQL's, whatever order ties come in
+      rank_each(db->rank, ctx.dim, ctx.order, RANK_QUERIES[queries[q]].limit, check_row, &ctx);
+      mismatches += ctx.mismatches;
+
+      int n = 0;
+      while (sqlite3_step(keys) == SQLITE_ROW) {
+        if (n >= ctx.n || sqlite3_column_int64(keys, 0) != ctx.keys[n]) {
+          fprintf(stderr, ":: Rank: %s differs from \"%s\" at row %d\n", sqlite3_sql(db->stmts[queries[q]]), keys_sql, n);
+          mismatches++;
+          break;
+        }
+        n++;
+      }
+      if (n < ctx.n) {
+        fprintf(stderr, ":: Rank: %d rows for \"%s\", SQL has %d\n", ctx.n, sqlite3_sql(db->stmts[queries[q]]), n);
+        mismatches++;
+      }
+
+      if (sqlite3_step(size) == SQLITE_ROW && sqlite3_column_int(size, 0) != rank_size(db->rank, ctx.dim)) {
+        fprintf(stderr, ":: Rank: %d names played, %s has %d\n", rank_size(db->rank, ctx.dim), STATS_TABLES[ctx.dim], sqlite3_column_int(size, 0));
+        mismatches++;
+      }
+    }
+
+    sqlite3_finalize(ctx.get);
+    sqlite3_finalize(keys);
+    sqlite3_finalize(size);
+    if (mismatches < 0) break;
+  }
+
+  db_end_read(db);
+  return mismatches;
 }
@@ -1,16 +1,190 @@
 #pragma once
 
+#include "rank.h"
+
 struct db_conn;
+struct similar;
+
+struct db_config {
+  // NULL for ~/.mpd_stats.db
+  const char *path;
+  // PRAGMA synchronous for the writer: OFF, NORMAL, FULL or EXTRA
+  const char *synchronous;
+  int busy_timeout_ms;
+  // fold plays older than this many days into daily aggregates, 0 to keep
+  // them all
+  int retention_days;
+};
 
-struct db_conn *db_init();
+// A read-only connection skips schema setup: open the writer first.
+struct db_conn *db_init(const struct db_config *config, int readonly);
 void db_free(struct db_conn *conn);
-int db_add_play(struct db_conn *conn, const char *title, const char *artist, const char *album, int mpd_song_id);
+// ID of the Source row with this name, added if new.
+int db_source(struct db_conn *conn, const char *name);
+
+struct db_play {
+  int source_id;
+  const char *title;
+  const char *artist;
+  const char *album;
+  // the song's id in that server's queue
+  int mpd_song_id;
+  // unix time
+  long played_at;
+  // rather than a new play, the end of the song's play at played_at:
+  // how long it was listened to and whether it was skipped. The tags are
+  // not used.
+  int ended;
+  long listened_ms;
+  int skipped;
+};
+
+// db_add_plays() result when a play breaks a constraint of the schema, so
+// that trying it again can't succeed
+#define DB_REFUSED -2
+
+// Record plays and play ends in one transaction, in order, along with how
+// far through the play journal they reach unless journal_generation is 0.
+// With no plays, only moves the journal position. 0, DB_REFUSED, or -1 on
+// any other error.
+int db_add_plays(struct db_conn *conn, const struct db_play *plays, int n, long journal_generation, long journal_offset);
+// Keep a play db_add_plays() just refused in RefusedPlays, with the reason,
+// and move the journal position past it in the same transaction.
+int db_refuse_play(struct db_conn *conn, const struct db_play *play, long journal_generation, long journal_offset);
+// Record a play on a source now.
+int db_add_play(struct db_conn *conn, int source_id, const char *title, const char *artist, const char *album, int mpd_song_id);
+// Journal position last committed by db_add_plays(), 0 and 0 if none.
+int db_journal_position(struct db_conn *conn, long *generation, long *offset);
+// Copy the WAL into the database file. 0 only if all of it was, so that
+// everything committed so far is synced.
+int db_checkpoint(struct db_conn *conn);
+// Path of the database file.
+const char *db_filename(struct db_conn *conn);
+
+#define DB_ROLLUP_DAYS 366
+// plays folded and pages vacuumed by each db_maintain()
+#define DB_MAINTAIN_PLAYS 2000
+#define DB_MAINTAIN_PAGES 256
+// Save what the similarity engine learnt since the last call, then one small
+// step of retention: fold a few expired plays into PlaysArchive, keeping the
+// all-time stats as they are, drop a day of rollups older than any window,
+// and give a few free pages back.
+// Returns 1 if there may be more to do, 0 if not, -1 on error.
+int db_maintain(struct db_conn *conn);
+
+// Bulk loading of plays with their original times. Artist, album and song IDs
+// are resolved in memory, and plays are committed batch plays at a time.
+// defer_index instead loads everything in one transaction without the stats
+// trigger and indexes, then rebuilds the stats and indexes once at the end.
+struct db_import;
+struct db_import *db_import_begin(struct db_conn *conn, int source_id, long batch, int defer_index);
+int db_import_play(struct db_import *import, const char *artist, const char *album, const char *title, long played_at);
+// Commit what is left, or roll it back if !commit. Frees import.
+int db_import_end(struct db_import *import, int commit);
+
+// Queries between these all see the same snapshot of the database. End
+// only a read that began, db_begin_read() returning 0.
+int db_begin_read(struct db_conn *db);
+int db_end_read(struct db_conn *db);
+
+// Called for each row of a query, in order. The name is only valid during
+// the call. Return non-zero to stop early.
+typedef int (*db_row_fn)(void *ctx, const char *name);
+
+// Stream the rows of a query to f. Returns the number of rows seen, -1 on
+// error.
+int db_fetch_recent_songs(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_recent_artists(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_recent_albums(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_frequent_songs(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_frequent_artists(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_frequent_albums(struct db_conn *db, db_row_fn f, void *ctx);
+// Most played over the last `days` days, today included, summed from daily
+// rollups: the cost grows with the window, not the history. With a retention
+// period only the last DB_ROLLUP_DAYS days of rollups are kept.
+int db_fetch_window_artists(struct db_conn *db, int days, db_row_fn f, void *ctx);
+int db_fetch_window_albums(struct db_conn *db, int days, db_row_fn f, void *ctx);
+int db_fetch_window_songs(struct db_conn *db, int days, db_row_fn f, void *ctx);
+// The last 7, 30 and 365 days.
+int db_fetch_week_albums(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_month_albums(struct db_conn *db, db_row_fn f, void *ctx);
+int db_fetch_year_albums(struct db_conn *db, db_row_fn f, void *ctx);
+// Artists and albums most played near the one last played on a source, from
+// the similarity engine or, without it, as it last saved them.
+int db_fetch_similar_artists(struct db_conn *db, int source_id, db_row_fn f, void *ctx);
+int db_fetch_similar_albums(struct db_conn *db, int source_id, db_row_fn f, void *ctx);
+
+enum db_ranking {
+  DB_RECENT,
+  DB_FREQUENT,
+  DB_SIMILAR,
+  // by the total time listened, so skips count for little
+  DB_LISTENED,
+};
+
+// Any of the lists above: the first `limit` artists, albums or songs by a
+// ranking, over the last `days` days for DB_FREQUENT and DB_LISTENED if not
+// 0. DB_SIMILAR has no songs.
+struct db_list {
+  enum db_ranking ranking;
+  enum rank_dim dim;
+  int days;
+  int limit;
+};
+// The limit of the fixed lists above: 10, or 100 songs.
+int db_list_default_limit(enum rank_dim dim);
+// DB_SIMILAR follows what was last played on source_id.
+int db_fetch_list(struct db_conn *db, const struct db_list *list, int source_id, db_row_fn f, void *ctx);
+
+// Play count and last play (a unix time) of a name, all time. 0 and 0 for a
+// name never played.
+int db_get_stats(struct db_conn *db, enum rank_dim dim, const char *name, long *plays, long *last);
+// Plays of a name over the last `days` days, and the last day (since the
+// epoch, UTC) of those it was played on.
+int db_get_window_stats(struct db_conn *db, enum rank_dim dim, const char *name, int days, long *plays, long *last_day);
+
+// Like db_row_fn, with the name's play count and last play.
+typedef int (*db_stats_fn)(void *ctx, const char *name, long plays, long last);
+// An artist's albums or songs, most played first, over all plays kept and
+// archived. Returns the number of rows seen, -1 on error.
+int db_fetch_artist_albums(struct db_conn *db, const char *artist, db_stats_fn f, void *ctx);
+int db_fetch_artist_songs(struct db_conn *db, const char *artist, db_stats_fn f, void *ctx);
+
+// Load every song and the *Stats totals into rank, then answer the top-list
+// queries above from it. Plays added through this connection update it.
+int db_load_rank(struct db_conn *db, struct rank *rank);
+// Share a rank loaded through another connection.
+void db_set_rank(struct db_conn *db, struct rank *rank);
+// Load the similarity engine's saved neighbours and every song, then count
+// the plays since its last save; plays added through this connection update
+// it, and db_maintain() saves it.
+int db_load_similar(struct db_conn *db, struct similar *similar);
+// Share a similarity engine loaded through another connection.
+void db_set_similar(struct db_conn *db, struct similar *similar);
+// Save what db_maintain() has not yet. Returns the number of lists written.
+int db_save_similar(struct db_conn *db);
+// A kept play as exported: its song and source (0 for plays from before
+// sources) by ID, and how long it was listened to, -1 if unknown.
+struct db_play_row {
+  long played_at;
+  int song_id;
+  int source_id;
+  long listened_ms;
+};
 
-void db_free_results(char **results, int n_results);
-int db_fetch_recent_songs(struct db_conn *db, char ***results);
-int db_fetch_recent_artists(struct db_conn *db, char ***results);
-int db_fetch_recent_albums(struct db_conn *db, char ***results);
-int db_fetch_frequent_songs(struct db_conn *db, char ***results);
-int db_fetch_frequent_artists(struct db_conn *db, char ***results);
-int db_fetch_frequent_albums(struct db_conn *db, char ***results);
+// What db_export() streams, in this order: every artist, album, song and
+// source (table being the rank_dim, N_RANK_DIMS for sources) by ID, with the
+// ID of its artist or album (0 for artists and sources); then the number of
+// plays; then each play by time. Return non-zero to stop.
+struct db_export_fn {
+  int (*name)(void *ctx, int table, int id, int parent_id, const char *name);
+  int (*begin_plays)(void *ctx, long n);
+  int (*play)(void *ctx, const struct db_play_row *play);
+};
+// Stream the whole history, from one snapshot. Plays folded into PlaysArchive
+// are not included. Returns the number of plays seen, -1 on error.
+long db_export(struct db_conn *db, const struct db_export_fn *fn, void *ctx);
 
+// Compare the rank engine's top lists with the *Stats tables. Returns the
+// number of mismatches, -1 on error.
+int db_check_rank(struct db_conn *db);
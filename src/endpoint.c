@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "endpoint.h"
+
+
+int endpoint_parse(struct mpd_endpoint *endpoint, const char *spec) {
+  const char *env_port = NULL;
+  if (spec == NULL) {
+    spec = getenv("MPD_HOST");
+    env_port = getenv("MPD_PORT");
+    if (spec == NULL || *spec == 0) spec = "localhost";
+  }
+  memset(endpoint, 0, sizeof(struct mpd_endpoint));
+
+  // a socket path may itself contain '@', so only look before the first '/'
+  const char *at = strchr(spec, '@');
+  const char *slash = strchr(spec, '/');
+  if (at != NULL && (slash == NULL || at < slash)) {
+    size_t len = at - spec;
+    // never echo the password back in an error
+    spec = at + 1;
+    if (len >= sizeof(endpoint->password)) goto _endpoint_parse_err;
+    memcpy(endpoint->password, at - len, len);
+  }
+
+  const char *host = spec;
+  size_t host_len = strlen(spec);
+  const char *port = env_port;
+
+  if (*spec != '/') {
+    // "[v6 address]:port" or "host:port"; a bare v6 address has no port
+    const char *colon = strrchr(spec, ':');
+    if (*spec == '[') {
+      const char *close = strchr(spec, ']');
+      if (close == NULL) goto _endpoint_parse_err;
+      host = spec + 1;
+      host_len = close - host;
+      if (close[1] == ':') port = close + 2;
+      else if (close[1] != 0) goto _endpoint_parse_err;
+    }
+    else if (colon != NULL && strchr(spec, ':') == colon) {
+      host_len = colon - spec;
+      port = colon + 1;
+    }
+
+    endpoint->port = ENDPOINT_DEFAULT_PORT;
+    if (port != NULL) {
+      char *end = NULL;
+      long n = strtol(port, &end, 10);
+      if (end == port || *end != 0 || n <= 0 || n > 65535) goto _endpoint_parse_err;
+      endpoint->port = n;
+    }
+  }
+
+  if (host_len == 0 || host_len >= sizeof(endpoint->host)) goto _endpoint_parse_err;
+  memcpy(endpoint->host, host, host_len);
+
+  if (endpoint->port == 0) {
+    snprintf(endpoint->name, sizeof(endpoint->name), "%s", endpoint->host);
+  }
+  else if (strchr(endpoint->host, ':') != NULL) {
+    snprintf(endpoint->name, sizeof(endpoint->name), "[%s]:%u", endpoint->host, endpoint->port);
+  }
+  else {
+    snprintf(endpoint->name, sizeof(endpoint->name), "%s:%u", endpoint->host, endpoint->port);
+  }
+  return 0;
+
+_endpoint_parse_err:
+  fprintf(stderr, ":: Invalid MPD address \"%s\"\n", spec);
+  return -1;
+}
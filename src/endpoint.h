@@ -0,0 +1,20 @@
+#pragma once
+
+#define ENDPOINT_DEFAULT_PORT 6600
+
+// One MPD server, given as "[password@]host[:port]" or
+// "[password@]/path/to/socket".
+struct mpd_endpoint {
+  // host:port or the socket path, without the password: plays are recorded
+  // with this as their source
+  char name[320];
+  char host[256];
+  // 0 for a Unix socket
+  unsigned port;
+  // empty for none
+  char password[128];
+};
+
+// A NULL spec reads MPD_HOST and MPD_PORT like libmpdclient does, falling
+// back to localhost:6600.
+int endpoint_parse(struct mpd_endpoint *endpoint, const char *spec);
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "idcache.h"
+#include "strpool.h"
+
+// MPD song ids are small (bounded by the queue length), so they index an
+// array directly; anything larger is simply not cached.
+#define ID_CACHE_MAX_MPD_ID (1 << 20)
+// source IDs index the per-source song maps the same way
+#define ID_CACHE_MAX_SOURCE_ID 1024
+
+struct id_map {
+  int *ids;
+  int cap;
+};
+
+struct song_slot {
+  int id;
+  uint64_t tags;
+};
+
+// one per source, by MPD song id
+struct song_map {
+  struct song_slot *slots;
+  int cap;
+};
+
+struct id_cache {
+  struct strpool *artists;
+  struct id_map artist_ids;
+  struct strpool *albums;
+  struct id_map album_ids;
+  // one per source ID
+  struct song_map *songs;
+  int n_sources;
+};
+
+
+static int id_map_get(const struct id_map *map, int key) {
+  if (key < 0 || key >= map->cap) return -1;
+  return map->ids[key];
+}
+
+
+static int id_map_put(struct id_map *map, int key, int id) {
+  if (key < 0) return -1;
+
+  if (key >= map->cap) {
+    int cap = map->cap ? map->cap : 256;
+    while (cap <= key) cap *= 2;
+    int *ids = realloc(map->ids, cap * sizeof(int));
+    if (ids == NULL) return -1;
+    memset(&ids[map->cap], 0xff, (cap - map->cap) * sizeof(int));
+    map->ids = ids;
+    map->cap = cap;
+  }
+
+  map->ids[key] = id;
+  return 0;
+}
+
+
+struct id_cache *id_cache_new(void) {
+  struct id_cache *cache = calloc(1, sizeof(struct id_cache));
+  if (cache == NULL) return NULL;
+
+  cache->artists = strpool_new();
+  cache->albums = strpool_new();
+  if (cache->artists == NULL || cache->albums == NULL) {
+    id_cache_free(cache);
+    return NULL;
+  }
+
+  return cache;
+}
+
+
+void id_cache_free(struct id_cache *cache) {
+  if (cache == NULL) return;
+
+  strpool_free(cache->artists);
+  strpool_free(cache->albums);
+  free(cache->artist_ids.ids);
+  free(cache->album_ids.ids);
+  for (int i = 0; i < cache->n_sources; i++) free(cache->songs[i].slots);
+  free(cache->songs);
+  free(cache);
+}
+
+
+// Albums are keyed on "<artist id>\x1f<album name>". Returns a buffer to free
+// if buf was too small.
+static char *album_key(char *buf, size_t size, int artist_id, const char *album) {
+  int n = snprintf(buf, size, "%d\x1f%s", artist_id, album);
+  if (n < 0) return NULL;
+  if ((size_t)n < size) return buf;
+
+  char *key = malloc(n + 1);
+  if (key != NULL) snprintf(key, n + 1, "%d\x1f%s", artist_id, album);
+  return key;
+}
+
+
+int id_cache_artist(const struct id_cache *cache, const char *artist) {
+  return id_map_get(&cache->artist_ids, strpool_find(cache->artists, artist));
+}
+
+
+int id_cache_album(const struct id_cache *cache, int artist_id, const char *album) {
+  char buf[256];
+  char *key = album_key(buf, sizeof(buf), artist_id, album);
+  if (key == NULL) return -1;
+
+  int id = id_map_get(&cache->album_ids, strpool_find(cache->albums, key));
+  if (key != buf) free(key);
+  return id;
+}
+
+
+int id_cache_song(const struct id_cache *cache, int source_id, int mpd_song_id, uint64_t tags) {
+  if (source_id < 0 || source_id >= cache->n_sources) return -1;
+  const struct song_map *map = &cache->songs[source_id];
+  if (mpd_song_id < 0 || mpd_song_id >= map->cap || map->slots[mpd_song_id].tags != tags) return -1;
+  return map->slots[mpd_song_id].id;
+}
+
+
+// FNV-1a over the tags, each with its terminating zero.
+uint64_t id_cache_tags(const char *title, const char *artist, const char *album) {
+  const char *tags[] = {title, artist, album};
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < 3; i++) {
+    for (const unsigned char *p = (const unsigned char *)(tags[i] != NULL ? tags[i] : ""); ; p++) {
+      hash = (hash ^ *p) * 1099511628211ull;
+      if (!*p) break;
+    }
+  }
+  return hash;
+}
+
+
+int id_cache_put_artist(struct id_cache *cache, const char *artist, int id) {
+  return id_map_put(&cache->artist_ids, strpool_intern(cache->artists, artist), id);
+}
+
+
+int id_cache_put_album(struct id_cache *cache, int artist_id, const char *album, int id) {
+  char buf[256];
+  char *key = album_key(buf, sizeof(buf), artist_id, album);
+  if (key == NULL) return -1;
+
+  int rv = id_map_put(&cache->album_ids, strpool_intern(cache->albums, key), id);
+  if (key != buf) free(key);
+  return rv;
+}
+
+
+int id_cache_put_song(struct id_cache *cache, int source_id, int mpd_song_id, uint64_t tags, int id) {
+  if (source_id < 0 || source_id >= ID_CACHE_MAX_SOURCE_ID || mpd_song_id < 0 || mpd_song_id >= ID_CACHE_MAX_MPD_ID) return 0;
+
+  if (source_id >= cache->n_sources) {
+    struct song_map *maps = realloc(cache->songs, (source_id + 1) * sizeof(struct song_map));
+    if (maps == NULL) return -1;
+    memset(&maps[cache->n_sources], 0, (source_id + 1 - cache->n_sources) * sizeof(struct song_map));
+    cache->songs = maps;
+    cache->n_sources = source_id + 1;
+  }
+
+  struct song_map *map = &cache->songs[source_id];
+  if (mpd_song_id >= map->cap) {
+    int cap = map->cap ? map->cap : 256;
+    while (cap <= mpd_song_id) cap *= 2;
+    struct song_slot *slots = realloc(map->slots, cap * sizeof(struct song_slot));
+    if (slots == NULL) return -1;
+    memset(&slots[map->cap], 0xff, (cap - map->cap) * sizeof(struct song_slot));
+    map->slots = slots;
+    map->cap = cap;
+  }
+  map->slots[mpd_song_id] = (struct song_slot){.id = id, .tags = tags};
+  return 0;
+}
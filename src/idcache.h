@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+// In-memory map from what MPD reports to database row IDs: artist name to
+// Artist.ID, (artist ID, album name) to Album.ID and (source ID, MPD song id)
+// to Song.ID. MPD song ids are per queue entry and start over when the queue
+// is cleared or MPD restarts, so each song id is kept with a hash of the
+// tags it was seen with, and only found again with the same tags.
+struct id_cache;
+
+struct id_cache *id_cache_new(void);
+void id_cache_free(struct id_cache *cache);
+
+// Row ID, or -1 if not cached.
+int id_cache_artist(const struct id_cache *cache, const char *artist);
+int id_cache_album(const struct id_cache *cache, int artist_id, const char *album);
+int id_cache_song(const struct id_cache *cache, int source_id, int mpd_song_id, uint64_t tags);
+uint64_t id_cache_tags(const char *title, const char *artist, const char *album);
+
+// Return -1 if out of memory.
+int id_cache_put_artist(struct id_cache *cache, const char *artist, int id);
+int id_cache_put_album(struct id_cache *cache, int artist_id, const char *album, int id);
+int id_cache_put_song(struct id_cache *cache, int source_id, int mpd_song_id, uint64_t tags, int id);
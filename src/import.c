@@ -0,0 +1,695 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <mpd/client.h>
+
+#include "import.h"
+#include "strpool.h"
+
+struct import_tags {
+  struct strpool *uris;
+  struct strpool *values;
+  // artist, album and title value ids of each URI
+  int (*songs)[3];
+  int cap;
+};
+
+struct play {
+  long time;
+  const char *artist;
+  const char *album;
+  const char *title;
+};
+
+static const enum mpd_tag_type PLAY_TAGS[] = {MPD_TAG_ARTIST, MPD_TAG_ALBUM, MPD_TAG_TITLE};
+
+static const char MONTHS[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+
+// Song tags
+
+static int tags_add_song(struct import_tags *tags, const struct mpd_song *song) {
+  int id = strpool_intern(tags->uris, mpd_song_get_uri(song));
+  if (id < 0) return -1;
+  if (id >= tags->cap) {
+    int cap = tags->cap ? tags->cap * 2 : 1024;
+    void *songs = realloc(tags->songs, cap * sizeof(tags->songs[0]));
+    if (songs == NULL) return -1;
+    tags->songs = songs;
+    tags->cap = cap;
+  }
+
+  for (int t = 0; t < 3; t++) {
+    const char *value = mpd_song_get_tag(song, PLAY_TAGS[t], 0);
+    tags->songs[id][t] = strpool_intern(tags->values, value ? value : "");
+    if (tags->songs[id][t] < 0) return -1;
+  }
+  return 0;
+}
+
+
+struct import_tags *import_tags_load(const struct mpd_endpoint *endpoint) {
+  struct import_tags *tags = calloc(1, sizeof(struct import_tags));
+  if (tags == NULL) return NULL;
+  tags->uris = strpool_new();
+  tags->values = strpool_new();
+  struct mpd_connection *mpd = mpd_connection_new(endpoint->host, endpoint->port, 0);
+  if (tags->uris == NULL || tags->values == NULL || mpd == NULL) goto _import_tags_load_err;
+
+  if (mpd_connection_get_error(mpd) == MPD_ERROR_SUCCESS && endpoint->password[0]) {
+    mpd_run_password(mpd, endpoint->password);
+  }
+  if (mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS || !mpd_send_list_all_meta(mpd, "")) goto _import_tags_load_mpd_err;
+
+  int failed = 0;
+  struct mpd_entity *entity;
+  while ((entity = mpd_recv_entity(mpd)) != NULL) {
+    if (!failed && mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+      failed = tags_add_song(tags, mpd_entity_get_song(entity));
+    }
+    mpd_entity_free(entity);
+  }
+  if (!mpd_response_finish(mpd)) goto _import_tags_load_mpd_err;
+  if (failed) goto _import_tags_load_err;
+
+  mpd_connection_free(mpd);
+  return tags;
+
+_import_tags_load_mpd_err:
+  fprintf(stderr, ":: Failed to read the MPD database of %s: %s\n", endpoint->name, mpd_connection_get_error_message(mpd));
+_import_tags_load_err:
+  if (mpd != NULL) mpd_connection_free(mpd);
+  import_tags_free(tags);
+  return NULL;
+}
+
+
+void import_tags_free(struct import_tags *tags) {
+  if (tags == NULL) return;
+  strpool_free(tags->uris);
+  strpool_free(tags->values);
+  free(tags->songs);
+  free(tags);
+}
+
+
+// Artist/Album/[NN ]Title.ext, in place. Missing directories leave the artist
+// or album empty.
+static void tags_from_path(char *uri, struct play *play) {
+  play->artist = "";
+  play->album = "";
+
+  char *title = strrchr(uri, '/');
+  if (title != NULL) {
+    *title++ = '\0';
+    char *album = strrchr(uri, '/');
+    if (album != NULL) {
+      *album++ = '\0';
+      char *artist = strrchr(uri, '/');
+      play->artist = artist ? artist + 1 : uri;
+      play->album = album;
+    } else {
+      play->album = uri;
+    }
+  } else {
+    title = uri;
+  }
+
+  char *ext = strrchr(title, '.');
+  if (ext != NULL && ext != title) *ext = '\0';
+
+  // a track number, and whatever separates it from the title
+  char *p = title;
+  while (*p >= '0' && *p <= '9' && p - title < 3) p++;
+  if (p != title) {
+    while (*p == ' ' || *p == '-' || *p == '.' || *p == '_') p++;
+    if (*p != '\0') title = p;
+  }
+  play->title = title;
+}
+
+
+static void tags_from_uri(const struct import_tags *tags, char *uri, struct play *play) {
+  int id = tags ? strpool_find(tags->uris, uri) : -1;
+  if (id < 0) {
+    tags_from_path(uri, play);
+    return;
+  }
+  play->artist = strpool_get(tags->values, tags->songs[id][0]);
+  play->album = strpool_get(tags->values, tags->songs[id][1]);
+  play->title = strpool_get(tags->values, tags->songs[id][2]);
+}
+
+
+
+// Times
+
+// Exactly n digits, or -1.
+static int digits(const char **p, int n) {
+  int v = 0;
+  for (int i = 0; i < n; i++) {
+    if ((*p)[i] < '0' || (*p)[i] > '9') return -1;
+    v = v * 10 + (*p)[i] - '0';
+  }
+  *p += n;
+  return v;
+}
+
+
+// Unix seconds, or ISO 8601 "YYYY-MM-DD[T ]HH:MM[:SS[.fff]]", in local time
+// unless followed by Z or an offset. *end is set past what was read.
+static int parse_time(const char *s, const char **end, long *t) {
+  const char *p = s;
+  while (*p >= '0' && *p <= '9') p++;
+  if (p != s && *p != '-') {
+    *t = strtol(s, NULL, 10);
+    *end = p;
+    return 0;
+  }
+
+  p = s;
+  struct tm tm = {0};
+  int year = digits(&p, 4);
+  if (year < 0 || *p++ != '-') return -1;
+  int month = digits(&p, 2);
+  if (month < 1 || *p++ != '-') return -1;
+  tm.tm_mday = digits(&p, 2);
+  if (tm.tm_mday < 1 || (*p != 'T' && *p != ' ')) return -1;
+  p++;
+  tm.tm_hour = digits(&p, 2);
+  if (tm.tm_hour < 0 || *p++ != ':') return -1;
+  tm.tm_min = digits(&p, 2);
+  if (tm.tm_min < 0) return -1;
+  if (*p == ':') {
+    p++;
+    tm.tm_sec = digits(&p, 2);
+    if (tm.tm_sec < 0) return -1;
+    if (*p == '.' || *p == ',') {
+      p++;
+      while (*p >= '0' && *p <= '9') p++;
+    }
+  }
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+
+  if (*p == 'Z') {
+    *t = timegm(&tm);
+    p++;
+  } else if (*p == '+' || *p == '-') {
+    int sign = *p++ == '-' ? -1 : 1;
+    int hours = digits(&p, 2);
+    if (*p == ':') p++;
+    int minutes = digits(&p, 2);
+    if (hours < 0 || minutes < 0) return -1;
+    *t = timegm(&tm) - sign * (hours * 3600L + minutes * 60L);
+  } else {
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+  }
+  *end = p;
+  return 0;
+}
+
+
+// A whole field holding a time, surrounding spaces aside.
+static int parse_time_field(const char *s, long *t) {
+  while (*s == ' ') s++;
+  const char *end;
+  if (parse_time(s, &end, t)) return -1;
+  while (*end == ' ') end++;
+  return *end == '\0' ? 0 : -1;
+}
+
+
+// Syslog's "Mon DD HH:MM[:SS]" in local time, which has no year: the latest
+// one not after now is assumed.
+static int parse_syslog_time(const char *s, long now, long *t) {
+  struct tm tm = {0};
+  tm.tm_mon = -1;
+  for (int i = 0; i < 12; i++) {
+    if (strncmp(s, MONTHS[i], 3) == 0) tm.tm_mon = i;
+  }
+  if (tm.tm_mon < 0 || s[3] != ' ') return -1;
+
+  const char *p = s + 4;
+  if (*p == ' ') p++;
+  tm.tm_mday = 0;
+  while (*p >= '0' && *p <= '9') tm.tm_mday = tm.tm_mday * 10 + *p++ - '0';
+  if (tm.tm_mday < 1 || tm.tm_mday > 31 || *p++ != ' ') return -1;
+  tm.tm_hour = digits(&p, 2);
+  if (tm.tm_hour < 0 || *p++ != ':') return -1;
+  tm.tm_min = digits(&p, 2);
+  if (tm.tm_min < 0) return -1;
+  if (*p == ':') {
+    p++;
+    tm.tm_sec = digits(&p, 2);
+    if (tm.tm_sec < 0) return -1;
+  }
+
+  time_t today = now;
+  struct tm local;
+  localtime_r(&today, &local);
+  tm.tm_year = local.tm_year;
+  tm.tm_isdst = -1;
+  struct tm copy = tm;
+  *t = mktime(&copy);
+  // a day's grace for clock differences
+  if (*t > now + 86400) {
+    tm.tm_year--;
+    *t = mktime(&tm);
+  }
+  return 0;
+}
+
+
+
+// Formats. Each returns 0 for a play, 1 for a line holding none and -1 for
+// one that cannot be read.
+
+static int mpd_log_play(char *line, long now, const struct import_tags *tags, struct play *play) {
+  static const char PLAYED[] = "player: played \"";
+  char *played = strstr(line, PLAYED);
+  if (played == NULL) return 1;
+  char *uri = played + sizeof(PLAYED) - 1;
+  char *end = strrchr(uri, '"');
+  if (end == NULL || end == uri) return -1;
+  *end = '\0';
+
+  const char *time_end;
+  if (parse_time(line, &time_end, &play->time) && parse_syslog_time(line, now, &play->time)) return -1;
+  tags_from_uri(tags, uri, play);
+  return 0;
+}
+
+
+// Split a CSV record into at most max fields in place, unquoting them.
+static int csv_fields(char *s, char **fields, int max) {
+  int n = 0;
+  while (n < max) {
+    fields[n++] = s;
+    char *w = s;
+    if (*s == '"') {
+      s++;
+      while (*s != '\0') {
+        if (*s == '"') {
+          if (s[1] != '"') {
+            s++;
+            break;
+          }
+          s++;
+        }
+        *w++ = *s++;
+      }
+    }
+    while (*s != '\0' && *s != ',') *w++ = *s++;
+    int more = *s == ',';
+    *w = '\0';
+    if (!more) break;
+    s++;
+  }
+  return n;
+}
+
+
+static int csv_play(char *record, int first, struct play *play) {
+  char *fields[4];
+  int n = csv_fields(record, fields, 4);
+  if (n == 1 && fields[0][0] == '\0') return 1;
+  if (parse_time_field(fields[0], &play->time)) return first ? 1 : -1;
+  if (n < 4 || fields[3][0] == '\0') return -1;
+  play->artist = fields[1];
+  play->album = fields[2];
+  play->title = fields[3];
+  return 0;
+}
+
+
+static const char *skip_space(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+  return p;
+}
+
+
+static int hex4(const char *p) {
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    int c = p[i];
+    if (c >= '0' && c <= '9') v = v * 16 + c - '0';
+    else if (c >= 'a' && c <= 'f') v = v * 16 + c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') v = v * 16 + c - 'A' + 10;
+    else return -1;
+  }
+  return v;
+}
+
+
+// Decode the JSON string at *p in place, never longer than its escaped form,
+// and move *p past it.
+static char *json_string(char **p) {
+  char *s = *p + 1;
+  char *w = s;
+  char *start = s;
+  while (*s != '"') {
+    if (*s == '\0') return NULL;
+    if (*s != '\\') {
+      *w++ = *s++;
+      continue;
+    }
+    s++;
+    switch (*s++) {
+      case '"': *w++ = '"'; break;
+      case '\\': *w++ = '\\'; break;
+      case '/': *w++ = '/'; break;
+      case 'b': *w++ = '\b'; break;
+      case 'f': *w++ = '\f'; break;
+      case 'n': *w++ = '\n'; break;
+      case 'r': *w++ = '\r'; break;
+      case 't': *w++ = '\t'; break;
+      case 'u': {
+        long c = hex4(s);
+        if (c < 0) return NULL;
+        s += 4;
+        if (c >= 0xd800 && c < 0xdc00 && s[0] == '\\' && s[1] == 'u') {
+          int low = hex4(s + 2);
+          if (low < 0xdc00 || low >= 0xe000) return NULL;
+          c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+          s += 6;
+        }
+        if (c < 0x80) {
+          *w++ = c;
+        } else if (c < 0x800) {
+          *w++ = 0xc0 | (c >> 6);
+          *w++ = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+          *w++ = 0xe0 | (c >> 12);
+          *w++ = 0x80 | ((c >> 6) & 0x3f);
+          *w++ = 0x80 | (c & 0x3f);
+        } else {
+          *w++ = 0xf0 | (c >> 18);
+          *w++ = 0x80 | ((c >> 12) & 0x3f);
+          *w++ = 0x80 | ((c >> 6) & 0x3f);
+          *w++ = 0x80 | (c & 0x3f);
+        }
+        break;
+      }
+      default:
+        return NULL;
+    }
+  }
+  *w = '\0';
+  *p = s + 1;
+  return start;
+}
+
+
+// A flat object; keys other than the four are ignored, as long as their
+// values are strings, numbers, booleans or null.
+static int jsonl_play(char *line, struct play *play) {
+  char *p = (char *)skip_space(line);
+  if (*p == '\0') return 1;
+  if (*p++ != '{') return -1;
+
+  int has_time = 0;
+  play->artist = "";
+  play->album = "";
+  play->title = NULL;
+  p = (char *)skip_space(p);
+  while (*p != '}') {
+    if (*p != '"') return -1;
+    char *key = json_string(&p);
+    if (key == NULL) return -1;
+    p = (char *)skip_space(p);
+    if (*p++ != ':') return -1;
+    p = (char *)skip_space(p);
+
+    char *value = NULL;
+    if (*p == '"') {
+      value = json_string(&p);
+      if (value == NULL) return -1;
+    } else if (strcmp(key, "time") == 0) {
+      char *end;
+      play->time = strtol(p, &end, 10);
+      if (end == p) return -1;
+      p = end;
+      // fractions of a second
+      if (*p == '.') strtod(p, &p);
+      has_time = 1;
+    } else {
+      char *end = p;
+      while (*end != '\0' && *end != ',' && *end != '}' && *end != '{' && *end != '[') end++;
+      if (end == p || *end == '{' || *end == '[') return -1;
+      p = end;
+    }
+
+    if (value != NULL) {
+      if (strcmp(key, "time") == 0) {
+        if (parse_time_field(value, &play->time)) return -1;
+        has_time = 1;
+      } else if (strcmp(key, "artist") == 0) {
+        play->artist = value;
+      } else if (strcmp(key, "album") == 0) {
+        play->album = value;
+      } else if (strcmp(key, "title") == 0) {
+        play->title = value;
+      }
+    }
+
+    p = (char *)skip_space(p);
+    if (*p == ',') p = (char *)skip_space(p + 1);
+    else if (*p != '}') return -1;
+  }
+
+  return has_time && play->title != NULL && play->title[0] != '\0' ? 0 : -1;
+}
+
+
+// Read the rest of a record whose quoted field spans lines.
+static ssize_t csv_record(FILE *in, char **line, size_t *cap, ssize_t len, char **more, size_t *more_cap) {
+  for (;;) {
+    int quoted = 0;
+    for (ssize_t i = 0; i < len; i++) quoted ^= (*line)[i] == '"';
+    if (!quoted) return len;
+
+    ssize_t n = getline(more, more_cap, in);
+    if (n == -1) return len;
+    if ((size_t)(len + n + 1) > *cap) {
+      char *grown = realloc(*line, len + n + 1);
+      if (grown == NULL) return -1;
+      *line = grown;
+      *cap = len + n + 1;
+    }
+    memcpy(*line + len, *more, n + 1);
+    len += n;
+  }
+}
+
+
+int import_stream(struct db_import *import, FILE *in, enum import_format format, const struct import_tags *tags, struct import_stats *stats) {
+  char *line = NULL;
+  size_t cap = 0;
+  char *more = NULL;
+  size_t more_cap = 0;
+  long now = time(NULL);
+
+  int rv = 0;
+  int first = 1;
+  ssize_t len;
+  while ((len = getline(&line, &cap, in)) != -1) {
+    if (format == IMPORT_CSV) {
+      len = csv_record(in, &line, &cap, len, &more, &more_cap);
+      if (len < 0) {
+        rv = -1;
+        break;
+      }
+    }
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+
+    struct play play;
+    int found;
+    switch (format) {
+      case IMPORT_CSV:
+        found = csv_play(line, first, &play);
+        break;
+      case IMPORT_JSONL:
+        found = jsonl_play(line, &play);
+        break;
+      case IMPORT_MPD_LOG:
+      default:
+        found = mpd_log_play(line, now, tags, &play);
+        break;
+    }
+    first = 0;
+
+    if (found < 0) stats->skipped++;
+    if (found != 0) continue;
+    if (db_import_play(import, play.artist, play.album, play.title, play.time)) {
+      rv = -1;
+      break;
+    }
+    stats->plays++;
+  }
+
+  if (ferror(in)) {
+    fprintf(stderr, ":: Failed to read plays: %s\n", strerror(errno));
+    rv = -1;
+  }
+  free(line);
+  free(more);
+  return rv;
+}
+
+
+
+// Command line
+
+static void import_usage(void) {
+  fprintf(stderr,
+      "Usage: mpd_stats import [--format FORMAT] [--source NAME] [--mpd ADDRESS] [--batch N] [--defer-index]\n"
+      "                        [--db PATH] [--db-sync MODE] FILE...\n"
+      "  FILE                    plays to import, - for stdin\n"
+      "  --format FORMAT         csv (time,artist,album,title), jsonl or mpd-log; by default from the\n"
+      "                          file extension (.csv, .jsonl), otherwise mpd-log\n"
+      "  --source NAME           source to record the plays under (default \"import\")\n"
+      "  --mpd ADDRESS           read the tags of songs in an MPD log from this server's database\n"
+      "                          (default: from the path, Artist/Album/[NN ]Title.ext)\n"
+      "  --batch N               plays per transaction (default 100000)\n"
+      "  --defer-index           load everything in one transaction, rebuilding stats and indexes at the end\n"
+      "  --db PATH               database to import into (default ~/.mpd_stats.db)\n"
+      "  --db-sync MODE          sqlite synchronous setting: OFF, NORMAL, FULL or EXTRA (default NORMAL)\n");
+}
+
+
+static enum import_format format_of(const char *path) {
+  const char *ext = strrchr(path, '.');
+  if (ext != NULL && strcasecmp(ext, ".csv") == 0) return IMPORT_CSV;
+  if (ext != NULL && (strcasecmp(ext, ".jsonl") == 0 || strcasecmp(ext, ".ndjson") == 0)) return IMPORT_JSONL;
+  return IMPORT_MPD_LOG;
+}
+
+
+int import_main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"format", required_argument, NULL, 'f'},
+    {"source", required_argument, NULL, 'S'},
+    {"mpd", required_argument, NULL, 'M'},
+    {"batch", required_argument, NULL, 'b'},
+    {"defer-index", no_argument, NULL, 'D'},
+    {"db", required_argument, NULL, 'B'},
+    {"db-sync", required_argument, NULL, 's'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int format = -1;
+  const char *source = "import";
+  const char *mpd = NULL;
+  long batch = 100000;
+  int defer_index = 0;
+  struct db_config config = {.path = NULL, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+
+  int c;
+  while ((c = getopt_long(argc, argv, "f:S:M:b:DB:s:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'f':
+        if (strcmp(optarg, "csv") == 0) format = IMPORT_CSV;
+        else if (strcmp(optarg, "jsonl") == 0) format = IMPORT_JSONL;
+        else if (strcmp(optarg, "mpd-log") == 0) format = IMPORT_MPD_LOG;
+        else {
+          fprintf(stderr, ":: Invalid format \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'S':
+        source = optarg;
+        break;
+      case 'M':
+        mpd = optarg;
+        break;
+      case 'b':
+        batch = strtol(optarg, NULL, 10);
+        if (batch <= 0) {
+          fprintf(stderr, ":: Invalid batch \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'D':
+        defer_index = 1;
+        break;
+      case 'B':
+        config.path = optarg;
+        break;
+      case 's':
+        if (strcasecmp(optarg, "OFF") && strcasecmp(optarg, "NORMAL") && strcasecmp(optarg, "FULL") && strcasecmp(optarg, "EXTRA")) {
+          fprintf(stderr, ":: Invalid synchronous mode \"%s\"\n", optarg);
+          return 1;
+        }
+        config.synchronous = optarg;
+        break;
+      case 'h':
+      default:
+        import_usage();
+        return 1;
+    }
+  }
+  if (optind == argc) {
+    import_usage();
+    return 1;
+  }
+
+  struct import_tags *tags = NULL;
+  if (mpd != NULL) {
+    struct mpd_endpoint endpoint;
+    if (endpoint_parse(&endpoint, mpd)) return 1;
+    tags = import_tags_load(&endpoint);
+    if (tags == NULL) return 2;
+  }
+
+  int rv = 3;
+  struct db_import *import = NULL;
+  struct db_conn *db = db_init(&config, 0);
+  if (db == NULL) {
+    fprintf(stderr, "DB init failed\n");
+    goto _import_main_end;
+  }
+  int source_id = db_source(db, source);
+  if (source_id < 0) goto _import_main_end;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  import = db_import_begin(db, source_id, batch, defer_index);
+  if (import == NULL) goto _import_main_end;
+
+  rv = 0;
+  struct import_stats stats = {0};
+  for (int i = optind; i < argc && rv == 0; i++) {
+    int is_stdin = strcmp(argv[i], "-") == 0;
+    FILE *in = is_stdin ? stdin : fopen(argv[i], "r");
+    if (in == NULL) {
+      fprintf(stderr, ":: Failed to open %s: %s\n", argv[i], strerror(errno));
+      rv = 4;
+      break;
+    }
+    enum import_format file_format = format >= 0 ? (enum import_format)format : format_of(argv[i]);
+    if (import_stream(import, in, file_format, tags, &stats)) {
+      fprintf(stderr, ":: Failed to import %s\n", argv[i]);
+      rv = 4;
+    }
+    if (!is_stdin) fclose(in);
+  }
+
+  if (db_import_end(import, rv == 0) && rv == 0) rv = 3;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (rv == 0) {
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Imported %ld plays in %.1fs, skipped %ld lines\n", stats.plays, seconds, stats.skipped);
+  }
+
+_import_main_end:
+  db_free(db);
+  import_tags_free(tags);
+  return rv;
+}
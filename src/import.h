@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "db.h"
+#include "endpoint.h"
+
+// Loading plays from before mpd_stats was running, keeping their times.
+enum import_format {
+  // time,artist,album,title, optionally quoted, with or without a header
+  IMPORT_CSV,
+  // one {"time": ..., "artist": ..., "album": ..., "title": ...} per line
+  IMPORT_JSONL,
+  // MPD's own log, reading its "player: played" lines
+  IMPORT_MPD_LOG,
+};
+
+struct import_stats {
+  long plays;
+  // lines that looked like plays but could not be read
+  long skipped;
+};
+
+// Song URI -> tags, read from an MPD server's database for the MPD log, which
+// only names the file played.
+struct import_tags;
+struct import_tags *import_tags_load(const struct mpd_endpoint *endpoint);
+void import_tags_free(struct import_tags *tags);
+
+// Import every play in the stream. Without tags (or for a URI they lack), an
+// MPD log's songs are named by their path: Artist/Album/[NN ]Title.ext.
+int import_stream(struct db_import *import, FILE *in, enum import_format format, const struct import_tags *tags, struct import_stats *stats);
+
+// `mpd_stats import`, argv[0] being "import".
+int import_main(int argc, char **argv);
@@ -0,0 +1,626 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "strpool.h"
+#include "metrics.h"
+
+#define JOURNAL_SUFFIX ".playlog"
+#define JOURNAL_MAGIC "MPDSPLG1"
+// plays per transaction when catching up
+#define JOURNAL_BATCH 4096
+// start the file afresh once this much of it is applied
+#define JOURNAL_TRUNCATE_BYTES (1 << 20)
+// before trying a batch the database refused again
+#define JOURNAL_RETRY_MS 1000
+// refusals of the same batch before it is applied one play at a time
+#define JOURNAL_MAX_FAILURES 3
+// longest string a record may carry
+#define JOURNAL_MAX_STRING (1 << 20)
+// how often to look for database maintenance once it is all done
+#define JOURNAL_MAINTAIN_S 600
+
+enum record_type {
+  RECORD_STRING = 1,
+  RECORD_PLAY = 2,
+  // the end of the source's play at played_at, listened to or skipped
+  RECORD_LISTENED = 3,
+  RECORD_SKIPPED = 4,
+};
+
+struct header {
+  char magic[8];
+  // changes every time the file is started afresh
+  uint64_t generation;
+};
+
+// Every record is one of these. A string record is followed by its bytes and
+// at least one zero, padded to a multiple of 8.
+struct record {
+  uint32_t type;
+  // CRC-32 of the record with this zeroed, then of a string's bytes
+  uint32_t crc;
+  int64_t played_at;
+  int32_t source_id;
+  int32_t mpd_song_id;
+  // string ids; a string record's own id is in title
+  uint32_t title;
+  uint32_t artist;
+  uint32_t album;
+  // a string record's length, or the ms an ended play was listened to
+  uint32_t len;
+};
+
+#define STRING_PADDED(len) (((size_t)(len) + 8) & ~(size_t)7)
+
+struct journal {
+  struct db_conn *db;
+  int fd;
+  int sync_each;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  int running;
+  int stop;
+
+  // the file, under lock
+  uint64_t generation;
+  long end;
+  // appended to since the last sync
+  int dirty;
+  // strings in the file, with their ids there
+  struct strpool *written;
+
+  // the compactor's: how much of the file the database has, the strings read
+  // so far, and how often in a row the next batch was refused
+  long applied;
+  struct strpool *strings;
+  int failures;
+
+  void (*applied_fn)(void *ctx);
+  void *ctx;
+};
+
+
+static uint32_t crc32(uint32_t crc, const void *data, size_t len) {
+  const unsigned char *p = data;
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+  }
+  return ~crc;
+}
+
+
+static uint32_t record_crc(const struct record *record, const char *payload, size_t len) {
+  struct record copy = *record;
+  copy.crc = 0;
+  return crc32(crc32(0, &copy, sizeof(copy)), payload, len);
+}
+
+
+// Size of the valid record at the start of buf, 0 if it is incomplete or
+// corrupt.
+static size_t record_check(const char *buf, size_t size) {
+  struct record record;
+  if (size < sizeof(record)) return 0;
+  memcpy(&record, buf, sizeof(record));
+
+  size_t payload = 0;
+  if (record.type == RECORD_STRING) {
+    if (record.len > JOURNAL_MAX_STRING) return 0;
+    payload = STRING_PADDED(record.len);
+    if (payload > size - sizeof(record)) return 0;
+  }
+  else if (record.type != RECORD_PLAY && record.type != RECORD_LISTENED && record.type != RECORD_SKIPPED) {
+    return 0;
+  }
+
+  if (record_crc(&record, buf + sizeof(record), payload) != record.crc) return 0;
+  return sizeof(record) + payload;
+}
+
+
+// Write a string record for s at dst, returning its size.
+static size_t put_string(char *dst, uint32_t id, const char *s, size_t len) {
+  struct record record = {.type = RECORD_STRING, .title = id, .len = len};
+  size_t payload = STRING_PADDED(len);
+  char *p = dst + sizeof(record);
+  memset(p + len, 0, payload - len);
+  memcpy(p, s, len);
+  record.crc = record_crc(&record, p, payload);
+  memcpy(dst, &record, sizeof(record));
+  return sizeof(record) + payload;
+}
+
+
+static int write_all(int fd, const void *buf, size_t len, long offset) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+
+static char *read_range(int fd, long from, long to) {
+  size_t len = to - from;
+  char *buf = malloc(len > 0 ? len : 1);
+  if (buf == NULL) return NULL;
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, from + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, ":: Failed to read play journal: %s\n", n == 0 ? "unexpected end of file" : strerror(errno));
+      free(buf);
+      return NULL;
+    }
+    done += n;
+  }
+  return buf;
+}
+
+
+// Empty the file and start a new generation, forgetting every string.
+static int journal_reset(struct journal *journal, uint64_t generation) {
+  struct header header = {.generation = generation};
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+
+  struct strpool *written = strpool_new();
+  struct strpool *strings = strpool_new();
+  if (written == NULL || strings == NULL) {
+    fprintf(stderr, ":: Play journal: out of memory\n");
+    strpool_free(written);
+    strpool_free(strings);
+    return -1;
+  }
+
+  if (ftruncate(journal->fd, 0) || write_all(journal->fd, &header, sizeof(header), 0) || fdatasync(journal->fd)) {
+    fprintf(stderr, ":: Failed to reset play journal: %s\n", strerror(errno));
+    strpool_free(written);
+    strpool_free(strings);
+    return -1;
+  }
+
+  strpool_free(journal->written);
+  strpool_free(journal->strings);
+  journal->written = written;
+  journal->strings = strings;
+  journal->generation = generation;
+  journal->end = sizeof(header);
+  journal->applied = sizeof(header);
+  journal->dirty = 0;
+  return 0;
+}
+
+
+// Apply a batch the database refused one play at a time, ends[i] being
+// where plays[i]'s record ends. A play the schema refuses will never go in:
+// it is set aside in RefusedPlays rather than holding up every play after
+// it. -1 if the database fails any other way, as when it is locked.
+static int journal_apply_each(struct journal *journal, const struct db_play *plays, const long *ends, int n) {
+  for (int i = 0; i < n; i++) {
+    const struct db_play *play = &plays[i];
+    int rv = db_add_plays(journal->db, play, 1, journal->generation, ends[i]);
+    if (rv == DB_REFUSED) {
+      if (db_refuse_play(journal->db, play, journal->generation, ends[i])) return -1;
+      if (play->ended) {
+        fprintf(stderr, ":: Play journal: set aside the end of the play of song %d at %ld on source %d\n",
+            play->mpd_song_id, play->played_at, play->source_id);
+      }
+      else {
+        fprintf(stderr, ":: Play journal: set aside the play of \"%s\" by \"%s\" on \"%s\" at %ld on source %d\n",
+            play->title, play->artist, play->album, play->played_at, play->source_id);
+      }
+    }
+    else if (rv) {
+      return -1;
+    }
+    journal->applied = ends[i];
+  }
+  return 0;
+}
+
+
+// Apply the records between journal->applied and to, in batches. Returns -1
+// if one was refused, with journal->applied at the end of the last batch
+// committed.
+static int journal_apply(struct journal *journal, long to) {
+  long base = journal->applied;
+  if (base >= to) return 0;
+
+  char *buf = read_range(journal->fd, base, to);
+  struct db_play *plays = malloc(JOURNAL_BATCH * sizeof(struct db_play));
+  long *ends = malloc(JOURNAL_BATCH * sizeof(long));
+  int rv = -1;
+  if (buf == NULL || plays == NULL || ends == NULL) goto _journal_apply_end;
+
+  size_t size = to - base, offset = 0;
+  int n = 0;
+  while (offset < size) {
+    size_t len = record_check(buf + offset, size - offset);
+    struct record record;
+    if (len == 0) {
+      fprintf(stderr, ":: Play journal: bad record at offset %ld\n", base + (long)offset);
+      goto _journal_apply_end;
+    }
+    memcpy(&record, buf + offset, sizeof(record));
+
+    int n_strings = strpool_size(journal->strings);
+    if (record.type == RECORD_STRING) {
+      // strings before a refused batch were already read
+      if ((int)record.title == n_strings
+          && strpool_intern(journal->strings, buf + offset + sizeof(record)) != (int)record.title) {
+        fprintf(stderr, ":: Play journal: out of memory\n");
+        goto _journal_apply_end;
+      }
+    }
+    else if (record.type != RECORD_PLAY) {
+      plays[n++] = (struct db_play){
+        .source_id = record.source_id,
+        .mpd_song_id = record.mpd_song_id,
+        .played_at = record.played_at,
+        .ended = 1,
+        .listened_ms = record.len,
+        .skipped = record.type == RECORD_SKIPPED,
+      };
+    }
+    else {
+      if ((int)record.title >= n_strings || (int)record.artist >= n_strings || (int)record.album >= n_strings) {
+        fprintf(stderr, ":: Play journal: unknown string at offset %ld\n", base + (long)offset);
+        goto _journal_apply_end;
+      }
+      plays[n++] = (struct db_play){
+        .source_id = record.source_id,
+        .title = strpool_get(journal->strings, record.title),
+        .artist = strpool_get(journal->strings, record.artist),
+        .album = strpool_get(journal->strings, record.album),
+        .mpd_song_id = record.mpd_song_id,
+        .played_at = record.played_at,
+      };
+    }
+    offset += len;
+    if (record.type != RECORD_STRING) ends[n - 1] = base + offset;
+
+    if (n == JOURNAL_BATCH || (offset == size && n > 0)) {
+      int added = db_add_plays(journal->db, plays, n, journal->generation, base + offset);
+      if (added) {
+        // retrying can't help a batch with a play the schema refuses
+        if (added != DB_REFUSED && ++journal->failures < JOURNAL_MAX_FAILURES) goto _journal_apply_end;
+        fprintf(stderr, ":: Play journal: batch refused, applying it play by play\n");
+        if (journal_apply_each(journal, plays, ends, n)) goto _journal_apply_end;
+      }
+      journal->failures = 0;
+      n = 0;
+    }
+    if (n == 0) journal->applied = base + offset;
+  }
+  rv = 0;
+
+_journal_apply_end:
+  free(ends);
+  free(plays);
+  free(buf);
+  return rv;
+}
+
+
+// Once everything is applied and the database synced, start the file afresh;
+// unless force, only when it has grown large.
+static void journal_compact(struct journal *journal, int force) {
+  pthread_mutex_lock(&journal->lock);
+  long end = journal->end;
+  pthread_mutex_unlock(&journal->lock);
+
+  if (journal->applied != end || end == sizeof(struct header)) return;
+  if (!force && end < JOURNAL_TRUNCATE_BYTES) return;
+  // a reader holding on to the WAL just delays this
+  if (db_checkpoint(journal->db)) return;
+
+  pthread_mutex_lock(&journal->lock);
+  if (journal->applied == journal->end) journal_reset(journal, journal->generation + 1);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+
+struct journal *journal_open(struct db_conn *db, int sync_each) {
+  struct journal *journal = calloc(1, sizeof(struct journal));
+  if (journal == NULL) return NULL;
+  journal->db = db;
+  journal->sync_each = sync_each;
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+
+  char path[PATH_MAX];
+  char *buf = NULL;
+  snprintf(path, sizeof(path), "%s" JOURNAL_SUFFIX, db_filename(db));
+  journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (journal->fd < 0) {
+    fprintf(stderr, ":: Failed to open play journal %s: %s\n", path, strerror(errno));
+    goto _journal_open_err;
+  }
+
+  long db_generation, db_offset;
+  struct stat st;
+  if (db_journal_position(db, &db_generation, &db_offset)) goto _journal_open_err;
+  if (fstat(journal->fd, &st) || (buf = read_range(journal->fd, 0, st.st_size)) == NULL) {
+    fprintf(stderr, ":: Failed to read play journal %s\n", path);
+    goto _journal_open_err;
+  }
+
+  struct header header;
+  if ((size_t)st.st_size < sizeof(header) || memcmp(buf, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+    // new, or cut short while being reset
+    if (journal_reset(journal, db_generation + 1)) goto _journal_open_err;
+    free(buf);
+    return journal;
+  }
+  memcpy(&header, buf, sizeof(header));
+  journal->generation = header.generation;
+  journal->written = strpool_new();
+  journal->strings = strpool_new();
+  if (journal->written == NULL || journal->strings == NULL) goto _journal_open_err;
+
+  size_t offset = sizeof(header), len;
+  while ((len = record_check(buf + offset, st.st_size - offset)) > 0) {
+    struct record record;
+    memcpy(&record, buf + offset, sizeof(record));
+    if (record.type == RECORD_STRING) {
+      const char *s = buf + offset + sizeof(record);
+      if (strpool_intern(journal->written, s) != (int)record.title || strpool_intern(journal->strings, s) != (int)record.title) break;
+    }
+    offset += len;
+  }
+  if (offset < (size_t)st.st_size) {
+    // the tail of an append cut short by a crash
+    fprintf(stderr, ":: Play journal: dropping %ld bytes of incomplete records\n", (long)st.st_size - (long)offset);
+    if (ftruncate(journal->fd, offset)) {
+      fprintf(stderr, ":: Failed to truncate play journal: %s\n", strerror(errno));
+      goto _journal_open_err;
+    }
+  }
+  journal->end = offset;
+
+  journal->applied = sizeof(header);
+  if (journal->generation == (uint64_t)db_generation) {
+    journal->applied = db_offset < journal->end ? db_offset : journal->end;
+  }
+  if (journal->applied < journal->end) {
+    fprintf(stderr, ":: Replaying %ld bytes of play journal\n", journal->end - journal->applied);
+    if (journal_apply(journal, journal->end)) {
+      fprintf(stderr, ":: Failed to replay play journal, will retry\n");
+    }
+  }
+  journal_compact(journal, 1);
+
+  free(buf);
+  return journal;
+
+_journal_open_err:
+  free(buf);
+  journal_close(journal);
+  return NULL;
+}
+
+
+// Wait for plays to apply, doing database maintenance in small steps while
+// there are none. Called and returns with the lock held.
+static void journal_idle(struct journal *journal, time_t *next_maintenance) {
+  while (!journal->stop && journal->applied == journal->end) {
+    time_t now = time(NULL);
+    if (now >= *next_maintenance) {
+      pthread_mutex_unlock(&journal->lock);
+      int more = db_maintain(journal->db);
+      pthread_mutex_lock(&journal->lock);
+      if (more <= 0) *next_maintenance = now + JOURNAL_MAINTAIN_S;
+      continue;
+    }
+
+    struct timespec deadline = {.tv_sec = *next_maintenance};
+    pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+  }
+}
+
+
+static void *journal_run(void *arg) {
+  struct journal *journal = arg;
+  time_t next_maintenance = 0;
+
+  pthread_mutex_lock(&journal->lock);
+  while (1) {
+    journal_idle(journal, &next_maintenance);
+    long to = journal->end;
+    int dirty = journal->dirty, stop = journal->stop;
+    journal->dirty = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    // one sync covers every play appended since the last
+    if (dirty && fdatasync(journal->fd)) {
+      fprintf(stderr, ":: Failed to sync play journal: %s\n", strerror(errno));
+    }
+    long applied = journal->applied;
+    int err = journal_apply(journal, to);
+    if (journal->applied != applied && journal->applied_fn != NULL) journal->applied_fn(journal->ctx);
+    if (!err) journal_compact(journal, stop);
+
+    pthread_mutex_lock(&journal->lock);
+    if (err) {
+      // left in the file for the next start
+      if (journal->stop) break;
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += JOURNAL_RETRY_MS / 1000;
+      pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+    }
+    else if (stop && journal->applied == journal->end) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  return NULL;
+}
+
+
+int journal_start(struct journal *journal, void (*applied)(void *ctx), void *ctx) {
+  journal->applied_fn = applied;
+  journal->ctx = ctx;
+  if (pthread_create(&journal->thread, NULL, journal_run, journal)) {
+    fprintf(stderr, ":: Failed to start play journal thread\n");
+    return -1;
+  }
+  journal->running = 1;
+  return 0;
+}
+
+
+void journal_close(struct journal *journal) {
+  if (journal == NULL) return;
+
+  if (journal->running) {
+    pthread_mutex_lock(&journal->lock);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->thread, NULL);
+  }
+
+  if (journal->fd >= 0) close(journal->fd);
+  strpool_free(journal->written);
+  strpool_free(journal->strings);
+  pthread_cond_destroy(&journal->wake);
+  pthread_mutex_destroy(&journal->lock);
+  free(journal);
+}
+
+
+// Write len bytes of records at the end of the file and wake the compactor.
+// Called with the lock held.
+static int journal_write(struct journal *journal, const char *buf, size_t len) {
+  if (write_all(journal->fd, buf, len, journal->end)) {
+    fprintf(stderr, ":: Failed to append to play journal: %s\n", strerror(errno));
+    // drop whatever part made it
+    if (ftruncate(journal->fd, journal->end)) {}
+    return -1;
+  }
+  journal->end += len;
+
+  if (journal->sync_each) {
+    if (fdatasync(journal->fd)) fprintf(stderr, ":: Failed to sync play journal: %s\n", strerror(errno));
+  }
+  else {
+    journal->dirty = 1;
+  }
+  pthread_cond_signal(&journal->wake);
+  return 0;
+}
+
+
+int journal_append(struct journal *journal, int source_id, const char *title, const char *artist, const char *album, int mpd_song_id, long *played_at) {
+  long start = metrics_start();
+  const char *tags[3] = {title ? title : "", artist ? artist : "", album ? album : ""};
+  size_t lens[3];
+  size_t size = sizeof(struct record);
+  for (int i = 0; i < 3; i++) {
+    lens[i] = strlen(tags[i]);
+    size += sizeof(struct record) + STRING_PADDED(lens[i]);
+  }
+
+  char stack[1024];
+  char *buf = NULL;
+  if (lens[0] <= JOURNAL_MAX_STRING && lens[1] <= JOURNAL_MAX_STRING && lens[2] <= JOURNAL_MAX_STRING) {
+    buf = size <= sizeof(stack) ? stack : malloc(size);
+  }
+  if (buf == NULL) {
+    fprintf(stderr, ":: Play journal: tags too long or out of memory\n");
+    metrics_record(METRIC_JOURNAL_APPEND, start, 0);
+    return -1;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+
+  // strings new to the file are written ahead of the play, and only interned
+  // once they are
+  int next = strpool_size(journal->written);
+  const char *fresh[3];
+  int n_fresh = 0;
+  uint32_t ids[3];
+  size_t len = 0;
+  for (int i = 0; i < 3; i++) {
+    int id = strpool_find(journal->written, tags[i]);
+    for (int k = 0; id < 0 && k < n_fresh; k++) {
+      if (strcmp(fresh[k], tags[i]) == 0) id = next + k;
+    }
+    if (id < 0) {
+      id = next + n_fresh;
+      fresh[n_fresh++] = tags[i];
+      len += put_string(buf + len, id, tags[i], lens[i]);
+    }
+    ids[i] = id;
+  }
+
+  struct record play = {
+    .type = RECORD_PLAY,
+    .played_at = time(NULL),
+    .source_id = source_id,
+    .mpd_song_id = mpd_song_id,
+    .title = ids[0],
+    .artist = ids[1],
+    .album = ids[2],
+  };
+  play.crc = record_crc(&play, NULL, 0);
+  memcpy(buf + len, &play, sizeof(play));
+  len += sizeof(play);
+
+  int rv = journal_write(journal, buf, len);
+  if (rv == 0) {
+    for (int k = 0; k < n_fresh; k++) {
+      if (strpool_intern(journal->written, fresh[k]) != next + k) {
+        fprintf(stderr, ":: Play journal: out of memory\n");
+      }
+    }
+    if (played_at != NULL) *played_at = play.played_at;
+  }
+
+  pthread_mutex_unlock(&journal->lock);
+  if (buf != stack) free(buf);
+  metrics_record(METRIC_JOURNAL_APPEND, start, rv == 0);
+  return rv;
+}
+
+
+int journal_append_end(struct journal *journal, int source_id, int mpd_song_id, long played_at, long listened_ms, int skipped) {
+  long start = metrics_start();
+  struct record end = {
+    .type = skipped ? RECORD_SKIPPED : RECORD_LISTENED,
+    .played_at = played_at,
+    .source_id = source_id,
+    .mpd_song_id = mpd_song_id,
+    .len = listened_ms < 0 ? 0 : listened_ms > UINT32_MAX ? UINT32_MAX : listened_ms,
+  };
+  end.crc = record_crc(&end, NULL, 0);
+
+  pthread_mutex_lock(&journal->lock);
+  int rv = journal_write(journal, (const char *)&end, sizeof(end));
+  pthread_mutex_unlock(&journal->lock);
+  metrics_record(METRIC_JOURNAL_APPEND, start, rv == 0);
+  return rv;
+}
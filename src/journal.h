@@ -0,0 +1,29 @@
+#pragma once
+
+#include "db.h"
+
+// Plays are appended to a journal file next to the database (its path plus
+// ".playlog") and applied to the database by a compactor thread, so
+// recording a play never waits on SQLite. The file holds fixed-size records,
+// each string written once and referred to by id afterwards; it is truncated
+// once everything in it is applied and checkpointed.
+struct journal;
+
+// Open the journal of db, creating it if needed, and apply any plays the
+// database does not have yet. sync_each syncs the file on every append
+// rather than once the compactor picks the play up.
+struct journal *journal_open(struct db_conn *db, int sync_each);
+// Start applying new plays on a thread, which takes over db. applied(ctx),
+// if not NULL, is called on that thread after each batch is committed. While
+// there are no plays to apply the thread runs db_maintain().
+int journal_start(struct journal *journal, void (*applied)(void *ctx), void *ctx);
+// Apply what is left, then stop. Anything that cannot be applied stays in
+// the file for the next journal_open().
+void journal_close(struct journal *journal);
+
+// Append a play, timestamped now, the time being stored in played_at if not
+// NULL. Safe to call from any thread. A missing tag is recorded as empty.
+int journal_append(struct journal *journal, int source_id, const char *title, const char *artist, const char *album, int mpd_song_id, long *played_at);
+// Append the end of a play appended at played_at: how long it was listened to
+// and whether it was skipped.
+int journal_append_end(struct journal *journal, int source_id, int mpd_song_id, long played_at, long listened_ms, int skipped);
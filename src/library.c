@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "library.h"
+#include "strpool.h"
+
+static const enum mpd_tag_type INDEXED_TAGS[] = {MPD_TAG_ARTIST, MPD_TAG_ALBUM, MPD_TAG_TITLE};
+#define N_INDEXED_TAGS (int)(sizeof(INDEXED_TAGS) / sizeof(INDEXED_TAGS[0]))
+
+// Songs for each distinct value of a tag, stored compressed: the songs for
+// value v are songs[offsets[v]] up to songs[offsets[v + 1]].
+struct tag_index {
+  struct strpool *values;
+  int *offsets;
+  int *songs;
+  int n_songs;
+};
+
+struct library {
+  struct strpool *uris;
+  struct tag_index tags[N_INDEXED_TAGS];
+};
+
+// (value, song) pairs collected while reading the database
+struct tag_pairs {
+  int *values;
+  int *songs;
+  int n;
+  int cap;
+};
+
+
+static int tag_pairs_push(struct tag_pairs *pairs, int value, int song) {
+  if (pairs->n == pairs->cap) {
+    int cap = pairs->cap ? pairs->cap * 2 : 1024;
+    int *values = realloc(pairs->values, cap * sizeof(int));
+    if (values == NULL) return -1;
+    pairs->values = values;
+    int *songs = realloc(pairs->songs, cap * sizeof(int));
+    if (songs == NULL) return -1;
+    pairs->songs = songs;
+    pairs->cap = cap;
+  }
+
+  pairs->values[pairs->n] = value;
+  pairs->songs[pairs->n] = song;
+  pairs->n++;
+  return 0;
+}
+
+
+// Counting sort of the pairs by value into the compressed layout.
+static int tag_index_build(struct tag_index *index, const struct tag_pairs *pairs) {
+  int n_values = strpool_size(index->values);
+  index->offsets = calloc(n_values + 1, sizeof(int));
+  index->songs = malloc((pairs->n + 1) * sizeof(int));
+  if (index->offsets == NULL || index->songs == NULL) return -1;
+
+  for (int i = 0; i < pairs->n; i++) {
+    index->offsets[pairs->values[i] + 1]++;
+  }
+  for (int v = 0; v < n_values; v++) {
+    index->offsets[v + 1] += index->offsets[v];
+  }
+
+  int *fill = malloc((n_values + 1) * sizeof(int));
+  if (fill == NULL) return -1;
+  memcpy(fill, index->offsets, (n_values + 1) * sizeof(int));
+  for (int i = 0; i < pairs->n; i++) {
+    index->songs[fill[pairs->values[i]]++] = pairs->songs[i];
+  }
+  free(fill);
+
+  index->n_songs = pairs->n;
+  return 0;
+}
+
+
+static int library_add_song(struct library *lib, struct tag_pairs *pairs, const struct mpd_song *song) {
+  int id = strpool_intern(lib->uris, mpd_song_get_uri(song));
+  if (id < 0) return -1;
+
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    const char *value;
+    for (unsigned i = 0; (value = mpd_song_get_tag(song, INDEXED_TAGS[t], i)) != NULL; i++) {
+      int value_id = strpool_intern(lib->tags[t].values, value);
+      if (value_id < 0 || tag_pairs_push(&pairs[t], value_id, id)) return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+struct library *library_load(struct mpd_connection *mpd) {
+  struct tag_pairs pairs[N_INDEXED_TAGS] = {0};
+  struct library *lib = calloc(1, sizeof(struct library));
+  if (lib == NULL) return NULL;
+
+  lib->uris = strpool_new();
+  if (lib->uris == NULL) goto _library_load_error;
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    lib->tags[t].values = strpool_new();
+    if (lib->tags[t].values == NULL) goto _library_load_error;
+  }
+
+  if (!mpd_send_list_all_meta(mpd, "")) goto _library_load_error;
+
+  struct mpd_entity *entity;
+  int failed = 0;
+  while ((entity = mpd_recv_entity(mpd)) != NULL) {
+    if (!failed && mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+      failed = library_add_song(lib, pairs, mpd_entity_get_song(entity));
+    }
+    mpd_entity_free(entity);
+  }
+  if (!mpd_response_finish(mpd) || failed) goto _library_load_error;
+
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    if (tag_index_build(&lib->tags[t], &pairs[t])) goto _library_load_error;
+    free(pairs[t].values);
+    free(pairs[t].songs);
+    pairs[t] = (struct tag_pairs){0};
+  }
+
+  return lib;
+
+_library_load_error:
+  if (mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+    fprintf(stderr, ":: Failed to read MPD database: %s\n", mpd_connection_get_error_message(mpd));
+  }
+  else {
+    fprintf(stderr, ":: Out of memory reading MPD database\n");
+  }
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    free(pairs[t].values);
+    free(pairs[t].songs);
+  }
+  library_free(lib);
+  return NULL;
+}
+
+
+void library_free(struct library *lib) {
+  if (lib == NULL) return;
+
+  strpool_free(lib->uris);
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    strpool_free(lib->tags[t].values);
+    free(lib->tags[t].offsets);
+    free(lib->tags[t].songs);
+  }
+  free(lib);
+}
+
+
+int library_lookup(const struct library *lib, enum mpd_tag_type tag, const char *value, const int **songs) {
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    if (INDEXED_TAGS[t] != tag) continue;
+
+    const struct tag_index *index = &lib->tags[t];
+    int v = strpool_find(index->values, value);
+    if (v < 0) break;
+
+    *songs = &index->songs[index->offsets[v]];
+    return index->offsets[v + 1] - index->offsets[v];
+  }
+
+  *songs = NULL;
+  return 0;
+}
+
+
+const char *library_uri(const struct library *lib, int song) {
+  return strpool_get(lib->uris, song);
+}
+
+
+int library_size(const struct library *lib) {
+  return strpool_size(lib->uris);
+}
+
+
+size_t library_memory(const struct library *lib) {
+  size_t bytes = sizeof(struct library) + strpool_memory(lib->uris);
+  for (int t = 0; t < N_INDEXED_TAGS; t++) {
+    const struct tag_index *index = &lib->tags[t];
+    bytes += strpool_memory(index->values);
+    bytes += (strpool_size(index->values) + 1) * sizeof(int);
+    bytes += (index->n_songs + 1) * sizeof(int);
+  }
+  return bytes;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <mpd/client.h>
+
+// In-memory index of the MPD database: tag value -> song URIs for the
+// artist, album and title tags.
+struct library;
+
+// Build the index from a single listallinfo. Returns NULL on error.
+struct library *library_load(struct mpd_connection *mpd);
+void library_free(struct library *lib);
+
+// Songs whose tag exactly matches value, as indices for library_uri().
+int library_lookup(const struct library *lib, enum mpd_tag_type tag, const char *value, const int **songs);
+const char *library_uri(const struct library *lib, int song);
+
+int library_size(const struct library *lib);
+size_t library_memory(const struct library *lib);
@@ -1,94 +1,130 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
 
-// docs: https://www.musicpd.org/doc/libmpdclient
-#include <mpd/client.h>
-
-#include "msleep.h"
 #include "db.h"
-#include "playlist.h"
-
-
-struct stat_state {
-  int song_id;
-  int new_song;
-  unsigned pos;
-};
-
-
-void stat_state_update(struct stat_state *state, struct mpd_connection *conn) {
-    struct mpd_status *status = mpd_run_status(conn);
-
-    int song_id = mpd_status_get_song_id(status);
-    unsigned pos = mpd_status_get_elapsed_ms(status);
-    if (song_id < 0) {
-      state->new_song = 0;
-    }
-    else if (song_id != state->song_id) {
-      state->new_song = 1;
-      state->song_id = song_id;
-    }
-    else if (pos < state-> pos) {
-      state->new_song = 1;
-    }
-    else {
-      state->new_song = 0;
-    }
-    state->pos = pos;
-
-    mpd_status_free(status);
+#include "worker.h"
+#include "options.h"
+#include "metrics.h"
+#include "rank.h"
+#include "similar.h"
+#include "endpoint.h"
+#include "reactor.h"
+#include "journal.h"
+#include "import.h"
+#include "report.h"
+#include "columnar.h"
+#include "playlist_plan.h"
+
+static struct reactor *running;
+static struct playlist_plan plan;
+
+static void on_signal(int sig) {
+  (void)sig;
+  if (running != NULL) reactor_stop(running);
 }
 
-void run_sm(struct stat_state *state, struct mpd_connection *mpd, struct db_conn *db) {
-  if (state->new_song) {
-    // get song info
-    // store in DB
-    struct mpd_song *song = mpd_run_current_song(mpd);
-    int song_id = mpd_song_get_id(song);
-    const char *title = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
-    const char *artist = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
-    const char *album = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0);
-    fprintf(stderr, "Now Playing %s by %s from %s\n", title, artist, album);
-    if (db_add_play(db, title, artist, album, song_id)) {
-      fprintf(stderr, ":: Failed to add to DB!\n");
-    }
-
-    mpd_song_free(song);
 
-    generate_playlists(mpd, db);
+// Plays reached the database: every server's playlists may change.
+static void on_applied(void *ctx) {
+  struct playlist_worker **workers = ctx;
+  for (int i = 0; i < OPTIONS_MAX_MPD; i++) {
+    if (workers[i] != NULL) playlist_worker_notify(workers[i]);
   }
 }
 
 
-int main() {
-  struct mpd_connection *mpd = mpd_connection_new(NULL, 0, 0);
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "import") == 0) return import_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "report") == 0) return report_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "export") == 0) return export_main(argc - 1, argv + 1);
 
-  if (mpd == NULL) {
-    fprintf(stderr, "Out of memory\n");
+  struct options opts;
+  if (options_parse(&opts, argc, argv)) {
     return 1;
   }
 
-  if (mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
-    fprintf(stderr, "MPD connection failed: %s\n", mpd_connection_get_error_message(mpd));
-    mpd_connection_free(mpd);
-    return 2;
+  if (opts.playlists == NULL) playlist_plan_default(&plan);
+  else if (playlist_plan_load(&plan, opts.playlists)) return 1;
+
+  // without --mpd, the server libmpdclient would pick
+  struct mpd_endpoint endpoints[OPTIONS_MAX_MPD];
+  int n_endpoints = opts.n_mpd > 0 ? opts.n_mpd : 1;
+  for (int i = 0; i < n_endpoints; i++) {
+    if (endpoint_parse(&endpoints[i], opts.n_mpd > 0 ? opts.mpd[i] : NULL)) return 1;
   }
 
-  struct db_conn *db = db_init();
+  struct db_conn *db = db_init(&opts.db, 0);
   if (db == NULL) {
     fprintf(stderr, "DB init failed\n");
-    mpd_connection_free(mpd);
     return 3;
   }
 
-  struct stat_state state = {.song_id = 0, .new_song = 0, .pos = 0};
-  while (1) {
-    stat_state_update(&state, mpd);
-    run_sm(&state, mpd, db);
-    msleep(500);
+  // without the rank engine the top lists are read from SQL instead
+  struct rank *rank = rank_new();
+  if (rank != NULL && db_load_rank(db, rank)) {
+    fprintf(stderr, ":: Failed to load rankings, querying the database instead\n");
+    rank_free(rank);
+    rank = NULL;
+  }
+
+  // without it "Similar to Now Playing" stays as last saved
+  struct similar *similar = similar_new();
+  if (similar != NULL && db_load_similar(db, similar)) {
+    fprintf(stderr, ":: Failed to load the similarity graph, querying the database instead\n");
+    similar_free(similar);
+    similar = NULL;
+  }
+
+  int rv = 3;
+  struct playlist_worker *workers[OPTIONS_MAX_MPD] = {0};
+  struct reactor *reactor = NULL;
+  // syncing each play costs what it would in the database
+  int sync_each = strcasecmp(opts.db.synchronous, "FULL") == 0 || strcasecmp(opts.db.synchronous, "EXTRA") == 0;
+  struct journal *journal = journal_open(db, sync_each);
+  if (journal == NULL) goto _main_end;
+  reactor = reactor_new(journal, opts.poll);
+  if (reactor == NULL) goto _main_end;
+
+  for (int i = 0; i < n_endpoints; i++) {
+    int source_id = db_source(db, endpoints[i].name);
+    if (source_id < 0) goto _main_end;
+
+    workers[i] = playlist_worker_start(&endpoints[i], source_id, &opts.db, rank, similar, &plan, opts.batch_size, opts.debounce_ms);
+    if (workers[i] == NULL) {
+      fprintf(stderr, "Playlist worker init failed\n");
+      goto _main_end;
+    }
+
+    if (reactor_add(reactor, &endpoints[i], source_id, workers[i])) goto _main_end;
   }
 
-  mpd_connection_free(mpd);
+  // from here on db belongs to the journal's thread
+  if (journal_start(journal, on_applied, workers)) goto _main_end;
+
+  if (metrics_exporter_start(opts.metrics_file, opts.metrics_socket, opts.metrics_interval_ms)) goto _main_end;
+
+  running = reactor;
+  struct sigaction action = {.sa_handler = on_signal};
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  rv = reactor_run(reactor) ? 4 : 0;
+
+  running = NULL;
+  metrics_exporter_stop();
+
+_main_end:
+  // applies what the reactor appended last, which may notify the workers
+  journal_close(journal);
+  for (int i = 0; i < n_endpoints; i++) playlist_worker_stop(workers[i]);
+  reactor_free(reactor);
+  // or the next start counts the plays since the last save again
+  if (similar != NULL) db_save_similar(db);
   db_free(db);
-  return 0;
+  rank_free(rank);
+  similar_free(similar);
+  return rv;
 }
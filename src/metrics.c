@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+// bucket i counts calls taking at most 2^i us; slower calls only show in +Inf
+#define N_BUCKETS 24
+
+static const char *STAGE_NAMES[N_METRICS] = {
+  [METRIC_STATUS] = "status",
+  [METRIC_JOURNAL_APPEND] = "journal_append",
+  [METRIC_ADD_PLAY] = "add_play",
+  [METRIC_MAINTAIN] = "maintain",
+  [METRIC_FETCH_RECENT_ARTISTS] = "fetch_recent_artists",
+  [METRIC_FETCH_RECENT_ALBUMS] = "fetch_recent_albums",
+  [METRIC_FETCH_RECENT_SONGS] = "fetch_recent_songs",
+  [METRIC_FETCH_FREQUENT_ARTISTS] = "fetch_frequent_artists",
+  [METRIC_FETCH_FREQUENT_ALBUMS] = "fetch_frequent_albums",
+  [METRIC_FETCH_FREQUENT_SONGS] = "fetch_frequent_songs",
+  [METRIC_FETCH_WINDOW_ARTISTS] = "fetch_window_artists",
+  [METRIC_FETCH_WINDOW_ALBUMS] = "fetch_window_albums",
+  [METRIC_FETCH_WINDOW_SONGS] = "fetch_window_songs",
+  [METRIC_FETCH_SIMILAR_ARTISTS] = "fetch_similar_artists",
+  [METRIC_FETCH_SIMILAR_ALBUMS] = "fetch_similar_albums",
+  [METRIC_FETCH_LISTENED_ARTISTS] = "fetch_listened_artists",
+  [METRIC_FETCH_LISTENED_ALBUMS] = "fetch_listened_albums",
+  [METRIC_FETCH_LISTENED_SONGS] = "fetch_listened_songs",
+  [METRIC_LIBRARY_LOAD] = "library_load",
+  [METRIC_SNAPSHOT] = "snapshot",
+  [METRIC_PLAYLIST_FETCH] = "playlist_fetch",
+  [METRIC_PLAYLIST_EDIT] = "playlist_edit",
+  [METRIC_PLAYLIST] = "playlist",
+  [METRIC_PLAYLISTS] = "playlists",
+};
+
+struct stage_metrics {
+  atomic_ulong count;
+  atomic_ulong errors;
+  atomic_ulong sum_ns;
+  atomic_ulong buckets[N_BUCKETS];
+};
+
+static struct stage_metrics stages[N_METRICS];
+
+
+long metrics_start(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+void metrics_record(enum metric_stage stage, long start, int ok) {
+  long ns = metrics_start() - start;
+  if (ns < 1) ns = 1;
+
+  struct stage_metrics *m = &stages[stage];
+  atomic_fetch_add_explicit(&m->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->sum_ns, ns, memory_order_relaxed);
+  if (!ok) atomic_fetch_add_explicit(&m->errors, 1, memory_order_relaxed);
+
+  unsigned long us = (ns - 1) / 1000;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzl(us);
+  if (bucket < N_BUCKETS) atomic_fetch_add_explicit(&m->buckets[bucket], 1, memory_order_relaxed);
+}
+
+
+unsigned long metrics_count(enum metric_stage stage, unsigned long *sum_ns) {
+  if (sum_ns != NULL) *sum_ns = atomic_load_explicit(&stages[stage].sum_ns, memory_order_relaxed);
+  return atomic_load_explicit(&stages[stage].count, memory_order_relaxed);
+}
+
+
+long metrics_quantile_ns(enum metric_stage stage, double q) {
+  struct stage_metrics *m = &stages[stage];
+  unsigned long count = atomic_load_explicit(&m->count, memory_order_relaxed);
+  if (count == 0) return -1;
+
+  unsigned long rank = (unsigned long)(q * count + 0.5), cumulative = 0;
+  if (rank < 1) rank = 1;
+  for (int b = 0; b < N_BUCKETS; b++) {
+    cumulative += atomic_load_explicit(&m->buckets[b], memory_order_relaxed);
+    if (cumulative >= rank) return (1L << b) * 1000;
+  }
+  return -1;
+}
+
+
+static int metrics_render(FILE *f) {
+  fprintf(f, "# HELP mpd_stats_stage_duration_seconds Time spent in each stage.\n");
+  fprintf(f, "# TYPE mpd_stats_stage_duration_seconds histogram\n");
+  for (int i = 0; i < N_METRICS; i++) {
+    struct stage_metrics *m = &stages[i];
+    unsigned long cumulative = 0;
+    for (int b = 0; b < N_BUCKETS; b++) {
+      cumulative += atomic_load_explicit(&m->buckets[b], memory_order_relaxed);
+      fprintf(f, "mpd_stats_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %lu\n",
+          STAGE_NAMES[i], (1L << b) * 1e-6, cumulative);
+    }
+    // recorders may be mid-update, keep the histogram monotonic
+    unsigned long count = atomic_load_explicit(&m->count, memory_order_relaxed);
+    if (count < cumulative) count = cumulative;
+    fprintf(f, "mpd_stats_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", STAGE_NAMES[i], count);
+    fprintf(f, "mpd_stats_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+        STAGE_NAMES[i], atomic_load_explicit(&m->sum_ns, memory_order_relaxed) * 1e-9);
+    fprintf(f, "mpd_stats_stage_duration_seconds_count{stage=\"%s\"} %lu\n", STAGE_NAMES[i], count);
+  }
+
+  fprintf(f, "# HELP mpd_stats_stage_errors_total Failed calls of each stage.\n");
+  fprintf(f, "# TYPE mpd_stats_stage_errors_total counter\n");
+  for (int i = 0; i < N_METRICS; i++) {
+    fprintf(f, "mpd_stats_stage_errors_total{stage=\"%s\"} %lu\n",
+        STAGE_NAMES[i], atomic_load_explicit(&stages[i].errors, memory_order_relaxed));
+  }
+
+  return ferror(f) ? -1 : 0;
+}
+
+
+int metrics_write_file(const char *path) {
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *f = fopen(tmp_path, "w");
+  if (f == NULL) {
+    fprintf(stderr, ":: Failed to open metrics file \"%s\"\n", tmp_path);
+    return -1;
+  }
+
+  int rv = metrics_render(f);
+  if (fclose(f)) rv = -1;
+  if (rv == 0 && rename(tmp_path, path)) rv = -1;
+
+  if (rv) {
+    fprintf(stderr, ":: Failed to write metrics file \"%s\"\n", path);
+    unlink(tmp_path);
+  }
+  return rv;
+}
+
+
+// Exporting
+
+static struct {
+  pthread_t thread;
+  int running;
+  const char *path;
+  const char *socket_path;
+  long interval_ms;
+  int listen_fd;
+  int wake[2];
+} exporter = {.listen_fd = -1, .wake = {-1, -1}};
+
+
+static void serve_client(int fd) {
+  // don't let a client which never reads hold up the exporter
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  char *text = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&text, &size);
+  if (f != NULL) {
+    metrics_render(f);
+    fclose(f);
+
+    // a client hanging up early must not SIGPIPE the daemon
+    for (size_t sent = 0; sent < size; ) {
+      ssize_t n = send(fd, text + sent, size - sent, MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+  }
+  free(text);
+  close(fd);
+}
+
+
+static void *exporter_run(void *arg) {
+  (void)arg;
+  struct pollfd fds[2] = {
+    {.fd = exporter.wake[0], .events = POLLIN},
+    {.fd = exporter.listen_fd, .events = POLLIN},
+  };
+  int n_fds = exporter.listen_fd >= 0 ? 2 : 1;
+  long next_write = metrics_start() / 1000000;
+
+  while (1) {
+    int timeout = -1;
+    if (exporter.path != NULL) {
+      long now = metrics_start() / 1000000;
+      if (now >= next_write) {
+        metrics_write_file(exporter.path);
+        next_write = now + exporter.interval_ms;
+      }
+      timeout = next_write - now;
+    }
+
+    if (poll(fds, n_fds, timeout) < 0) continue;
+    if (fds[0].revents) break;
+    if (n_fds > 1 && (fds[1].revents & POLLIN)) {
+      int fd = accept(exporter.listen_fd, NULL, NULL);
+      if (fd >= 0) serve_client(fd);
+    }
+  }
+
+  // leave the final counts behind
+  if (exporter.path != NULL) metrics_write_file(exporter.path);
+  return NULL;
+}
+
+
+static int listen_unix(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, ":: Metrics socket path too long \"%s\"\n", socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) goto _listen_unix_err;
+
+  // a stale socket from an earlier run would fail the bind
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) goto _listen_unix_err;
+  return fd;
+
+_listen_unix_err:
+  fprintf(stderr, ":: Failed to listen on metrics socket \"%s\"\n", socket_path);
+  if (fd >= 0) close(fd);
+  return -1;
+}
+
+
+int metrics_exporter_start(const char *path, const char *socket_path, long interval_ms) {
+  if (path == NULL && socket_path == NULL) return 0;
+
+  exporter.path = path;
+  exporter.socket_path = socket_path;
+  exporter.interval_ms = interval_ms;
+
+  if (socket_path != NULL) {
+    exporter.listen_fd = listen_unix(socket_path);
+    if (exporter.listen_fd < 0) return -1;
+  }
+
+  if (pipe(exporter.wake)) goto _metrics_exporter_start_err;
+  if (pthread_create(&exporter.thread, NULL, exporter_run, NULL)) goto _metrics_exporter_start_err;
+  exporter.running = 1;
+  return 0;
+
+_metrics_exporter_start_err:
+  fprintf(stderr, ":: Failed to start metrics exporter\n");
+  metrics_exporter_stop();
+  return -1;
+}
+
+
+void metrics_exporter_stop(void) {
+  if (exporter.running) {
+    if (write(exporter.wake[1], "", 1) != 1) {
+      fprintf(stderr, ":: Failed to wake metrics exporter\n");
+    }
+    pthread_join(exporter.thread, NULL);
+    exporter.running = 0;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (exporter.wake[i] >= 0) close(exporter.wake[i]);
+    exporter.wake[i] = -1;
+  }
+  if (exporter.listen_fd >= 0) {
+    close(exporter.listen_fd);
+    unlink(exporter.socket_path);
+    exporter.listen_fd = -1;
+  }
+}
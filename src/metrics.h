@@ -0,0 +1,52 @@
+#pragma once
+
+// Per-stage call counts, errors and log2-bucketed latency histograms, safe to
+// record from any thread.
+
+enum metric_stage {
+  METRIC_STATUS,
+  METRIC_JOURNAL_APPEND,
+  METRIC_ADD_PLAY,
+  METRIC_MAINTAIN,
+  METRIC_FETCH_RECENT_ARTISTS,
+  METRIC_FETCH_RECENT_ALBUMS,
+  METRIC_FETCH_RECENT_SONGS,
+  METRIC_FETCH_FREQUENT_ARTISTS,
+  METRIC_FETCH_FREQUENT_ALBUMS,
+  METRIC_FETCH_FREQUENT_SONGS,
+  METRIC_FETCH_WINDOW_ARTISTS,
+  METRIC_FETCH_WINDOW_ALBUMS,
+  METRIC_FETCH_WINDOW_SONGS,
+  METRIC_FETCH_SIMILAR_ARTISTS,
+  METRIC_FETCH_SIMILAR_ALBUMS,
+  METRIC_FETCH_LISTENED_ARTISTS,
+  METRIC_FETCH_LISTENED_ALBUMS,
+  METRIC_FETCH_LISTENED_SONGS,
+  METRIC_LIBRARY_LOAD,
+  METRIC_SNAPSHOT,
+  METRIC_PLAYLIST_FETCH,
+  METRIC_PLAYLIST_EDIT,
+  METRIC_PLAYLIST,
+  METRIC_PLAYLISTS,
+  N_METRICS
+};
+
+// Monotonic timestamp in ns to pass to metrics_record().
+long metrics_start(void);
+void metrics_record(enum metric_stage stage, long start, int ok);
+
+// Calls of a stage recorded so far, and their total time in ns.
+unsigned long metrics_count(enum metric_stage stage, unsigned long *sum_ns);
+// The time in ns within which a fraction q of the calls of a stage completed,
+// as the bound of its histogram bucket (so up to twice over); -1 if beyond
+// the last bucket or nothing was recorded.
+long metrics_quantile_ns(enum metric_stage stage, double q);
+
+// Write every stage in the Prometheus text format. The file is written to a
+// temporary and renamed into place, so readers never see a partial file.
+int metrics_write_file(const char *path);
+
+// Rewrite path every interval_ms and/or serve the metrics to each client
+// connecting to the Unix socket at socket_path. Either may be NULL.
+int metrics_exporter_start(const char *path, const char *socket_path, long interval_ms);
+void metrics_exporter_stop(void);
@@ -1,3 +1,4 @@
 #pragma once
 
 int msleep(long msec);
+long monotonic_ms(void);
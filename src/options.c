@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+
+#include "options.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+      "Usage: %s [--mpd ADDRESS]... [--poll] [--playlists PATH] [--batch-size N] [--debounce MS] [--db-sync MODE]\n"
+      "          [--db-busy-timeout MS] [--retention DAYS] [--metrics-file PATH] [--metrics-socket PATH] [--metrics-interval MS]\n"
+      "  --mpd ADDRESS           [password@]host[:port] or socket path of an MPD server to watch, repeatable\n"
+      "                          (default MPD_HOST and MPD_PORT, or localhost:6600)\n"
+      "  --poll                  poll MPD status every 500ms instead of waiting on idle events\n"
+      "  --playlists PATH        read the playlists to keep from PATH (see playlists.conf)\n"
+      "  --batch-size N          max commands per command list when writing playlists (default 256)\n"
+      "  --debounce MS           wait for track changes to settle before regenerating playlists (default 0)\n"
+      "  --db-sync MODE          sqlite synchronous setting: OFF, NORMAL, FULL or EXTRA (default NORMAL)\n"
+      "  --db-busy-timeout MS    how long to wait for a locked database (default 5000)\n"
+      "  --retention DAYS        fold plays older than DAYS into per-day counts, keeping all-time stats\n"
+      "                          (default 0, keep every play)\n"
+      "  --metrics-file PATH     periodically write stage timings to PATH in the Prometheus text format\n"
+      "  --metrics-socket PATH   serve stage timings to each client connecting to the Unix socket PATH\n"
+      "  --metrics-interval MS   how often to rewrite the metrics file (default 10000)\n"
+      "       %s import --help   load plays from before mpd_stats was running\n"
+      "       %s report --help   list top and recent plays while mpd_stats is running\n",
+      prog, prog, prog);
+}
+
+int options_parse(struct options *opts, int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"mpd", required_argument, NULL, 'M'},
+    {"poll", no_argument, NULL, 'p'},
+    {"playlists", required_argument, NULL, 'P'},
+    {"batch-size", required_argument, NULL, 'b'},
+    {"debounce", required_argument, NULL, 'd'},
+    {"db-sync", required_argument, NULL, 's'},
+    {"db-busy-timeout", required_argument, NULL, 't'},
+    {"retention", required_argument, NULL, 'r'},
+    {"metrics-file", required_argument, NULL, 'm'},
+    {"metrics-socket", required_argument, NULL, 'u'},
+    {"metrics-interval", required_argument, NULL, 'i'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  opts->n_mpd = 0;
+  opts->poll = 0;
+  opts->batch_size = 256;
+  opts->debounce_ms = 0;
+  opts->playlists = NULL;
+  opts->db.path = NULL;
+  opts->db.synchronous = "NORMAL";
+  opts->db.busy_timeout_ms = 5000;
+  opts->db.retention_days = 0;
+  opts->metrics_file = NULL;
+  opts->metrics_socket = NULL;
+  opts->metrics_interval_ms = 10000;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "M:pP:b:d:s:t:r:m:u:i:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'M':
+        if (opts->n_mpd == OPTIONS_MAX_MPD) {
+          fprintf(stderr, ":: At most %d MPD servers\n", OPTIONS_MAX_MPD);
+          return -1;
+        }
+        opts->mpd[opts->n_mpd++] = optarg;
+        break;
+      case 'p':
+        opts->poll = 1;
+        break;
+      case 'P':
+        opts->playlists = optarg;
+        break;
+      case 'b':
+        opts->batch_size = strtoul(optarg, NULL, 10);
+        if (opts->batch_size == 0) {
+          fprintf(stderr, ":: Invalid batch size \"%s\"\n", optarg);
+          return -1;
+        }
+        break;
+      case 'd':
+        opts->debounce_ms = strtol(optarg, NULL, 10);
+        if (opts->debounce_ms < 0) {
+          fprintf(stderr, ":: Invalid debounce \"%s\"\n", optarg);
+          return -1;
+        }
+        break;
+      case 's':
+        if (strcasecmp(optarg, "OFF") && strcasecmp(optarg, "NORMAL") && strcasecmp(optarg, "FULL") && strcasecmp(optarg, "EXTRA")) {
+          fprintf(stderr, ":: Invalid synchronous mode \"%s\"\n", optarg);
+          return -1;
+        }
+        opts->db.synchronous = optarg;
+        break;
+      case 't':
+        opts->db.busy_timeout_ms = strtol(optarg, NULL, 10);
+        if (opts->db.busy_timeout_ms < 0) {
+          fprintf(stderr, ":: Invalid busy timeout \"%s\"\n", optarg);
+          return -1;
+        }
+        break;
+      case 'r':
+        opts->db.retention_days = strtol(optarg, NULL, 10);
+        if (opts->db.retention_days < 0) {
+          fprintf(stderr, ":: Invalid retention \"%s\"\n", optarg);
+          return -1;
+        }
+        break;
+      case 'm':
+        opts->metrics_file = optarg;
+        break;
+      case 'u':
+        opts->metrics_socket = optarg;
+        break;
+      case 'i':
+        opts->metrics_interval_ms = strtol(optarg, NULL, 10);
+        if (opts->metrics_interval_ms <= 0) {
+          fprintf(stderr, ":: Invalid metrics interval \"%s\"\n", optarg);
+          return -1;
+        }
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  return 0;
+}
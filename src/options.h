@@ -0,0 +1,22 @@
+#pragma once
+
+#include "db.h"
+
+#define OPTIONS_MAX_MPD 16
+
+struct options {
+  // MPD addresses given with --mpd, none for the default server
+  const char *mpd[OPTIONS_MAX_MPD];
+  int n_mpd;
+  int poll;
+  unsigned batch_size;
+  long debounce_ms;
+  // NULL for the built-in playlists
+  const char *playlists;
+  struct db_config db;
+  const char *metrics_file;
+  const char *metrics_socket;
+  long metrics_interval_ms;
+};
+
+int options_parse(struct options *opts, int argc, char **argv);
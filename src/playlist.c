@@ -1,118 +1,367 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
 
 #include "playlist.h"
-#include "msleep.h"
+#include "playlist_diff.h"
+#include "metrics.h"
+#include "arena.h"
 
-struct uri_node;
-struct uri_node {
-  char *uri;
-  struct uri_node *next;
+// A growable array of URIs, allocated in the pass's arena.
+struct uri_array {
+  const char **uris;
+  int n;
+  int cap;
 };
 
-struct uri_node *uri_node_create(const char *uri) {
-  struct uri_node *node = malloc(sizeof(struct uri_node));
-  int n = strlen(uri);
-  node->uri = malloc((n+1)*sizeof(char));
-  strncpy(node->uri, uri, n);
-  node->uri[n] = 0;
-  node->next = NULL;
-  return node;
+static bool uri_array_push(struct arena *arena, struct uri_array *array, const char *uri) {
+  if (array->n == array->cap) {
+    int cap = array->cap ? array->cap * 2 : 64;
+    const char **uris = arena_grow(arena, array->uris, array->cap * sizeof(const char *), cap * sizeof(const char *));
+    if (uris == NULL) return false;
+    array->uris = uris;
+    array->cap = cap;
+  }
+  array->uris[array->n++] = uri;
+  return true;
+}
+
+// shared by every playlist worker
+static struct {
+  atomic_ulong regenerations;
+  atomic_ulong unchanged;
+  atomic_ulong skipped;
+  atomic_ulong edits;
+  atomic_ulong saved;
+} totals;
+
+static void count(atomic_ulong *total, unsigned long n) {
+  atomic_fetch_add_explicit(total, n, memory_order_relaxed);
 }
 
-struct uri_node *uri_node_append(struct uri_node *node, const char *uri) {
-  node->next = uri_node_create(uri);
-  return node->next;
+void playlist_get_stats(struct playlist_stats *stats) {
+  stats->regenerations = atomic_load_explicit(&totals.regenerations, memory_order_relaxed);
+  stats->unchanged = atomic_load_explicit(&totals.unchanged, memory_order_relaxed);
+  stats->skipped = atomic_load_explicit(&totals.skipped, memory_order_relaxed);
+  stats->edits = atomic_load_explicit(&totals.edits, memory_order_relaxed);
+  stats->saved = atomic_load_explicit(&totals.saved, memory_order_relaxed);
 }
 
-void uri_node_free(struct uri_node *root) {
-  struct uri_node *ptr = root;
-  while (ptr != NULL) {
-    struct uri_node *next = ptr-> next;
-    free(ptr->uri);
-    free(ptr);
+// Read the contents of a stored playlist. A playlist which doesn't exist yet
+// is read as empty.
+bool fetch_playlist(struct mpd_connection *mpd, const char *playlist_name, struct arena *arena, struct uri_array *current) {
+  if (!mpd_send_list_playlist(mpd, playlist_name)) return false;
 
-    ptr = next;
+  struct mpd_song *song;
+  bool ok = true;
+  while ((song = mpd_recv_song(mpd)) != NULL) {
+    const char *uri = ok ? arena_strdup(arena, mpd_song_get_uri(song)) : NULL;
+    // keep reading to the end of the response even when out of memory
+    if (uri == NULL || !uri_array_push(arena, current, uri)) ok = false;
+    mpd_song_free(song);
   }
+
+  if (!mpd_response_finish(mpd)) {
+    if (mpd_connection_get_error(mpd) == MPD_ERROR_SERVER
+        && mpd_connection_get_server_error(mpd) == MPD_SERVER_ERROR_NO_EXIST
+        && mpd_connection_clear_error(mpd)) {
+      return true;
+    }
+    return false;
+  }
+
+  if (!ok) fprintf(stderr, ":: Out of memory reading \"%s\"\n", playlist_name);
+  return ok;
 }
 
-void generate_playlist(struct mpd_connection *mpd, struct db_conn *db, int (*f)(struct db_conn *, char ***), int tag, const char *playlist_name, bool top) {
-  char **results = NULL;
-  int n_results = f(db, &results);
+// Apply the edits to a stored playlist, sending them as command lists of at
+// most batch_size commands each.
+bool send_edits(struct mpd_connection *mpd, const char *playlist_name, const struct playlist_edit *edits, int n_edits, unsigned n_current, unsigned batch_size) {
+  unsigned length = n_current;
 
-  int n_effective_results = n_results;
-  if (top) n_effective_results = 1;
-  fprintf(stderr, ":: Generating %s: %d/%d\n", playlist_name, n_effective_results, n_results);
+  for (int i = 0; i < n_edits; ) {
+    if (!mpd_command_list_begin(mpd, false)) return false;
 
-  if (!mpd_run_playlist_clear(mpd, playlist_name)) mpd_connection_clear_error(mpd);
+    for (unsigned n = 0; i < n_edits && n < batch_size; i++, n++) {
+      const struct playlist_edit *edit = &edits[i];
+      bool sent = false;
+      switch (edit->op) {
+        case EDIT_CLEAR:
+          sent = mpd_send_playlist_clear(mpd, playlist_name);
+          length = 0;
+          break;
+        case EDIT_DELETE:
+          sent = mpd_send_playlist_delete(mpd, playlist_name, edit->from);
+          length--;
+          break;
+        case EDIT_MOVE:
+          sent = mpd_send_playlist_move(mpd, playlist_name, edit->from, edit->to);
+          break;
+        case EDIT_ADD:
+          // appending doesn't need a server new enough to insert at a position
+          if (edit->to < length) {
+            sent = mpd_send_playlist_add_to(mpd, playlist_name, edit->uri, edit->to);
+          }
+          else {
+            sent = mpd_send_playlist_add(mpd, playlist_name, edit->uri);
+          }
+          length++;
+          break;
+      }
+      if (!sent) return false;
+    }
+
+    if (!mpd_command_list_end(mpd)) return false;
+    if (!mpd_response_finish(mpd)) return false;
+  }
 
-  struct uri_node *root = NULL, *ptr = NULL;
+  return true;
+}
+
+// The tag a row of each dimension is matched against.
+static const int DIM_TAGS[N_RANK_DIMS] = {
+  [RANK_ARTIST] = MPD_TAG_ARTIST,
+  [RANK_ALBUM] = MPD_TAG_ALBUM,
+  [RANK_SONG] = MPD_TAG_TITLE,
+};
 
-  for (int i = 0; i < n_effective_results; i++) {
-    fprintf(stderr, ":::: %d, %s\n", i, results[i]);
-    // if (!mpd_search_db_songs(mpd, 1)) goto _generate_playlist_error;
-    if (!mpd_search_add_db_songs_to_playlist(mpd, playlist_name)) goto _generate_playlist_error;
-    if (!mpd_search_add_tag_constraint(mpd, MPD_OPERATOR_DEFAULT, tag, results[i])) goto _generate_playlist_error;
-    if (!mpd_search_commit(mpd)) goto _generate_playlist_error;
+// One row of a list, resolved to library songs once per pass.
+struct snapshot_row {
+  const char *name;
+  const int *songs;
+  int n_songs;
+};
+
+// The rows of one of the plan's lists, shared by every playlist using it.
+struct snapshot_list {
+  struct snapshot_row *rows;
+  int n_rows;
+  int cap;
+  int tag;
+  bool failed;
+};
+
+struct snapshot {
+  const struct library *lib;
+  struct arena *arena;
+  struct snapshot_list lists[PLAN_MAX_PLAYLISTS];
+  int n_lists;
+};
+
+// Add a row to the list being fetched, the last one in the snapshot.
+static int snapshot_row(void *arg, const char *name) {
+  struct snapshot *snapshot = arg;
+  struct snapshot_list *list = &snapshot->lists[snapshot->n_lists - 1];
+
+  if (list->n_rows == list->cap) {
+    int cap = list->cap ? list->cap * 2 : 16;
+    struct snapshot_row *rows = arena_grow(snapshot->arena, list->rows, list->cap * sizeof(struct snapshot_row), cap * sizeof(struct snapshot_row));
+    if (rows == NULL) goto _snapshot_row_oom;
+    list->rows = rows;
+    list->cap = cap;
+  }
+
+  struct snapshot_row *row = &list->rows[list->n_rows];
+  row->name = arena_strdup(snapshot->arena, name);
+  if (row->name == NULL) goto _snapshot_row_oom;
+  row->n_songs = library_lookup(snapshot->lib, list->tag, name, &row->songs);
+  list->n_rows++;
+  return 0;
+
+_snapshot_row_oom:
+  list->failed = true;
+  return 1;
+}
+
+// Fetch each of the plan's lists once, inside one read transaction so every
+// playlist is built from the same state of the database.
+static void snapshot_take(struct snapshot *snapshot, struct db_conn *db, const struct playlist_plan *plan, int source_id) {
+  bool in_transaction = db_begin_read(db) == 0;
+
+  for (int i = 0; i < plan->n_lists; i++) {
+    struct snapshot_list *list = &snapshot->lists[snapshot->n_lists++];
+    list->tag = DIM_TAGS[plan->lists[i].dim];
+    if (db_fetch_list(db, &plan->lists[i], source_id, snapshot_row, snapshot) < 0) list->failed = true;
+  }
+
+  if (in_transaction) db_end_read(db);
+}
 
-    struct mpd_pair *pair = mpd_recv_pair(mpd);
-    struct mpd_song *song = NULL;
-    while (pair != NULL) {
-      if (song == NULL) {
-        song = mpd_song_begin(pair);
+// FNV-1a over the names of the rows a playlist takes: while they and the
+// library are the same, so is the playlist.
+static uint64_t rows_hash(const struct snapshot_row *rows, int n_rows) {
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < n_rows; i++) {
+    for (const unsigned char *p = (const unsigned char *)rows[i].name; ; p++) {
+      hash = (hash ^ *p) * 1099511628211ull;
+      if (!*p) break;
+    }
+  }
+  return hash;
+}
+
+void playlist_memo_reset(struct playlist_memo *memo) {
+  memset(memo, 0, sizeof(struct playlist_memo));
+}
+
+// When MPD last modified each of the plan's stored playlists, to the second;
+// 0 for one that does not exist.
+static bool fetch_modified(struct mpd_connection *mpd, const struct playlist_plan *plan, time_t *modified) {
+  memset(modified, 0, plan->n_playlists * sizeof(time_t));
+  if (!mpd_send_list_playlists(mpd)) return false;
+
+  struct mpd_playlist *stored;
+  while ((stored = mpd_recv_playlist(mpd)) != NULL) {
+    for (int i = 0; i < plan->n_playlists; i++) {
+      if (strcmp(plan->playlists[i].name, mpd_playlist_get_path(stored)) == 0) {
+        modified[i] = mpd_playlist_get_last_modified(stored);
       }
-      mpd_return_pair(mpd, pair);
-      // free(pair);
-      pair = mpd_recv_pair(mpd);
-
-      if (pair == NULL || !mpd_song_feed(song, pair)) {
-        const char *uri = mpd_song_get_uri(song);
-        if (ptr == NULL) {
-          root = uri_node_create(uri);
-          ptr = root;
-        }
-        else {
-          ptr = uri_node_append(ptr, uri);
-        }
-        mpd_song_free(song);
-        song = NULL;
+    }
+    mpd_playlist_free(stored);
+  }
+  return mpd_response_finish(mpd);
+}
+
+// Returns whether the playlist now holds the list's rows; edited is set once
+// edits are sent.
+static bool generate_playlist(struct mpd_connection *mpd, const struct snapshot *snapshot, const struct plan_playlist *playlist,
+    unsigned batch_size, bool *edited) {
+  long start = metrics_start();
+  int ok = 0;
+  const char *playlist_name = playlist->name;
+  struct arena *arena = snapshot->arena;
+
+  struct uri_array current = {0}, target = {0};
+  struct playlist_edit *edits = NULL;
+  int n_edits = 0;
+
+  const struct snapshot_list *list = &snapshot->lists[playlist->list];
+  if (list->failed) {
+    // keep the playlist as it is rather than emptying it
+    fprintf(stderr, ":: Not generating %s: query failed\n", playlist_name);
+    goto _generate_playlist_end;
+  }
+
+  int n_rows = list->n_rows < playlist->rows ? list->n_rows : playlist->rows;
+  fprintf(stderr, ":: Generating %s: %d/%d\n", playlist_name, n_rows, list->n_rows);
+
+  for (int i = 0; i < n_rows; i++) {
+    const struct snapshot_row *row = &list->rows[i];
+    fprintf(stderr, ":::: %d, %s\n", i, row->name);
+    for (int j = 0; j < row->n_songs; j++) {
+      if (!uri_array_push(arena, &target, library_uri(snapshot->lib, row->songs[j]))) {
+        fprintf(stderr, ":: Out of memory generating \"%s\"\n", playlist_name);
+        goto _generate_playlist_end;
       }
     }
   }
-  
 
-  for (ptr = root; ptr != NULL; ptr = ptr->next) {
-    //fprintf(stderr, "got song uri for %s: %s\n", playlist_name, ptr->uri);
+  long stage_start = metrics_start();
+  bool fetched = fetch_playlist(mpd, playlist_name, arena, &current);
+  metrics_record(METRIC_PLAYLIST_FETCH, stage_start, fetched);
+  if (!fetched) goto _generate_playlist_error;
+
+  n_edits = playlist_diff(current.uris, current.n, target.uris, target.n, &edits);
+  if (n_edits < 0) {
+    fprintf(stderr, ":: Failed to diff playlist \"%s\"\n", playlist_name);
+    goto _generate_playlist_end;
+  }
 
-    // small delay required to make things work
-    msleep(10);
-    // praise the small delay
+  // versus clearing the playlist and adding every track, which the diff
+  // never takes more edits than
+  int saved = 1 + target.n - n_edits;
+  count(&totals.regenerations, 1);
+  count(&totals.edits, n_edits);
+  count(&totals.saved, saved);
+  fprintf(stderr, ":: %s: %d edits (%d saved)\n", playlist_name, n_edits, saved);
 
-    if (!mpd_run_playlist_add(mpd, playlist_name, ptr->uri)) goto _generate_playlist_error;
+  if (n_edits == 0) {
+    count(&totals.unchanged, 1);
+    ok = 1;
+    goto _generate_playlist_end;
   }
 
-  uri_node_free(root);
-  db_free_results(results, n_results);
-  return;
+  stage_start = metrics_start();
+  *edited = true;
+  bool sent = send_edits(mpd, playlist_name, edits, n_edits, current.n, batch_size);
+  metrics_record(METRIC_PLAYLIST_EDIT, stage_start, sent);
+  if (!sent) goto _generate_playlist_error;
+  ok = 1;
+  goto _generate_playlist_end;
 
 _generate_playlist_error:
   fprintf(stderr, ":: Error encountered in generate_playlist \"%s\": %s\n", playlist_name, mpd_connection_get_error_message(mpd));
   mpd_connection_clear_error(mpd);
-  uri_node_free(root);
-  db_free_results(results, n_results);
+
+_generate_playlist_end:
+  free(edits);
+  metrics_record(METRIC_PLAYLIST, start, ok);
+  return ok;
 }
 
-void generate_playlists(struct mpd_connection *mpd, struct db_conn *db) {
+void generate_playlists(struct mpd_connection *mpd, int source_id, struct db_conn *db, const struct library *lib,
+    const struct playlist_plan *plan, struct playlist_memo *memo, unsigned batch_size) {
+  long start = metrics_start();
+  // holds every name and URI read during the pass, freed in one go at the end
+  struct snapshot snapshot = {.lib = lib, .arena = arena_new()};
+  if (snapshot.arena == NULL) {
+    fprintf(stderr, ":: Out of memory generating playlists\n");
+    metrics_record(METRIC_PLAYLISTS, start, 0);
+    return;
+  }
+
   fprintf(stderr, "Generating playlists...\n");
-  // generate_playlist(mpd, db, db_fetch_frequent_songs, MPD_TAG_TITLE, "Most Played Songs", 0);
-  generate_playlist(mpd, db, db_fetch_frequent_albums, MPD_TAG_ALBUM, "Most Played Albums", 0);
-  //generate_playlist(mpd, db, db_fetch_frequent_artists, MPD_TAG_ARTIST, "Most Played Artists", 0);
-
-  //generate_playlist(mpd, db, db_fetch_recent_songs, MPD_TAG_TITLE, "Recently Played Songs", 0);
-  generate_playlist(mpd, db, db_fetch_recent_albums, MPD_TAG_ALBUM, "Recently Played Albums", 0);
-  generate_playlist(mpd, db, db_fetch_recent_artists, MPD_TAG_ARTIST, "From Recently Played Artists", 0);
-  generate_playlist(mpd, db, db_fetch_recent_albums, MPD_TAG_ALBUM, "Last Played Album", 1);
-  generate_playlist(mpd, db, db_fetch_recent_artists, MPD_TAG_ARTIST, "From Last Played Artists", 1);
-  fprintf(stderr, "Done!\n");
+  long stage_start = metrics_start();
+  snapshot_take(&snapshot, db, plan, source_id);
+  bool snapshot_ok = true;
+  for (int i = 0; i < snapshot.n_lists; i++) snapshot_ok &= !snapshot.lists[i].failed;
+  metrics_record(METRIC_SNAPSHOT, stage_start, snapshot_ok);
+
+  // one round trip tells which playlists were edited in MPD since built
+  time_t modified[PLAN_MAX_PLAYLISTS];
+  bool listed = memo != NULL && fetch_modified(mpd, plan, modified);
+  // a pass is ok only if every playlist in it is
+  bool all_ok = listed || memo == NULL;
+  if (!all_ok) {
+    fprintf(stderr, ":: Failed to list stored playlists: %s\n", mpd_connection_get_error_message(mpd));
+    mpd_connection_clear_error(mpd);
+  }
+
+  bool edited[PLAN_MAX_PLAYLISTS] = {0}, any_edited = false;
+  for (int i = 0; i < plan->n_playlists; i++) {
+    const struct plan_playlist *playlist = &plan->playlists[i];
+    const struct snapshot_list *list = &snapshot.lists[playlist->list];
+    uint64_t hash = rows_hash(list->rows, list->n_rows < playlist->rows ? list->n_rows : playlist->rows);
+    if (listed && !list->failed && memo->valid[i] && memo->hash[i] == hash && memo->modified[i] == modified[i]) {
+      count(&totals.skipped, 1);
+      continue;
+    }
+    bool ok = generate_playlist(mpd, &snapshot, playlist, batch_size, &edited[i]);
+    all_ok &= ok;
+    any_edited |= edited[i];
+    if (memo != NULL) {
+      memo->valid[i] = ok && listed;
+      memo->hash[i] = hash;
+      memo->modified[i] = modified[i];
+    }
+  }
+
+  // the playlists edited are remembered as of those edits
+  if (memo != NULL && any_edited) {
+    listed = fetch_modified(mpd, plan, modified);
+    for (int i = 0; i < plan->n_playlists; i++) {
+      if (!edited[i]) continue;
+      memo->valid[i] &= listed;
+      memo->modified[i] = modified[i];
+    }
+    if (!listed) mpd_connection_clear_error(mpd);
+    all_ok &= listed;
+  }
+  struct playlist_stats stats;
+  playlist_get_stats(&stats);
+  fprintf(stderr, "Done! %lu/%lu playlists unchanged, %lu skipped, %lu edits sent, %lu saved\n",
+      stats.unchanged, stats.regenerations, stats.skipped, stats.edits, stats.saved);
+  arena_free(snapshot.arena);
+  metrics_record(METRIC_PLAYLISTS, start, all_ok);
 }
@@ -1,6 +1,40 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
 #include "db.h"
+#include "library.h"
+#include "playlist_plan.h"
 #include <mpd/client.h>
 
-void generate_playlists(struct mpd_connection *mpd, struct db_conn *db);
+// Running totals over every playlist regeneration; `saved` counts edits
+// avoided compared to clearing the playlist and re-adding every track, and
+// `skipped` the playlists not looked at because their rows had not changed.
+// Summed over every worker.
+struct playlist_stats {
+  unsigned long regenerations;
+  unsigned long unchanged;
+  unsigned long skipped;
+  unsigned long edits;
+  unsigned long saved;
+};
+
+void playlist_get_stats(struct playlist_stats *stats);
+// What each of a plan's playlists was last built from, per MPD connection,
+// and when MPD last saw it modified once built, so that an edit made in MPD
+// is noticed. Reset it when the library is reloaded or on reconnecting.
+struct playlist_memo {
+  uint64_t hash[PLAN_MAX_PLAYLISTS];
+  time_t modified[PLAN_MAX_PLAYLISTS];
+  bool valid[PLAN_MAX_PLAYLISTS];
+};
+
+void playlist_memo_reset(struct playlist_memo *memo);
+
+// Bring every playlist of the plan on the server of source_id up to date,
+// skipping those whose rows are the same as when memo last saw them built
+// and which MPD has not modified since. A NULL memo rebuilds them all.
+void generate_playlists(struct mpd_connection *mpd, int source_id, struct db_conn *db, const struct library *lib,
+    const struct playlist_plan *plan, struct playlist_memo *memo, unsigned batch_size);
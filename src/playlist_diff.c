@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "playlist_diff.h"
+
+// Entries are matched by URI, each current entry taking the first unused
+// target entry with the same URI. Unmatched entries are deleted, the longest
+// run of matched entries already in target order stays put, every other
+// matched entry is moved, and missing target entries are inserted. If that
+// takes more edits than clearing the playlist and adding every target entry,
+// the clear and adds are used instead.
+
+// Longest strictly increasing subsequence of seq, marking its members in keep.
+static int mark_lis(const int *seq, int n, char *keep) {
+  int *tails = malloc((n + 1) * sizeof(int));
+  int *prev = malloc((n + 1) * sizeof(int));
+  if (tails == NULL || prev == NULL) {
+    free(tails);
+    free(prev);
+    return -1;
+  }
+
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    int lo = 0, hi = len;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (seq[tails[mid]] < seq[i]) lo = mid + 1;
+      else hi = mid;
+    }
+    prev[i] = lo > 0 ? tails[lo - 1] : -1;
+    tails[lo] = i;
+    if (lo == len) len++;
+  }
+
+  for (int i = len > 0 ? tails[len - 1] : -1; i >= 0; i = prev[i]) {
+    keep[i] = 1;
+  }
+
+  free(tails);
+  free(prev);
+  return 0;
+}
+
+int playlist_diff(const char **current, int n_current, const char **target, int n_target, struct playlist_edit **edits) {
+  int rv = -1;
+  int n_edits = 0;
+  int *match = malloc((n_current + 1) * sizeof(int));
+  char *used = calloc(n_target + 1, 1);
+  char *placed = calloc(n_target + 1, 1);
+  // the playlist being edited, as target indices (-1 for entries to delete)
+  int *sim = malloc((n_current + n_target + 1) * sizeof(int));
+  char *keep = calloc(n_current + 1, 1);
+  *edits = malloc((n_current + n_target + 1) * sizeof(struct playlist_edit));
+  if (match == NULL || used == NULL || placed == NULL || sim == NULL || keep == NULL || *edits == NULL) {
+    goto _playlist_diff_end;
+  }
+
+  int n_deleted = 0;
+  for (int i = 0; i < n_current; i++) {
+    match[i] = -1;
+    for (int j = 0; j < n_target; j++) {
+      if (!used[j] && strcmp(current[i], target[j]) == 0) {
+        used[j] = 1;
+        match[i] = j;
+        break;
+      }
+    }
+    if (match[i] < 0) n_deleted++;
+  }
+
+  int n_sim = 0;
+  if (n_current > 0 && n_deleted == n_current) {
+    (*edits)[n_edits++] = (struct playlist_edit){.op = EDIT_CLEAR};
+  }
+  else {
+    // back to front, so earlier positions stay valid
+    for (int i = n_current - 1; i >= 0; i--) {
+      if (match[i] < 0) {
+        (*edits)[n_edits++] = (struct playlist_edit){.op = EDIT_DELETE, .from = i};
+      }
+    }
+    for (int i = 0; i < n_current; i++) {
+      if (match[i] >= 0) sim[n_sim++] = match[i];
+    }
+  }
+
+  if (mark_lis(sim, n_sim, keep)) goto _playlist_diff_end;
+  for (int i = 0; i < n_sim; i++) {
+    if (keep[i]) placed[sim[i]] = 1;
+  }
+
+  // Place the remaining target entries in order, each directly after the
+  // last already placed entry which precedes it. Placed entries therefore
+  // always appear in target order, and once all are placed sim == target.
+  for (int t = 0; t < n_target; t++) {
+    if (placed[t]) continue;
+
+    int to = 0, from = -1;
+    for (int i = 0; i < n_sim; i++) {
+      if (placed[sim[i]] && sim[i] < t) to = i + 1;
+      if (sim[i] == t) from = i;
+    }
+
+    if (from >= 0) {
+      if (from < to) to--;
+      if (from != to) {
+        (*edits)[n_edits++] = (struct playlist_edit){.op = EDIT_MOVE, .from = from, .to = to};
+        memmove(&sim[from], &sim[from + 1], (n_sim - from - 1) * sizeof(int));
+        memmove(&sim[to + 1], &sim[to], (n_sim - to - 1) * sizeof(int));
+        sim[to] = t;
+      }
+    }
+    else {
+      (*edits)[n_edits++] = (struct playlist_edit){.op = EDIT_ADD, .to = to, .uri = target[t]};
+      memmove(&sim[to + 1], &sim[to], (n_sim - to) * sizeof(int));
+      sim[to] = t;
+      n_sim++;
+    }
+    placed[t] = 1;
+  }
+
+  // when the lists have little in common, clearing and refilling is shorter
+  if (n_edits > 1 + n_target) {
+    n_edits = 0;
+    (*edits)[n_edits++] = (struct playlist_edit){.op = EDIT_CLEAR};
+    for (int t = 0; t < n_target; t++) {
+      (*edits)[n_edits++] = (struct playlist_edit){.op = EDIT_ADD, .to = t, .uri = target[t]};
+    }
+  }
+
+  rv = n_edits;
+
+_playlist_diff_end:
+  free(match);
+  free(used);
+  free(placed);
+  free(sim);
+  free(keep);
+  if (rv < 0) {
+    free(*edits);
+    *edits = NULL;
+  }
+  return rv;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+enum playlist_edit_op {
+  EDIT_CLEAR,
+  EDIT_DELETE,
+  EDIT_MOVE,
+  EDIT_ADD,
+};
+
+struct playlist_edit {
+  enum playlist_edit_op op;
+  unsigned from;
+  unsigned to;
+  const char *uri;
+};
+
+// Compute the edits turning the playlist `current` into `target`, to be
+// applied in order. Positions refer to the playlist as left by the previous
+// edit; EDIT_ADD with `to` equal to the playlist length appends. There are
+// never more than 1 + n_target edits. Returns the number of edits (stored in
+// *edits, free with free()) or -1 on error.
+int playlist_diff(const char **current, int n_current, const char **target, int n_target, struct playlist_edit **edits);
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "playlist_plan.h"
+
+static const char *RANKINGS[] = {
+  [DB_RECENT] = "recent",
+  [DB_FREQUENT] = "frequent",
+  [DB_SIMILAR] = "similar",
+  [DB_LISTENED] = "listened",
+};
+
+static const char *DIMS[N_RANK_DIMS] = {
+  [RANK_ARTIST] = "artists",
+  [RANK_ALBUM] = "albums",
+  [RANK_SONG] = "songs",
+};
+
+
+int playlist_plan_add(struct playlist_plan *plan, const char *name, const struct db_list *list, int top) {
+  if (plan->n_playlists == PLAN_MAX_PLAYLISTS) {
+    fprintf(stderr, ":: At most %d playlists\n", PLAN_MAX_PLAYLISTS);
+    return -1;
+  }
+  if (strlen(name) >= PLAN_MAX_NAME) {
+    fprintf(stderr, ":: Playlist name \"%s\" is too long\n", name);
+    return -1;
+  }
+  for (int i = 0; i < plan->n_playlists; i++) {
+    if (strcmp(plan->playlists[i].name, name) == 0) {
+      fprintf(stderr, ":: Playlist \"%s\" is defined twice\n", name);
+      return -1;
+    }
+  }
+
+  // a shorter list of the same ranking is a prefix of a longer one
+  int j = 0;
+  while (j < plan->n_lists && (plan->lists[j].ranking != list->ranking || plan->lists[j].dim != list->dim
+        || plan->lists[j].days != list->days)) j++;
+  if (j == plan->n_lists) plan->lists[plan->n_lists++] = *list;
+  else if (plan->lists[j].limit < list->limit) plan->lists[j].limit = list->limit;
+
+  struct plan_playlist *playlist = &plan->playlists[plan->n_playlists++];
+  snprintf(playlist->name, sizeof(playlist->name), "%s", name);
+  playlist->list = j;
+  playlist->rows = top > 0 && top < list->limit ? top : list->limit;
+  return 0;
+}
+
+
+static void add_default(struct playlist_plan *plan, const char *name, enum db_ranking ranking, enum rank_dim dim, int days, int top) {
+  struct db_list list = {.ranking = ranking, .dim = dim, .days = days, .limit = db_list_default_limit(dim)};
+  playlist_plan_add(plan, name, &list, top);
+}
+
+void playlist_plan_default(struct playlist_plan *plan) {
+  memset(plan, 0, sizeof(struct playlist_plan));
+  add_default(plan, "Most Played Albums", DB_FREQUENT, RANK_ALBUM, 0, 0);
+  add_default(plan, "Most Played This Week", DB_FREQUENT, RANK_ALBUM, 7, 0);
+  add_default(plan, "Most Played This Month", DB_FREQUENT, RANK_ALBUM, 30, 0);
+  add_default(plan, "Recently Played Albums", DB_RECENT, RANK_ALBUM, 0, 0);
+  add_default(plan, "From Recently Played Artists", DB_RECENT, RANK_ARTIST, 0, 0);
+  add_default(plan, "Last Played Album", DB_RECENT, RANK_ALBUM, 0, 1);
+  add_default(plan, "From Last Played Artists", DB_RECENT, RANK_ARTIST, 0, 1);
+  add_default(plan, "Similar to Now Playing", DB_SIMILAR, RANK_ALBUM, 0, 0);
+}
+
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s)) s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1])) end--;
+  *end = 0;
+  return s;
+}
+
+static int lookup(const char **names, int n, const char *name) {
+  for (int i = 0; i < n; i++) {
+    if (strcmp(names[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+// A positive "key=N" option, 0 if the word is not that option, -1 if N is bad.
+static int parse_option(const char *word, const char *key, int *value) {
+  size_t len = strlen(key);
+  if (strncmp(word, key, len) != 0 || word[len] != '=') return 0;
+  char *end;
+  long n = strtol(word + len + 1, &end, 10);
+  if (*end || end == word + len + 1 || n <= 0 || n > 1000000) return -1;
+  *value = n;
+  return 1;
+}
+
+// Parse "NAME = RANKING DIMENSION [OPTION]..." into the plan.
+static int parse_line(struct playlist_plan *plan, char *line) {
+  char *eq = strchr(line, '=');
+  if (eq == NULL) return -1;
+  *eq = 0;
+  char *name = trim(line);
+  if (!*name) return -1;
+
+  char *save;
+  char *word = strtok_r(eq + 1, " \t", &save);
+  int ranking = word ? lookup(RANKINGS, sizeof(RANKINGS) / sizeof(RANKINGS[0]), word) : -1;
+  word = strtok_r(NULL, " \t", &save);
+  int dim = word ? lookup(DIMS, N_RANK_DIMS, word) : -1;
+  if (ranking < 0 || dim < 0) return -1;
+  if (ranking == DB_SIMILAR && dim == RANK_SONG) {
+    fprintf(stderr, ":: Only artists and albums have similar ones\n");
+    return -1;
+  }
+
+  struct db_list list = {.ranking = ranking, .dim = dim, .limit = db_list_default_limit(dim)};
+  int top = 0;
+  while ((word = strtok_r(NULL, " \t", &save)) != NULL) {
+    int rv;
+    if ((rv = parse_option(word, "days", &list.days)) || (rv = parse_option(word, "limit", &list.limit))
+        || (rv = parse_option(word, "top", &top))) {
+      if (rv < 0) return -1;
+      continue;
+    }
+    return -1;
+  }
+  if (list.days > 0 && ranking != DB_FREQUENT && ranking != DB_LISTENED) {
+    fprintf(stderr, ":: Only \"frequent\" and \"listened\" take days\n");
+    return -1;
+  }
+
+  return playlist_plan_add(plan, name, &list, top);
+}
+
+int playlist_plan_load(struct playlist_plan *plan, const char *path) {
+  int rv = -1;
+  char *line = NULL;
+  size_t cap = 0;
+  long line_no = 0;
+
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, ":: Failed to open playlists \"%s\"\n", path);
+    return -1;
+  }
+
+  memset(plan, 0, sizeof(struct playlist_plan));
+  while (getline(&line, &cap, in) != -1) {
+    line_no++;
+    line[strcspn(line, "#\r\n")] = 0;
+    if (!*trim(line)) continue;
+
+    if (parse_line(plan, line)) {
+      fprintf(stderr, ":: %s:%ld: expected NAME = recent|frequent|similar|listened artists|albums|songs [days=N] [limit=N] [top=N]\n",
+          path, line_no);
+      goto _playlist_plan_load_end;
+    }
+  }
+  rv = 0;
+
+_playlist_plan_load_end:
+  free(line);
+  fclose(in);
+  return rv;
+}
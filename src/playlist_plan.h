@@ -0,0 +1,38 @@
+#pragma once
+
+#include "db.h"
+
+#define PLAN_MAX_PLAYLISTS 64
+#define PLAN_MAX_NAME 128
+
+// Which playlists to keep, and the distinct lists they are made from: each
+// list is fetched once per regeneration, however many playlists use it.
+struct plan_playlist {
+  char name[PLAN_MAX_NAME];
+  // index into the plan's lists
+  int list;
+  // rows of the list the playlist takes
+  int rows;
+};
+
+struct playlist_plan {
+  struct plan_playlist playlists[PLAN_MAX_PLAYLISTS];
+  int n_playlists;
+  struct db_list lists[PLAN_MAX_PLAYLISTS];
+  int n_lists;
+};
+
+// The built-in playlists, used when no file is given.
+void playlist_plan_default(struct playlist_plan *plan);
+
+// Read playlists from a file, one per line, '#' starting a comment:
+//   NAME = recent|frequent|similar|listened artists|albums|songs [days=N] [limit=N] [top=N]
+// limit is how many rows the ranking returns (default 10, 100 for songs) and
+// top how many of them the playlist takes (default all); days restricts
+// "frequent" and "listened" to the last N days. -1 after saying which line
+// is wrong.
+int playlist_plan_load(struct playlist_plan *plan, const char *path);
+
+// Add a playlist of the first `top` rows (0 for all) of a list, sharing the
+// list with the playlists already added where it can.
+int playlist_plan_add(struct playlist_plan *plan, const char *name, const struct db_list *list, int top);
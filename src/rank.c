@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rank.h"
+#include "strpool.h"
+
+// Entries with the same play count share a bucket; buckets form a list in
+// ascending count order. A play moves its entry to the next bucket up, and a
+// skip takes it back down, creating or dropping a bucket at most once, so
+// either is O(1).
+struct rank_bucket {
+  unsigned count;
+  int head;
+  // towards higher and lower counts, -1 at the ends
+  int up;
+  int down;
+};
+
+struct rank_table {
+  struct strpool *names;
+  int cap;
+  int n_played;
+
+  unsigned *count;
+  long *last;
+
+  // position by count: the entry's bucket and its neighbours in it
+  int *bucket;
+  int *bucket_next;
+  int *bucket_prev;
+
+  // position by recency, most recent first
+  int *recent_next;
+  int *recent_prev;
+  int recent_head;
+
+  struct rank_bucket *buckets;
+  int n_buckets;
+  int cap_buckets;
+  int free_buckets;
+  int highest;
+  int lowest;
+};
+
+struct rank {
+  pthread_mutex_t lock;
+  struct rank_table tables[N_RANK_DIMS];
+
+  // database song ID -> entry in each table, -1 for none
+  int (*songs)[N_RANK_DIMS];
+  int cap_songs;
+};
+
+
+static int table_init(struct rank_table *t) {
+  memset(t, 0, sizeof(struct rank_table));
+  t->recent_head = t->highest = t->lowest = t->free_buckets = -1;
+  t->names = strpool_new();
+  return t->names == NULL ? -1 : 0;
+}
+
+
+static void table_free(struct rank_table *t) {
+  strpool_free(t->names);
+  free(t->count);
+  free(t->last);
+  free(t->bucket);
+  free(t->bucket_next);
+  free(t->bucket_prev);
+  free(t->recent_next);
+  free(t->recent_prev);
+  free(t->buckets);
+}
+
+
+// Entry for a name, growing the per-entry arrays when it is new.
+static int table_entry(struct rank_table *t, const char *name) {
+  int e = strpool_intern(t->names, name);
+  if (e < 0 || e < t->cap) return e;
+
+  int cap = t->cap ? t->cap * 2 : 1024;
+  while (cap <= e) cap *= 2;
+
+#define GROW(field) do { \
+    void *p = realloc(t->field, cap * sizeof(*t->field)); \
+    if (p == NULL) return -1; \
+    t->field = p; \
+  } while (0)
+  GROW(count);
+  GROW(last);
+  GROW(bucket);
+  GROW(bucket_next);
+  GROW(bucket_prev);
+  GROW(recent_next);
+  GROW(recent_prev);
+#undef GROW
+
+  for (int i = t->cap; i < cap; i++) {
+    t->count[i] = 0;
+    t->last[i] = 0;
+    t->bucket[i] = -1;
+  }
+  t->cap = cap;
+  return e;
+}
+
+
+// A new bucket between down and up (either may be -1).
+static int bucket_new(struct rank_table *t, unsigned count, int down, int up) {
+  int b = t->free_buckets;
+  if (b >= 0) {
+    t->free_buckets = t->buckets[b].up;
+  }
+  else {
+    if (t->n_buckets == t->cap_buckets) {
+      int cap = t->cap_buckets ? t->cap_buckets * 2 : 64;
+      struct rank_bucket *buckets = realloc(t->buckets, cap * sizeof(struct rank_bucket));
+      if (buckets == NULL) return -1;
+      t->buckets = buckets;
+      t->cap_buckets = cap;
+    }
+    b = t->n_buckets++;
+  }
+
+  t->buckets[b] = (struct rank_bucket){.count = count, .head = -1, .up = up, .down = down};
+  if (down >= 0) t->buckets[down].up = b;
+  else t->lowest = b;
+  if (up >= 0) t->buckets[up].down = b;
+  else t->highest = b;
+  return b;
+}
+
+
+static void bucket_push(struct rank_table *t, int b, int e) {
+  int head = t->buckets[b].head;
+  t->bucket[e] = b;
+  t->bucket_prev[e] = -1;
+  t->bucket_next[e] = head;
+  if (head >= 0) t->bucket_prev[head] = e;
+  t->buckets[b].head = e;
+}
+
+
+// Take an entry out of its bucket, dropping the bucket if it empties.
+static void bucket_remove(struct rank_table *t, int e) {
+  int b = t->bucket[e];
+  struct rank_bucket *bucket = &t->buckets[b];
+
+  if (t->bucket_prev[e] >= 0) t->bucket_next[t->bucket_prev[e]] = t->bucket_next[e];
+  else bucket->head = t->bucket_next[e];
+  if (t->bucket_next[e] >= 0) t->bucket_prev[t->bucket_next[e]] = t->bucket_prev[e];
+  t->bucket[e] = -1;
+
+  if (bucket->head >= 0) return;
+  if (bucket->down >= 0) t->buckets[bucket->down].up = bucket->up;
+  else t->lowest = bucket->up;
+  if (bucket->up >= 0) t->buckets[bucket->up].down = bucket->down;
+  else t->highest = bucket->down;
+  bucket->up = t->free_buckets;
+  t->free_buckets = b;
+}
+
+
+static void recent_remove(struct rank_table *t, int e) {
+  if (t->recent_prev[e] >= 0) t->recent_next[t->recent_prev[e]] = t->recent_next[e];
+  else t->recent_head = t->recent_next[e];
+  if (t->recent_next[e] >= 0) t->recent_prev[t->recent_next[e]] = t->recent_prev[e];
+}
+
+
+static void recent_push(struct rank_table *t, int e) {
+  t->recent_prev[e] = -1;
+  t->recent_next[e] = t->recent_head;
+  if (t->recent_head >= 0) t->recent_prev[t->recent_head] = e;
+  t->recent_head = e;
+}
+
+
+static int table_play(struct rank_table *t, int e, long time) {
+  int old = t->bucket[e];
+  unsigned count = t->count[e] + 1;
+
+  int b;
+  if (old >= 0) {
+    int up = t->buckets[old].up;
+    b = (up >= 0 && t->buckets[up].count == count) ? up : bucket_new(t, count, old, up);
+  }
+  else {
+    // above names whose every play was skipped
+    int down = -1, up = t->lowest;
+    if (up >= 0 && t->buckets[up].count == 0) {
+      down = up;
+      up = t->buckets[up].up;
+    }
+    b = (up >= 0 && t->buckets[up].count == count) ? up : bucket_new(t, count, down, up);
+  }
+  if (b < 0) return -1;
+
+  if (old >= 0) {
+    bucket_remove(t, e);
+    recent_remove(t, e);
+  }
+  else {
+    t->n_played++;
+  }
+  bucket_push(t, b, e);
+  recent_push(t, e);
+
+  t->count[e] = count;
+  if (time > t->last[e]) t->last[e] = time;
+  return 0;
+}
+
+
+// Take a play back out of the entry's count, leaving when it was played.
+static int table_unplay(struct rank_table *t, int e) {
+  int old = t->bucket[e];
+  if (old < 0 || t->count[e] == 0) return 0;
+  unsigned count = t->count[e] - 1;
+
+  int down = t->buckets[old].down;
+  int b = (down >= 0 && t->buckets[down].count == count) ? down : bucket_new(t, count, down, old);
+  if (b < 0) return -1;
+
+  bucket_remove(t, e);
+  bucket_push(t, b, e);
+  t->count[e] = count;
+  return 0;
+}
+
+
+struct rank *rank_new(void) {
+  struct rank *rank = calloc(1, sizeof(struct rank));
+  if (rank == NULL) return NULL;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&rank->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  for (int i = 0; i < N_RANK_DIMS; i++) {
+    if (table_init(&rank->tables[i])) {
+      rank_free(rank);
+      return NULL;
+    }
+  }
+  return rank;
+}
+
+
+void rank_free(struct rank *rank) {
+  if (rank == NULL) return;
+
+  for (int i = 0; i < N_RANK_DIMS; i++) {
+    table_free(&rank->tables[i]);
+  }
+  free(rank->songs);
+  pthread_mutex_destroy(&rank->lock);
+  free(rank);
+}
+
+
+void rank_lock(struct rank *rank) {
+  pthread_mutex_lock(&rank->lock);
+}
+
+
+void rank_unlock(struct rank *rank) {
+  pthread_mutex_unlock(&rank->lock);
+}
+
+
+int rank_add_song(struct rank *rank, int song_id, const char *artist, const char *album, const char *title) {
+  if (song_id < 0) return -1;
+  rank_lock(rank);
+
+  int rv = -1;
+  if (song_id >= rank->cap_songs) {
+    int cap = rank->cap_songs ? rank->cap_songs * 2 : 1024;
+    while (cap <= song_id) cap *= 2;
+    void *songs = realloc(rank->songs, cap * sizeof(*rank->songs));
+    if (songs == NULL) goto _rank_add_song_end;
+    rank->songs = songs;
+    memset(rank->songs + rank->cap_songs, 0xff, (cap - rank->cap_songs) * sizeof(*rank->songs));
+    rank->cap_songs = cap;
+  }
+
+  const char *names[N_RANK_DIMS] = {[RANK_ARTIST] = artist, [RANK_ALBUM] = album, [RANK_SONG] = title};
+  for (int i = 0; i < N_RANK_DIMS; i++) {
+    int e = table_entry(&rank->tables[i], names[i]);
+    if (e < 0) goto _rank_add_song_end;
+    rank->songs[song_id][i] = e;
+  }
+  rv = 0;
+
+_rank_add_song_end:
+  rank_unlock(rank);
+  return rv;
+}
+
+
+int rank_seed(struct rank *rank, enum rank_dim dim, const char *name, unsigned count, long last_played) {
+  struct rank_table *t = &rank->tables[dim];
+  rank_lock(rank);
+  int e = table_entry(t, name);
+  if (e >= 0) {
+    t->count[e] = count;
+    t->last[e] = last_played;
+  }
+  rank_unlock(rank);
+  return e < 0 ? -1 : 0;
+}
+
+
+struct seed_key {
+  long key;
+  int entry;
+};
+
+static int cmp_seed_key(const void *a, const void *b) {
+  long x = ((const struct seed_key *)a)->key, y = ((const struct seed_key *)b)->key;
+  return (x > y) - (x < y);
+}
+
+
+int rank_seed_done(struct rank *rank) {
+  int rv = 0;
+  rank_lock(rank);
+
+  for (int i = 0; i < N_RANK_DIMS && rv == 0; i++) {
+    struct rank_table *t = &rank->tables[i];
+    int n = strpool_size(t->names);
+    struct seed_key *order = malloc((n + 1) * sizeof(struct seed_key));
+    if (order == NULL) {
+      rv = -1;
+      break;
+    }
+
+    int n_seeded = 0;
+    for (int e = 0; e < n; e++) {
+      if (t->last[e] > 0 && t->bucket[e] < 0) order[n_seeded++] = (struct seed_key){.key = t->last[e], .entry = e};
+    }
+
+    // oldest first, each pushed in front of the last
+    qsort(order, n_seeded, sizeof(struct seed_key), cmp_seed_key);
+    for (int j = 0; j < n_seeded; j++) recent_push(t, order[j].entry);
+
+    // lowest count first, each joining the highest bucket or starting one
+    // above it
+    for (int j = 0; j < n_seeded; j++) order[j].key = t->count[order[j].entry];
+    qsort(order, n_seeded, sizeof(struct seed_key), cmp_seed_key);
+    for (int j = 0; j < n_seeded && rv == 0; j++) {
+      int e = order[j].entry;
+      int b = t->highest;
+      if (b < 0 || t->buckets[b].count != t->count[e]) b = bucket_new(t, t->count[e], b, -1);
+      if (b < 0) rv = -1;
+      else bucket_push(t, b, e);
+    }
+    t->n_played += n_seeded;
+    free(order);
+  }
+
+  rank_unlock(rank);
+  return rv;
+}
+
+
+int rank_play(struct rank *rank, int song_id, long time) {
+  rank_lock(rank);
+  int rv = -1;
+  if (song_id >= 0 && song_id < rank->cap_songs && rank->songs[song_id][0] >= 0) {
+    rv = 0;
+    for (int i = 0; i < N_RANK_DIMS; i++) {
+      if (table_play(&rank->tables[i], rank->songs[song_id][i], time)) rv = -1;
+    }
+  }
+  rank_unlock(rank);
+  return rv;
+}
+
+
+int rank_skip(struct rank *rank, int song_id) {
+  rank_lock(rank);
+  int rv = -1;
+  if (song_id >= 0 && song_id < rank->cap_songs && rank->songs[song_id][0] >= 0) {
+    rv = 0;
+    for (int i = 0; i < N_RANK_DIMS; i++) {
+      if (table_unplay(&rank->tables[i], rank->songs[song_id][i])) rv = -1;
+    }
+  }
+  rank_unlock(rank);
+  return rv;
+}
+
+
+int rank_each(struct rank *rank, enum rank_dim dim, enum rank_order order, int limit, int (*f)(void *ctx, const char *name), void *ctx) {
+  const struct rank_table *t = &rank->tables[dim];
+  int n = 0;
+  rank_lock(rank);
+
+  if (order == RANK_RECENT) {
+    for (int e = t->recent_head; e >= 0 && n < limit; e = t->recent_next[e]) {
+      n++;
+      if (f(ctx, strpool_get(t->names, e))) goto _rank_each_end;
+    }
+  }
+  else {
+    for (int b = t->highest; b >= 0 && n < limit; b = t->buckets[b].down) {
+      for (int e = t->buckets[b].head; e >= 0 && n < limit; e = t->bucket_next[e]) {
+        n++;
+        if (f(ctx, strpool_get(t->names, e))) goto _rank_each_end;
+      }
+    }
+  }
+
+_rank_each_end:
+  rank_unlock(rank);
+  return n;
+}
+
+
+int rank_get(struct rank *rank, enum rank_dim dim, const char *name, unsigned *count, long *last_played) {
+  const struct rank_table *t = &rank->tables[dim];
+  rank_lock(rank);
+  int e = strpool_find(t->names, name);
+  if (e >= 0 && t->bucket[e] < 0) e = -1;
+  if (e >= 0) {
+    *count = t->count[e];
+    *last_played = t->last[e];
+  }
+  rank_unlock(rank);
+  return e < 0 ? -1 : 0;
+}
+
+
+int rank_size(struct rank *rank, enum rank_dim dim) {
+  rank_lock(rank);
+  int n = rank->tables[dim].n_played;
+  rank_unlock(rank);
+  return n;
+}
+
+
+size_t rank_memory(struct rank *rank) {
+  rank_lock(rank);
+  size_t bytes = rank->cap_songs * sizeof(*rank->songs);
+  for (int i = 0; i < N_RANK_DIMS; i++) {
+    const struct rank_table *t = &rank->tables[i];
+    bytes += strpool_memory(t->names);
+    bytes += t->cap * (sizeof(unsigned) + sizeof(long) + 5 * sizeof(int));
+    bytes += t->cap_buckets * sizeof(struct rank_bucket);
+  }
+  rank_unlock(rank);
+  return bytes;
+}
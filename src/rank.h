@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+
+// In-memory play counts (less skips) and last played times per artist, album
+// and song name, mirroring the *Stats tables. Keeps every played name ordered
+// both by count and by recency, so the top K of either is read in O(K).
+struct rank;
+
+enum rank_dim {
+  RANK_ARTIST,
+  RANK_ALBUM,
+  RANK_SONG,
+  N_RANK_DIMS
+};
+
+enum rank_order {
+  RANK_RECENT,
+  RANK_FREQUENT
+};
+
+struct rank *rank_new(void);
+void rank_free(struct rank *rank);
+
+// Every call is serialised on one lock. Taking it explicitly (it is
+// recursive) makes several reads see the same state.
+void rank_lock(struct rank *rank);
+void rank_unlock(struct rank *rank);
+
+// Map a database song ID to its names, as recorded in the Song, Album and
+// Artist tables.
+int rank_add_song(struct rank *rank, int song_id, const char *artist, const char *album, const char *title);
+
+// Seed the totals of a name, then call rank_seed_done() once all are in.
+int rank_seed(struct rank *rank, enum rank_dim dim, const char *name, unsigned count, long last_played);
+int rank_seed_done(struct rank *rank);
+
+// Count a play of a song added with rank_add_song(). -1 if it is unknown.
+int rank_play(struct rank *rank, int song_id, long time);
+// Take back a play of the song once it was skipped.
+int rank_skip(struct rank *rank, int song_id);
+
+// Call f with the first `limit` names in the given order; f returns non-zero
+// to stop. Returns the number of names passed to f.
+int rank_each(struct rank *rank, enum rank_dim dim, enum rank_order order, int limit, int (*f)(void *ctx, const char *name), void *ctx);
+
+// -1 if the name has never been played.
+int rank_get(struct rank *rank, enum rank_dim dim, const char *name, unsigned *count, long *last_played);
+// Number of played names.
+int rank_size(struct rank *rank, enum rank_dim dim);
+size_t rank_memory(struct rank *rank);
@@ -0,0 +1,625 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// docs: https://www.musicpd.org/doc/libmpdclient
+#include <mpd/client.h>
+
+#include "reactor.h"
+#include "journal.h"
+#include "msleep.h"
+#include "metrics.h"
+
+// how far behind the expected position playback must be before a jump back
+// (seek to start, repeat) counts as a new play
+#define SEEK_SLACK_MS 1000
+// a play moved on from before half the song, or this long, counts as skipped;
+// without a duration, before SKIP_UNKNOWN_MS
+#define SKIP_MAX_MS 240000
+#define SKIP_UNKNOWN_MS 30000
+
+#define POLL_INTERVAL_MS 500
+// for connecting and the greeting, and for each reply once connected
+#define CONNECT_TIMEOUT_MS 5000
+#define REQUEST_TIMEOUT_MS 5000
+#define RETRY_MIN_MS 500
+#define RETRY_MAX_MS 30000
+
+#define MAX_EVENTS 16
+
+
+struct stat_state {
+  int song_id;
+  int new_song;
+  unsigned pos;
+  int playing;
+  long stamp;
+
+  // the play in progress, as journaled at played_at (0 for none): how long
+  // it has been playing for, and the song's length if known
+  long played_at;
+  int play_song_id;
+  long listened_ms;
+  unsigned duration_ms;
+};
+
+enum watch_state {
+  // waiting until due_ms to reconnect
+  WATCH_DOWN,
+  // non-blocking connect in progress
+  WATCH_CONNECTING,
+  // waiting for the "OK MPD" greeting
+  WATCH_GREETING,
+  // idle sent, waiting for events
+  WATCH_IDLE,
+  // status and currentsong sent, reading the reply as it arrives
+  WATCH_SYNCING,
+  // polled at due_ms
+  WATCH_POLLING,
+};
+
+struct watch {
+  struct mpd_endpoint endpoint;
+  int source_id;
+  struct playlist_worker *worker;
+
+  enum watch_state state;
+  // the socket, owned by mpd once connected
+  int fd;
+  struct mpd_connection *mpd;
+  char greeting[64];
+  size_t greeting_len;
+  // the server does not support idle
+  int no_idle;
+
+  // kept across reconnects, so a song still playing is not counted again
+  struct stat_state stat;
+
+  // deadline for the current state, 0 for none
+  long due_ms;
+  long retry_ms;
+  // when the pending status request was sent, for metrics
+  long sync_start;
+  // the reply to it so far: the status, then the current song, if any
+  struct mpd_parser *parser;
+  struct mpd_status *status;
+  struct mpd_song *song;
+  int replies;
+};
+
+struct reactor {
+  int epoll_fd;
+  int stop_fd;
+  struct journal *journal;
+  int poll;
+
+  struct watch **watches;
+  int n_watches;
+};
+
+
+static void stat_state_update(struct stat_state *state, const struct mpd_status *status) {
+    long now = monotonic_ms();
+    int song_id = mpd_status_get_song_id(status);
+    unsigned pos = mpd_status_get_elapsed_ms(status);
+    enum mpd_state player = mpd_status_get_state(status);
+
+    // when idling we only see the player at each event, so compare against
+    // where it would be had it kept playing since the last update
+    unsigned expected = state->pos;
+    if (state->playing) {
+      expected += now - state->stamp;
+      state->listened_ms += now - state->stamp;
+    }
+
+    if (song_id < 0 || player == MPD_STATE_STOP) {
+      // forget the song, so starting it again counts as a play
+      state->new_song = 0;
+      state->song_id = -1;
+    }
+    else if (song_id != state->song_id) {
+      state->new_song = 1;
+      state->song_id = song_id;
+    }
+    else if (pos + SEEK_SLACK_MS < expected) {
+      state->new_song = 1;
+    }
+    else {
+      state->new_song = 0;
+    }
+    state->pos = pos;
+    state->playing = (player == MPD_STATE_PLAY);
+    state->stamp = now;
+}
+
+
+static void watch_epoll(struct reactor *reactor, struct watch *watch, int op, uint32_t events) {
+  struct epoll_event event = {.events = events, .data.ptr = watch};
+  if (epoll_ctl(reactor->epoll_fd, op, watch->fd, &event)) {
+    fprintf(stderr, ":: %s: epoll_ctl: %s\n", watch->endpoint.name, strerror(errno));
+  }
+}
+
+
+// Journal how long the play in progress was listened to, once it is over.
+// Moving on to another song early is a skip; stopping is not.
+static void watch_end_play(struct reactor *reactor, struct watch *watch, int moved_on) {
+  struct stat_state *state = &watch->stat;
+  if (state->played_at == 0) return;
+
+  unsigned duration = state->duration_ms;
+  long listened = duration > 0 && state->listened_ms > duration ? duration : state->listened_ms;
+  long threshold = duration == 0 ? SKIP_UNKNOWN_MS : duration / 2 < SKIP_MAX_MS ? duration / 2 : SKIP_MAX_MS;
+  if (journal_append_end(reactor->journal, watch->source_id, state->play_song_id, state->played_at, listened,
+        moved_on && listened < threshold)) {
+    fprintf(stderr, ":: Failed to record end of play!\n");
+  }
+  state->played_at = 0;
+}
+
+
+static void watch_sync_free(struct watch *watch) {
+  if (watch->status != NULL) mpd_status_free(watch->status);
+  if (watch->song != NULL) mpd_song_free(watch->song);
+  watch->status = NULL;
+  watch->song = NULL;
+}
+
+
+// Drop the connection and retry after the current backoff. What plays while
+// disconnected is unknown, so the play in progress ends here: counted up to
+// now, not through the outage.
+static void watch_down(struct reactor *reactor, struct watch *watch, const char *reason) {
+  fprintf(stderr, ":: %s: %s, retrying in %ldms\n", watch->endpoint.name, reason, watch->retry_ms);
+
+  struct stat_state *state = &watch->stat;
+  long now = monotonic_ms();
+  if (state->playing) state->listened_ms += now - state->stamp;
+  state->playing = 0;
+  state->stamp = now;
+  watch_end_play(reactor, watch, 0);
+  watch_sync_free(watch);
+
+  if (watch->fd >= 0) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    if (watch->mpd != NULL) mpd_connection_free(watch->mpd);
+    else close(watch->fd);
+  }
+  watch->mpd = NULL;
+  watch->fd = -1;
+
+  watch->state = WATCH_DOWN;
+  watch->due_ms = monotonic_ms() + watch->retry_ms;
+  watch->retry_ms = watch->retry_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : watch->retry_ms * 2;
+}
+
+
+static void watch_connect(struct reactor *reactor, struct watch *watch) {
+  const struct mpd_endpoint *endpoint = &watch->endpoint;
+  struct addrinfo *addrs = NULL;
+  struct sockaddr_un unix_addr = {.sun_family = AF_UNIX};
+  const struct sockaddr *addr;
+  socklen_t addr_len;
+
+  if (endpoint->port == 0) {
+    size_t len = strlen(endpoint->host);
+    if (len >= sizeof(unix_addr.sun_path)) {
+      watch_down(reactor, watch, "socket path too long");
+      return;
+    }
+    memcpy(unix_addr.sun_path, endpoint->host, len + 1);
+    addr = (const struct sockaddr *)&unix_addr;
+    addr_len = sizeof(unix_addr);
+  }
+  else {
+    // resolving blocks, but is local for the usual localhost or address
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV};
+    char port[12];
+    snprintf(port, sizeof(port), "%u", endpoint->port);
+    int err = getaddrinfo(endpoint->host, port, &hints, &addrs);
+    if (err) {
+      watch_down(reactor, watch, gai_strerror(err));
+      return;
+    }
+    addr = addrs->ai_addr;
+    addr_len = addrs->ai_addrlen;
+  }
+
+  watch->fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  // requests are small and each waits on the last reply, so Nagle can only
+  // delay them
+  int one = 1;
+  if (watch->fd >= 0 && endpoint->port != 0) setsockopt(watch->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (watch->fd < 0 || (connect(watch->fd, addr, addr_len) && errno != EINPROGRESS && errno != EAGAIN)) {
+    watch_down(reactor, watch, strerror(errno));
+  }
+  else {
+    watch->state = WATCH_CONNECTING;
+    watch->due_ms = monotonic_ms() + CONNECT_TIMEOUT_MS;
+    watch_epoll(reactor, watch, EPOLL_CTL_ADD, EPOLLOUT);
+  }
+
+  if (addrs != NULL) freeaddrinfo(addrs);
+}
+
+
+// What to wait for on the socket while the mpd_async has output queued or a
+// reply pending.
+static uint32_t async_epoll_events(struct mpd_async *async) {
+  return EPOLLIN | (mpd_async_events(async) & MPD_ASYNC_EVENT_WRITE ? EPOLLOUT : 0);
+}
+
+
+// Ask for the player status and the current song in one command list, so both
+// replies arrive together and describe the same moment. It goes through the
+// connection's mpd_async, so the reply is read without blocking.
+static void watch_sync(struct reactor *reactor, struct watch *watch) {
+  struct mpd_async *async = mpd_connection_get_async(watch->mpd);
+  watch->sync_start = metrics_start();
+  watch_sync_free(watch);
+  watch->status = mpd_status_begin();
+  watch->replies = 0;
+  if (watch->status == NULL || !mpd_async_send_command(async, "command_list_ok_begin", NULL)
+      || !mpd_async_send_command(async, "status", NULL) || !mpd_async_send_command(async, "currentsong", NULL)
+      || !mpd_async_send_command(async, "command_list_end", NULL) || !mpd_async_io(async, MPD_ASYNC_EVENT_WRITE)) {
+    metrics_record(METRIC_STATUS, watch->sync_start, 0);
+    const char *error = mpd_async_get_error_message(async);
+    watch_down(reactor, watch, error != NULL ? error : "out of memory");
+    return;
+  }
+  watch->state = WATCH_SYNCING;
+  watch->due_ms = monotonic_ms() + REQUEST_TIMEOUT_MS;
+  watch_epoll(reactor, watch, EPOLL_CTL_MOD, async_epoll_events(async));
+}
+
+
+// Wait for the next change to the player or database, or poll.
+static void watch_wait(struct reactor *reactor, struct watch *watch) {
+  if (reactor->poll || watch->no_idle) {
+    // a hangup is still reported with no events asked for
+    watch->state = WATCH_POLLING;
+    watch->due_ms = monotonic_ms() + POLL_INTERVAL_MS;
+    watch_epoll(reactor, watch, EPOLL_CTL_MOD, 0);
+    return;
+  }
+
+  if (!mpd_send_idle_mask(watch->mpd, MPD_IDLE_PLAYER | MPD_IDLE_DATABASE)) {
+    watch_down(reactor, watch, mpd_connection_get_error_message(watch->mpd));
+    return;
+  }
+  watch->state = WATCH_IDLE;
+  watch->due_ms = 0;
+  watch_epoll(reactor, watch, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+
+// Read the greeting without blocking, then hand the socket to libmpdclient.
+static void watch_greet(struct reactor *reactor, struct watch *watch) {
+  size_t space = sizeof(watch->greeting) - 1 - watch->greeting_len;
+  ssize_t n = recv(watch->fd, watch->greeting + watch->greeting_len, space, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (n <= 0) {
+    watch_down(reactor, watch, n == 0 ? "connection closed" : strerror(errno));
+    return;
+  }
+  watch->greeting_len += n;
+  watch->greeting[watch->greeting_len] = 0;
+
+  char *end = strchr(watch->greeting, '\n');
+  if (end == NULL) {
+    if (watch->greeting_len == sizeof(watch->greeting) - 1) watch_down(reactor, watch, "bad greeting");
+    return;
+  }
+  *end = 0;
+
+  struct mpd_async *async = mpd_async_new(watch->fd);
+  watch->mpd = async != NULL ? mpd_connection_new_async(async, watch->greeting) : NULL;
+  if (watch->mpd == NULL) {
+    // the socket belongs to the mpd_async once created
+    if (async != NULL) watch->fd = -1;
+    watch_down(reactor, watch, "out of memory");
+    return;
+  }
+  mpd_connection_set_timeout(watch->mpd, REQUEST_TIMEOUT_MS);
+  if (mpd_connection_get_error(watch->mpd) == MPD_ERROR_SUCCESS && watch->endpoint.password[0]) {
+    mpd_run_password(watch->mpd, watch->endpoint.password);
+  }
+  if (mpd_connection_get_error(watch->mpd) != MPD_ERROR_SUCCESS) {
+    watch_down(reactor, watch, mpd_connection_get_error_message(watch->mpd));
+    return;
+  }
+
+  fprintf(stderr, ":: %s: connected\n", watch->endpoint.name);
+  watch->retry_ms = RETRY_MIN_MS;
+  watch_sync(reactor, watch);
+}
+
+
+// Feed a line of the reply to watch_sync() to the status or the song. Returns
+// 1 once the whole command list is in, -1 with error set on failure.
+static int watch_sync_line(struct watch *watch, char *line, const char **error) {
+  switch (mpd_parser_feed(watch->parser, line)) {
+    case MPD_PARSER_PAIR: {
+      struct mpd_pair pair = {.name = mpd_parser_get_name(watch->parser), .value = mpd_parser_get_value(watch->parser)};
+      if (watch->replies == 0) mpd_status_feed(watch->status, &pair);
+      // the currentsong reply is empty when stopped
+      else if (watch->song != NULL) mpd_song_feed(watch->song, &pair);
+      else if (strcmp(pair.name, "file") == 0 && (watch->song = mpd_song_begin(&pair)) == NULL) {
+        *error = "out of memory";
+        return -1;
+      }
+      return 0;
+    }
+    case MPD_PARSER_SUCCESS:
+      if (!mpd_parser_is_discrete(watch->parser)) return 1;
+      watch->replies++;
+      return 0;
+    case MPD_PARSER_ERROR:
+      *error = mpd_parser_get_message(watch->parser);
+      return -1;
+    default:
+      *error = "malformed reply";
+      return -1;
+  }
+}
+
+
+// Read what has arrived of the reply to watch_sync() without blocking; once
+// it is complete, record a play if a new song started.
+static void watch_synced(struct reactor *reactor, struct watch *watch, uint32_t events) {
+  struct mpd_async *async = mpd_connection_get_async(watch->mpd);
+  enum mpd_async_event io = (events & EPOLLIN ? MPD_ASYNC_EVENT_READ : 0) | (events & EPOLLOUT ? MPD_ASYNC_EVENT_WRITE : 0)
+    | (events & EPOLLHUP ? MPD_ASYNC_EVENT_HUP : 0) | (events & EPOLLERR ? MPD_ASYNC_EVENT_ERROR : 0);
+  const char *error = NULL;
+  int done = 0;
+  if (!mpd_async_io(async, io)) {
+    error = mpd_async_get_error_message(async);
+    done = -1;
+  }
+  char *line;
+  while (done == 0 && (line = mpd_async_recv_line(async)) != NULL) done = watch_sync_line(watch, line, &error);
+  if (done == 0 && mpd_async_get_error(async) != MPD_ERROR_SUCCESS) {
+    error = mpd_async_get_error_message(async);
+    done = -1;
+  }
+
+  if (done == 0) {
+    watch_epoll(reactor, watch, EPOLL_CTL_MOD, async_epoll_events(async));
+    return;
+  }
+  metrics_record(METRIC_STATUS, watch->sync_start, done > 0);
+  if (done < 0) {
+    watch_down(reactor, watch, error != NULL ? error : "connection closed");
+    return;
+  }
+
+  struct mpd_song *song = watch->song;
+  watch->song = NULL;
+  stat_state_update(&watch->stat, watch->status);
+  watch_sync_free(watch);
+  if (watch->stat.new_song || watch->stat.song_id < 0) watch_end_play(reactor, watch, watch->stat.new_song);
+  if (watch->stat.new_song && song != NULL) {
+    int song_id = mpd_song_get_id(song);
+    const char *title = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
+    const char *artist = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
+    const char *album = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0);
+    fprintf(stderr, "%s: Now Playing %s by %s from %s\n", watch->endpoint.name, title, artist, album);
+    long played_at;
+    if (journal_append(reactor->journal, watch->source_id, title, artist, album, song_id, &played_at)) {
+      fprintf(stderr, ":: Failed to record play!\n");
+    }
+    else {
+      watch->stat.played_at = played_at;
+      watch->stat.play_song_id = song_id;
+      watch->stat.listened_ms = 0;
+      watch->stat.duration_ms = mpd_song_get_duration_ms(song);
+    }
+  }
+  if (song != NULL) mpd_song_free(song);
+
+  watch_wait(reactor, watch);
+}
+
+
+static void watch_event(struct reactor *reactor, struct watch *watch, uint32_t events) {
+  switch (watch->state) {
+    case WATCH_CONNECTING: {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+        watch->state = WATCH_GREETING;
+        watch->greeting_len = 0;
+        watch_epoll(reactor, watch, EPOLL_CTL_MOD, EPOLLIN);
+      }
+      else {
+        watch_down(reactor, watch, strerror(err ? err : errno));
+      }
+      break;
+    }
+
+    case WATCH_GREETING:
+      watch_greet(reactor, watch);
+      break;
+
+    case WATCH_IDLE: {
+      enum mpd_idle idle = mpd_recv_idle(watch->mpd, false);
+      if (idle == 0) {
+        if (mpd_connection_get_error(watch->mpd) != MPD_ERROR_SERVER || !mpd_connection_clear_error(watch->mpd)) {
+          watch_down(reactor, watch, mpd_connection_get_error_message(watch->mpd));
+          return;
+        }
+        fprintf(stderr, ":: %s: MPD does not support idle, falling back to polling\n", watch->endpoint.name);
+        watch->no_idle = 1;
+      }
+
+      if ((idle & MPD_IDLE_DATABASE) && watch->worker != NULL) playlist_worker_notify(watch->worker);
+      watch_sync(reactor, watch);
+      break;
+    }
+
+    case WATCH_SYNCING:
+      watch_synced(reactor, watch, events);
+      break;
+
+    case WATCH_POLLING:
+      if (events & (EPOLLHUP | EPOLLERR)) watch_down(reactor, watch, "connection closed");
+      break;
+
+    case WATCH_DOWN:
+      break;
+  }
+}
+
+
+static void watch_timer(struct reactor *reactor, struct watch *watch) {
+  watch->due_ms = 0;
+  switch (watch->state) {
+    case WATCH_DOWN:
+      watch_connect(reactor, watch);
+      break;
+
+    case WATCH_CONNECTING:
+    case WATCH_GREETING:
+      watch_down(reactor, watch, "timed out connecting");
+      break;
+
+    case WATCH_POLLING:
+      watch_sync(reactor, watch);
+      break;
+
+    case WATCH_SYNCING:
+      metrics_record(METRIC_STATUS, watch->sync_start, 0);
+      watch_down(reactor, watch, "timed out waiting for status");
+      break;
+
+    case WATCH_IDLE:
+      break;
+  }
+}
+
+
+struct reactor *reactor_new(struct journal *journal, int poll) {
+  struct reactor *reactor = calloc(1, sizeof(struct reactor));
+  if (reactor == NULL) return NULL;
+
+  reactor->journal = journal;
+  reactor->poll = poll;
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  reactor->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (reactor->epoll_fd < 0 || reactor->stop_fd < 0
+      || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->stop_fd, &event)) {
+    fprintf(stderr, ":: Failed to set up event loop: %s\n", strerror(errno));
+    reactor_free(reactor);
+    return NULL;
+  }
+
+  return reactor;
+}
+
+
+void reactor_free(struct reactor *reactor) {
+  if (reactor == NULL) return;
+
+  for (int i = 0; i < reactor->n_watches; i++) {
+    struct watch *watch = reactor->watches[i];
+    if (watch->mpd != NULL) mpd_connection_free(watch->mpd);
+    else if (watch->fd >= 0) close(watch->fd);
+    watch_sync_free(watch);
+    mpd_parser_free(watch->parser);
+    free(watch);
+  }
+  free(reactor->watches);
+  if (reactor->epoll_fd >= 0) close(reactor->epoll_fd);
+  if (reactor->stop_fd >= 0) close(reactor->stop_fd);
+  free(reactor);
+}
+
+
+int reactor_add(struct reactor *reactor, const struct mpd_endpoint *endpoint, int source_id, struct playlist_worker *worker) {
+  struct watch **watches = realloc(reactor->watches, (reactor->n_watches + 1) * sizeof(struct watch *));
+  if (watches == NULL) return -1;
+  reactor->watches = watches;
+
+  struct watch *watch = calloc(1, sizeof(struct watch));
+  if (watch == NULL) return -1;
+  watch->endpoint = *endpoint;
+  watch->source_id = source_id;
+  watch->worker = worker;
+  watch->fd = -1;
+  watch->stat.song_id = -1;
+  watch->parser = mpd_parser_new();
+  if (watch->parser == NULL) {
+    free(watch);
+    return -1;
+  }
+  watch->retry_ms = RETRY_MIN_MS;
+  // connect as soon as the reactor runs
+  watch->state = WATCH_DOWN;
+  watch->due_ms = monotonic_ms();
+
+  reactor->watches[reactor->n_watches++] = watch;
+  return 0;
+}
+
+
+int reactor_run(struct reactor *reactor) {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1) {
+    long now = monotonic_ms();
+    int timeout = -1;
+    for (int i = 0; i < reactor->n_watches; i++) {
+      long due = reactor->watches[i]->due_ms;
+      if (due == 0) continue;
+      long wait = due > now ? due - now : 0;
+      if (timeout < 0 || wait < timeout) timeout = wait;
+    }
+
+    int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, ":: epoll_wait: %s\n", strerror(errno));
+      return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      // the stop eventfd, left readable so the reactor stays stopped; what
+      // is playing counts as listened to until now
+      if (events[i].data.ptr == NULL) {
+        for (int j = 0; j < reactor->n_watches; j++) {
+          struct stat_state *state = &reactor->watches[j]->stat;
+          if (state->playing) state->listened_ms += monotonic_ms() - state->stamp;
+          state->playing = 0;
+          watch_end_play(reactor, reactor->watches[j], 0);
+        }
+        return 0;
+      }
+      watch_event(reactor, events[i].data.ptr, events[i].events);
+    }
+
+    now = monotonic_ms();
+    for (int i = 0; i < reactor->n_watches; i++) {
+      struct watch *watch = reactor->watches[i];
+      if (watch->due_ms != 0 && watch->due_ms <= now) watch_timer(reactor, watch);
+    }
+  }
+}
+
+
+void reactor_stop(struct reactor *reactor) {
+  uint64_t one = 1;
+  // an eventfd write only fails on overflow, which still leaves it readable
+  if (write(reactor->stop_fd, &one, sizeof(one)) != sizeof(one)) return;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "endpoint.h"
+#include "journal.h"
+#include "worker.h"
+
+// Watches any number of MPD servers from one thread. Each connection waits in
+// idle mode (or is polled), all of them on one epoll set, and every play is
+// appended to the journal given. A server that cannot be reached is retried
+// with backoff without holding up the others.
+struct reactor;
+
+// poll: fetch each server's status every 500ms instead of idling.
+struct reactor *reactor_new(struct journal *journal, int poll);
+void reactor_free(struct reactor *reactor);
+
+// Watch a server, recording its plays under source_id. Its worker (may be
+// NULL) is told when the server's database changes.
+int reactor_add(struct reactor *reactor, const struct mpd_endpoint *endpoint, int source_id, struct playlist_worker *worker);
+
+// Run until reactor_stop(). Returns -1 if waiting for events fails.
+int reactor_run(struct reactor *reactor);
+// Safe to call from another thread or a signal handler.
+void reactor_stop(struct reactor *reactor);
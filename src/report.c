@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "report.h"
+
+static const char *DIM_NAMES[N_RANK_DIMS] = {
+  [RANK_ARTIST] = "artists",
+  [RANK_ALBUM] = "albums",
+  [RANK_SONG] = "songs",
+};
+
+// One list of a report being written.
+struct list_ctx {
+  struct db_conn *db;
+  const struct report *report;
+  FILE *out;
+  // "albums" or "songs" within REPORT_ARTIST, NULL otherwise
+  const char *list;
+  int rows;
+  int failed;
+};
+
+
+static void write_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (const unsigned char *c = (const unsigned char *)s; *c; c++) {
+    if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+    else if (*c == '\n') fputs("\\n", out);
+    else if (*c == '\t') fputs("\\t", out);
+    else if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+    else fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+static void write_csv_field(FILE *out, const char *s) {
+  if (strpbrk(s, ",\"\r\n") == NULL) {
+    fputs(s, out);
+    return;
+  }
+  fputc('"', out);
+  for (const char *c = s; *c; c++) {
+    if (*c == '"') fputc('"', out);
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+// Windows only know the day of a last play. Text is in local time, JSON and
+// CSV in UTC.
+static void format_last(char *buf, size_t size, long last, int is_day, enum report_format format) {
+  struct tm tm;
+  time_t t = is_day ? last * 86400 : last;
+  if (last == 0) buf[0] = '\0';
+  else if (is_day) strftime(buf, size, "%Y-%m-%d", gmtime_r(&t, &tm));
+  else if (format == REPORT_TEXT) strftime(buf, size, "%Y-%m-%d %H:%M", localtime_r(&t, &tm));
+  else strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+}
+
+
+static int write_row(void *arg, const char *name, long plays, long last) {
+  struct list_ctx *ctx = arg;
+  char when[32];
+  format_last(when, sizeof(when), last, ctx->report->kind == REPORT_TOP && ctx->report->days > 0, ctx->report->format);
+  ctx->rows++;
+
+  switch (ctx->report->format) {
+    case REPORT_TEXT:
+      fprintf(ctx->out, "%4d  %-48s %7ld  %s\n", ctx->rows, name, plays, when);
+      break;
+    case REPORT_JSON:
+      fprintf(ctx->out, "%s\n%s  {\"rank\": %d, \"name\": ", ctx->rows > 1 ? "," : "", ctx->list != NULL ? "  " : "", ctx->rows);
+      write_json_string(ctx->out, name);
+      fprintf(ctx->out, ", \"plays\": %ld, \"last_played\": ", plays);
+      if (when[0]) write_json_string(ctx->out, when);
+      else fputs("null", ctx->out);
+      fputc('}', ctx->out);
+      break;
+    case REPORT_CSV:
+      if (ctx->list != NULL) fprintf(ctx->out, "%s,", ctx->list);
+      fprintf(ctx->out, "%d,", ctx->rows);
+      write_csv_field(ctx->out, name);
+      fprintf(ctx->out, ",%ld,%s\n", plays, when);
+      break;
+  }
+  return ctx->report->limit > 0 && ctx->rows >= ctx->report->limit;
+}
+
+// A name from the top lists, with its numbers looked up in the same snapshot.
+static int write_name(void *arg, const char *name) {
+  struct list_ctx *ctx = arg;
+  long plays, last;
+  int err = ctx->report->kind == REPORT_TOP && ctx->report->days > 0
+    ? db_get_window_stats(ctx->db, ctx->report->dim, name, ctx->report->days, &plays, &last)
+    : db_get_stats(ctx->db, ctx->report->dim, name, &plays, &last);
+  if (err) {
+    ctx->failed = 1;
+    return 1;
+  }
+  return write_row(ctx, name, plays, last);
+}
+
+
+static void begin_list(struct list_ctx *ctx, const char *title) {
+  const struct report *report = ctx->report;
+  switch (report->format) {
+    case REPORT_TEXT:
+      if (ctx->list != NULL && strcmp(ctx->list, "songs") == 0) fputc('\n', ctx->out);
+      fprintf(ctx->out, "%s\n", title);
+      break;
+    case REPORT_JSON:
+      if (ctx->list == NULL) fputc('[', ctx->out);
+      else {
+        fprintf(ctx->out, "%s\n  \"%s\": [", strcmp(ctx->list, "albums") == 0 ? "" : ",", ctx->list);
+      }
+      break;
+    case REPORT_CSV:
+      break;
+  }
+}
+
+static void end_list(struct list_ctx *ctx) {
+  if (ctx->report->format == REPORT_JSON) fprintf(ctx->out, "%s]", ctx->rows > 0 ? "\n  " : "");
+}
+
+
+static int fetch_list(struct list_ctx *ctx) {
+  static int (*const TOP[N_RANK_DIMS])(struct db_conn *, db_row_fn, void *) = {
+    db_fetch_frequent_artists, db_fetch_frequent_albums, db_fetch_frequent_songs,
+  };
+  static int (*const WINDOW[N_RANK_DIMS])(struct db_conn *, int, db_row_fn, void *) = {
+    db_fetch_window_artists, db_fetch_window_albums, db_fetch_window_songs,
+  };
+  static int (*const RECENT[N_RANK_DIMS])(struct db_conn *, db_row_fn, void *) = {
+    db_fetch_recent_artists, db_fetch_recent_albums, db_fetch_recent_songs,
+  };
+  const struct report *report = ctx->report;
+
+  switch (report->kind) {
+    case REPORT_TOP:
+      if (report->days > 0) return WINDOW[report->dim](ctx->db, report->days, write_name, ctx);
+      return TOP[report->dim](ctx->db, write_name, ctx);
+    case REPORT_RECENT:
+      return RECENT[report->dim](ctx->db, write_name, ctx);
+    case REPORT_ARTIST:
+      if (strcmp(ctx->list, "albums") == 0) return db_fetch_artist_albums(ctx->db, report->artist, write_row, ctx);
+      return db_fetch_artist_songs(ctx->db, report->artist, write_row, ctx);
+  }
+  return -1;
+}
+
+
+int report_write(struct db_conn *db, const struct report *report, FILE *out) {
+  static const char *ARTIST_LISTS[] = {"albums", "songs"};
+  struct list_ctx ctx = {.db = db, .report = report, .out = out};
+  char title[256];
+  int rows = 0;
+
+  if (db_begin_read(db)) return -1;
+
+  if (report->kind == REPORT_ARTIST) {
+    if (report->format == REPORT_JSON) {
+      fputs("{\n  \"artist\": ", out);
+      write_json_string(out, report->artist);
+      fputc(',', out);
+    }
+    else if (report->format == REPORT_CSV) fputs("list,rank,name,plays,last_played\n", out);
+
+    for (int i = 0; i < 2 && !ctx.failed; i++) {
+      ctx.list = ARTIST_LISTS[i];
+      ctx.rows = 0;
+      snprintf(title, sizeof(title), "%s by %s", i == 0 ? "Albums" : "Songs", report->artist);
+      begin_list(&ctx, title);
+      if (fetch_list(&ctx) < 0) ctx.failed = 1;
+      end_list(&ctx);
+      rows += ctx.rows;
+    }
+    if (report->format == REPORT_JSON) fputs("\n}\n", out);
+  }
+  else {
+    if (report->kind == REPORT_RECENT) snprintf(title, sizeof(title), "Recently played %s", DIM_NAMES[report->dim]);
+    else if (report->days > 0) snprintf(title, sizeof(title), "Most played %s, last %d days", DIM_NAMES[report->dim], report->days);
+    else snprintf(title, sizeof(title), "Most played %s", DIM_NAMES[report->dim]);
+
+    if (report->format == REPORT_CSV) fputs("rank,name,plays,last_played\n", out);
+    begin_list(&ctx, title);
+    if (fetch_list(&ctx) < 0) ctx.failed = 1;
+    if (report->format == REPORT_JSON) fprintf(out, "%s]\n", ctx.rows > 0 ? "\n" : "");
+    rows = ctx.rows;
+  }
+
+  if (db_end_read(db)) ctx.failed = 1;
+  return ctx.failed ? -1 : rows;
+}
+
+
+static void report_usage(void) {
+  fprintf(stderr,
+      "Usage: mpd_stats report [--days N] [--limit N] [--format FORMAT] [--db PATH] top|recent artists|albums|songs\n"
+      "       mpd_stats report [--limit N] [--format FORMAT] [--db PATH] artist NAME\n"
+      "  top                     most played, up to 10 (100 songs)\n"
+      "  recent                  most recently played, up to 10\n"
+      "  artist NAME             NAME's albums and songs, most played first\n"
+      "  --days N                top: over the last N days, today included, instead of all time\n"
+      "  --limit N               at most N rows per list\n"
+      "  --format FORMAT         text, json or csv (default text)\n"
+      "  --db PATH               database to read (default ~/.mpd_stats.db), opened read-only\n");
+}
+
+
+int report_main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"days", required_argument, NULL, 'd'},
+    {"limit", required_argument, NULL, 'n'},
+    {"format", required_argument, NULL, 'f'},
+    {"db", required_argument, NULL, 'B'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  struct report report = {.format = REPORT_TEXT};
+  struct db_config config = {.path = NULL, .synchronous = "NORMAL", .busy_timeout_ms = 5000};
+
+  int c;
+  while ((c = getopt_long(argc, argv, "d:n:f:B:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'd':
+        report.days = atoi(optarg);
+        if (report.days <= 0) {
+          fprintf(stderr, ":: Invalid days \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        report.limit = atoi(optarg);
+        if (report.limit <= 0) {
+          fprintf(stderr, ":: Invalid limit \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'f':
+        if (strcmp(optarg, "text") == 0) report.format = REPORT_TEXT;
+        else if (strcmp(optarg, "json") == 0) report.format = REPORT_JSON;
+        else if (strcmp(optarg, "csv") == 0) report.format = REPORT_CSV;
+        else {
+          fprintf(stderr, ":: Invalid format \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'B':
+        config.path = optarg;
+        break;
+      case 'h':
+      default:
+        report_usage();
+        return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    report_usage();
+    return 1;
+  }
+
+  const char *what = argv[optind], *arg = argv[optind + 1];
+  if (strcmp(what, "artist") == 0) {
+    report.kind = REPORT_ARTIST;
+    report.artist = arg;
+  }
+  else if (strcmp(what, "top") == 0 || strcmp(what, "recent") == 0) {
+    report.kind = strcmp(what, "top") == 0 ? REPORT_TOP : REPORT_RECENT;
+    int dim;
+    for (dim = 0; dim < N_RANK_DIMS && strcmp(arg, DIM_NAMES[dim]) != 0; dim++);
+    if (dim == N_RANK_DIMS) {
+      fprintf(stderr, ":: Invalid list \"%s\": artists, albums or songs\n", arg);
+      return 1;
+    }
+    report.dim = dim;
+  }
+  else {
+    report_usage();
+    return 1;
+  }
+  if (report.days > 0 && report.kind != REPORT_TOP) {
+    fprintf(stderr, ":: --days only applies to top\n");
+    return 1;
+  }
+
+  // read-only, and in WAL mode: reading never holds up the daemon's writes
+  struct db_conn *db = db_init(&config, 1);
+  if (db == NULL) {
+    fprintf(stderr, "DB init failed\n");
+    return 3;
+  }
+  int rows = report_write(db, &report, stdout);
+  db_free(db);
+  if (rows < 0) return 4;
+  if (rows == 0 && report.kind == REPORT_ARTIST) fprintf(stderr, ":: No plays by \"%s\"\n", report.artist);
+  return 0;
+}
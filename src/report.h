@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "db.h"
+
+// Listings of the plays in a database for `mpd_stats report`, read through a
+// read-only connection while the daemon keeps recording.
+enum report_kind {
+  // most played, all time or over the last `days` days
+  REPORT_TOP,
+  // most recently played
+  REPORT_RECENT,
+  // one artist's albums, then their songs
+  REPORT_ARTIST,
+};
+
+enum report_format {
+  REPORT_TEXT,
+  REPORT_JSON,
+  REPORT_CSV,
+};
+
+struct report {
+  enum report_kind kind;
+  // artists, albums or songs listed by REPORT_TOP and REPORT_RECENT
+  enum rank_dim dim;
+  // REPORT_TOP over this many days, today included; 0 for all time
+  int days;
+  // REPORT_ARTIST's artist
+  const char *artist;
+  // rows per list at most, 0 for as many as the query gives
+  int limit;
+  enum report_format format;
+};
+
+// Write the report to out, reading it all in one snapshot of the database.
+// Returns the number of rows written, -1 on error.
+int report_write(struct db_conn *db, const struct report *report, FILE *out);
+
+// `mpd_stats report`, argv[0] being "report".
+int report_main(int argc, char **argv);
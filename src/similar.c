@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "similar.h"
+#include "strpool.h"
+
+struct similar_edge {
+  int to;
+  unsigned weight;
+};
+
+// Neighbours heaviest first. A weight only grows by one at a time, so a
+// bumped edge just moves in front of the run of edges it was equal to: a
+// binary search and a swap.
+struct similar_node {
+  struct similar_edge *edges;
+  int n;
+  int cap;
+  // bumped by each change, and copied when saved
+  unsigned version;
+  unsigned saved;
+  int queued;
+};
+
+struct similar_graph {
+  struct strpool *names;
+  struct similar_node *nodes;
+  int cap;
+  long edges;
+  // nodes changed since their last save
+  int *changed;
+  int n_changed;
+  int cap_changed;
+};
+
+// The last plays of one source, oldest overwritten first.
+struct similar_window {
+  int nodes[SIMILAR_WINDOW][N_SIMILAR_DIMS];
+  long times[SIMILAR_WINDOW];
+  int n;
+  int next;
+};
+
+struct similar {
+  pthread_mutex_t lock;
+  struct similar_graph graphs[N_SIMILAR_DIMS];
+
+  // database song ID -> node in each graph, -1 for none
+  int (*songs)[N_SIMILAR_DIMS];
+  int cap_songs;
+
+  // by source ID
+  struct similar_window *windows;
+  int cap_windows;
+
+  long through;
+};
+
+
+static int graph_node(struct similar_graph *g, const char *name) {
+  int e = strpool_intern(g->names, name);
+  if (e < 0 || e < g->cap) return e;
+
+  int cap = g->cap ? g->cap * 2 : 1024;
+  while (cap <= e) cap *= 2;
+  struct similar_node *nodes = realloc(g->nodes, cap * sizeof(struct similar_node));
+  if (nodes == NULL) return -1;
+  memset(nodes + g->cap, 0, (cap - g->cap) * sizeof(struct similar_node));
+  g->nodes = nodes;
+  g->cap = cap;
+  return e;
+}
+
+
+static int graph_changed(struct similar_graph *g, int a) {
+  struct similar_node *node = &g->nodes[a];
+  node->version++;
+  if (node->queued) return 0;
+
+  if (g->n_changed == g->cap_changed) {
+    int cap = g->cap_changed ? g->cap_changed * 2 : 256;
+    int *changed = realloc(g->changed, cap * sizeof(int));
+    if (changed == NULL) return -1;
+    g->changed = changed;
+    g->cap_changed = cap;
+  }
+  g->changed[g->n_changed++] = a;
+  node->queued = 1;
+  return 0;
+}
+
+
+// Room for one more edge, unless the node is at SIMILAR_NEIGHBOURS.
+static int node_reserve(struct similar_node *node) {
+  if (node->n < node->cap) return 0;
+  if (node->cap == SIMILAR_NEIGHBOURS) return -1;
+  int cap = node->cap ? node->cap * 2 : 4;
+  struct similar_edge *edges = realloc(node->edges, cap * sizeof(struct similar_edge));
+  if (edges == NULL) return -1;
+  node->edges = edges;
+  node->cap = cap;
+  return 0;
+}
+
+
+// Add one to the edge from a to b.
+static int edge_bump(struct similar_graph *g, int a, int b) {
+  struct similar_node *node = &g->nodes[a];
+  int i = 0;
+  while (i < node->n && node->edges[i].to != b) i++;
+
+  if (i == node->n) {
+    if (node_reserve(node) == 0) {
+      node->edges[node->n++] = (struct similar_edge){.to = b, .weight = 0};
+      g->edges++;
+    }
+    else {
+      // full: the lightest makes way, keeping its weight
+      i = node->n - 1;
+      node->edges[i].to = b;
+    }
+  }
+
+  unsigned weight = ++node->edges[i].weight;
+  int lo = 0, hi = i;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (node->edges[mid].weight < weight) hi = mid;
+    else lo = mid + 1;
+  }
+  struct similar_edge edge = node->edges[i];
+  node->edges[i] = node->edges[lo];
+  node->edges[lo] = edge;
+  return graph_changed(g, a);
+}
+
+
+struct similar *similar_new(void) {
+  struct similar *similar = calloc(1, sizeof(struct similar));
+  if (similar == NULL) return NULL;
+  pthread_mutex_init(&similar->lock, NULL);
+
+  for (int i = 0; i < N_SIMILAR_DIMS; i++) {
+    similar->graphs[i].names = strpool_new();
+    if (similar->graphs[i].names == NULL) {
+      similar_free(similar);
+      return NULL;
+    }
+  }
+  return similar;
+}
+
+
+void similar_free(struct similar *similar) {
+  if (similar == NULL) return;
+
+  for (int i = 0; i < N_SIMILAR_DIMS; i++) {
+    struct similar_graph *g = &similar->graphs[i];
+    for (int j = 0; j < g->cap; j++) free(g->nodes[j].edges);
+    free(g->nodes);
+    free(g->changed);
+    strpool_free(g->names);
+  }
+  free(similar->songs);
+  free(similar->windows);
+  pthread_mutex_destroy(&similar->lock);
+  free(similar);
+}
+
+
+int similar_add_song(struct similar *similar, int song_id, const char *artist, const char *album) {
+  if (song_id < 0) return -1;
+  pthread_mutex_lock(&similar->lock);
+
+  int rv = -1;
+  if (song_id >= similar->cap_songs) {
+    int cap = similar->cap_songs ? similar->cap_songs * 2 : 1024;
+    while (cap <= song_id) cap *= 2;
+    void *songs = realloc(similar->songs, cap * sizeof(*similar->songs));
+    if (songs == NULL) goto _similar_add_song_end;
+    similar->songs = songs;
+    memset(similar->songs + similar->cap_songs, 0xff, (cap - similar->cap_songs) * sizeof(*similar->songs));
+    similar->cap_songs = cap;
+  }
+
+  const char *names[N_SIMILAR_DIMS] = {[RANK_ARTIST] = artist, [RANK_ALBUM] = album};
+  for (int i = 0; i < N_SIMILAR_DIMS; i++) {
+    int e = graph_node(&similar->graphs[i], names[i]);
+    if (e < 0) goto _similar_add_song_end;
+    similar->songs[song_id][i] = e;
+  }
+  rv = 0;
+
+_similar_add_song_end:
+  pthread_mutex_unlock(&similar->lock);
+  return rv;
+}
+
+
+int similar_seed(struct similar *similar, enum rank_dim dim, const char *name, const char *neighbour, unsigned weight) {
+  struct similar_graph *g = &similar->graphs[dim];
+  pthread_mutex_lock(&similar->lock);
+  int rv = -1;
+  int a = graph_node(g, name);
+  int b = a >= 0 ? graph_node(g, neighbour) : -1;
+  if (b >= 0) {
+    struct similar_node *node = &g->nodes[a];
+    // a longer list, saved with another SIMILAR_NEIGHBOURS, keeps its head
+    rv = 0;
+    if (node_reserve(node) == 0) {
+      node->edges[node->n++] = (struct similar_edge){.to = b, .weight = weight};
+      g->edges++;
+    }
+  }
+  pthread_mutex_unlock(&similar->lock);
+  return rv;
+}
+
+
+static int window_play(struct similar *similar, int source_id, int song_id, long time, int count) {
+  if (song_id < 0 || song_id >= similar->cap_songs || similar->songs[song_id][0] < 0) return -1;
+  if (source_id < 0) source_id = 0;
+
+  if (source_id >= similar->cap_windows) {
+    int cap = similar->cap_windows ? similar->cap_windows * 2 : 8;
+    while (cap <= source_id) cap *= 2;
+    struct similar_window *windows = realloc(similar->windows, cap * sizeof(struct similar_window));
+    if (windows == NULL) return -1;
+    memset(windows + similar->cap_windows, 0, (cap - similar->cap_windows) * sizeof(struct similar_window));
+    similar->windows = windows;
+    similar->cap_windows = cap;
+  }
+
+  struct similar_window *w = &similar->windows[source_id];
+  const int *nodes = similar->songs[song_id];
+  int rv = 0;
+  for (int k = 0; count && k < w->n; k++) {
+    // plays out of order, as an import may add, pair with nothing
+    if (time < w->times[k] || time - w->times[k] > SIMILAR_SPAN) continue;
+    for (int d = 0; d < N_SIMILAR_DIMS; d++) {
+      int a = nodes[d], b = w->nodes[k][d];
+      if (a == b) continue;
+      if (edge_bump(&similar->graphs[d], a, b) || edge_bump(&similar->graphs[d], b, a)) rv = -1;
+    }
+  }
+
+  memcpy(w->nodes[w->next], nodes, sizeof(w->nodes[0]));
+  w->times[w->next] = time;
+  w->next = (w->next + 1) % SIMILAR_WINDOW;
+  if (w->n < SIMILAR_WINDOW) w->n++;
+  return rv;
+}
+
+
+int similar_play(struct similar *similar, int source_id, int song_id, long time, long play_id) {
+  pthread_mutex_lock(&similar->lock);
+  int rv = window_play(similar, source_id, song_id, time, 1);
+  if (play_id > similar->through) similar->through = play_id;
+  pthread_mutex_unlock(&similar->lock);
+  return rv;
+}
+
+
+int similar_recall(struct similar *similar, int source_id, int song_id, long time) {
+  pthread_mutex_lock(&similar->lock);
+  int rv = window_play(similar, source_id, song_id, time, 0);
+  pthread_mutex_unlock(&similar->lock);
+  return rv;
+}
+
+
+int similar_each(struct similar *similar, enum rank_dim dim, const char *name, int source_id, int limit,
+    int (*f)(void *ctx, const char *name), void *ctx) {
+  const struct similar_graph *g = &similar->graphs[dim];
+  int n = 0;
+  pthread_mutex_lock(&similar->lock);
+
+  int a = -1;
+  if (name != NULL) a = strpool_find(g->names, name);
+  else if (source_id >= 0 && source_id < similar->cap_windows && similar->windows[source_id].n > 0) {
+    const struct similar_window *w = &similar->windows[source_id];
+    a = w->nodes[(w->next + SIMILAR_WINDOW - 1) % SIMILAR_WINDOW][dim];
+  }
+  if (a >= 0 && a < g->cap) {
+    const struct similar_node *node = &g->nodes[a];
+    for (int i = 0; i < node->n && n < limit; i++) {
+      n++;
+      if (f(ctx, strpool_get(g->names, node->edges[i].to))) break;
+    }
+  }
+
+  pthread_mutex_unlock(&similar->lock);
+  return n;
+}
+
+
+int similar_changes(struct similar *similar, struct similar_list **lists, long *through) {
+  pthread_mutex_lock(&similar->lock);
+  int n = 0;
+  for (int d = 0; d < N_SIMILAR_DIMS; d++) n += similar->graphs[d].n_changed;
+
+  *lists = n > 0 ? malloc(n * sizeof(struct similar_list)) : NULL;
+  if (n > 0 && *lists == NULL) n = -1;
+  for (int d = 0, i = 0; d < N_SIMILAR_DIMS && n > 0; d++) {
+    const struct similar_graph *g = &similar->graphs[d];
+    for (int j = 0; j < g->n_changed; j++, i++) {
+      const struct similar_node *node = &g->nodes[g->changed[j]];
+      struct similar_list *list = &(*lists)[i];
+      list->dim = d;
+      list->node = g->changed[j];
+      list->version = node->version;
+      list->name = strpool_get(g->names, list->node);
+      list->n = node->n;
+      for (int k = 0; k < node->n; k++) {
+        // pooled strings never move
+        list->neighbours[k] = strpool_get(g->names, node->edges[k].to);
+        list->weights[k] = node->edges[k].weight;
+      }
+    }
+  }
+  *through = similar->through;
+
+  pthread_mutex_unlock(&similar->lock);
+  return n;
+}
+
+
+void similar_saved(struct similar *similar, const struct similar_list *lists, int n) {
+  pthread_mutex_lock(&similar->lock);
+  for (int i = 0; i < n; i++) {
+    similar->graphs[lists[i].dim].nodes[lists[i].node].saved = lists[i].version;
+  }
+
+  // keep queued only what changed again meanwhile
+  for (int d = 0; d < N_SIMILAR_DIMS; d++) {
+    struct similar_graph *g = &similar->graphs[d];
+    int kept = 0;
+    for (int j = 0; j < g->n_changed; j++) {
+      struct similar_node *node = &g->nodes[g->changed[j]];
+      if (node->saved != node->version) g->changed[kept++] = g->changed[j];
+      else node->queued = 0;
+    }
+    g->n_changed = kept;
+  }
+  pthread_mutex_unlock(&similar->lock);
+}
+
+
+int similar_size(struct similar *similar, enum rank_dim dim, long *edges) {
+  pthread_mutex_lock(&similar->lock);
+  int n = strpool_size(similar->graphs[dim].names);
+  *edges = similar->graphs[dim].edges;
+  pthread_mutex_unlock(&similar->lock);
+  return n;
+}
+
+
+size_t similar_memory(struct similar *similar) {
+  pthread_mutex_lock(&similar->lock);
+  size_t bytes = similar->cap_songs * sizeof(*similar->songs) + similar->cap_windows * sizeof(struct similar_window);
+  for (int d = 0; d < N_SIMILAR_DIMS; d++) {
+    const struct similar_graph *g = &similar->graphs[d];
+    bytes += strpool_memory(g->names) + g->cap * sizeof(struct similar_node) + g->cap_changed * sizeof(int);
+    for (int j = 0; j < g->cap; j++) bytes += g->nodes[j].cap * sizeof(struct similar_edge);
+  }
+  pthread_mutex_unlock(&similar->lock);
+  return bytes;
+}
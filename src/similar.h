@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "rank.h"
+
+// Artists and albums played near each other: each play is paired with the
+// last few plays of the same source, and every artist and album keeps its
+// heaviest neighbours by the number of such pairs. A node holds at most
+// SIMILAR_NEIGHBOURS; a new neighbour of a full node replaces the lightest
+// one, taking its weight plus one (Space-Saving), so the heavy ones are kept
+// and a play costs the same however long the history.
+struct similar;
+
+// only artists and albums, the first two rank dimensions
+#define N_SIMILAR_DIMS (RANK_ALBUM + 1)
+#define SIMILAR_NEIGHBOURS 64
+// a play is paired with up to this many previous plays of its source...
+#define SIMILAR_WINDOW 8
+// ...played at most this many seconds before it
+#define SIMILAR_SPAN (60 * 60)
+
+struct similar *similar_new(void);
+void similar_free(struct similar *similar);
+
+// Map a database song ID to its artist and album names.
+int similar_add_song(struct similar *similar, int song_id, const char *artist, const char *album);
+
+// Append a saved neighbour of a name; a name's neighbours come heaviest first.
+int similar_seed(struct similar *similar, enum rank_dim dim, const char *name, const char *neighbour, unsigned weight);
+
+// Count a play of a song added with similar_add_song(), the play's rowid
+// being play_id. -1 if the song is unknown.
+int similar_play(struct similar *similar, int source_id, int song_id, long time, long play_id);
+// Only remember a play as one of its source's last, for the plays after it.
+int similar_recall(struct similar *similar, int source_id, int song_id, long time);
+
+// Call f with the heaviest `limit` neighbours of a name, or with a NULL name
+// of the artist or album last played on source_id; f returns non-zero to
+// stop. Returns the number of names passed to f.
+int similar_each(struct similar *similar, enum rank_dim dim, const char *name, int source_id, int limit,
+    int (*f)(void *ctx, const char *name), void *ctx);
+
+// A copy of one node's neighbours, for saving.
+struct similar_list {
+  enum rank_dim dim;
+  int node;
+  unsigned version;
+  const char *name;
+  int n;
+  const char *neighbours[SIMILAR_NEIGHBOURS];
+  unsigned weights[SIMILAR_NEIGHBOURS];
+};
+
+// Copy out the lists changed since they were last saved, and the rowid of the
+// last play they count. Returns the number of lists, -1 if out of memory.
+int similar_changes(struct similar *similar, struct similar_list **lists, long *through);
+// Mark lists from similar_changes() as saved, unless they changed since.
+void similar_saved(struct similar *similar, const struct similar_list *lists, int n);
+
+// Number of nodes and edges, and bytes held.
+int similar_size(struct similar *similar, enum rank_dim dim, long *edges);
+size_t similar_memory(struct similar *similar);
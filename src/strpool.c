@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "strpool.h"
+
+#define STRPOOL_BLOCK_SIZE (64 * 1024)
+
+struct strpool {
+  char **blocks;
+  int n_blocks;
+  size_t block_used;
+  size_t bytes;
+
+  const char **strings;
+  uint32_t *hashes;
+  int n_strings;
+  int cap_strings;
+
+  // open addressing over ids, -1 for empty slots
+  int *table;
+  uint32_t table_size;
+};
+
+
+static uint32_t strpool_hash(const char *s) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+struct strpool *strpool_new(void) {
+  struct strpool *pool = calloc(1, sizeof(struct strpool));
+  if (pool == NULL) return NULL;
+
+  pool->table_size = 1024;
+  pool->table = malloc(pool->table_size * sizeof(int));
+  if (pool->table == NULL) {
+    free(pool);
+    return NULL;
+  }
+  memset(pool->table, 0xff, pool->table_size * sizeof(int));
+  return pool;
+}
+
+
+void strpool_free(struct strpool *pool) {
+  if (pool == NULL) return;
+
+  for (int i = 0; i < pool->n_blocks; i++) {
+    free(pool->blocks[i]);
+  }
+  free(pool->blocks);
+  free(pool->strings);
+  free(pool->hashes);
+  free(pool->table);
+  free(pool);
+}
+
+
+static int strpool_slot(const struct strpool *pool, const char *s, uint32_t hash) {
+  uint32_t mask = pool->table_size - 1;
+  for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+    int id = pool->table[i];
+    if (id < 0 || (pool->hashes[id] == hash && strcmp(pool->strings[id], s) == 0)) {
+      return i;
+    }
+  }
+}
+
+
+static int strpool_grow_table(struct strpool *pool) {
+  uint32_t size = pool->table_size * 2;
+  int *table = malloc(size * sizeof(int));
+  if (table == NULL) return -1;
+  memset(table, 0xff, size * sizeof(int));
+
+  for (int id = 0; id < pool->n_strings; id++) {
+    uint32_t i = pool->hashes[id] & (size - 1);
+    while (table[i] >= 0) i = (i + 1) & (size - 1);
+    table[i] = id;
+  }
+
+  free(pool->table);
+  pool->table = table;
+  pool->table_size = size;
+  return 0;
+}
+
+
+static char *strpool_store(struct strpool *pool, const char *s) {
+  size_t n = strlen(s) + 1;
+
+  if (pool->n_blocks == 0 || pool->block_used + n > STRPOOL_BLOCK_SIZE) {
+    char **blocks = realloc(pool->blocks, (pool->n_blocks + 1) * sizeof(char *));
+    if (blocks == NULL) return NULL;
+    pool->blocks = blocks;
+
+    size_t size = n > STRPOOL_BLOCK_SIZE ? n : STRPOOL_BLOCK_SIZE;
+    char *block = malloc(size);
+    if (block == NULL) return NULL;
+
+    // an oversized string gets a block of its own, keep filling the current one
+    if (size > STRPOOL_BLOCK_SIZE && pool->n_blocks > 0) {
+      pool->blocks[pool->n_blocks] = pool->blocks[pool->n_blocks - 1];
+      pool->blocks[pool->n_blocks - 1] = block;
+      pool->n_blocks++;
+      pool->bytes += size;
+      memcpy(block, s, n);
+      return block;
+    }
+
+    pool->blocks[pool->n_blocks++] = block;
+    pool->block_used = 0;
+    pool->bytes += size;
+  }
+
+  char *dst = pool->blocks[pool->n_blocks - 1] + pool->block_used;
+  memcpy(dst, s, n);
+  pool->block_used += n;
+  return dst;
+}
+
+
+int strpool_intern(struct strpool *pool, const char *s) {
+  uint32_t hash = strpool_hash(s);
+  int slot = strpool_slot(pool, s, hash);
+  if (pool->table[slot] >= 0) return pool->table[slot];
+
+  if (pool->n_strings == pool->cap_strings) {
+    int cap = pool->cap_strings ? pool->cap_strings * 2 : 256;
+    const char **strings = realloc(pool->strings, cap * sizeof(const char *));
+    if (strings == NULL) return -1;
+    pool->strings = strings;
+    uint32_t *hashes = realloc(pool->hashes, cap * sizeof(uint32_t));
+    if (hashes == NULL) return -1;
+    pool->hashes = hashes;
+    pool->cap_strings = cap;
+  }
+
+  const char *stored = strpool_store(pool, s);
+  if (stored == NULL) return -1;
+
+  int id = pool->n_strings++;
+  pool->strings[id] = stored;
+  pool->hashes[id] = hash;
+  pool->table[slot] = id;
+
+  // keep the load factor under 1/2
+  if ((uint32_t)pool->n_strings * 2 > pool->table_size && strpool_grow_table(pool)) {
+    pool->n_strings--;
+    pool->table[slot] = -1;
+    return -1;
+  }
+
+  return id;
+}
+
+
+int strpool_find(const struct strpool *pool, const char *s) {
+  return pool->table[strpool_slot(pool, s, strpool_hash(s))];
+}
+
+
+const char *strpool_get(const struct strpool *pool, int id) {
+  return pool->strings[id];
+}
+
+
+int strpool_size(const struct strpool *pool) {
+  return pool->n_strings;
+}
+
+
+size_t strpool_memory(const struct strpool *pool) {
+  return sizeof(struct strpool)
+    + pool->bytes
+    + pool->n_blocks * sizeof(char *)
+    + pool->cap_strings * (sizeof(const char *) + sizeof(uint32_t))
+    + pool->table_size * sizeof(int);
+}
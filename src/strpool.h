@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+// Interned strings: each distinct string is stored once, in large shared
+// blocks, and gets a dense id (0, 1, 2, ...) usable as an array index.
+struct strpool;
+
+struct strpool *strpool_new(void);
+void strpool_free(struct strpool *pool);
+
+// Id of the string, adding it if needed; -1 if out of memory.
+int strpool_intern(struct strpool *pool, const char *s);
+// Id of the string, or -1 if it hasn't been interned.
+int strpool_find(const struct strpool *pool, const char *s);
+const char *strpool_get(const struct strpool *pool, int id);
+int strpool_size(const struct strpool *pool);
+size_t strpool_memory(const struct strpool *pool);
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <mpd/client.h>
+
+#include "worker.h"
+#include "db.h"
+#include "playlist.h"
+#include "library.h"
+#include "metrics.h"
+
+struct playlist_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int dirty;
+  int stop;
+
+  unsigned batch_size;
+  long debounce_ms;
+
+  struct mpd_endpoint endpoint;
+  int source_id;
+  struct mpd_connection *mpd;
+  struct db_conn *db;
+
+  struct library *library;
+  unsigned long db_update;
+
+  const struct playlist_plan *plan;
+  struct playlist_memo memo;
+};
+
+
+static struct mpd_connection *worker_connect(const struct mpd_endpoint *endpoint) {
+  struct mpd_connection *mpd = mpd_connection_new(endpoint->host, endpoint->port, 0);
+  if (mpd == NULL) {
+    fprintf(stderr, ":: Worker: out of memory\n");
+    return NULL;
+  }
+
+  if (mpd_connection_get_error(mpd) == MPD_ERROR_SUCCESS && endpoint->password[0]) {
+    mpd_run_password(mpd, endpoint->password);
+  }
+
+  if (mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+    fprintf(stderr, ":: Worker: MPD connection to %s failed: %s\n", endpoint->name, mpd_connection_get_error_message(mpd));
+    mpd_connection_free(mpd);
+    return NULL;
+  }
+
+  return mpd;
+}
+
+
+// Rebuild the library index if MPD's database changed since it was loaded.
+// On failure the previous index, if any, is kept.
+static void worker_refresh_library(struct playlist_worker *worker) {
+  struct mpd_stats *stats = mpd_run_stats(worker->mpd);
+  if (stats == NULL) return;
+  unsigned long db_update = mpd_stats_get_db_update_time(stats);
+  mpd_stats_free(stats);
+
+  if (worker->library != NULL && db_update == worker->db_update) return;
+
+  long start = metrics_start();
+  struct library *library = library_load(worker->mpd);
+  metrics_record(METRIC_LIBRARY_LOAD, start, library != NULL);
+  if (library == NULL) return;
+
+  library_free(worker->library);
+  worker->library = library;
+  worker->db_update = db_update;
+  playlist_memo_reset(&worker->memo);
+  fprintf(stderr, ":: Library: %d songs, %zu KiB\n", library_size(library), library_memory(library) / 1024);
+}
+
+
+static void *worker_run(void *arg) {
+  struct playlist_worker *worker = arg;
+
+  pthread_mutex_lock(&worker->lock);
+  while (1) {
+    while (!worker->dirty && !worker->stop) {
+      pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    if (worker->stop) break;
+
+    if (worker->debounce_ms > 0) {
+      // let a burst of track changes settle before regenerating
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += worker->debounce_ms / 1000;
+      deadline.tv_nsec += (worker->debounce_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      while (!worker->stop && pthread_cond_timedwait(&worker->cond, &worker->lock, &deadline) != ETIMEDOUT);
+      if (worker->stop) break;
+    }
+
+    worker->dirty = 0;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (worker->mpd == NULL) {
+      worker->mpd = worker_connect(&worker->endpoint);
+      // the playlists may have been edited while disconnected
+      playlist_memo_reset(&worker->memo);
+    }
+    if (worker->mpd != NULL) {
+      worker_refresh_library(worker);
+      if (worker->library != NULL) {
+        generate_playlists(worker->mpd, worker->source_id, worker->db, worker->library, worker->plan, &worker->memo, worker->batch_size);
+      }
+
+      if (mpd_connection_get_error(worker->mpd) != MPD_ERROR_SUCCESS) {
+        // reconnect on the next run
+        mpd_connection_free(worker->mpd);
+        worker->mpd = NULL;
+      }
+    }
+
+    pthread_mutex_lock(&worker->lock);
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return NULL;
+}
+
+
+struct playlist_worker *playlist_worker_start(const struct mpd_endpoint *endpoint, int source_id, const struct db_config *db_config,
+    struct rank *rank, struct similar *similar, const struct playlist_plan *plan, unsigned batch_size, long debounce_ms) {
+  struct playlist_worker *worker = calloc(1, sizeof(struct playlist_worker));
+  if (worker == NULL) return NULL;
+
+  worker->endpoint = *endpoint;
+  worker->source_id = source_id;
+  worker->plan = plan;
+  worker->batch_size = batch_size;
+  worker->debounce_ms = debounce_ms;
+
+  worker->db = db_init(db_config, 1);
+  if (worker->db == NULL) {
+    free(worker);
+    return NULL;
+  }
+  if (rank != NULL) db_set_rank(worker->db, rank);
+  if (similar != NULL) db_set_similar(worker->db, similar);
+
+  // a failed connection is retried when the first regeneration is due
+  worker->mpd = worker_connect(&worker->endpoint);
+
+  pthread_mutex_init(&worker->lock, NULL);
+  pthread_cond_init(&worker->cond, NULL);
+
+  if (pthread_create(&worker->thread, NULL, worker_run, worker)) {
+    fprintf(stderr, ":: Failed to start playlist worker\n");
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    if (worker->mpd != NULL) mpd_connection_free(worker->mpd);
+    db_free(worker->db);
+    free(worker);
+    return NULL;
+  }
+
+  return worker;
+}
+
+
+void playlist_worker_notify(struct playlist_worker *worker) {
+  pthread_mutex_lock(&worker->lock);
+  worker->dirty = 1;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+
+void playlist_worker_stop(struct playlist_worker *worker) {
+  if (worker == NULL) return;
+
+  pthread_mutex_lock(&worker->lock);
+  worker->stop = 1;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_join(worker->thread, NULL);
+
+  pthread_cond_destroy(&worker->cond);
+  pthread_mutex_destroy(&worker->lock);
+  if (worker->mpd != NULL) mpd_connection_free(worker->mpd);
+  library_free(worker->library);
+  db_free(worker->db);
+  free(worker);
+}
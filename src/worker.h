@@ -0,0 +1,22 @@
+#pragma once
+
+#include "db.h"
+#include "endpoint.h"
+#include "playlist_plan.h"
+
+struct playlist_worker;
+
+// Start a thread regenerating the playlists of one MPD server, recorded as
+// source_id, whenever notified, using its own MPD connection and a read-only
+// DB connection. Queries are answered from rank and similar when they are not
+// NULL. The plan must outlive the worker.
+struct playlist_worker *playlist_worker_start(const struct mpd_endpoint *endpoint, int source_id, const struct db_config *db_config,
+    struct rank *rank, struct similar *similar, const struct playlist_plan *plan, unsigned batch_size, long debounce_ms);
+
+// Mark the playlists, and the library index if MPD's database has changed,
+// as out of date. Never blocks on a regeneration:
+// notifications arriving while one runs are folded into a single follow-up.
+void playlist_worker_notify(struct playlist_worker *worker);
+
+// Wait for any regeneration in progress to finish and stop the thread.
+void playlist_worker_stop(struct playlist_worker *worker);
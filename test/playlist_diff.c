@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "../src/playlist_diff.h"
+
+// Applies playlist_diff's edits to random current playlists the way MPD
+// would and checks each ends up as its target.
+
+#define MAX_FAILURES_SHOWN 5
+
+enum pair_kind {
+  // independent lists over a few URIs, so most repeat
+  PAIR_RANDOM,
+  // the current list with a few entries deleted, added, moved or repeated
+  PAIR_PERTURBED,
+  PAIR_SHUFFLED,
+  PAIR_IDENTICAL,
+  // unique URIs with a single entry moved, which must take one edit
+  PAIR_ONE_MOVE,
+  N_PAIR_KINDS,
+};
+
+static const char *PAIR_KIND_NAMES[N_PAIR_KINDS] = {"random", "perturbed", "shuffled", "identical", "one move"};
+
+static uint64_t rng_state;
+
+// the same URIs twice over, so matching can't rely on pointer equality
+static char **current_pool;
+static char **target_pool;
+static int pool_size;
+
+
+static uint64_t rng_next(void) {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ull;
+}
+
+
+static int rng_below(int n) {
+  return n > 0 ? (int)((rng_next() >> 33) % (uint64_t)n) : 0;
+}
+
+
+static int pool_init(int n) {
+  current_pool = calloc(n, sizeof(char *));
+  target_pool = calloc(n, sizeof(char *));
+  if (current_pool == NULL || target_pool == NULL) return -1;
+  pool_size = n;
+
+  char uri[64];
+  for (int i = 0; i < n; i++) {
+    snprintf(uri, sizeof(uri), "Artist %d/Album %d/%02d Title.flac", i / 40, i / 10, i % 10);
+    current_pool[i] = strdup(uri);
+    target_pool[i] = strdup(uri);
+    if (current_pool[i] == NULL || target_pool[i] == NULL) return -1;
+  }
+  return 0;
+}
+
+
+static void pool_free(void) {
+  for (int i = 0; current_pool != NULL && target_pool != NULL && i < pool_size; i++) {
+    free(current_pool[i]);
+    free(target_pool[i]);
+  }
+  free(current_pool);
+  free(target_pool);
+}
+
+
+static void shuffle(int *ids, int n) {
+  for (int i = n - 1; i > 0; i--) {
+    int j = rng_below(i + 1);
+    int tmp = ids[i];
+    ids[i] = ids[j];
+    ids[j] = tmp;
+  }
+}
+
+
+// Distinct URI ids, in random order.
+static void pick_unique(int *ids, int n) {
+  for (int i = 0; i < n; i++) {
+    // pool_size >= 2 * max_len, so a retry is rare
+    int id;
+    int seen;
+    do {
+      id = rng_below(pool_size);
+      seen = 0;
+      for (int j = 0; j < i && !seen; j++) seen = ids[j] == id;
+    } while (seen);
+    ids[i] = id;
+  }
+}
+
+
+// Fill current and target with URI ids; target has room for 2 * max_len.
+static void make_pair(enum pair_kind kind, int max_len, int *current, int *n_current, int *target, int *n_target) {
+  *n_current = rng_below(max_len + 1);
+
+  switch (kind) {
+    case PAIR_RANDOM: {
+      int n_uris = 1 + rng_below(max_len);
+      int base = rng_below(pool_size - n_uris + 1);
+      *n_target = rng_below(max_len + 1);
+      for (int i = 0; i < *n_current; i++) current[i] = base + rng_below(n_uris);
+      for (int i = 0; i < *n_target; i++) target[i] = base + rng_below(n_uris);
+      break;
+    }
+    case PAIR_PERTURBED: {
+      for (int i = 0; i < *n_current; i++) current[i] = rng_below(pool_size);
+      memcpy(target, current, *n_current * sizeof(int));
+      *n_target = *n_current;
+      int n_changes = 1 + rng_below(4);
+      for (int c = 0; c < n_changes; c++) {
+        int op = rng_below(4);
+        if (op == 0 && *n_target > 0) {
+          int at = rng_below(*n_target);
+          memmove(&target[at], &target[at + 1], (*n_target - at - 1) * sizeof(int));
+          (*n_target)--;
+        }
+        else if (op == 1 && *n_target > 1) {
+          int from = rng_below(*n_target), to = rng_below(*n_target);
+          int id = target[from];
+          memmove(&target[from], &target[from + 1], (*n_target - from - 1) * sizeof(int));
+          memmove(&target[to + 1], &target[to], (*n_target - to - 1) * sizeof(int));
+          target[to] = id;
+        }
+        else if (*n_target < 2 * max_len) {
+          // a new URI, or another copy of one already there
+          int id = op == 3 && *n_target > 0 ? target[rng_below(*n_target)] : rng_below(pool_size);
+          int at = rng_below(*n_target + 1);
+          memmove(&target[at + 1], &target[at], (*n_target - at) * sizeof(int));
+          target[at] = id;
+          (*n_target)++;
+        }
+      }
+      break;
+    }
+    case PAIR_SHUFFLED:
+    case PAIR_IDENTICAL:
+      for (int i = 0; i < *n_current; i++) current[i] = rng_below(pool_size);
+      memcpy(target, current, *n_current * sizeof(int));
+      *n_target = *n_current;
+      if (kind == PAIR_SHUFFLED) shuffle(target, *n_target);
+      break;
+    case PAIR_ONE_MOVE: {
+      if (*n_current < 2) *n_current = 2;
+      pick_unique(current, *n_current);
+      memcpy(target, current, *n_current * sizeof(int));
+      *n_target = *n_current;
+      int from = rng_below(*n_target), to = rng_below(*n_target - 1);
+      if (to >= from) to++;
+      int id = target[from];
+      memmove(&target[from], &target[from + 1], (*n_target - from - 1) * sizeof(int));
+      memmove(&target[to + 1], &target[to], (*n_target - to - 1) * sizeof(int));
+      target[to] = id;
+      break;
+    }
+    default:
+      *n_target = 0;
+      break;
+  }
+}
+
+
+// Apply the edits to a copy of current, checking every position is in range
+// for the playlist as left by the previous edit. Returns the length reached,
+// or -1 with the reason in *error.
+static int apply_edits(const char **current, int n_current, const struct playlist_edit *edits, int n_edits,
+    const char **playlist, const char **error) {
+  memcpy(playlist, current, n_current * sizeof(char *));
+  int n = n_current;
+
+  for (int e = 0; e < n_edits; e++) {
+    const struct playlist_edit *edit = &edits[e];
+    switch (edit->op) {
+      case EDIT_CLEAR:
+        n = 0;
+        break;
+      case EDIT_DELETE:
+        if (edit->from >= (unsigned)n) {
+          *error = "delete past the end";
+          return -1;
+        }
+        memmove(&playlist[edit->from], &playlist[edit->from + 1], (n - edit->from - 1) * sizeof(char *));
+        n--;
+        break;
+      case EDIT_MOVE: {
+        if (edit->from >= (unsigned)n || edit->to >= (unsigned)n) {
+          *error = "move past the end";
+          return -1;
+        }
+        const char *uri = playlist[edit->from];
+        memmove(&playlist[edit->from], &playlist[edit->from + 1], (n - edit->from - 1) * sizeof(char *));
+        memmove(&playlist[edit->to + 1], &playlist[edit->to], (n - edit->to - 1) * sizeof(char *));
+        playlist[edit->to] = uri;
+        break;
+      }
+      case EDIT_ADD:
+        if (edit->to > (unsigned)n || edit->uri == NULL) {
+          *error = edit->uri == NULL ? "add without a URI" : "add past the end";
+          return -1;
+        }
+        memmove(&playlist[edit->to + 1], &playlist[edit->to], (n - edit->to) * sizeof(char *));
+        playlist[edit->to] = edit->uri;
+        n++;
+        break;
+      default:
+        *error = "unknown edit";
+        return -1;
+    }
+  }
+
+  return n;
+}
+
+
+static void print_list(const char *label, const char **uris, int n) {
+  fprintf(stderr, "::::   %s (%d):", label, n);
+  for (int i = 0; i < n; i++) fprintf(stderr, " %s", uris[i]);
+  fprintf(stderr, "\n");
+}
+
+
+static void print_edits(const struct playlist_edit *edits, int n_edits) {
+  static const char *OP_NAMES[] = {"clear", "delete", "move", "add"};
+  fprintf(stderr, "::::   edits (%d):", n_edits);
+  for (int e = 0; e < n_edits; e++) {
+    const struct playlist_edit *edit = &edits[e];
+    fprintf(stderr, " %s", edit->op <= EDIT_ADD ? OP_NAMES[edit->op] : "?");
+    if (edit->op == EDIT_DELETE || edit->op == EDIT_MOVE) fprintf(stderr, " %u", edit->from);
+    if (edit->op == EDIT_MOVE || edit->op == EDIT_ADD) fprintf(stderr, " %u", edit->to);
+    if (edit->op == EDIT_ADD) fprintf(stderr, " %s", edit->uri ? edit->uri : "(null)");
+    fprintf(stderr, ";");
+  }
+  fprintf(stderr, "\n");
+}
+
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [--pairs N] [--max-len N] [--seed N]\n"
+    "  --pairs N     current/target pairs to diff (default 200000)\n"
+    "  --max-len N   longest current playlist (default 40)\n"
+    "  --seed N      random seed (default 1)\n",
+    prog);
+}
+
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    {"pairs", required_argument, NULL, 'n'},
+    {"max-len", required_argument, NULL, 'l'},
+    {"seed", required_argument, NULL, 'r'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  long n_pairs = 200000;
+  int max_len = 40;
+  uint64_t seed = 1;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'n': n_pairs = atol(optarg); break;
+      case 'l': max_len = atoi(optarg); break;
+      case 'r': seed = strtoull(optarg, NULL, 10); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (n_pairs < 1 || max_len < 2) {
+    fprintf(stderr, ":: Need pairs >= 1 and max-len >= 2\n");
+    return 1;
+  }
+  rng_state = seed ? seed : 1;
+
+  int rv = 1;
+  int *current_ids = malloc(2 * max_len * sizeof(int));
+  int *target_ids = malloc(2 * max_len * sizeof(int));
+  const char **current = malloc(2 * max_len * sizeof(char *));
+  const char **target = malloc(2 * max_len * sizeof(char *));
+  // room for a wrong diff adding far more than it should
+  const char **playlist = malloc(8 * max_len * sizeof(char *));
+  if (current_ids == NULL || target_ids == NULL || current == NULL || target == NULL || playlist == NULL ||
+      pool_init(4 * max_len)) {
+    fprintf(stderr, ":: Out of memory\n");
+    goto _main_end;
+  }
+
+  long pairs[N_PAIR_KINDS] = {0}, edits_sent[N_PAIR_KINDS] = {0}, refill[N_PAIR_KINDS] = {0};
+  long failed = 0;
+  for (long p = 0; p < n_pairs; p++) {
+    enum pair_kind kind = p % N_PAIR_KINDS;
+    int n_current, n_target;
+    make_pair(kind, max_len, current_ids, &n_current, target_ids, &n_target);
+    for (int i = 0; i < n_current; i++) current[i] = current_pool[current_ids[i]];
+    for (int i = 0; i < n_target; i++) target[i] = target_pool[target_ids[i]];
+
+    struct playlist_edit *edits;
+    int n_edits = playlist_diff(current, n_current, target, n_target, &edits);
+    if (n_edits < 0) {
+      fprintf(stderr, ":: Failed to diff pair %ld\n", p);
+      goto _main_end;
+    }
+
+    const char *error = NULL;
+    int n = -1;
+    if (n_edits > n_current + n_target + 1) error = "more edits than there is room for";
+    else n = apply_edits(current, n_current, edits, n_edits, playlist, &error);
+    if (error == NULL && n != n_target) error = "wrong length";
+    for (int i = 0; error == NULL && i < n; i++) {
+      if (strcmp(playlist[i], target[i]) != 0) error = "wrong entry";
+    }
+    if (error == NULL && n_edits > 1 + n_target) error = "more edits than clearing and refilling";
+    if (error == NULL && kind == PAIR_IDENTICAL && n_edits != 0) error = "edits to an unchanged playlist";
+    if (error == NULL && kind == PAIR_ONE_MOVE && n_edits != 1) error = "more than one edit for a single move";
+
+    if (error != NULL) {
+      if (failed < MAX_FAILURES_SHOWN) {
+        fprintf(stderr, ":: Pair %ld (%s, seed %llu): %s\n", p, PAIR_KIND_NAMES[kind], (unsigned long long)seed, error);
+        print_list("current", current, n_current);
+        print_list("target", target, n_target);
+        print_edits(edits, n_edits);
+      }
+      failed++;
+    }
+
+    pairs[kind]++;
+    edits_sent[kind] += n_edits;
+    // versus clearing the playlist and adding every track
+    refill[kind] += 1 + n_target;
+    free(edits);
+  }
+
+  long total_edits = 0, total_refill = 0;
+  for (int k = 0; k < N_PAIR_KINDS; k++) {
+    printf("%-10s %8ld pairs, %9ld edits vs %9ld clearing and refilling\n", PAIR_KIND_NAMES[k], pairs[k], edits_sent[k], refill[k]);
+    total_edits += edits_sent[k];
+    total_refill += refill[k];
+  }
+  printf("Playlist diff: %ld pairs, %ld edits vs %ld clearing and refilling, %ld failed\n", n_pairs, total_edits, total_refill, failed);
+  rv = failed > 0;
+
+_main_end:
+  free(current_ids);
+  free(target_ids);
+  free(current);
+  free(target);
+  free(playlist);
+  pool_free();
+  return rv;
+}